@@ -56,3 +56,9 @@ run_str("strhash(string, 'fnv1a')", "strhash fnv1a", setup="string = str(uuid.uu
 run_str("strhash(string, 'fnv1')", "strhash fnv1", setup="string = str(uuid.uuid1())")
 run_str("strhash(string, 'djb2')", "strhash djb2", setup="string = str(uuid.uuid1())")
 run_str("strhash(string, 'murmur')", "strhash murmur", setup="string = str(uuid.uuid1())")
+
+# CJK heavy keys are hashed from their UCS2 storage, no UTF-8 copy.
+cjk_setup = "string = '用户:' + ''.join(chr(random.randint(0x4e00, 0x9fff)) for _ in range(32))"
+run_str("strhash(string)", "strhash cjk default", setup=cjk_setup)
+run_str("strhash(string, 'murmur')", "strhash cjk murmur", setup=cjk_setup)
+run_str("strhash(string.encode())", "strhash cjk encode()", setup=cjk_setup)
@@ -0,0 +1,87 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ctools_hash.h"
+#include "ctools_lfu_core.h"
+
+#define LOOP 10000000
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep results alive so the compiler can't drop the loops. */
+static volatile unsigned int sink;
+
+#define RUN_HASH(title, func)                           \
+  do {                                                  \
+    double start = now_seconds();                       \
+    for (int i = 0; i < LOOP; i++) {                    \
+      key[0] = (char)i;                                 \
+      sink ^= func(key, len);                           \
+    }                                                   \
+    printf("%s,\t%.3f ns each (%d loops)\n", title,     \
+           (now_seconds() - start) * 1e9 / LOOP, LOOP); \
+  } while (0)
+
+#define RUN_UCS(title, func)                            \
+  do {                                                  \
+    double start = now_seconds();                       \
+    for (int i = 0; i < LOOP; i++) {                    \
+      cjk[0] = (uint16_t)(0x4e00 + (i & 0xfff));        \
+      sink ^= func(cjk, 2, 32);                         \
+    }                                                   \
+    printf("%s,\t%.3f ns each (%d loops)\n", title,     \
+           (now_seconds() - start) * 1e9 / LOOP, LOOP); \
+  } while (0)
+
+int main(void) {
+  char key[] = "c9e2a4f6-0f52-11ea-8d71-362b9e155667";
+  unsigned long len = strlen(key);
+  double start;
+
+  RUN_HASH("fnv1a", ctools_fnv1a);
+  RUN_HASH("fnv1", ctools_fnv1);
+  RUN_HASH("djb2", ctools_djb2);
+  RUN_HASH("murmur", ctools_murmur_hash2);
+
+  /* The same kernels over CJK text in UCS2, encoded to UTF-8 on the fly. */
+  uint16_t cjk[32];
+  for (int i = 0; i < 32; i++) cjk[i] = (uint16_t)(0x4e00 + i * 613);
+  RUN_UCS("fnv1a cjk ucs2", ctools_fnv1a_ucs);
+  RUN_UCS("murmur cjk ucs2", ctools_murmur_hash2_ucs);
+
+  start = now_seconds();
+  for (int i = 0; i < LOOP; i++) {
+    sink ^= (unsigned int)ctools_jump_consistent_hash((uint64_t)i, 1024);
+  }
+  printf("jump_consistent_hash,\t%.3f ns each (%d loops)\n",
+         (now_seconds() - start) * 1e9 / LOOP, LOOP);
+
+  ctools_rng rng;
+  ctools_rng_seed(&rng, 1);
+  start = now_seconds();
+  for (int i = 0; i < LOOP; i++) {
+    sink ^= ctools_rng_limit(&rng, 1023);
+  }
+  printf("rng_limit,\t%.3f ns each (%d loops)\n",
+         (now_seconds() - start) * 1e9 / LOOP, LOOP);
+  return 0;
+}
@@ -16,3 +16,10 @@
 
 from _ctools_utils import *
 from _ctools_lfu import *
+from _ctools_disk import *
+
+
+def get_include():
+    """Return the directory containing ctools_capi.h and capi.pxd."""
+    import os
+    return os.path.dirname(os.path.abspath(__file__))
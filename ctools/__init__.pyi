@@ -1,5 +1,6 @@
 from datetime import datetime
-from typing import Any, Mapping, Iterable, Tuple, Callable, Optional
+from typing import (Any, Mapping, Iterable, Iterator, List, Tuple, Callable,
+                    Optional, Union)
 
 def jump_consistent_hash(key: int, num_bucket: int) -> int: pass
 
@@ -7,14 +8,127 @@ def strhash(s: str, method: str = 'fnv1a') -> int: ...
 
 def int8_to_datetime(date_integer: int) -> datetime: ...
 
+# struct format of the records drain_trace() returns:
+# (key hash, monotonic time in ns, op, hit)
+TRACE_RECORD: str
+TRACE_GET: int
+TRACE_SET: int
+TRACE_DEL: int
+
+def metrics_text(caches_by_name: Mapping[str, "LFUCache"]) -> str:
+    """
+    Render hits, misses, evictions, size, capacity and the latency of
+    get_many_or_load loaders of every cache in OpenMetrics text format,
+    labeled cache="name", for a Prometheus scrape handler.
+    """
+    pass
+
+def get_include() -> str: ...
+
 class LFUCache:
 
-    def __init__(self, capacity: int) -> None: ...
+    def __init__(self, capacity: int, arena_bytes: int = 0,
+                 spill_path: str = None, spill_bytes: int = 0,
+                 on_refresh: Optional[Callable[[Any], Any]] = None,
+                 pinned_count: bool = True,
+                 weak_values: bool = False,
+                 seed: Optional[int] = None,
+                 policy: str = "lfu",
+                 max_item_size: int = 0,
+                 admission_size: int = 0) -> None:
+        """
+        With arena_bytes > 0, bytes and str values are copied into a slab
+        arena of at most arena_bytes and rebuilt on read.
+
+        With spill_path, evicted entries are pickled into an mmap'd ring
+        log of spill_bytes at that path and promoted back on a hit. When
+        the log wraps around, entries of its oldest segment that a lookup
+        such as `in` found since the last lap are kept, up to half a
+        segment; the others are lost. The file is removed when the cache
+        goes away. spill_path must not exist yet (FileExistsError
+        otherwise) and records are checksummed with a per-process key, so
+        the file is never read back from disk contents the cache didn't
+        write.
+
+        on_refresh(key) is called by the one read that finds an entry past
+        its soft_ttl, see set.
+
+        With pinned_count, pinned entries take their share of capacity,
+        otherwise capacity only bounds the evictable entries. Inserting
+        into a cache whose capacity is all taken by pinned entries raises
+        ValueError.
+
+        With weak_values, entries hold weak references to their values and
+        read as misses once the value is gone. Dead entries are swept in
+        batches by the next write, len or iteration. Values that can't be
+        weakly referenced, such as int, str, bytes and tuple, raise
+        TypeError. Not compatible with arena_bytes, and weak entries are
+        never spilled. Calling __init__ again without weak_values stores
+        new values strongly.
+
+        Eviction sampling and XFetch draw from a generator owned by the
+        cache. Given a seed, the same operations evict the same keys.
+
+        policy "gdsf" evicts by GreedyDual-Size-Frequency instead: the
+        entry with the lowest inflation + (hits + 1) * cost / size goes
+        first, from a heap rather than a sample, and its priority becomes
+        the inflation new and re-rated entries start from. Priority
+        classes don't apply then.
+
+        Values bigger than max_item_size bytes bypass the cache, writing
+        one drops the old value of its key. With admission_size > 0, a new
+        entry of size bytes is admitted with probability exp(-size / c)
+        (AdaptSize), c starting at admission_size and tuned on the hit
+        ratio of every few thousand lookups. Both decide before anything
+        is evicted.
+        """
+        pass
+
+    @classmethod
+    def from_items(cls, items: Union[Mapping, Iterable[Tuple[Any, Any]]],
+                   capacity: int,
+                   initial_weights: Optional[Mapping[Any, int]] = None
+                   ) -> "LFUCache":
+        """
+        Build a cache from a mapping or (key, value) pairs, e.g. to warm it
+        up from a dump. Storage is sized once where reserve() can, and
+        entries are inserted without eviction checks until the cache is
+        full. initial_weights
+        maps keys to the weight they start with, as coldest() and hottest()
+        report them.
+        """
+        pass
+
+    def reserve(self, n: int) -> None:
+        """
+        Size the cache storage for n entries (capacity at most) in one go,
+        so that a following bulk insert doesn't grow it step by step.
+
+        A hint only: it does nothing on Python 3.13+, where no public API
+        presizes a dict, nor while a view returned by _store() is alive.
+        """
+        pass
 
     def get(self, key, default=None):
         """ Return the value for key if key is in the cache, else default. """
         pass
 
+    def get_many_or_load(self, keys: Iterable,
+                         loader: Callable[[List], Mapping]) -> dict:
+        """
+        Look keys up and call loader(missing_keys) once for the misses. The
+        mapping it returns is inserted, and the hits merged with it are
+        returned.
+        """
+        pass
+
+    def fetch(self, key, default=None) -> Tuple[Any, bool]:
+        """
+        Return (value, refresh), or (default, False) on a miss. refresh is
+        True for the one read that should reload a soft expired entry.
+        """
+        pass
+
     def pop(self, key, default=None): # real signature unknown; restored from __doc__
         """
         Cache.pop(k[,default]) -> v, remove specified key and return the corresponding value.
@@ -82,6 +196,94 @@ class LFUCache:
 
     def lfu(self) -> Any: ...
 
+    def coldest(self, k: int) -> List[Tuple[Any, int]]:
+        """
+        Return the k least frequently used entries as (key, weight), the
+        coldest first, in the order eviction would take them. Pinned
+        entries are left out.
+        """
+        pass
+
+    def hottest(self, k: int) -> List[Tuple[Any, int]]:
+        """ Like coldest, the k most frequently used entries first. """
+        pass
+
+    def peek(self, key, default=None) -> Any:
+        """
+        Like get, but leaves the entry weight, the hit and miss counters and
+        the expiry refresh untouched.
+        """
+        pass
+
+    def frequency(self, key) -> int:
+        """
+        Return the weight of key in the units of coldest(), without bumping
+        it. Raise KeyError if key is missing.
+        """
+        pass
+
+    def weight_histogram(self, bins: int = 16,
+                         raw: bool = False) -> List[Tuple[int, int, int]]:
+        """
+        Return the weight distribution of the entries as (low, high, count)
+        over at most bins equal width bins, in one pass. raw counts visits
+        instead of the decayed weight.
+        """
+        pass
+
+    def admission_hints(self) -> Tuple[float, int]:
+        """
+        Return (c, rejections): the admission parameter, 0 without
+        admission_size, and the writes kept out so far.
+        """
+        pass
+
+    def start_trace(self, sample_rate: float = 1.0,
+                    buffer_size: int = 65536) -> None:
+        """
+        Record sample_rate of the gets, sets and deletes from now on, as
+        (hash(key), time, op, hit) records in a ring of buffer_size that
+        keeps the newest. Replaces a running trace.
+        """
+        pass
+
+    def drain_trace(self) -> bytes:
+        """
+        Return the buffered records, oldest first, packed as TRACE_RECORD
+        structs, and empty the buffer.
+        """
+        pass
+
+    def stop_trace(self) -> bytes:
+        """ Stop tracing, return what drain_trace would. """
+        pass
+
+    def trace_hints(self) -> (int, int):
+        """ Return (buffered, dropped) records of the running trace. """
+        pass
+
+    def weight_scan(self, k: int, hottest: bool = False) -> "LFUWeightScan":
+        """ Start a coldest(k) or hottest(k) scan spread over many calls. """
+        pass
+
+    def freeze(self, gc_freeze: bool = True) -> None:
+        """
+        Move LFU counters into one compact array so that reads after fork()
+        don't dirty the pages holding keys, values and entries.
+        With gc_freeze, also call gc.freeze().
+        """
+        pass
+
+    def unfreeze(self) -> None: ...
+
+    def arena_hints(self) -> (int, int, int):
+        """Return (limit, allocated, used) bytes of the value arena."""
+        pass
+
+    def spill_hints(self) -> (int, int, int):
+        """Return (count, live_bytes, size) of the disk tier."""
+        pass
+
     def setnx(self, key, callback: Callable[[], Any]):
         """
         Insert key with a value of callback() if key is not in the dictionary.
@@ -89,3 +291,189 @@ class LFUCache:
         Return the value for key if key is in the dictionary, else callback().
         """
         pass
+
+    def set(self, key, value, tags: Optional[Iterable] = None,
+            ttl: float = 0, soft_ttl: float = 0, delta: float = 0,
+            priority: int = 0, cost: float = 1,
+            size: float = 0) -> None:
+        """
+        Set key to value. The entry can be dropped later together with all
+        other entries sharing one of its tags, see invalidate_tag.
+
+        After ttl seconds the entry is gone. After soft_ttl seconds it is
+        still served but one read is told to refresh it, see fetch and
+        on_refresh. delta, the seconds the value took to compute, lets
+        that read come a little before soft_ttl at random (XFetch), so
+        hot keys don't all reload at once. 0 means never.
+
+        Entries of a lower priority class (0-255) are evicted before any
+        entry of a higher one.
+
+        cost, what recomputing the value costs, and size, in any unit as
+        long as it is the same for every entry, rank the entry under the
+        "gdsf" policy, where size 0 counts as 1. Admission and
+        max_item_size take size in bytes, 0 has the value measured then:
+        exactly for bytes and str, by __sizeof__ otherwise, which doesn't
+        count the items of a container. Pass size for those.
+        """
+        pass
+
+    def pin(self, key) -> None:
+        """
+        Never evict key. Pinned entries are kept apart from the evictable
+        ones, so eviction doesn't scan them.
+        """
+        pass
+
+    def unpin(self, key) -> None: ...
+
+    def namespace(self, name, quota: Optional[int] = None) -> "LFUNamespace":
+        """
+        Return the namespace called name, created on first use, a partition
+        of the cache with its own keys and stats. Once the cache is full,
+        victims are picked from the namespace furthest over its quota
+        first. 0 is no quota.
+        """
+        pass
+
+    def invalidate_tag(self, tag) -> int:
+        """
+        Drop every entry set with tag, return the number dropped. The cost
+        scales with the number of tagged entries, not the cache size.
+        """
+        pass
+
+    def invalidate_all(self) -> None:
+        """
+        Invalidate every entry in O(1). Stale entries read as misses and are
+        reclaimed lazily by lookups and evictions.
+        """
+        pass
+
+
+class LFUNamespace:
+
+    def __len__(self) -> int: ...
+
+    def __contains__(self, key) -> bool: ...
+
+    def __getitem__(self, key) -> Any: ...
+
+    def __setitem__(self, key, value) -> None: ...
+
+    def __delitem__(self, key) -> None: ...
+
+    def get(self, key, default=None) -> Any: ...
+
+    def hints(self) -> (int, int, int, int):
+        """Return (quota, size, hits, misses) of the namespace."""
+        pass
+
+
+class LFUWeightScan:
+
+    def step(self, n: int = 1024) -> bool:
+        """ Visit up to n more entries, return True once all were seen. """
+        pass
+
+    def result(self) -> List[Tuple[Any, int]]:
+        """
+        Return the entries kept so far. Entries removed since they were
+        seen are left out; if the cache changed between steps, the result
+        is approximate.
+        """
+        pass
+
+
+class CacheGroup:
+
+    def __init__(self, max_bytes: int) -> None:
+        """
+        LFUCaches sharing a budget of max_bytes. A member keeps its own
+        capacity, but once the group holds more than max_bytes, each
+        member offers the entry it would evict next and the coldest of
+        those goes, whichever member holds it, on a tie the member holding
+        more bytes. A big group asks a few members drawn by their bytes
+        instead of all of them. Bytes are always measured from the values,
+        the size given to LFUCache.set only ranks entries under "gdsf".
+        """
+        pass
+
+    def __len__(self) -> int: ...
+
+    def join(self, cache: LFUCache) -> None:
+        """
+        Add cache to the group. Its entries are measured in bytes (exactly
+        for bytes and str) and evicted right away if they don't fit. A
+        cache is in one group at most.
+        """
+        pass
+
+    def leave(self, cache: LFUCache) -> None: ...
+
+    def set_max_bytes(self, max_bytes: int) -> None: ...
+
+    def occupancy(self) -> List[Tuple[LFUCache, int, int]]:
+        """ Return (cache, bytes, entries) of every member. """
+        pass
+
+    def hints(self) -> Tuple[int, int]:
+        """ Return (bytes, max_bytes). """
+        pass
+
+
+class DiskLFUStore:
+
+    def __init__(self, path: str, max_bytes: int,
+                 segment_bytes: int = 0) -> None:
+        """
+        Open or create a persistent store in directory path.
+
+        Keys are str or bytes. bytes and str values are stored as is, other
+        values are pickled. Once more than max_bytes of records are live,
+        the least frequently used entries are dropped. A store that was not
+        closed is recovered by replaying its segment files. A store is
+        locked while open: opening it again, even from the same process,
+        raises BlockingIOError.
+        """
+        pass
+
+    def __len__(self) -> int: ...
+
+    def __contains__(self, key: Union[str, bytes]) -> bool: ...
+
+    def __getitem__(self, key: Union[str, bytes]) -> Any: ...
+
+    def __setitem__(self, key: Union[str, bytes], value: Any) -> None: ...
+
+    def __delitem__(self, key: Union[str, bytes]) -> None: ...
+
+    def __iter__(self) -> Iterator[Union[str, bytes]]: ...
+
+    def __enter__(self) -> "DiskLFUStore": ...
+
+    def __exit__(self, *args) -> None: ...
+
+    def get(self, key: Union[str, bytes], default: Any = None) -> Any: ...
+
+    def keys(self) -> List[Union[str, bytes]]: ...
+
+    def clear(self) -> None: ...
+
+    def sync(self) -> None:
+        """Flush segments and index to disk."""
+        pass
+
+    def compact(self) -> int:
+        """Copy live records out of old segments; return segments removed."""
+        pass
+
+    def close(self) -> None: ...
+
+    def hints(self) -> (int, int, int):
+        """Return (max_bytes, hits, misses)."""
+        pass
+
+    def disk_hints(self) -> (int, int, int, bool):
+        """Return (count, live_bytes, disk_bytes, recovered)."""
+        pass
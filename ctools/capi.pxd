@@ -0,0 +1,47 @@
+# -*- coding: utf-8 -*-
+
+# Copyright 2019 ko-han. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Cython declarations for ctools_capi.h.
+#
+#   from ctools.capi cimport *
+#   CToolsUtils_IMPORT()
+#   CToolsLFU_IMPORT()
+#
+# Build with include_dirs=[ctools.get_include()].
+
+from cpython.object cimport PyObject, PyTypeObject
+from libc.stdint cimport int32_t, uint64_t
+
+cdef extern from "ctools_capi.h":
+    int CTOOLS_CAPI_VERSION
+
+    int CToolsUtils_IMPORT "CTools_ImportUtils"() except -1
+    int CToolsLFU_IMPORT "CTools_ImportLFU"() except -1
+
+    unsigned int CTools_fnv1a(const char *s, unsigned long len) nogil
+    unsigned int CTools_fnv1(const char *s, unsigned long len) nogil
+    unsigned int CTools_djb2(const char *s, unsigned long len) nogil
+    unsigned int CTools_murmur_hash2(const char *s, unsigned long len) nogil
+    int32_t CTools_jump_consistent_hash(uint64_t key, int32_t num_buckets) nogil
+
+    bint CTools_LFUCache_Check(object op)
+    object CTools_LFUCache_New(Py_ssize_t capacity)
+    # Miss returns NULL without an exception, hence the raw pointer. An
+    # error returns NULL with one set, check PyErr_Occurred() on NULL.
+    PyObject *CTools_LFUCache_GetItem(object cache, object key)
+    int CTools_LFUCache_SetItem(object cache, object key, object value) except -1
+    int CTools_LFUCache_DelItem(object cache, object key) except -1
+    Py_ssize_t CTools_LFUCache_Size(object cache)
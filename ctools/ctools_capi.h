@@ -0,0 +1,126 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Public C-API of ctools.
+ *
+ * Other C extensions reach the native hash kernels and LFUCache through
+ * capsules, the same way datetime.h exposes PyDateTime_CAPI:
+ *
+ *   if (CToolsUtils_IMPORT < 0) return NULL;
+ *   if (CToolsLFU_IMPORT < 0) return NULL;
+ *   h = CTools_fnv1a(s, len);
+ *   CTools_LFUCache_SetItem(cache, key, value);
+ *
+ * Use ctools.get_include() to locate this header.
+ */
+#ifndef _CTOOLS_CAPI_H
+#define _CTOOLS_CAPI_H
+#include <Python.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CTOOLS_CAPI_VERSION 1
+
+#define CTOOLS_UTILS_CAPSULE_NAME "_ctools_utils._C_API"
+#define CTOOLS_LFU_CAPSULE_NAME "_ctools_lfu._C_API"
+
+typedef struct {
+  int version;
+  unsigned int (*fnv1a)(const char *s, unsigned long len);
+  unsigned int (*fnv1)(const char *s, unsigned long len);
+  unsigned int (*djb2)(const char *s, unsigned long len);
+  unsigned int (*murmur_hash2)(const char *s, unsigned long len);
+  int32_t (*jump_consistent_hash)(uint64_t key, int32_t num_buckets);
+} CToolsUtils_CAPI;
+
+typedef struct {
+  int version;
+  PyTypeObject *LFUCacheType;
+  /* Return a new cache, or NULL with an exception set. */
+  PyObject *(*LFUCache_New)(Py_ssize_t capacity);
+  /* Return a new reference and bump the entry weight. On a miss return NULL
+   * *without* an exception set, so hot paths pay nothing for KeyError. On
+   * an error, e.g. from the key's __hash__ or __eq__, return NULL with an
+   * exception set: check PyErr_Occurred() after a NULL. */
+  PyObject *(*LFUCache_GetItem)(PyObject *cache, PyObject *key);
+  /* Return 0 on success, -1 with an exception set on failure. */
+  int (*LFUCache_SetItem)(PyObject *cache, PyObject *key, PyObject *value);
+  int (*LFUCache_DelItem)(PyObject *cache, PyObject *key);
+  Py_ssize_t (*LFUCache_Size)(PyObject *cache);
+} CToolsLFU_CAPI;
+
+/* The extensions themselves define _CTOOLS_MODULE and only need the tables
+ * above; everybody else gets the import machinery below. */
+#ifndef _CTOOLS_MODULE
+
+static CToolsUtils_CAPI *CToolsUtilsAPI = NULL;
+static CToolsLFU_CAPI *CToolsLFUAPI = NULL;
+
+static int CTools_ImportUtils(void) {
+  CToolsUtilsAPI =
+      (CToolsUtils_CAPI *)PyCapsule_Import(CTOOLS_UTILS_CAPSULE_NAME, 0);
+  if (!CToolsUtilsAPI) return -1;
+  if (CToolsUtilsAPI->version != CTOOLS_CAPI_VERSION) {
+    PyErr_Format(PyExc_ImportError, "ctools C-API version %d, expected %d",
+                 CToolsUtilsAPI->version, CTOOLS_CAPI_VERSION);
+    CToolsUtilsAPI = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int CTools_ImportLFU(void) {
+  CToolsLFUAPI = (CToolsLFU_CAPI *)PyCapsule_Import(CTOOLS_LFU_CAPSULE_NAME, 0);
+  if (!CToolsLFUAPI) return -1;
+  if (CToolsLFUAPI->version != CTOOLS_CAPI_VERSION) {
+    PyErr_Format(PyExc_ImportError, "ctools C-API version %d, expected %d",
+                 CToolsLFUAPI->version, CTOOLS_CAPI_VERSION);
+    CToolsLFUAPI = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+#define CToolsUtils_IMPORT CTools_ImportUtils()
+#define CToolsLFU_IMPORT CTools_ImportLFU()
+
+#define CTools_fnv1a(s, len) CToolsUtilsAPI->fnv1a(s, len)
+#define CTools_fnv1(s, len) CToolsUtilsAPI->fnv1(s, len)
+#define CTools_djb2(s, len) CToolsUtilsAPI->djb2(s, len)
+#define CTools_murmur_hash2(s, len) CToolsUtilsAPI->murmur_hash2(s, len)
+#define CTools_jump_consistent_hash(key, num_buckets) \
+  CToolsUtilsAPI->jump_consistent_hash(key, num_buckets)
+
+#define CTools_LFUCache_Check(op) \
+  PyObject_TypeCheck(op, CToolsLFUAPI->LFUCacheType)
+#define CTools_LFUCache_New(capacity) CToolsLFUAPI->LFUCache_New(capacity)
+#define CTools_LFUCache_GetItem(cache, key) \
+  CToolsLFUAPI->LFUCache_GetItem(cache, key)
+#define CTools_LFUCache_SetItem(cache, key, value) \
+  CToolsLFUAPI->LFUCache_SetItem(cache, key, value)
+#define CTools_LFUCache_DelItem(cache, key) \
+  CToolsLFUAPI->LFUCache_DelItem(cache, key)
+#define CTools_LFUCache_Size(cache) CToolsLFUAPI->LFUCache_Size(cache)
+
+#endif /* _CTOOLS_MODULE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_CAPI_H */
@@ -49,6 +49,10 @@ install() {
 	pip install .
 }
 
+inplace() {
+	python setup.py build_clib build_ext --inplace
+}
+
 tests() {
 	python tests/tests.py
 }
@@ -88,6 +92,9 @@ clean)
 install)
 	install
 	;;
+inplace)
+	inplace
+	;;
 compile)
 	compile
 	;;
@@ -20,9 +20,28 @@ from glob import glob
 from setuptools import setup, Extension
 
 
+# libctools: pure C kernels, linked statically into every extension.
+libraries = [
+    ("ctools", {
+        "sources": [
+            "src/ctools_arena.c",
+            "src/ctools_hash.c",
+            "src/ctools_kv.c",
+            "src/ctools_lfu_core.c",
+            "src/ctools_spill.c",
+            "src/ctools_store.c",
+        ],
+        "include_dirs": ["src"],
+    }),
+]
+
 extensions = [
-    Extension("_ctools_utils", glob("src/ctools_utils.c")),
-    Extension("_ctools_lfu", glob("src/ctools_lfu.c")),
+    Extension("_ctools_utils", glob("src/ctools_utils.c"),
+              include_dirs=["src", "ctools"]),
+    Extension("_ctools_lfu", glob("src/ctools_lfu.c"),
+              include_dirs=["src", "ctools"]),
+    Extension("_ctools_disk", glob("src/ctools_disk.c"),
+              include_dirs=["src", "ctools"]),
 ]
 
 with io.open('README.rst', 'rt', encoding='utf8') as f:
@@ -41,6 +60,7 @@ setup(
     python_requires=">=3",
     include_package_data=True,
     zip_safe=False,
+    libraries=libraries,
     ext_modules=extensions,
     packages=['ctools'],
     classifiers=[
@@ -0,0 +1,129 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "ctools_arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+ctools_arena *ctools_arena_new(size_t limit, size_t page_size) {
+  ctools_arena *arena;
+  size_t size = CTOOLS_ARENA_MIN_CHUNK;
+  int n = 0;
+
+  if (page_size == 0) page_size = CTOOLS_ARENA_PAGE_SIZE;
+  if (page_size > limit) page_size = limit;
+  page_size &= ~(size_t)7;
+  if (page_size < CTOOLS_ARENA_MIN_CHUNK) return NULL;
+
+  arena = (ctools_arena *)calloc(1, sizeof(ctools_arena));
+  if (!arena) return NULL;
+  arena->limit = limit;
+  arena->page_size = page_size;
+
+  while (n < CTOOLS_ARENA_MAX_CLASSES - 1 && size < page_size) {
+    arena->classes[n++].chunk_size = size;
+    size = ALIGN8((size_t)(size * CTOOLS_ARENA_GROWTH));
+  }
+  arena->classes[n++].chunk_size = page_size;
+  arena->n_classes = n;
+  return arena;
+}
+
+void ctools_arena_reset(ctools_arena *arena) {
+  for (size_t i = 0; i < arena->n_pages; i++) free(arena->pages[i]);
+  free(arena->pages);
+  arena->pages = NULL;
+  arena->n_pages = arena->pages_cap = 0;
+  arena->allocated = 0;
+  for (int i = 0; i < arena->n_classes; i++) {
+    ctools_slab_class *cls = &arena->classes[i];
+    cls->free_list = NULL;
+    cls->cursor = cls->end = NULL;
+    cls->pages = cls->used = 0;
+  }
+}
+
+void ctools_arena_free(ctools_arena *arena) {
+  if (!arena) return;
+  ctools_arena_reset(arena);
+  free(arena);
+}
+
+int ctools_arena_class(const ctools_arena *arena, size_t size) {
+  int lo = 0, hi = arena->n_classes - 1;
+  if (size > arena->classes[hi].chunk_size) return -1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (arena->classes[mid].chunk_size < size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int ctools_arena_grow(ctools_arena *arena, ctools_slab_class *cls) {
+  char *page;
+  if (arena->allocated + arena->page_size > arena->limit) return -1;
+  if (arena->n_pages == arena->pages_cap) {
+    size_t cap = arena->pages_cap ? arena->pages_cap * 2 : 16;
+    void **pages = (void **)realloc(arena->pages, cap * sizeof(void *));
+    if (!pages) return -1;
+    arena->pages = pages;
+    arena->pages_cap = cap;
+  }
+  page = (char *)malloc(arena->page_size);
+  if (!page) return -1;
+  arena->pages[arena->n_pages++] = page;
+  arena->allocated += arena->page_size;
+  cls->cursor = page;
+  cls->end = page + arena->page_size - arena->page_size % cls->chunk_size;
+  cls->pages++;
+  return 0;
+}
+
+void *ctools_arena_alloc(ctools_arena *arena, size_t size) {
+  ctools_slab_class *cls;
+  void *chunk;
+  int i = ctools_arena_class(arena, size);
+  if (i < 0) return NULL;
+  cls = &arena->classes[i];
+
+  if (cls->free_list) {
+    chunk = cls->free_list;
+    memcpy(&cls->free_list, chunk, sizeof(void *));
+  } else {
+    if (cls->cursor == cls->end && ctools_arena_grow(arena, cls)) return NULL;
+    chunk = cls->cursor;
+    cls->cursor += cls->chunk_size;
+  }
+  cls->used++;
+  return chunk;
+}
+
+void ctools_arena_release(ctools_arena *arena, void *chunk, size_t size) {
+  ctools_slab_class *cls = &arena->classes[ctools_arena_class(arena, size)];
+  memcpy(chunk, &cls->free_list, sizeof(void *));
+  cls->free_list = chunk;
+  cls->used--;
+}
+
+size_t ctools_arena_used(const ctools_arena *arena) {
+  size_t used = 0;
+  for (int i = 0; i < arena->n_classes; i++)
+    used += arena->classes[i].used * arena->classes[i].chunk_size;
+  return used;
+}
@@ -0,0 +1,78 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_ARENA_H
+#define _CTOOLS_ARENA_H
+#include <stddef.h>
+#include "ctools_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A memcached style slab allocator with a hard memory limit.
+ *
+ * Memory is requested from malloc in pages. Each page is carved into chunks
+ * of one slab class; class sizes grow by CTOOLS_ARENA_GROWTH from
+ * CTOOLS_ARENA_MIN_CHUNK up to the page size. Freed chunks go back to the
+ * free list of their class and pages are only returned by reset/free. */
+
+#define CTOOLS_ARENA_MIN_CHUNK 64
+#define CTOOLS_ARENA_GROWTH 1.25
+#define CTOOLS_ARENA_MAX_CLASSES 64
+#define CTOOLS_ARENA_PAGE_SIZE (1024 * 1024)
+
+typedef struct {
+  size_t chunk_size;
+  void *free_list; /* linked through the first word of each free chunk */
+  char *cursor;    /* bump pointer into the newest page of this class */
+  char *end;
+  size_t pages;
+  size_t used; /* chunks handed out */
+} ctools_slab_class;
+
+typedef struct {
+  size_t limit;
+  size_t page_size;
+  size_t allocated; /* bytes of pages requested from malloc */
+  int n_classes;
+  ctools_slab_class classes[CTOOLS_ARENA_MAX_CLASSES];
+  void **pages;
+  size_t n_pages;
+  size_t pages_cap;
+} ctools_arena;
+
+/* page_size == 0 means CTOOLS_ARENA_PAGE_SIZE, clipped to limit.
+ * Return NULL on bad arguments or out of memory. */
+ctools_arena *ctools_arena_new(size_t limit, size_t page_size);
+void ctools_arena_free(ctools_arena *arena);
+/* Release every page; all chunks become invalid. */
+void ctools_arena_reset(ctools_arena *arena);
+
+/* Return the slab class for size, or -1 if size exceeds the page size. */
+int ctools_arena_class(const ctools_arena *arena, size_t size);
+/* Return a chunk of at least size bytes, or NULL when the class has no free
+ * chunk and the limit forbids another page. */
+void *ctools_arena_alloc(ctools_arena *arena, size_t size);
+/* size must be the size passed to ctools_arena_alloc. */
+void ctools_arena_release(ctools_arena *arena, void *chunk, size_t size);
+
+/* Bytes held by chunks currently in use. */
+size_t ctools_arena_used(const ctools_arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_ARENA_H */
@@ -36,6 +36,8 @@ typedef unsigned __int64 uint64_t;
 #define UINT16_MAX _UI16_MAX
 #define UINT32_MAX _UI32_MAX
 #define UINT64_MAX _UI64_MAX
+#else
+#include <stdint.h>
 #endif  // _MSC_VER
 
 #define PYOBJECT_CVT(x) ((PyObject*)(x))
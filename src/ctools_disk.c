@@ -0,0 +1,468 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "ctools_config.h"
+#include "ctools_store.h"
+
+/* Keys are stored with a one byte type tag, values with a kind flag. */
+#define DISK_KEY_BYTES 'b'
+#define DISK_KEY_STR 's'
+#define DISK_VALUE_BYTES 0
+#define DISK_VALUE_STR 1
+#define DISK_VALUE_PICKLE 2
+
+// clang-format off
+typedef struct {
+  PyObject_HEAD
+  ctools_store *store;
+  Py_ssize_t hits;
+  Py_ssize_t misses;
+} DiskLFUStore;
+// clang-format on
+
+static PyObject *pickle_dumps = NULL;
+static PyObject *pickle_loads = NULL;
+
+#define DiskLFUStore_CHECK_OPEN(self, rv)                             \
+  do {                                                                \
+    if (!(self)->store) {                                             \
+      PyErr_SetString(PyExc_ValueError, "operation on closed store"); \
+      return rv;                                                      \
+    }                                                                 \
+  } while (0)
+
+/* Encode key into a new bytes object holding tag + data. */
+static PyObject *DiskLFUStore_key(PyObject *key) {
+  const char *data;
+  Py_ssize_t len;
+  char tag;
+  PyObject *rv;
+
+  if (PyBytes_Check(key)) {
+    tag = DISK_KEY_BYTES;
+    data = PyBytes_AS_STRING(key);
+    len = PyBytes_GET_SIZE(key);
+  } else if (PyUnicode_Check(key)) {
+    tag = DISK_KEY_STR;
+    if (!(data = PyUnicode_AsUTF8AndSize(key, &len))) return NULL;
+  } else {
+    return PyErr_Format(PyExc_TypeError,
+                        "keys must be str or bytes, not %.200s",
+                        Py_TYPE(key)->tp_name);
+  }
+  if (!(rv = PyBytes_FromStringAndSize(NULL, len + 1))) return NULL;
+  PyBytes_AS_STRING(rv)[0] = tag;
+  memcpy(PyBytes_AS_STRING(rv) + 1, data, len);
+  return rv;
+}
+
+static PyObject *DiskLFUStore_decode_key(const ctools_store_record *rec) {
+  if (rec->key[0] == DISK_KEY_STR)
+    return PyUnicode_DecodeUTF8(rec->key + 1, rec->key_len - 1, NULL);
+  return PyBytes_FromStringAndSize(rec->key + 1, rec->key_len - 1);
+}
+
+static PyObject *DiskLFUStore_decode_value(const ctools_store_record *rec) {
+  switch (rec->flags) {
+    case DISK_VALUE_BYTES:
+      return PyBytes_FromStringAndSize(rec->value, rec->value_len);
+    case DISK_VALUE_STR:
+      return PyUnicode_DecodeUTF8(rec->value, rec->value_len, NULL);
+    default:
+      return PyObject_CallFunction(pickle_loads, "y#", rec->value,
+                                   (Py_ssize_t)rec->value_len);
+  }
+}
+
+static void DiskLFUStore_set_error(void) {
+  if (errno == EFBIG) {
+    PyErr_SetString(PyExc_ValueError, "record is larger than a segment");
+  } else {
+    PyErr_SetFromErrno(PyExc_OSError);
+  }
+}
+
+/* Return a new reference to the value of key, NULL without an exception
+ * on a miss. */
+static PyObject *DiskLFUStore_lookup(DiskLFUStore *self, PyObject *key) {
+  ctools_store_record rec;
+  PyObject *k = DiskLFUStore_key(key);
+  int found;
+  if (!k) return NULL;
+  found = ctools_store_get(self->store, PyBytes_AS_STRING(k),
+                           (uint32_t)PyBytes_GET_SIZE(k), &rec);
+  Py_DECREF(k);
+  if (!found) {
+    self->misses++;
+    return NULL;
+  }
+  self->hits++;
+  return DiskLFUStore_decode_value(&rec);
+}
+
+static int DiskLFUStore_SetItem(DiskLFUStore *self, PyObject *key,
+                                PyObject *value) {
+  PyObject *k, *pickled = NULL;
+  const char *data;
+  Py_ssize_t len;
+  uint32_t kind;
+  int rv;
+
+  DiskLFUStore_CHECK_OPEN(self, -1);
+  if (PyBytes_CheckExact(value)) {
+    kind = DISK_VALUE_BYTES;
+    data = PyBytes_AS_STRING(value);
+    len = PyBytes_GET_SIZE(value);
+  } else if (PyUnicode_CheckExact(value)) {
+    kind = DISK_VALUE_STR;
+    if (!(data = PyUnicode_AsUTF8AndSize(value, &len))) return -1;
+  } else {
+    kind = DISK_VALUE_PICKLE;
+    pickled = PyObject_CallFunction(pickle_dumps, "Oi", value, -1);
+    if (!pickled) return -1;
+    data = PyBytes_AS_STRING(pickled);
+    len = PyBytes_GET_SIZE(pickled);
+  }
+  if (!(k = DiskLFUStore_key(key))) {
+    Py_XDECREF(pickled);
+    return -1;
+  }
+  if (len > UINT32_MAX || PyBytes_GET_SIZE(k) > UINT32_MAX) {
+    errno = EFBIG;
+    rv = -1;
+  } else {
+    rv = ctools_store_put(self->store, PyBytes_AS_STRING(k),
+                          (uint32_t)PyBytes_GET_SIZE(k), data, (uint32_t)len,
+                          kind);
+  }
+  Py_DECREF(k);
+  Py_XDECREF(pickled);
+  if (rv) DiskLFUStore_set_error();
+  return rv;
+}
+
+static int DiskLFUStore_DelItem(DiskLFUStore *self, PyObject *key) {
+  PyObject *k;
+  int rv;
+  DiskLFUStore_CHECK_OPEN(self, -1);
+  if (!(k = DiskLFUStore_key(key))) return -1;
+  rv = ctools_store_delete(self->store, PyBytes_AS_STRING(k),
+                           (uint32_t)PyBytes_GET_SIZE(k));
+  Py_DECREF(k);
+  if (rv < 0) {
+    DiskLFUStore_set_error();
+    return -1;
+  }
+  if (!rv) {
+    PyErr_SetObject(PyExc_KeyError, key);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *DiskLFUStore_new(PyTypeObject *type, PyObject *args,
+                                  PyObject *kwds) {
+  DiskLFUStore *self = (DiskLFUStore *)type->tp_alloc(type, 0);
+  if (!self) return NULL;
+  self->store = NULL;
+  return (PyObject *)self;
+}
+
+static int DiskLFUStore_init(DiskLFUStore *self, PyObject *args,
+                             PyObject *kwds) {
+  PyObject *path = NULL;
+  Py_ssize_t max_bytes, segment_bytes = 0;
+  static char *kwlist[] = {"path", "max_bytes", "segment_bytes", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&n|n", kwlist,
+                                   PyUnicode_FSConverter, &path, &max_bytes,
+                                   &segment_bytes))
+    return -1;
+  if (max_bytes <= 0 || segment_bytes < 0) {
+    Py_DECREF(path);
+    PyErr_SetString(PyExc_ValueError, "max_bytes should be positive");
+    return -1;
+  }
+  if (!pickle_dumps) {
+    PyObject *pickle = PyImport_ImportModule("pickle");
+    if (!pickle) {
+      Py_DECREF(path);
+      return -1;
+    }
+    pickle_dumps = PyObject_GetAttrString(pickle, "dumps");
+    pickle_loads = PyObject_GetAttrString(pickle, "loads");
+    Py_DECREF(pickle);
+    if (!pickle_dumps || !pickle_loads) {
+      Py_CLEAR(pickle_dumps);
+      Py_CLEAR(pickle_loads);
+      Py_DECREF(path);
+      return -1;
+    }
+  }
+  if (self->store) {
+    ctools_store_close(self->store);
+    self->store = NULL;
+  }
+  self->store = ctools_store_open(PyBytes_AS_STRING(path), (size_t)max_bytes,
+                                  (size_t)segment_bytes);
+  if (!self->store) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    Py_DECREF(path);
+    return -1;
+  }
+  Py_DECREF(path);
+  self->hits = 0;
+  self->misses = 0;
+  return 0;
+}
+
+static void DiskLFUStore_tp_dealloc(DiskLFUStore *self) {
+  ctools_store_close(self->store);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static Py_ssize_t DiskLFUStore_Size(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, -1);
+  return (Py_ssize_t)self->store->count;
+}
+
+static int DiskLFUStore_Contains(DiskLFUStore *self, PyObject *key) {
+  ctools_store_record rec;
+  PyObject *k;
+  int found;
+  DiskLFUStore_CHECK_OPEN(self, -1);
+  if (!(k = DiskLFUStore_key(key))) return -1;
+  found = ctools_store_get(self->store, PyBytes_AS_STRING(k),
+                           (uint32_t)PyBytes_GET_SIZE(k), &rec);
+  Py_DECREF(k);
+  return found;
+}
+
+static PyObject *DiskLFUStore_mp_subscript(DiskLFUStore *self, PyObject *key) {
+  PyObject *value;
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  value = DiskLFUStore_lookup(self, key);
+  if (!value && !PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+  return value;
+}
+
+static int DiskLFUStore_mp_ass_sub(DiskLFUStore *self, PyObject *key,
+                                   PyObject *value) {
+  if (value == NULL) return DiskLFUStore_DelItem(self, key);
+  return DiskLFUStore_SetItem(self, key, value);
+}
+
+static PySequenceMethods DiskLFUStore_as_sequence = {
+    0,                                 /* sq_length */
+    0,                                 /* sq_concat */
+    0,                                 /* sq_repeat */
+    0,                                 /* sq_item */
+    0,                                 /* sq_slice */
+    0,                                 /* sq_ass_item */
+    0,                                 /* sq_ass_slice */
+    (objobjproc)DiskLFUStore_Contains, /* sq_contains */
+    0,                                 /* sq_inplace_concat */
+    0,                                 /* sq_inplace_repeat */
+};
+
+static PyMappingMethods DiskLFUStore_as_mapping = {
+    (lenfunc)DiskLFUStore_Size,             /*mp_length*/
+    (binaryfunc)DiskLFUStore_mp_subscript,  /*mp_subscript*/
+    (objobjargproc)DiskLFUStore_mp_ass_sub, /*mp_ass_subscript*/
+};
+
+static PyObject *DiskLFUStore_get(DiskLFUStore *self, PyObject *args,
+                                  PyObject *kw) {
+  PyObject *key, *_default = Py_None, *value;
+  static char *kwlist[] = {"key", "default", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
+    return NULL;
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  value = DiskLFUStore_lookup(self, key);
+  if (!value && !PyErr_Occurred()) {
+    Py_INCREF(_default);
+    return _default;
+  }
+  return value;
+}
+
+static PyObject *DiskLFUStore_keys(DiskLFUStore *self) {
+  ctools_store_record rec;
+  size_t pos = 0;
+  PyObject *keys;
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  if (!(keys = PyList_New(0))) return NULL;
+  while (ctools_store_next(self->store, &pos, &rec)) {
+    PyObject *key = DiskLFUStore_decode_key(&rec);
+    if (!key || PyList_Append(keys, key)) {
+      Py_XDECREF(key);
+      Py_DECREF(keys);
+      return NULL;
+    }
+    Py_DECREF(key);
+  }
+  return keys;
+}
+
+static PyObject *DiskLFUStore_tp_iter(DiskLFUStore *self) {
+  PyObject *keys, *it;
+  if (!(keys = DiskLFUStore_keys(self))) return NULL;
+  it = PySeqIter_New(keys);
+  Py_DECREF(keys);
+  return it;
+}
+
+static PyObject *DiskLFUStore_clear(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  if (ctools_store_clear(self->store)) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static PyObject *DiskLFUStore_sync(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  if (ctools_store_sync(self->store)) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static PyObject *DiskLFUStore_compact(DiskLFUStore *self) {
+  int n = 0, rv;
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  /* stop once every segment has been through once */
+  for (size_t todo = self->store->n_segments - 1; todo; todo--) {
+    if ((rv = ctools_store_compact(self->store)) < 0)
+      return PyErr_SetFromErrno(PyExc_OSError);
+    n += rv;
+  }
+  return PyLong_FromLong(n);
+}
+
+static PyObject *DiskLFUStore_close(DiskLFUStore *self) {
+  ctools_store *store = self->store;
+  self->store = NULL;
+  if (ctools_store_close(store)) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static PyObject *DiskLFUStore_enter(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *DiskLFUStore_exit(DiskLFUStore *self, PyObject *args) {
+  return DiskLFUStore_close(self);
+}
+
+static PyObject *DiskLFUStore_hints(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  return Py_BuildValue("nnn", (Py_ssize_t)self->store->max_bytes, self->hits,
+                       self->misses);
+}
+
+static PyObject *DiskLFUStore_disk_hints(DiskLFUStore *self) {
+  DiskLFUStore_CHECK_OPEN(self, NULL);
+  return Py_BuildValue("nnnO", (Py_ssize_t)self->store->count,
+                       (Py_ssize_t)self->store->live_bytes,
+                       (Py_ssize_t)ctools_store_disk_bytes(self->store),
+                       self->store->recovered ? Py_True : Py_False);
+}
+
+static PyMethodDef DiskLFUStore_methods[] = {
+    {"get", (PyCFunction)DiskLFUStore_get, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"keys", (PyCFunction)(void (*)(void))DiskLFUStore_keys, METH_NOARGS,
+     NULL},
+    {"clear", (PyCFunction)(void (*)(void))DiskLFUStore_clear, METH_NOARGS,
+     NULL},
+    {"sync", (PyCFunction)(void (*)(void))DiskLFUStore_sync, METH_NOARGS,
+     NULL},
+    {"compact", (PyCFunction)(void (*)(void))DiskLFUStore_compact,
+     METH_NOARGS, NULL},
+    {"close", (PyCFunction)(void (*)(void))DiskLFUStore_close, METH_NOARGS,
+     NULL},
+    {"hints", (PyCFunction)(void (*)(void))DiskLFUStore_hints, METH_NOARGS,
+     NULL},
+    {"disk_hints", (PyCFunction)(void (*)(void))DiskLFUStore_disk_hints,
+     METH_NOARGS, NULL},
+    {"__enter__", (PyCFunction)(void (*)(void))DiskLFUStore_enter,
+     METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)DiskLFUStore_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+PyDoc_STRVAR(DiskLFUStore__doc__,
+             "A persistent key-value store on local disk with LFU eviction.");
+
+static PyTypeObject DiskLFUStoreType = {
+    PyVarObject_HEAD_INIT(NULL, 0) "DiskLFUStore", /* tp_name */
+    sizeof(DiskLFUStore),                          /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor)DiskLFUStore_tp_dealloc,           /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    0,                                             /* tp_repr */
+    0,                                             /* tp_as_number */
+    &DiskLFUStore_as_sequence,                     /* tp_as_sequence */
+    &DiskLFUStore_as_mapping,                      /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                            /* tp_flags */
+    DiskLFUStore__doc__,                           /* tp_doc */
+    0,                                             /* tp_traverse */
+    0,                                             /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    (getiterfunc)DiskLFUStore_tp_iter,             /* tp_iter */
+    0,                                             /* tp_iternext */
+    DiskLFUStore_methods,                          /* tp_methods */
+    0,                                             /* tp_members */
+    0,                                             /* tp_getset */
+    0,                                             /* tp_base */
+    0,                                             /* tp_dict */
+    0,                                             /* tp_descr_get */
+    0,                                             /* tp_descr_set */
+    0,                                             /* tp_dictoffset */
+    (initproc)DiskLFUStore_init,                   /* tp_init */
+    0,                                             /* tp_alloc */
+    (newfunc)DiskLFUStore_new,                     /* tp_new */
+};
+
+static struct PyModuleDef _ctools_disk_module = {
+    PyModuleDef_HEAD_INIT,
+    "_ctools_disk", /* m_name */
+    NULL,           /* m_doc */
+    -1,             /* m_size */
+    NULL,           /* m_methods */
+    NULL,           /* m_reload */
+    NULL,           /* m_traverse */
+    NULL,           /* m_clear */
+    NULL,           /* m_free */
+};
+
+PyMODINIT_FUNC PyInit__ctools_disk(void) {
+  if (PyType_Ready(&DiskLFUStoreType) < 0) return NULL;
+
+  PyObject *m = PyModule_Create(&_ctools_disk_module);
+  if (m == NULL) return NULL;
+
+  Py_INCREF(&DiskLFUStoreType);
+  PyModule_AddObject(m, "DiskLFUStore", (PyObject *)&DiskLFUStoreType);
+  return m;
+}
@@ -0,0 +1,269 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "ctools_hash.h"
+
+int32_t ctools_jump_consistent_hash(uint64_t key, int32_t num_buckets) {
+  int64_t b = -1, j = 0;
+  while (j < num_buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (b + 1) * ((double)(1LL << 31) / ((double)((key >> 33) + 1)));
+  }
+  return (int32_t)b;
+}
+
+unsigned int ctools_fnv1a(const char *s, unsigned long len) {
+  unsigned int hash = 2166136261U;
+  for (unsigned long i = 0; i < len; i++) {
+    hash = hash ^ s[i];
+    /* hash * (1 << 24 + 1 << 8 + 0x93) */
+    hash +=
+        (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24);
+  }
+  return hash;
+}
+
+uint64_t ctools_fnv1a_64(const char *s, unsigned long len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned long i = 0; i < len; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+unsigned int ctools_fnv1(const char *s, unsigned long len) {
+  unsigned int hash = 2166136261U;
+  for (unsigned long i = 0; i < len; i++) {
+    /* hash * (1 << 24 + 1 << 8 + 0x93) */
+    hash +=
+        (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24);
+    hash = hash ^ s[i];
+  }
+  return hash;
+}
+
+unsigned int ctools_murmur_hash2(const char *str, unsigned long len) {
+  unsigned int hash, key;
+
+  hash = 0 ^ len;
+  while (len >= 4) {
+    key = str[0];
+    key |= str[1] << 8;
+    key |= str[2] << 16;
+    key |= str[3] << 24;
+
+    key *= 0x5bd1e995;
+    key ^= key >> 24;
+    key *= 0x5bd1e995;
+
+    hash *= 0x5bd1e995;
+    hash ^= key;
+
+    str += 4;
+    len -= 4;
+  }
+
+  switch (len) {
+    case 3:
+      hash ^= str[2] << 16;
+      /* fall through */
+    case 2:
+      hash ^= str[1] << 8;
+      /* fall through */
+    case 1:
+      hash ^= str[0];
+      hash *= 0x5bd1e995;
+    default:;
+  }
+
+  hash ^= hash >> 13;
+  hash *= 0x5bd1e995;
+  hash ^= hash >> 15;
+
+  return hash;
+}
+
+unsigned int ctools_djb2(const char *str, unsigned long len) {
+  unsigned int hash = 5381;
+  for (unsigned long i = 0; i < len; i++) {
+    hash = ((hash << 5) + hash) + str[i];
+  }
+
+  return hash;
+}
+
+/* Feed the UTF-8 bytes of each code point to STEP, cast to char like the byte
+ * kernels read them, so sign extension stays the same. */
+#define CTOOLS_UCS_EACH(type, data, len, STEP)     \
+  do {                                             \
+    const type *_p = (const type *)(data);         \
+    for (unsigned long _i = 0; _i < (len); _i++) { \
+      uint32_t _c = _p[_i];                        \
+      if (_c < 0x80) {                             \
+        STEP((char)_c);                            \
+      } else if (_c < 0x800) {                     \
+        STEP((char)(0xc0 | (_c >> 6)));            \
+        STEP((char)(0x80 | (_c & 0x3f)));          \
+      } else if (_c < 0x10000) {                   \
+        STEP((char)(0xe0 | (_c >> 12)));           \
+        STEP((char)(0x80 | ((_c >> 6) & 0x3f)));   \
+        STEP((char)(0x80 | (_c & 0x3f)));          \
+      } else {                                     \
+        STEP((char)(0xf0 | (_c >> 18)));           \
+        STEP((char)(0x80 | ((_c >> 12) & 0x3f)));  \
+        STEP((char)(0x80 | ((_c >> 6) & 0x3f)));   \
+        STEP((char)(0x80 | (_c & 0x3f)));          \
+      }                                            \
+    }                                              \
+  } while (0)
+
+/* One loop per kind, the branches a kind can't take fold away. */
+#define CTOOLS_UCS_WALK(data, kind, len, STEP)      \
+  do {                                              \
+    switch (kind) {                                 \
+      case 1:                                       \
+        CTOOLS_UCS_EACH(uint8_t, data, len, STEP);  \
+        break;                                      \
+      case 2:                                       \
+        CTOOLS_UCS_EACH(uint16_t, data, len, STEP); \
+        break;                                      \
+      default:                                      \
+        CTOOLS_UCS_EACH(uint32_t, data, len, STEP); \
+    }                                               \
+  } while (0)
+
+long ctools_utf8_length(const void *data, int kind, unsigned long len) {
+  long n = 0;
+  switch (kind) {
+    case 1: {
+      const uint8_t *p = (const uint8_t *)data;
+      for (unsigned long i = 0; i < len; i++) n += 1 + (p[i] >> 7);
+      return n;
+    }
+    case 2: {
+      const uint16_t *p = (const uint16_t *)data;
+      for (unsigned long i = 0; i < len; i++) {
+        if (p[i] < 0x80) {
+          n += 1;
+        } else if (p[i] < 0x800) {
+          n += 2;
+        } else {
+          if (p[i] >= 0xd800 && p[i] <= 0xdfff) return -1;
+          n += 3;
+        }
+      }
+      return n;
+    }
+    default: {
+      const uint32_t *p = (const uint32_t *)data;
+      for (unsigned long i = 0; i < len; i++) {
+        if (p[i] < 0x80) {
+          n += 1;
+        } else if (p[i] < 0x800) {
+          n += 2;
+        } else if (p[i] < 0x10000) {
+          if (p[i] >= 0xd800 && p[i] <= 0xdfff) return -1;
+          n += 3;
+        } else {
+          n += 4;
+        }
+      }
+      return n;
+    }
+  }
+}
+
+unsigned int ctools_fnv1a_ucs(const void *data, int kind, unsigned long len) {
+  unsigned int hash = 2166136261U;
+#define FNV1A_STEP(b)                                               \
+  do {                                                              \
+    hash = hash ^ (b);                                              \
+    hash += (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + \
+            (hash << 24);                                           \
+  } while (0)
+  CTOOLS_UCS_WALK(data, kind, len, FNV1A_STEP);
+#undef FNV1A_STEP
+  return hash;
+}
+
+unsigned int ctools_fnv1_ucs(const void *data, int kind, unsigned long len) {
+  unsigned int hash = 2166136261U;
+#define FNV1_STEP(b)                                                \
+  do {                                                              \
+    hash += (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + \
+            (hash << 24);                                           \
+    hash = hash ^ (b);                                              \
+  } while (0)
+  CTOOLS_UCS_WALK(data, kind, len, FNV1_STEP);
+#undef FNV1_STEP
+  return hash;
+}
+
+unsigned int ctools_djb2_ucs(const void *data, int kind, unsigned long len) {
+  unsigned int hash = 5381;
+#define DJB2_STEP(b) hash = ((hash << 5) + hash) + (b)
+  CTOOLS_UCS_WALK(data, kind, len, DJB2_STEP);
+#undef DJB2_STEP
+  return hash;
+}
+
+unsigned int ctools_murmur_hash2_ucs(const void *data, int kind,
+                                     unsigned long len) {
+  unsigned int hash, key;
+  char str[4];
+  int n = 0;
+
+  hash = 0 ^ (unsigned long)ctools_utf8_length(data, kind, len);
+#define MURMUR_STEP(b)     \
+  do {                     \
+    str[n++] = (b);        \
+    if (n == 4) {          \
+      key = str[0];        \
+      key |= str[1] << 8;  \
+      key |= str[2] << 16; \
+      key |= str[3] << 24; \
+                           \
+      key *= 0x5bd1e995;   \
+      key ^= key >> 24;    \
+      key *= 0x5bd1e995;   \
+                           \
+      hash *= 0x5bd1e995;  \
+      hash ^= key;         \
+      n = 0;               \
+    }                      \
+  } while (0)
+  CTOOLS_UCS_WALK(data, kind, len, MURMUR_STEP);
+#undef MURMUR_STEP
+
+  switch (n) {
+    case 3:
+      hash ^= str[2] << 16;
+      /* fall through */
+    case 2:
+      hash ^= str[1] << 8;
+      /* fall through */
+    case 1:
+      hash ^= str[0];
+      hash *= 0x5bd1e995;
+    default:;
+  }
+
+  hash ^= hash >> 13;
+  hash *= 0x5bd1e995;
+  hash ^= hash >> 15;
+
+  return hash;
+}
@@ -0,0 +1,52 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_HASH_H
+#define _CTOOLS_HASH_H
+#include "ctools_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pure C hash kernels, shared by the python extensions and libctools. */
+
+unsigned int ctools_fnv1a(const char *s, unsigned long len);
+unsigned int ctools_fnv1(const char *s, unsigned long len);
+unsigned int ctools_djb2(const char *s, unsigned long len);
+unsigned int ctools_murmur_hash2(const char *s, unsigned long len);
+/* 64 bit FNV-1a, for hash tables that outgrow 32 bits. */
+uint64_t ctools_fnv1a_64(const char *s, unsigned long len);
+
+/* The same kernels over a PEP 393 style array of len code points, kind (1, 2
+ * or 4) bytes each. The code points are UTF-8 encoded on the fly, so the
+ * result equals hashing the UTF-8 bytes without building them. Surrogates
+ * have no UTF-8 form, check for them with ctools_utf8_length first. */
+unsigned int ctools_fnv1a_ucs(const void *data, int kind, unsigned long len);
+unsigned int ctools_fnv1_ucs(const void *data, int kind, unsigned long len);
+unsigned int ctools_djb2_ucs(const void *data, int kind, unsigned long len);
+unsigned int ctools_murmur_hash2_ucs(const void *data, int kind,
+                                     unsigned long len);
+/* Length of the UTF-8 encoding, or -1 if there is a surrogate. */
+long ctools_utf8_length(const void *data, int kind, unsigned long len);
+
+/* Generate a number in the range [0, num_buckets).
+ * See https://arxiv.org/abs/1406.2294 */
+int32_t ctools_jump_consistent_hash(uint64_t key, int32_t num_buckets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_HASH_H */
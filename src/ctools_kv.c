@@ -0,0 +1,194 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "ctools_kv.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctools_hash.h"
+
+#define KV_INIT_SIZE 64
+#define KV_MINUTES(now) ((now) / 60)
+
+static char kv_removed;
+#define KV_REMOVED ((ctools_kv_item *)&kv_removed)
+#define KV_USED(item) ((item) && (item) != KV_REMOVED)
+#define KV_EXPIRED(item, now) ((item)->exptime && (item)->exptime <= (now))
+
+static int kv_resize(ctools_kv *kv, size_t cap) {
+  ctools_kv_item **old = kv->slots;
+  size_t old_cap = old ? kv->mask + 1 : 0;
+  ctools_kv_item **slots =
+      (ctools_kv_item **)calloc(cap, sizeof(ctools_kv_item *));
+  if (!slots) return -1;
+  kv->slots = slots;
+  kv->mask = cap - 1;
+  kv->tombs = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (!KV_USED(old[i])) continue;
+    size_t j = old[i]->hash & kv->mask;
+    while (slots[j]) j = (j + 1) & kv->mask;
+    slots[j] = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+ctools_kv *ctools_kv_new(size_t max_bytes) {
+  ctools_kv *kv = (ctools_kv *)calloc(1, sizeof(ctools_kv));
+  if (!kv) return NULL;
+  kv->max_bytes = max_bytes;
+  ctools_rng_seed(&kv->rng, (uint64_t)(size_t)kv);
+  if (kv_resize(kv, KV_INIT_SIZE)) {
+    free(kv);
+    return NULL;
+  }
+  return kv;
+}
+
+void ctools_kv_flush(ctools_kv *kv) {
+  for (size_t i = 0; i <= kv->mask; i++) {
+    if (KV_USED(kv->slots[i])) free(kv->slots[i]);
+    kv->slots[i] = NULL;
+  }
+  kv->count = kv->tombs = kv->bytes = 0;
+}
+
+void ctools_kv_free(ctools_kv *kv) {
+  if (!kv) return;
+  ctools_kv_flush(kv);
+  free(kv->slots);
+  free(kv);
+}
+
+static size_t kv_find(ctools_kv *kv, uint64_t hash, const char *key,
+                      uint32_t key_len) {
+  size_t i = hash & kv->mask;
+  for (; kv->slots[i]; i = (i + 1) & kv->mask) {
+    ctools_kv_item *item = kv->slots[i];
+    if (item == KV_REMOVED || item->hash != hash) continue;
+    if (item->key_len == key_len && !memcmp(CTOOLS_KV_KEY(item), key, key_len))
+      return i;
+  }
+  return (size_t)-1;
+}
+
+static void kv_unlink(ctools_kv *kv, size_t i) {
+  ctools_kv_item *item = kv->slots[i];
+  kv->bytes -= CTOOLS_KV_ITEM_SIZE(item->key_len, item->value_len);
+  kv->count--;
+  kv->tombs++;
+  kv->slots[i] = KV_REMOVED;
+  free(item);
+}
+
+/* Unlink the lowest weight item among a few sampled ones, preferring any
+ * expired one. */
+static void kv_evict(ctools_kv *kv, uint32_t now) {
+  unsigned int minutes = KV_MINUTES(now), weight = 0;
+  size_t victim = (size_t)-1;
+  for (int n = 0; n < CTOOLS_LFU_BUCKET; n++) {
+    size_t i = (size_t)ctools_rng_next(&kv->rng) & kv->mask;
+    while (!KV_USED(kv->slots[i])) i = (i + 1) & kv->mask;
+    if (KV_EXPIRED(kv->slots[i], now)) {
+      kv->expired++;
+      kv_unlink(kv, i);
+      return;
+    }
+    unsigned int w = ctools_lfu_weight(&kv->slots[i]->counter, minutes);
+    if (victim == (size_t)-1 || w < weight) {
+      victim = i;
+      weight = w;
+    }
+  }
+  kv->evictions++;
+  kv_unlink(kv, victim);
+}
+
+ctools_kv_item *ctools_kv_get(ctools_kv *kv, const char *key,
+                              uint32_t key_len, uint32_t now) {
+  size_t i = kv_find(kv, ctools_fnv1a_64(key, key_len), key, key_len);
+  if (i == (size_t)-1) return NULL;
+  if (KV_EXPIRED(kv->slots[i], now)) {
+    kv->expired++;
+    kv_unlink(kv, i);
+    return NULL;
+  }
+  ctools_lfu_counter_incr(&kv->slots[i]->counter, KV_MINUTES(now));
+  return kv->slots[i];
+}
+
+ctools_kv_item *ctools_kv_alloc(const char *key, uint32_t key_len,
+                                uint32_t value_len, uint32_t flags,
+                                uint32_t exptime) {
+  ctools_kv_item *item =
+      (ctools_kv_item *)malloc(CTOOLS_KV_ITEM_SIZE(key_len, value_len));
+  if (!item) return NULL;
+  item->hash = ctools_fnv1a_64(key, key_len);
+  item->cas = 0;
+  item->flags = flags;
+  item->exptime = exptime;
+  item->key_len = key_len;
+  item->value_len = value_len;
+  memcpy(CTOOLS_KV_KEY(item), key, key_len);
+  return item;
+}
+
+int ctools_kv_link(ctools_kv *kv, ctools_kv_item *item, uint32_t now) {
+  size_t size = CTOOLS_KV_ITEM_SIZE(item->key_len, item->value_len);
+  size_t i;
+
+  if (size > kv->max_bytes) {
+    errno = E2BIG;
+    return -1;
+  }
+  /* grow before touching anything, so a failure leaves the old item */
+  if ((kv->count + kv->tombs + 1) * 2 > kv->mask + 1) {
+    size_t cap = kv->mask + 1;
+    while (cap < (kv->count + 1) * 4) cap *= 2;
+    if (kv_resize(kv, cap)) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  i = kv_find(kv, item->hash, CTOOLS_KV_KEY(item), item->key_len);
+  if (i != (size_t)-1) {
+    item->counter = kv->slots[i]->counter;
+    kv_unlink(kv, i);
+  } else {
+    ctools_lfu_counter_init(&item->counter, KV_MINUTES(now));
+  }
+  while (kv->count && kv->bytes + size > kv->max_bytes) kv_evict(kv, now);
+  i = item->hash & kv->mask;
+  while (KV_USED(kv->slots[i])) i = (i + 1) & kv->mask;
+  if (kv->slots[i] == KV_REMOVED) kv->tombs--;
+  kv->slots[i] = item;
+  item->cas = ++kv->cas;
+  kv->count++;
+  kv->bytes += size;
+  return 0;
+}
+
+int ctools_kv_delete(ctools_kv *kv, const char *key, uint32_t key_len,
+                     uint32_t now) {
+  size_t i = kv_find(kv, ctools_fnv1a_64(key, key_len), key, key_len);
+  if (i == (size_t)-1) return 0;
+  if (KV_EXPIRED(kv->slots[i], now)) {
+    kv->expired++;
+    kv_unlink(kv, i);
+    return 0;
+  }
+  kv_unlink(kv, i);
+  return 1;
+}
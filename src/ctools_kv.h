@@ -0,0 +1,85 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_KV_H
+#define _CTOOLS_KV_H
+#include <stddef.h>
+#include "ctools_config.h"
+#include "ctools_lfu_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An in-memory key-value table of byte strings, bounded by bytes and
+ * evicting by the LFU counter scheme of LFUCache. It is the engine behind
+ * ctoolsd. A table is not thread safe; callers shard and lock. */
+
+typedef struct {
+  uint64_t hash;
+  uint64_t cas;
+  uint32_t flags;
+  uint32_t exptime; /* absolute unix time, 0 for never */
+  uint32_t key_len;
+  uint32_t value_len;
+  ctools_lfu_counter counter;
+} ctools_kv_item;
+
+#define CTOOLS_KV_KEY(item) ((char *)((item) + 1))
+#define CTOOLS_KV_VALUE(item) (CTOOLS_KV_KEY(item) + (item)->key_len)
+#define CTOOLS_KV_ITEM_SIZE(key_len, value_len) \
+  (sizeof(ctools_kv_item) + (size_t)(key_len) + (size_t)(value_len))
+
+typedef struct {
+  ctools_kv_item **slots;
+  size_t mask;
+  size_t count;
+  size_t tombs;
+  size_t max_bytes;
+  size_t bytes;
+  uint64_t cas;
+  ctools_rng rng; /* one per table, so shards don't share draws */
+  uint64_t evictions;
+  uint64_t expired;
+} ctools_kv;
+
+ctools_kv *ctools_kv_new(size_t max_bytes);
+void ctools_kv_free(ctools_kv *kv);
+
+/* Return the item of key and bump its counter, or NULL. Expired items are
+ * unlinked on the way. The item stays valid until the table is modified. */
+ctools_kv_item *ctools_kv_get(ctools_kv *kv, const char *key,
+                              uint32_t key_len, uint32_t now);
+
+/* Allocate an unlinked item holding key; the caller fills the value. */
+ctools_kv_item *ctools_kv_alloc(const char *key, uint32_t key_len,
+                                uint32_t value_len, uint32_t flags,
+                                uint32_t exptime);
+/* Link item, replacing the current item of its key (whose counter it
+ * inherits) and evicting until it fits. The table owns item on success.
+ * Return -1 with errno set to E2BIG if item is bigger than the table, or
+ * ENOMEM if the table can't grow; the table is unchanged then. */
+int ctools_kv_link(ctools_kv *kv, ctools_kv_item *item, uint32_t now);
+
+/* Return 1 if key was deleted, 0 if missing. */
+int ctools_kv_delete(ctools_kv *kv, const char *key, uint32_t key_len,
+                     uint32_t now);
+/* Drop every item. */
+void ctools_kv_flush(ctools_kv *kv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_KV_H */
@@ -12,90 +12,262 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#define PY_SSIZE_T_CLEAN
+#define _CTOOLS_MODULE
 #include <Python.h>
-#include <time.h>
+#include "ctools_arena.h"
+#include "ctools_capi.h"
 #include "ctools_config.h"
-
-#define LFU_INIT_VAL 255U
-
-#define LFU_BUCKET 8
-#define LFU_BUCKET_SIZE 256
-
-static inline unsigned int time_in_minutes(void) {
-  return (unsigned int)(((uint64_t)time(NULL) / 60) & UINT32_MAX);
-}
+#include "ctools_lfu_core.h"
+#include "ctools_spill.h"
 
 // clang-format off
 typedef struct _LFUValue {
   PyObject_HEAD
   PyObject *wrapped;
-  unsigned int last_visit;
-  unsigned int visit_count;
+  /* Points at _counter, or into the owning cache's compact counter array
+   * once the cache is frozen. */
+  ctools_lfu_counter *counter;
+  ctools_lfu_counter _counter;
+  /* Value copied into the cache's arena, wrapped is NULL then. */
+  struct _LFUArenaValue *chunk;
+  /* Cache generation the entry was written in, see invalidate_all. */
+  uint64_t generation;
+  /* Tuple of the tags the entry was set with, or NULL. */
+  PyObject *tags;
+  /* Soft and hard expiry, NULL for entries set without a ttl. */
+  ctools_lfu_expiry *expiry;
+  /* Lower classes are evicted first, see set. */
+  unsigned char priority;
+  /* The entry lives in the cache's pinned dict, see pin. */
+  unsigned char pinned;
+  /* Namespace of the entry and its slot in there, see namespace. */
+  struct _LFUNamespace *ns;
+  Py_ssize_t ns_pos;
+  /* Recomputation cost and size of the value, and the entry's node in the
+   * cache's GDSF heap, see policy. */
+  double cost;
+  double size;
+  /* Measured bytes of the value, counted against the cache's group. */
+  double bytes;
+  ctools_gdsf_node gdsf;
+  unsigned int gdsf_count; /* visit_count gdsf.priority was computed with */
 } LFUWrapper;
 // clang-format on
 
+/* Layout of a bytes or str value stored in an arena chunk. */
+typedef struct _LFUArenaValue {
+  uint32_t size;
+  uint32_t kind; /* LFU_ARENA_BYTES or a PyUnicode kind */
+} LFUArenaValue;
+
+#define LFU_ARENA_BYTES 0
+#define LFUArenaValue_DATA(v) ((char *)(v) + sizeof(LFUArenaValue))
+#define LFUArenaValue_CHUNK_SIZE(v) (sizeof(LFUArenaValue) + (v)->size)
+
+/* Weak reference to a value that remembers its key, like weakref.KeyedRef,
+ * so a dead value can be matched back to its entry. */
+typedef struct {
+  PyWeakReference ref;
+  PyObject *key;
+} LFUWeakRef;
+
+/* weakref.ref, looked up at import rather than through the private
+ * _PyWeakref_RefType. */
+static PyTypeObject *LFUWeakRef_base = NULL;
+
+static int LFUWeakRef_tp_traverse(LFUWeakRef *self, visitproc visit,
+                                  void *arg) {
+  Py_VISIT(self->key);
+  return LFUWeakRef_base->tp_traverse((PyObject *)self, visit, arg);
+}
+
+static int LFUWeakRef_tp_clear(LFUWeakRef *self) {
+  Py_CLEAR(self->key);
+  return LFUWeakRef_base->tp_clear((PyObject *)self);
+}
+
+static void LFUWeakRef_tp_dealloc(LFUWeakRef *self) {
+  Py_CLEAR(self->key);
+  LFUWeakRef_base->tp_dealloc((PyObject *)self);
+}
+
+static PyTypeObject LFUWeakRefType = {
+    PyVarObject_HEAD_INIT(NULL, 0) "LFUWeakRef", /* tp_name */
+    sizeof(LFUWeakRef),                          /* tp_basicsize */
+    0,                                           /* tp_itemsize */
+    (destructor)LFUWeakRef_tp_dealloc,           /* tp_dealloc */
+    0,                                           /* tp_print */
+    0,                                           /* tp_getattr */
+    0,                                           /* tp_setattr */
+    0,                                           /* tp_compare */
+    0,                                           /* tp_repr */
+    0,                                           /* tp_as_number */
+    0,                                           /* tp_as_sequence */
+    0,                                           /* tp_as_mapping */
+    0,                                           /* tp_hash */
+    0,                                           /* tp_call */
+    0,                                           /* tp_str */
+    0,                                           /* tp_getattro */
+    0,                                           /* tp_setattro */
+    0,                                           /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,     /* tp_flags */
+    "Weak reference to a LFUCache value",        /* tp_doc */
+    (traverseproc)LFUWeakRef_tp_traverse,        /* tp_traverse */
+    (inquiry)LFUWeakRef_tp_clear,                /* tp_clear */
+};
+
+/* The referent of ref, borrowed, or Py_None once it died. Dropping the new
+ * reference leaves it as alive as PyWeakref_GET_OBJECT, deprecated in 3.13,
+ * would have. */
+static PyObject *LFUWeakRef_object(PyObject *ref) {
+#if PY_VERSION_HEX >= 0x030D0000
+  PyObject *obj;
+  if (PyWeakref_GetRef(ref, &obj) <= 0) return Py_None;
+  Py_DECREF(obj);
+  return obj;
+#else
+  return PyWeakref_GET_OBJECT(ref);
+#endif
+}
+
+#define LFUWrapper_IS_WEAK(self) \
+  ((self)->wrapped && Py_TYPE((self)->wrapped) == &LFUWeakRefType)
+
+/* The value behind wrapped, borrowed. Py_None once a weak value died. */
+#define LFUWrapper_REFERENT(wrapped)                                \
+  (Py_TYPE(wrapped) == &LFUWeakRefType ? LFUWeakRef_object(wrapped) \
+                                       : (wrapped))
+
+#define LFUWrapper_IS_GONE(self) \
+  (LFUWrapper_IS_WEAK(self) && LFUWeakRef_object((self)->wrapped) == Py_None)
+
+/* Atomic values (str, bytes, int, float, ...) can't form reference cycles,
+ * so wrappers holding them stay untracked and a full collection never has
+ * to walk them. Only container-valued entries are reported to the GC. */
+#define LFUWrapper_MAYBE_TRACK(self)                        \
+  do {                                                      \
+    if ((self)->wrapped && PyObject_IS_GC((self)->wrapped)) \
+      PyObject_GC_Track(self);                              \
+  } while (0)
+
+static LFUWrapper *LFUWrapper_alloc(PyTypeObject *type, PyObject *wrapped) {
+  LFUWrapper *self = (LFUWrapper *)PyObject_GC_New(LFUWrapper, type);
+  if (!self) return NULL;
+  self->wrapped = wrapped;
+  Py_INCREF(wrapped);
+  self->counter = &self->_counter;
+  self->chunk = NULL;
+  self->generation = 0;
+  self->tags = NULL;
+  self->expiry = NULL;
+  self->priority = 0;
+  self->pinned = 0;
+  self->ns = NULL;
+  self->ns_pos = 0;
+  self->cost = 1;
+  self->size = 1;
+  self->bytes = 0;
+  self->gdsf.pos = CTOOLS_GDSF_NONE;
+  self->gdsf.item = NULL;
+  LFUWrapper_MAYBE_TRACK(self);
+  return self;
+}
+
 static PyObject *LFUWrapper_new(PyTypeObject *type, PyObject *args,
                                 PyObject *kwds) {
-  LFUWrapper *self;
   PyObject *wrapped;
   static char *kwlist[] = {"obj", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &wrapped))
     return NULL;
   assert(wrapped);
-  self = (LFUWrapper *)PyObject_GC_New(LFUWrapper, type);
-  if (!self) return NULL;
-  PyObject_GC_Track(self);
-  self->wrapped = wrapped;
-  Py_INCREF(wrapped);
-  return (PyObject *)self;
+  return (PyObject *)LFUWrapper_alloc(type, wrapped);
 }
 
 static int LFUWrapper_init(LFUWrapper *self, PyObject *args, PyObject *kwds) {
-  self->last_visit = time_in_minutes();
-  self->visit_count = LFU_INIT_VAL;
+  ctools_lfu_counter_init(self->counter, ctools_time_in_minutes());
   return 0;
 }
 
 static int LFUWrapper_tp_traverse(LFUWrapper *self, visitproc visit,
                                   void *arg) {
   Py_VISIT(self->wrapped);
+  Py_VISIT(self->tags);
   return 0;
 }
 
 static int LFUWrapper_tp_clear(LFUWrapper *self) {
   Py_CLEAR(self->wrapped);
+  Py_CLEAR(self->tags);
   return 0;
 }
 
 static void LFUWrapper_tp_dealloc(LFUWrapper *self) {
   PyObject_GC_UnTrack(self);
   LFUWrapper_tp_clear(self);
+  PyMem_Free(self->expiry);
   PyObject_GC_Del(self);
 }
 
-#define LFUWrapper_UPDATE_WEIGHT(self)    \
-  do {                                    \
-    self->visit_count++;                  \
-    self->last_visit = time_in_minutes(); \
-  } while (0)
+/* Give the wrapper its own copy of expiry, or drop it if expiry is NULL. */
+static int LFUWrapper_set_expiry(LFUWrapper *self,
+                                 const ctools_lfu_expiry *expiry) {
+  if (!expiry) {
+    PyMem_Free(self->expiry);
+    self->expiry = NULL;
+    return 0;
+  }
+  if (!self->expiry && !(self->expiry = PyMem_New(ctools_lfu_expiry, 1))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  *self->expiry = *expiry;
+  return 0;
+}
+
+#define LFUWrapper_IS_EXPIRED(self) \
+  ((self)->expiry &&                \
+   ctools_lfu_expired((self)->expiry, ctools_time_in_seconds()))
+
+#define LFUWrapper_UPDATE_WEIGHT(self) \
+  ctools_lfu_counter_incr((self)->counter, ctools_time_in_minutes())
+
+/* Return a new reference to the value, rebuilt from the arena if needed. */
+static PyObject *LFUWrapper_VALUE(LFUWrapper *self) {
+  LFUArenaValue *v = self->chunk;
+  if (self->wrapped) {
+    PyObject *value = LFUWrapper_REFERENT(self->wrapped);
+    Py_INCREF(value);
+    return value;
+  }
+  if (v->kind == LFU_ARENA_BYTES)
+    return PyBytes_FromStringAndSize(LFUArenaValue_DATA(v), v->size);
+  return PyUnicode_FromKindAndData(v->kind, LFUArenaValue_DATA(v),
+                                   v->size / v->kind);
+}
 
 static PyObject *LFUWrapper_wrapped(LFUWrapper *self) {
   LFUWrapper_UPDATE_WEIGHT(self);
-  PyObject *wrapped = self->wrapped;
-  Py_INCREF(wrapped);
-  return wrapped;
+  return LFUWrapper_VALUE(self);
 }
 
-static inline unsigned int LFUWrapper_WEIGHT(LFUWrapper *self,
-                                             unsigned int now) {
-  register unsigned int num, counter;
-  counter = self->visit_count;
-  num = now - self->last_visit;
-  return num > counter ? 0 : counter - num;
-}
+#define LFUWrapper_WEIGHT(self, now) ctools_lfu_weight((self)->counter, now)
+
+/* Eviction order: priority class first, then weight. */
+#define LFUWrapper_RANK(self, now) \
+  (((uint64_t)(self)->priority << 32) | LFUWrapper_WEIGHT(self, now))
+
+/* Move the counter back into the wrapper before it leaves a frozen cache. */
+#define LFUWrapper_DETACH(self)                 \
+  do {                                          \
+    if ((self)->counter != &(self)->_counter) { \
+      (self)->_counter = *(self)->counter;      \
+      (self)->counter = &(self)->_counter;      \
+    }                                           \
+  } while (0)
 
 static PyObject *LFUWrapper_weight(LFUWrapper *self) {
-  return Py_BuildValue("I", LFUWrapper_WEIGHT(self, time_in_minutes()));
+  return Py_BuildValue("I", LFUWrapper_WEIGHT(self, ctools_time_in_minutes()));
 }
 
 static PyMethodDef LFUWrapper_methods[] = {
@@ -105,7 +277,11 @@ static PyMethodDef LFUWrapper_methods[] = {
 };
 
 static PyObject *LFUWrapper_repr(LFUWrapper *self) {
-  return PyObject_Repr(self->wrapped);
+  PyObject *value = LFUWrapper_VALUE(self);
+  if (!value) return NULL;
+  PyObject *rv = PyObject_Repr(value);
+  Py_DECREF(value);
+  return rv;
 }
 
 static PyTypeObject LFUWrapperType = {
@@ -147,34 +323,180 @@ static PyTypeObject LFUWrapperType = {
     0,                                           /* tp_alloc */
     (newfunc)LFUWrapper_new,                     /* tp_new */
 };
+
+/* A new entry for value, what calling LFUWrapper(value) does minus the
+ * argument parsing. */
+static LFUWrapper *LFUWrapper_create(PyObject *value, unsigned int now) {
+  LFUWrapper *self = LFUWrapper_alloc(&LFUWrapperType, value);
+  if (self) ctools_lfu_counter_init(self->counter, now);
+  return self;
+}
 /* LFUWrapper Type Define */
 
 // clang-format off
-typedef struct {
+typedef struct _LFUCache {
   PyObject_HEAD
   PyObject *dict;
   Py_ssize_t capacity;
   Py_ssize_t hits;
   Py_ssize_t misses;
+  /* Compact counter array of a frozen cache, see LFUCache_freeze. */
+  ctools_lfu_counter *counters;
+  /* Off-heap storage for bytes and str values, see arena_bytes. */
+  ctools_arena *arena;
+  /* Disk tier for evicted entries, see spill_path. */
+  ctools_spill *spill;
+  /* Entries of older generations are stale, see invalidate_all. */
+  uint64_t generation;
+  Py_ssize_t stale;
+  Py_ssize_t reclaim_pos; /* dict position the stale scan resumes at */
+  /* tag -> set of keys, see invalidate_tag. */
+  PyObject *tags;
+  /* Called with the key of an entry due for refresh, see soft_ttl. */
+  PyObject *on_refresh;
+  /* No entry hard expires before next_expiry, 0 is none, see ttl. */
+  double next_expiry;
+  /* Pinned entries, kept apart from dict so eviction never sees them. */
+  PyObject *pinned;
+  int pinned_count; /* pinned entries count against capacity */
+  /* name -> LFUNamespace */
+  PyObject *namespaces;
+  /* With weak_values, weakrefs of dead values queue up in dead until the
+   * next sweep, weak_callback is dead.append. */
+  PyObject *dead;
+  PyObject *weak_callback;
+  /* Draws eviction samples and XFetch coins, see seed. */
+  ctools_rng rng;
+  Py_ssize_t evictions;
+  /* Time spent in get_many_or_load loaders, see metrics_text. */
+  ctools_lfu_latency load_latency;
+  /* Sampled access records, see start_trace. */
+  ctools_lfu_trace *trace;
+  /* Evictable entries by GDSF priority, NULL unless policy is "gdsf". */
+  ctools_gdsf *gdsf;
+  /* Values bigger than max_item_size bytes bypass the cache, 0 is no
+   * limit. admission.c is 0 without admission_size. */
+  Py_ssize_t max_item_size;
+  ctools_admission admission;
+  Py_ssize_t rejections;
+  /* Sum of the entry sizes, and the group whose byte budget the cache
+   * shares, see CacheGroup. */
+  double bytes;
+  struct _LFUCacheGroup *group;
 } LFUCache;
+
+typedef struct {
+  PyObject *key; /* borrowed from the cache's dict */
+  LFUWrapper *wrapper;
+} LFUNamespaceEntry;
+
+/* A partition of the cache with its own quota and stats. Its entries live
+ * in the cache's dict keyed by (namespace, key), and are listed here too
+ * so victims can be sampled from a namespace over quota. */
+typedef struct _LFUNamespace {
+  PyObject_HEAD
+  LFUCache *cache;
+  PyObject *name;
+  Py_ssize_t quota; /* 0 is no quota */
+  Py_ssize_t hits;
+  Py_ssize_t misses;
+  LFUNamespaceEntry *entries;
+  Py_ssize_t count;
+  Py_ssize_t alloc;
+  Py_ssize_t stale; /* entries left over from invalidate_all */
+} LFUNamespace;
+
+/* Caches sharing one byte budget. Over budget, the coldest of the entries
+ * the members would evict next goes, whichever member holds it. */
+typedef struct _LFUCacheGroup {
+  PyObject_HEAD
+  double max_bytes;
+  double bytes; /* sum of the members' bytes */
+  PyObject *members; /* list of LFUCache */
+  ctools_rng rng;
+} LFUCacheGroup;
 // clang-format on
 
-Py_ssize_t PyLFUCache_Size(LFUCache *self) { return PyDict_Size(self->dict); }
+/* Account n more bytes to the cache and its group. */
+#define LFUCache_ADD_BYTES(self, n)                    \
+  do {                                                 \
+    double _bytes = (n);                               \
+    (self)->bytes += _bytes;                           \
+    if ((self)->group) (self)->group->bytes += _bytes; \
+  } while (0)
 
-/* return a random number between 0 and limit inclusive. */
-int rand_limit(int limit) {
-  int divisor = RAND_MAX / (limit + 1);
-  int rv;
+#define LFUNamespace_SIZE(ns) ((ns)->count - (ns)->stale)
 
-  do {
-    rv = rand() / divisor;
-  } while (rv > limit);
+#define LFUWrapper_IS_STALE(self, cache) \
+  ((self)->generation != (cache)->generation)
 
-  return rv;
+/* Stale, hard expired and dead weak entries are only waiting to be
+ * reclaimed. */
+#define LFUWrapper_IS_DEAD(self, cache)                               \
+  (LFUWrapper_IS_STALE(self, cache) || LFUWrapper_IS_EXPIRED(self) || \
+   LFUWrapper_IS_GONE(self))
+
+static void LFUCache_sweep(LFUCache *self);
+static void LFUCache_expire(LFUCache *self);
+
+static void LFUCache_trace(LFUCache *self, PyObject *key, int op, int hit) {
+  Py_hash_t hash;
+  /* the lookup failed, its error is the caller's to report */
+  if (PyErr_Occurred()) return;
+  /* an unhashable key goes unrecorded, the lookup reports it */
+  if ((hash = PyObject_Hash(key)) == -1) {
+    PyErr_Clear();
+    return;
+  }
+  ctools_lfu_trace_add(self->trace, (uint64_t)hash, op, hit);
+}
+
+#define LFUCache_TRACE(self, key, op, hit)                        \
+  do {                                                            \
+    if ((self)->trace && ctools_lfu_trace_sampled((self)->trace)) \
+      LFUCache_trace(self, key, CTOOLS_LFU_TRACE_##op, hit);      \
+  } while (0)
+
+#define LFUCache_SWEEP(self)                             \
+  do {                                                   \
+    if ((self)->dead && PyList_GET_SIZE((self)->dead))   \
+      LFUCache_sweep(self);                              \
+    if ((self)->next_expiry &&                           \
+        ctools_time_in_seconds() >= (self)->next_expiry) \
+      LFUCache_expire(self);                             \
+  } while (0)
+
+/* Lower next_expiry to the hard deadline of expiry, if it has one. */
+#define LFUCache_WATCH_EXPIRY(self, expiry)                             \
+  do {                                                                  \
+    if ((expiry) && (expiry)->hard > 0 &&                               \
+        (!(self)->next_expiry || (expiry)->hard < (self)->next_expiry)) \
+      (self)->next_expiry = (expiry)->hard;                             \
+  } while (0)
+
+Py_ssize_t PyLFUCache_Size(LFUCache *self) {
+  LFUCache_SWEEP(self);
+  return PyDict_Size(self->dict) + PyDict_Size(self->pinned) - self->stale;
 }
 
+/* Number of entries held against capacity. */
+#define LFUCache_USED(self)    \
+  (PyDict_Size((self)->dict) + \
+   ((self)->pinned_count ? PyDict_Size((self)->pinned) : 0))
+
+static LFUWrapper *LFUCache_live(LFUCache *self, PyObject *key);
+
+static int LFUCache_spill_find(LFUCache *self, PyObject *key, size_t *slot,
+                               ctools_spill_record *rec);
+
 static int LFUCache_Contains(PyObject *self, PyObject *key) {
-  return PyDict_Contains(((LFUCache *)self)->dict, key);
+  LFUCache *cache = (LFUCache *)self;
+  size_t slot;
+  ctools_spill_record rec;
+  if (LFUCache_live(cache, key)) return 1;
+  if (PyErr_Occurred()) return -1;
+  if (!cache->spill) return 0;
+  return LFUCache_spill_find(cache, key, &slot, &rec);
 }
 
 /* Hack to implement "key in dict" */
@@ -191,49 +513,137 @@ static PySequenceMethods LFUCache_as_sequence = {
     0,                 /* sq_inplace_repeat */
 };
 
-#define PyLFUCache_GetItem(self, key) \
-  (LFUWrapper *)PyDict_GetItem(((LFUCache *)self)->dict, key)
+/* Return the borrowed wrapper of key, evictable or pinned. */
+static LFUWrapper *LFUCache_find(LFUCache *self, PyObject *key) {
+  PyObject *wrapper = PyDict_GetItem(self->dict, key);
+  if (!wrapper && PyDict_Size(self->pinned))
+    wrapper = PyDict_GetItem(self->pinned, key);
+  return (LFUWrapper *)wrapper;
+}
+
+#define PyLFUCache_GetItem(self, key) LFUCache_find((LFUCache *)(self), key)
+
+#define LFUWrapper_OF_GDSF(node) \
+  ((LFUWrapper *)((char *)(node) - offsetof(LFUWrapper, gdsf)))
+
+/* Compute the GDSF priority of the entry with its hits plus one as the
+ * frequency. */
+static void LFUCache_gdsf_rate(LFUCache *self, LFUWrapper *wrapper) {
+  unsigned int count = wrapper->counter->visit_count;
+  double freq = count > CTOOLS_LFU_INIT_VAL ? count - CTOOLS_LFU_INIT_VAL : 0;
+  wrapper->gdsf_count = count;
+  wrapper->gdsf.priority =
+      ctools_gdsf_priority(self->gdsf, freq + 1, wrapper->cost, wrapper->size);
+}
+
+/* Put the evictable entry of key into the GDSF heap, the heap borrows the
+ * key of the dict. */
+static int LFUCache_gdsf_add(LFUCache *self, PyObject *key,
+                             LFUWrapper *wrapper) {
+  if (!self->gdsf) return 0;
+  LFUCache_gdsf_rate(self, wrapper);
+  wrapper->gdsf.item = key;
+  if (ctools_gdsf_push(self->gdsf, &wrapper->gdsf)) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return 0;
+}
+
+#define LFUCache_GDSF_DEL(self, wrapper)                         \
+  do {                                                           \
+    if ((self)->gdsf && (wrapper)->gdsf.pos != CTOOLS_GDSF_NONE) \
+      ctools_gdsf_remove((self)->gdsf, &(wrapper)->gdsf);        \
+  } while (0)
+
+/* Return the key of the lowest GDSF priority, evicting it ages the cache
+ * to it. A hit only bumps the counter, so an entry hit since it was rated
+ * is re-rated on its way to the top instead of on every hit. Dead entries
+ * go first, as with sampled LFU: every entry of a small heap is checked, a
+ * few random slots of a big one. */
+static PyObject *LFUCache_gdsf_victim(LFUCache *self) {
+  ctools_gdsf_node *node;
+  size_t n = self->gdsf->count;
+  if (n < CTOOLS_LFU_BUCKET_SIZE) {
+    for (size_t i = 0; i < n; i++) {
+      node = self->gdsf->heap[i];
+      if (LFUWrapper_IS_DEAD(LFUWrapper_OF_GDSF(node), self)) goto found;
+    }
+  } else {
+    for (int i = 0; i < CTOOLS_LFU_BUCKET; i++) {
+      node = self->gdsf->heap[ctools_rng_limit(&self->rng, (uint32_t)n - 1)];
+      if (LFUWrapper_IS_DEAD(LFUWrapper_OF_GDSF(node), self)) goto found;
+    }
+  }
+  while ((node = ctools_gdsf_min(self->gdsf))) {
+    LFUWrapper *wrapper = LFUWrapper_OF_GDSF(node);
+    if (!LFUWrapper_IS_DEAD(wrapper, self) &&
+        wrapper->counter->visit_count != wrapper->gdsf_count) {
+      LFUCache_gdsf_rate(self, wrapper);
+      ctools_gdsf_fix(self->gdsf, node);
+      continue;
+    }
+    goto found;
+  }
+  PyErr_SetString(PyExc_KeyError, "No key in dict");
+  return NULL;
+
+found:
+  Py_INCREF((PyObject *)node->item);
+  return (PyObject *)node->item;
+}
 
 static PyObject *LFUCache_lfu(LFUCache *self) {
   PyObject *key = NULL, *wrapper = NULL;
   Py_ssize_t pos = 0;
-  uint32_t min = 0, weight;
+  uint64_t min = 0, weight;
   PyObject *rv = NULL;
-  uint32_t now = time_in_minutes();
-  Py_ssize_t dict_len = PyLFUCache_Size(self);
+  uint32_t now = ctools_time_in_minutes();
+  Py_ssize_t dict_len = PyDict_Size(self->dict);
 
+  if (self->gdsf) return LFUCache_gdsf_victim(self);
   if (dict_len == 0) {
     PyErr_SetString(PyExc_KeyError, "No key in dict");
     return NULL;
-  } else if (dict_len < LFU_BUCKET_SIZE) {
+  } else if (dict_len < CTOOLS_LFU_BUCKET_SIZE) {
     while (PyDict_Next(self->dict, &pos, &key, &wrapper)) {
-      weight = LFUWrapper_WEIGHT((LFUWrapper *)wrapper, now);
-      if (min == 0 || weight < min) {
+      if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, self)) {
+        rv = key;
+        break;
+      }
+      weight = LFUWrapper_RANK((LFUWrapper *)wrapper, now);
+      if (!rv || weight < min) {
         min = weight;
         rv = key;
       }
     }
   } else {
     PyObject *keylist = PyDict_Keys(self->dict);
-    Py_ssize_t b_size = dict_len / LFU_BUCKET;
-    for (int i = 0; i < LFU_BUCKET - 1; i++) {
-      pos = i * b_size + rand_limit(b_size);
+    Py_ssize_t b_size = dict_len / CTOOLS_LFU_BUCKET;
+    for (int i = 0; i < CTOOLS_LFU_BUCKET - 1; i++) {
+      pos = i * b_size + ctools_rng_limit(&self->rng, (uint32_t)b_size);
       key = PyList_GET_ITEM(keylist, pos);
       wrapper = PyDict_GetItem(self->dict, key);
-      weight = LFUWrapper_WEIGHT((LFUWrapper *)wrapper, now);
-      if (min == 0 || weight < min) {
+      if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, self)) {
+        rv = key;
+        goto sampled;
+      }
+      weight = LFUWrapper_RANK((LFUWrapper *)wrapper, now);
+      if (!rv || weight < min) {
         min = weight;
         rv = key;
       }
     }
-    if ((dict_len % LFU_BUCKET)) {
-      pos = LFU_BUCKET * b_size + (dict_len - LFU_BUCKET * b_size) / 2;
-      wrapper = PyDict_GetItem(self->dict, PyList_GetItem(keylist, pos));
-      weight = LFUWrapper_WEIGHT((LFUWrapper *)wrapper, now);
-      if (min == 0 || weight < min) {
+    if ((dict_len % CTOOLS_LFU_BUCKET)) {
+      pos = CTOOLS_LFU_BUCKET * b_size +
+            (dict_len - CTOOLS_LFU_BUCKET * b_size) / 2;
+      key = PyList_GET_ITEM(keylist, pos);
+      wrapper = PyDict_GetItem(self->dict, key);
+      if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, self) ||
+          LFUWrapper_RANK((LFUWrapper *)wrapper, now) < min)
         rv = key;
-      }
     }
+  sampled:
     Py_XDECREF(keylist);
   }
   assert(rv);
@@ -241,158 +651,1228 @@ static PyObject *LFUCache_lfu(LFUCache *self) {
   return rv;
 }
 
-static PyObject *LFUCache_evict(LFUCache *self) {
-  PyObject *k = LFUCache_lfu(self);
-  if (!k) {
-    PyErr_Clear();
-    Py_RETURN_NONE;
+static PyObject *LFUCache_evict(LFUCache *self);
+
+/* Return the chunk size needed to keep value in the arena, or -1 if it is
+ * neither an exact bytes nor str, or too big for any slab class. */
+static Py_ssize_t LFUCache_arena_size(LFUCache *self, PyObject *value) {
+  Py_ssize_t size;
+  if (PyBytes_CheckExact(value)) {
+    size = PyBytes_GET_SIZE(value);
+  } else if (PyUnicode_CheckExact(value)) {
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(value)) {
+      PyErr_Clear();
+      return -1;
+    }
+#endif
+    size = PyUnicode_GET_LENGTH(value) * PyUnicode_KIND(value);
+  } else {
+    return -1;
+  }
+  if (size > UINT32_MAX) return -1;
+  size += sizeof(LFUArenaValue);
+  if (ctools_arena_class(self->arena, size) < 0) return -1;
+  return size;
+}
+
+/* Try to move the value of wrapper into the arena. When the arena is full
+ * and may_evict is set, evict a few entries to make room; values that still
+ * don't fit stay ordinary python objects. */
+static void LFUCache_arena_load(LFUCache *self, LFUWrapper *wrapper,
+                                int may_evict) {
+  PyObject *value = wrapper->wrapped;
+  LFUArenaValue *v;
+  Py_ssize_t size = LFUCache_arena_size(self, value);
+  if (size < 0) return;
+
+  v = (LFUArenaValue *)ctools_arena_alloc(self->arena, size);
+  for (int i = 0; !v && may_evict && i < CTOOLS_LFU_BUCKET; i++) {
+    PyObject *rv = LFUCache_evict(self);
+    if (!rv) {
+      PyErr_Clear();
+      return;
+    }
+    Py_DECREF(rv);
+    v = (LFUArenaValue *)ctools_arena_alloc(self->arena, size);
   }
-  if (PyDict_DelItem(self->dict, k)) {
-    return PyErr_Format(PyExc_KeyError, "Fail to delete Key %S", k);
+  if (!v) return;
+
+  v->size = (uint32_t)(size - sizeof(LFUArenaValue));
+  if (PyBytes_CheckExact(value)) {
+    v->kind = LFU_ARENA_BYTES;
+    memcpy(LFUArenaValue_DATA(v), PyBytes_AS_STRING(value), v->size);
+  } else {
+    v->kind = PyUnicode_KIND(value);
+    memcpy(LFUArenaValue_DATA(v), PyUnicode_DATA(value), v->size);
   }
-  Py_DECREF(k);
-  Py_RETURN_NONE;
+  wrapper->chunk = v;
+  wrapper->wrapped = NULL;
+  Py_DECREF(value);
 }
 
-int PyLFUCache_DelItem(LFUCache *self, PyObject *key) {
-  LFUWrapper *wrapper = PyLFUCache_GetItem(self, key);
-  if (!wrapper) {
-    PyErr_Format(PyExc_TypeError, "%S", key);
-    return -1;
+/* Give the arena chunk of wrapper back. With keep, the value is rebuilt
+ * first because somebody else still references the wrapper. */
+static int LFUCache_arena_unload(LFUCache *self, LFUWrapper *wrapper,
+                                 int keep) {
+  LFUArenaValue *v = wrapper->chunk;
+  if (!v) return 0;
+  if (keep && !(wrapper->wrapped = LFUWrapper_VALUE(wrapper))) return -1;
+  wrapper->chunk = NULL;
+  ctools_arena_release(self->arena, v, LFUArenaValue_CHUNK_SIZE(v));
+  return 0;
+}
+
+/* Unload every entry, pinned ones too, and drop all arena pages. With keep
+ * every value is rebuilt first because the entries stay in the cache. */
+static void LFUCache_arena_reset(LFUCache *self, int keep) {
+  PyObject *dicts[2] = {self->dict, self->pinned}, *key, *wrapper;
+  if (!self->arena) return;
+  for (int d = 0; d < 2; d++) {
+    Py_ssize_t pos = 0;
+    int shared;
+    if (!dicts[d]) continue;
+    shared = keep || Py_REFCNT(dicts[d]) > 1;
+    while (PyDict_Next(dicts[d], &pos, &key, &wrapper)) {
+      LFUWrapper *w = (LFUWrapper *)wrapper;
+      if (LFUCache_arena_unload(self, w, shared || Py_REFCNT(w) > 1)) {
+        PyErr_WriteUnraisable((PyObject *)self);
+        w->chunk = NULL;
+        w->wrapped = Py_None;
+        Py_INCREF(Py_None);
+      }
+    }
   }
-  if (PyDict_DelItem(self->dict, key)) {
-    Py_XINCREF(wrapper->wrapped);
+  ctools_arena_reset(self->arena);
+}
+
+static PyObject *pickle_dumps = NULL;
+static PyObject *pickle_loads = NULL;
+
+static int LFUCache_import_pickle(void) {
+  PyObject *pickle;
+  if (pickle_dumps) return 0;
+  if (!(pickle = PyImport_ImportModule("pickle"))) return -1;
+  pickle_dumps = PyObject_GetAttrString(pickle, "dumps");
+  pickle_loads = PyObject_GetAttrString(pickle, "loads");
+  Py_DECREF(pickle);
+  if (!pickle_dumps || !pickle_loads) {
+    Py_CLEAR(pickle_dumps);
+    Py_CLEAR(pickle_loads);
     return -1;
   }
   return 0;
 }
 
-int PyLFUCache_SetItem(LFUCache *self, PyObject *key, PyObject *value) {
-  LFUWrapper *wrapper = (LFUWrapper *)PyDict_GetItem(self->dict, key);
-  if (wrapper) {
-    Py_DECREF(wrapper->wrapped);
-    wrapper->wrapped = value;
-    Py_INCREF(wrapper->wrapped);
+#define LFUCache_PICKLE(obj) PyObject_CallFunction(pickle_dumps, "Oi", obj, -1)
+#define LFUCache_UNPICKLE(buf, len) \
+  PyObject_CallFunction(pickle_loads, "y#", buf, (Py_ssize_t)(len))
+
+/* The spill file is a cache tier of its own: records that can't be pickled
+ * or unpickled are simply not stored or reported as misses, so the helpers
+ * below never leave an exception set. */
+
+/* Find the record of key. Return 1 and fill *slot and rec when present.
+ *
+ * Pickling, unpickling and comparing keys run python code that may write to
+ * the spill file or reopen it: the probe starts over once the key is
+ * pickled, candidates are unpickled from a copy and the slot is checked
+ * again after each comparison. */
+static int LFUCache_spill_find(LFUCache *self, PyObject *key, size_t *slot,
+                               ctools_spill_record *rec) {
+  PyObject *pickled = NULL, *copy, *other;
+  Py_hash_t hash = PyObject_Hash(key);
+  uint64_t secret = 0;
+  int found = 0, eq;
+
+  if (hash == -1) {
+    PyErr_Clear();
     return 0;
   }
-  if (PyLFUCache_Size(self) + 1 > self->capacity) {
-    if (!LFUCache_evict(self)) {
-      return -1;
+  *slot = CTOOLS_SPILL_START;
+  while (self->spill &&
+         ctools_spill_find(self->spill, (uint64_t)hash, slot, rec)) {
+    if (!pickled) {
+      if (!(pickled = LFUCache_PICKLE(key)) || !self->spill) break;
+      secret = self->spill->secret;
+      *slot = CTOOLS_SPILL_START;
+      continue;
+    }
+    if (rec->key_len == PyBytes_GET_SIZE(pickled) &&
+        !memcmp(rec->key, PyBytes_AS_STRING(pickled), rec->key_len)) {
+      found = 1;
+      break;
+    }
+    /* equal keys may pickle differently, e.g. 1 and 1.0 */
+    if (!(copy = PyBytes_FromStringAndSize(rec->key, rec->key_len))) break;
+    other = LFUCache_UNPICKLE(PyBytes_AS_STRING(copy), PyBytes_GET_SIZE(copy));
+    Py_DECREF(copy);
+    if (!other) break;
+    eq = PyObject_RichCompareBool(key, other, Py_EQ);
+    Py_DECREF(other);
+    /* the file changed under us: report a miss, it's only a cache */
+    if (eq < 0 || !self->spill || self->spill->secret != secret ||
+        !ctools_spill_recheck(self->spill, *slot, rec))
+      break;
+    if (eq) {
+      found = 1;
+      break;
     }
   }
-  PyObject *args = Py_BuildValue("(O)", value);
-  if (!args) return -1;
+  Py_XDECREF(pickled);
+  PyErr_Clear();
+  return found;
+}
 
-  wrapper =
-      (LFUWrapper *)PyObject_CallObject((PyObject *)&LFUWrapperType, args);
-  if (!wrapper) {
-    Py_DECREF(args);
-    return -1;
-  }
-  if (PyDict_SetItem(self->dict, key, (PyObject *)wrapper)) {
-    Py_DECREF(args);
-    Py_DECREF(wrapper);
-    return -1;
+/* Remove key from the spill file and return a new reference to its value,
+ * or NULL on a miss. */
+static PyObject *LFUCache_spill_take(LFUCache *self, PyObject *key) {
+  size_t slot;
+  ctools_spill_record rec;
+  PyObject *data, *value;
+  if (!LFUCache_spill_find(self, key, &slot, &rec)) return NULL;
+  /* unpickling may run code touching the cache, copy before dropping */
+  data = PyBytes_FromStringAndSize(rec.value, rec.value_len);
+  ctools_spill_delete(self->spill, slot);
+  if (!data) {
+    PyErr_Clear();
+    return NULL;
   }
-  Py_DECREF(args);
-  Py_DECREF(wrapper);
-  return 0;
+  value = LFUCache_UNPICKLE(PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+  Py_DECREF(data);
+  if (!value) PyErr_Clear();
+  return value;
 }
 
-void PyLFUCache_Clear(LFUCache *self) {
-  PyDict_Clear(self->dict);
-  self->misses = 0;
-  self->hits = 0;
+static void LFUCache_spill_discard(LFUCache *self, PyObject *key) {
+  size_t slot;
+  ctools_spill_record rec;
+  if (LFUCache_spill_find(self, key, &slot, &rec))
+    ctools_spill_delete(self->spill, slot);
 }
 
-static PyObject *LFUCache_new(PyTypeObject *type, PyObject *args,
-                              PyObject *kwds) {
-  LFUCache *self;
-  self = (LFUCache *)PyObject_GC_New(LFUCache, type);
-  if (!self) return NULL;
-  PyObject_GC_Track(self);
-  if (!(self->dict = PyDict_New())) {
-    Py_DECREF(self);
-    return NULL;
+/* Write an evicted entry to the spill file. */
+static void LFUCache_spill_demote(LFUCache *self, PyObject *key,
+                                  LFUWrapper *wrapper) {
+  PyObject *value = NULL, *k = NULL, *v = NULL;
+  Py_hash_t hash = PyObject_Hash(key);
+  if (hash == -1) goto done;
+  if (!(value = LFUWrapper_VALUE(wrapper))) goto done;
+  if (!(k = LFUCache_PICKLE(key)) || !(v = LFUCache_PICKLE(value))) goto done;
+  if (PyBytes_GET_SIZE(k) > UINT32_MAX || PyBytes_GET_SIZE(v) > UINT32_MAX)
+    goto done;
+  ctools_spill_put(self->spill, (uint64_t)hash, PyBytes_AS_STRING(k),
+                   (uint32_t)PyBytes_GET_SIZE(k), PyBytes_AS_STRING(v),
+                   (uint32_t)PyBytes_GET_SIZE(v));
+done:
+  Py_XDECREF(value);
+  Py_XDECREF(k);
+  Py_XDECREF(v);
+  PyErr_Clear();
+}
+
+/* Unlink key from the index of every tag of its wrapper. */
+static int LFUCache_untag(LFUCache *self, PyObject *key, LFUWrapper *wrapper) {
+  PyObject *tags = wrapper->tags, *keys;
+  if (!tags) return 0;
+  wrapper->tags = NULL;
+  for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(tags); i++) {
+    PyObject *tag = PyTuple_GET_ITEM(tags, i);
+    if (!(keys = PyDict_GetItem(self->tags, tag))) continue;
+    if (PySet_Discard(keys, key) < 0 ||
+        (PySet_GET_SIZE(keys) == 0 && PyDict_DelItem(self->tags, tag))) {
+      Py_DECREF(tags);
+      return -1;
+    }
   }
-  return (PyObject *)self;
+  Py_DECREF(tags);
+  return 0;
 }
 
-static int LFUCache_init(LFUCache *self, PyObject *args, PyObject *kwds) {
-  static char *kwlist[] = {"capacity", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &self->capacity)) {
-    return -1;
+/* Index key under every tag of the iterable tags. */
+static int LFUCache_tag(LFUCache *self, PyObject *key, LFUWrapper *wrapper,
+                        PyObject *tags) {
+  PyObject *keys, *type, *value, *tb;
+  if (!tags || tags == Py_None) return 0;
+  if (!(tags = PySequence_Tuple(tags))) return -1;
+  if (PyTuple_GET_SIZE(tags) == 0) {
+    Py_DECREF(tags);
+    return 0;
   }
-  if (self->capacity <= 0) {
-    PyErr_SetString(PyExc_ValueError, "Capacity should be a positive number");
-    return -1;
+  wrapper->tags = tags;
+  for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(tags); i++) {
+    PyObject *tag = PyTuple_GET_ITEM(tags, i);
+    if (!(keys = PyDict_GetItem(self->tags, tag))) {
+      if (!(keys = PySet_New(NULL))) goto fail;
+      int rv = PyDict_SetItem(self->tags, tag, keys);
+      Py_DECREF(keys);
+      if (rv) goto fail;
+    }
+    if (PySet_Add(keys, key)) goto fail;
   }
-  self->hits = 0;
-  self->misses = 0;
   return 0;
+fail:
+  /* leave no half indexed entry behind */
+  PyErr_Fetch(&type, &value, &tb);
+  LFUCache_untag(self, key, wrapper);
+  PyErr_Restore(type, value, tb);
+  return -1;
 }
 
-static int LFUCache_tp_traverse(LFUCache *self, visitproc visit, void *arg) {
-  Py_VISIT(self->dict);
+/* List wrapper in namespace ns. */
+static int LFUNamespace_add(LFUNamespace *ns, PyObject *key,
+                            LFUWrapper *wrapper) {
+  if (ns->count == ns->alloc) {
+    Py_ssize_t alloc = ns->alloc ? ns->alloc * 2 : 16;
+    void *entries =
+        PyMem_Realloc(ns->entries, alloc * sizeof(LFUNamespaceEntry));
+    if (!entries) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    ns->entries = entries;
+    ns->alloc = alloc;
+  }
+  ns->entries[ns->count].key = key;
+  ns->entries[ns->count].wrapper = wrapper;
+  wrapper->ns = ns;
+  wrapper->ns_pos = ns->count++;
   return 0;
 }
 
-static int LFUCache_tp_clear(LFUCache *self) {
-  Py_CLEAR(self->dict);
-  return 0;
+/* Unlist wrapper from its namespace, the last entry fills the hole. */
+static void LFUNamespace_del(LFUWrapper *wrapper) {
+  LFUNamespace *ns = wrapper->ns;
+  Py_ssize_t pos = wrapper->ns_pos;
+  ns->entries[pos] = ns->entries[--ns->count];
+  ns->entries[pos].wrapper->ns_pos = pos;
+  wrapper->ns = NULL;
 }
 
-static void LFUCache_tp_dealloc(LFUCache *self) {
-  PyObject_GC_UnTrack(self);
-  LFUCache_tp_clear(self);
-  PyObject_GC_Del(self);
+/* Every entry leaves the cache through here. */
+static int LFUCache_remove(LFUCache *self, PyObject *key,
+                           LFUWrapper *wrapper) {
+  int stale = LFUWrapper_IS_STALE(wrapper, self);
+  if (LFUCache_untag(self, key, wrapper)) return -1;
+  LFUWrapper_DETACH(wrapper);
+  if (LFUCache_arena_unload(self, wrapper, Py_REFCNT(wrapper) > 1)) return -1;
+  LFUCache_GDSF_DEL(self, wrapper);
+  LFUCache_ADD_BYTES(self, -wrapper->bytes);
+  if (PyDict_DelItem(wrapper->pinned ? self->pinned : self->dict, key))
+    return -1;
+  if (stale) self->stale--;
+  if (wrapper->ns) {
+    if (stale) wrapper->ns->stale--;
+    LFUNamespace_del(wrapper);
+  }
+  return 0;
 }
 
-static PyObject *LFUCache_repr(LFUCache *self) {
-  return PyObject_Repr(self->dict);
+/* Return the borrowed wrapper of key unless it is missing, stale or
+ * expired. A dead entry found here is reclaimed. NULL may come with an
+ * exception. */
+static LFUWrapper *LFUCache_live(LFUCache *self, PyObject *key) {
+  /* unlike LFUCache_find, errors of __hash__ and __eq__ are kept */
+  LFUWrapper *wrapper =
+      (LFUWrapper *)PyDict_GetItemWithError(self->dict, key);
+  if (!wrapper && !PyErr_Occurred() && PyDict_Size(self->pinned))
+    wrapper = (LFUWrapper *)PyDict_GetItemWithError(self->pinned, key);
+  if (!wrapper || !LFUWrapper_IS_DEAD(wrapper, self)) return wrapper;
+  if (LFUCache_remove(self, key, wrapper)) PyErr_Clear();
+  return NULL;
 }
 
-/* mp_subscript: __getitem__() */
-static PyObject *LFUCache_mp_subscript(LFUCache *self, PyObject *key) {
-  LFUWrapper *wrapper = PyLFUCache_GetItem(self, key);
-  if (!wrapper) {
-    self->misses++;
-    return PyErr_Format(PyExc_KeyError, "%S", key);
+/* Drop the entries whose weak values died. The weakref callback only
+ * queues them, so no entry vanishes in the middle of another operation and
+ * a burst of deaths is swept in one batch. */
+static void LFUCache_sweep(LFUCache *self) {
+  Py_ssize_t n = PyList_GET_SIZE(self->dead);
+  for (Py_ssize_t i = 0; i < n; i++) {
+    LFUWeakRef *ref = (LFUWeakRef *)PyList_GET_ITEM(self->dead, i);
+    LFUWrapper *wrapper = PyLFUCache_GetItem(self, ref->key);
+    if (wrapper && wrapper->wrapped == (PyObject *)ref &&
+        LFUCache_remove(self, ref->key, wrapper))
+      PyErr_Clear();
   }
-  self->hits++;
-  return LFUWrapper_wrapped(wrapper);
+  /* removals may have queued more */
+  if (PyList_SetSlice(self->dead, 0, n, NULL)) PyErr_Clear();
 }
 
-/* mp_ass_subscript: __setitem__() and __delitem__() */
-static int LFUCache_mp_ass_sub(LFUCache *self, PyObject *key, PyObject *value) {
-  if (value == NULL) {
-    return PyLFUCache_DelItem(self, key);
-  } else {
-    return PyLFUCache_SetItem(self, key, value);
+/* Drop the entries past their hard expiry once the earliest deadline
+ * passed, so len and the views agree with lookups. */
+static void LFUCache_expire(LFUCache *self) {
+  PyObject *key, *wrapper, *keys, *dict = self->dict;
+  Py_ssize_t pos = 0;
+  double now = ctools_time_in_seconds(), next = 0;
+  ctools_lfu_expiry *e;
+  if (!(keys = PyList_New(0))) {
+    PyErr_Clear();
+    return;
+  }
+  for (;;) {
+    if (!PyDict_Next(dict, &pos, &key, &wrapper)) {
+      if (dict == self->pinned) break;
+      dict = self->pinned;
+      pos = 0;
+      continue;
+    }
+    if (!(e = ((LFUWrapper *)wrapper)->expiry) || e->hard <= 0) continue;
+    if (ctools_lfu_expired(e, now)) {
+      if (PyList_Append(keys, key)) {
+        PyErr_Clear();
+        Py_DECREF(keys);
+        return;
+      }
+    } else if (!next || e->hard < next) {
+      next = e->hard;
+    }
   }
+  /* removals run python code, which may set new deadlines */
+  self->next_expiry = next;
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++) {
+    LFUWrapper *w;
+    key = PyList_GET_ITEM(keys, i);
+    if ((w = PyLFUCache_GetItem(self, key)) && LFUWrapper_IS_EXPIRED(w) &&
+        LFUCache_remove(self, key, w))
+      PyErr_Clear();
+  }
+  Py_DECREF(keys);
 }
 
-static PyMappingMethods LFUCache_as_mapping = {
-    (lenfunc)PyLFUCache_Size,           /*mp_length*/
-    (binaryfunc)LFUCache_mp_subscript,  /*mp_subscript*/
-    (objobjargproc)LFUCache_mp_ass_sub, /*mp_ass_subscript*/
-};
-
-static PyObject *LFUCache_hints(LFUCache *self) {
-  return Py_BuildValue("iii", self->capacity, self->hits, self->misses);
+/* Return a new reference to what the entry of key keeps of value: value
+ * itself, or a weak reference to it with weak_values. */
+static PyObject *LFUCache_store_value(LFUCache *self, PyObject *key,
+                                      PyObject *value) {
+  LFUWeakRef *ref;
+  if (!self->weak_callback) {
+    Py_INCREF(value);
+    return value;
+  }
+  ref = (LFUWeakRef *)PyObject_CallFunctionObjArgs(
+      (PyObject *)&LFUWeakRefType, value, self->weak_callback, NULL);
+  if (!ref) return NULL;
+  Py_INCREF(key);
+  ref->key = key;
+  return (PyObject *)ref;
 }
 
-static PyObject *LFUCache_keys(LFUCache *self) {
-  return PyDict_Keys(self->dict);
+/* Drop one stale entry, resuming the scan where the previous call stopped
+ * so a full reclamation walks the dict about once. Return 1 on success. */
+static int LFUCache_reclaim(LFUCache *self) {
+  PyObject *key, *wrapper;
+  for (int n = 0; n < CTOOLS_LFU_BUCKET_SIZE; n++) {
+    if (!PyDict_Next(self->dict, &self->reclaim_pos, &key, &wrapper)) {
+      self->reclaim_pos = 0;
+      continue;
+    }
+    if (!LFUWrapper_IS_STALE((LFUWrapper *)wrapper, self)) continue;
+    Py_INCREF(key);
+    int rv = LFUCache_remove(self, key, (LFUWrapper *)wrapper);
+    Py_DECREF(key);
+    if (rv) PyErr_Clear();
+    return !rv;
+  }
+  return 0;
 }
 
-static PyObject *LFUCache_values(LFUCache *self) {
-  LFUWrapper *wrapper;
-  PyObject *values = PyDict_Values(self->dict);
-  if (!values) return NULL;
-  if (PyList_GET_SIZE(values) == 0) return values;
-
-  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(values); i++) {
+/* Evict key, demoting it to the spill file on the way out. */
+static int LFUCache_evict_key(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = PyLFUCache_GetItem(self, key);
+  /* Weak, tagged, expiring and namespaced entries aren't spilled, the
+   * spill file owns its values and keeps neither tags, expiry nor
+   * namespace. */
+  if (wrapper && self->spill && !LFUWrapper_IS_WEAK(wrapper) &&
+      !wrapper->tags && !wrapper->expiry && !wrapper->ns &&
+      !LFUWrapper_IS_STALE(wrapper, self)) {
+    LFUCache_spill_demote(self, key, wrapper);
+    /* pickling runs python code, the entry may be gone */
+    wrapper = PyLFUCache_GetItem(self, key);
+  }
+  if (!wrapper) {
+    PyErr_Format(PyExc_KeyError, "Fail to delete Key %S", key);
+    return -1;
+  }
+  /* GDSF: the priority of a live victim is the new inflation */
+  if (wrapper->gdsf.pos == 0 && !LFUWrapper_IS_DEAD(wrapper, self))
+    self->gdsf->inflation = wrapper->gdsf.priority;
+  if (LFUCache_remove(self, key, wrapper)) {
+    PyErr_Format(PyExc_KeyError, "Fail to delete Key %S", key);
+    return -1;
+  }
+  self->evictions++;
+  return 0;
+}
+
+/* Evict a sampled entry of the namespace furthest over its quota. Return 1
+ * on success, 0 if no namespace is over quota, -1 on error. */
+static int LFUCache_evict_over_quota(LFUCache *self) {
+  PyObject *name, *obj, *key;
+  Py_ssize_t pos = 0, over = 0;
+  LFUNamespace *ns = NULL;
+  LFUNamespaceEntry *victim = NULL;
+  uint64_t min = 0, rank;
+  uint32_t now = ctools_time_in_minutes();
+
+  while (PyDict_Next(self->namespaces, &pos, &name, &obj)) {
+    LFUNamespace *n = (LFUNamespace *)obj;
+    if (n->quota && LFUNamespace_SIZE(n) - n->quota > over) {
+      over = LFUNamespace_SIZE(n) - n->quota;
+      ns = n;
+    }
+  }
+  if (!ns) return 0;
+  for (int i = 0; i < CTOOLS_LFU_BUCKET; i++) {
+    LFUNamespaceEntry *e =
+        &ns->entries[ctools_rng_limit(&self->rng, (uint32_t)ns->count - 1)];
+    if (e->wrapper->pinned) continue;
+    if (LFUWrapper_IS_DEAD(e->wrapper, self)) {
+      victim = e;
+      break;
+    }
+    rank = LFUWrapper_RANK(e->wrapper, now);
+    if (!victim || rank < min) {
+      min = rank;
+      victim = e;
+    }
+  }
+  if (!victim) return 0;
+  key = victim->key;
+  Py_INCREF(key);
+  int rv = LFUCache_evict_key(self, key);
+  Py_DECREF(key);
+  return rv ? -1 : 1;
+}
+
+static PyObject *LFUCache_evict(LFUCache *self) {
+  if (self->stale && LFUCache_reclaim(self)) Py_RETURN_NONE;
+  if (PyDict_Size(self->namespaces)) {
+    int rv = LFUCache_evict_over_quota(self);
+    if (rv < 0) return NULL;
+    if (rv) Py_RETURN_NONE;
+  }
+  PyObject *k = LFUCache_lfu(self);
+  if (!k) {
+    PyErr_Clear();
+    Py_RETURN_NONE;
+  }
+  int rv = LFUCache_evict_key(self, k);
+  Py_DECREF(k);
+  if (rv) return NULL;
+  Py_RETURN_NONE;
+}
+
+typedef struct {
+  uint64_t rank;
+  PyObject *key;
+} LFUVictim;
+
+static int LFUVictim_cmp(const void *a, const void *b) {
+  uint64_t x = ((const LFUVictim *)a)->rank;
+  uint64_t y = ((const LFUVictim *)b)->rank;
+  return x < y ? -1 : x > y;
+}
+
+/* Evict the n lightest entries. One pass ranks the whole cache, where n
+ * calls to evict() would copy the key list of a big cache n times. */
+static int LFUCache_evict_n(LFUCache *self, Py_ssize_t n) {
+  PyObject *key, *wrapper;
+  Py_ssize_t size, pos = 0, i = 0;
+  uint32_t now = ctools_time_in_minutes();
+  LFUVictim *victims;
+  int rv = 0;
+
+  /* namespaces over quota pay first */
+  while (n > 0 && PyDict_Size(self->namespaces)) {
+    if ((rv = LFUCache_evict_over_quota(self)) < 0) return -1;
+    if (!rv) break;
+    n--;
+  }
+  rv = 0;
+  size = PyDict_Size(self->dict);
+  if (n > size) n = size;
+  if (n <= 0) return 0;
+  /* the heap has them in order already */
+  if (n == 1 || self->gdsf) {
+    for (; n > 0; n--) {
+      if (!(key = LFUCache_evict(self))) return -1;
+      Py_DECREF(key);
+    }
+    return 0;
+  }
+  if (!(victims = PyMem_New(LFUVictim, size))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  while (PyDict_Next(self->dict, &pos, &key, &wrapper)) {
+    LFUWrapper *w = (LFUWrapper *)wrapper;
+    victims[i].rank = LFUWrapper_IS_DEAD(w, self) ? 0 : LFUWrapper_RANK(w, now);
+    victims[i++].key = key;
+  }
+  qsort(victims, size, sizeof(LFUVictim), LFUVictim_cmp);
+  /* spilling runs python code, hold the keys */
+  for (i = 0; i < n; i++) Py_INCREF(victims[i].key);
+  for (i = 0; i < n; i++) {
+    if (!rv && PyDict_GetItem(self->dict, victims[i].key))
+      rv = LFUCache_evict_key(self, victims[i].key);
+    Py_DECREF(victims[i].key);
+  }
+  PyMem_Free(victims);
+  return rv;
+}
+
+int PyLFUCache_DelItem(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_live(self, key);
+  LFUCache_TRACE(self, key, DEL, wrapper != NULL);
+  if (!wrapper) {
+    size_t slot;
+    if (PyErr_Occurred()) return -1;
+    ctools_spill_record rec;
+    if (self->spill && LFUCache_spill_find(self, key, &slot, &rec)) {
+      ctools_spill_delete(self->spill, slot);
+      return 0;
+    }
+    PyErr_Format(PyExc_TypeError, "%S", key);
+    return -1;
+  }
+  if (LFUCache_remove(self, key, wrapper)) {
+    Py_XINCREF(wrapper->wrapped);
+    return -1;
+  }
+  return 0;
+}
+
+/* Return a new reference to the key member would evict next with its rank
+ * in *rank, or NULL if it has nothing to evict. */
+static PyObject *LFUCacheGroup_candidate(LFUCache *member, uint64_t *rank,
+                                         uint32_t now) {
+  PyObject *key;
+  LFUWrapper *wrapper;
+  if (!PyDict_Size(member->dict)) return NULL;
+  if (!(key = LFUCache_lfu(member))) {
+    PyErr_Clear();
+    return NULL;
+  }
+  wrapper = (LFUWrapper *)PyDict_GetItem(member->dict, key);
+  *rank = LFUWrapper_IS_DEAD(wrapper, member) ? 0
+                                              : LFUWrapper_RANK(wrapper, now);
+  return key;
+}
+
+/* Draw a member, the more bytes it holds the likelier. */
+static LFUCache *LFUCacheGroup_draw(LFUCacheGroup *self) {
+  Py_ssize_t n = PyList_GET_SIZE(self->members);
+  double at = ctools_rng_unit(&self->rng) * self->bytes;
+  for (Py_ssize_t i = 0; i < n - 1; i++) {
+    LFUCache *member = (LFUCache *)PyList_GET_ITEM(self->members, i);
+    if ((at -= member->bytes) <= 0) return member;
+  }
+  return (LFUCache *)PyList_GET_ITEM(self->members, n - 1);
+}
+
+/* Evict until need more bytes fit the budget. Every member of a small
+ * group offers its next victim, a big group samples CTOOLS_LFU_BUCKET
+ * members by their bytes, and the lowest rank offered goes. Return 0 on
+ * success, also when only pinned entries are left, -1 on error. */
+static int LFUCacheGroup_make_room(LFUCacheGroup *self, double need) {
+  uint32_t now = ctools_time_in_minutes();
+  while (self->members && self->bytes + need > self->max_bytes) {
+    Py_ssize_t n = PyList_GET_SIZE(self->members);
+    LFUCache *victim = NULL;
+    PyObject *key = NULL, *k;
+    uint64_t min = 0, rank;
+    int rv;
+    for (Py_ssize_t i = 0; i < Py_MIN(n, CTOOLS_LFU_BUCKET); i++) {
+      LFUCache *member =
+          n <= CTOOLS_LFU_BUCKET
+              ? (LFUCache *)PyList_GET_ITEM(self->members, i)
+              : LFUCacheGroup_draw(self);
+      if (!(k = LFUCacheGroup_candidate(member, &rank, now))) continue;
+      /* on a tie the member holding more bytes gives, so an even load
+       * stays even */
+      if (key && (rank > min ||
+                  (rank == min && member->bytes <= victim->bytes))) {
+        Py_DECREF(k);
+        continue;
+      }
+      Py_XSETREF(key, k);
+      victim = member;
+      min = rank;
+    }
+    if (!key) return 0;
+    /* spilling runs python code, hold the member */
+    Py_INCREF(victim);
+    rv = LFUCache_evict_key(victim, key);
+    Py_DECREF(victim);
+    Py_DECREF(key);
+    if (rv) return -1;
+  }
+  return 0;
+}
+
+/* Bytes of value as admission and groups see them: exact for bytes, str and
+ * bytearray, __sizeof__ for anything else, which is shallow: a container
+ * counts its own footprint, not its items. -1 on error. */
+static double LFUCache_value_size(PyObject *value) {
+  PyObject *rv;
+  double size;
+  if (PyBytes_Check(value)) return (double)PyBytes_GET_SIZE(value);
+  if (PyByteArray_Check(value)) return (double)PyByteArray_GET_SIZE(value);
+  if (PyUnicode_Check(value))
+    return (double)PyUnicode_GET_LENGTH(value) * PyUnicode_KIND(value);
+  if (!(rv = PyObject_CallMethod(value, "__sizeof__", NULL))) return -1;
+  size = PyLong_AsDouble(rv);
+  Py_DECREF(rv);
+  if (size == -1 && PyErr_Occurred()) return -1;
+  return size;
+}
+
+/* Decide on a new entry of size and measured bytes, before anything is
+ * evicted for it. Return 1 if it stays out. */
+static int LFUCache_rejects(LFUCache *self, double size, double bytes) {
+  if (self->max_item_size && size > (double)self->max_item_size) return 1;
+  if (self->group && bytes > self->group->max_bytes) return 1;
+  if (!self->admission.c) return 0;
+  ctools_admission_tune(&self->admission, (uint64_t)self->hits,
+                        (uint64_t)(self->hits + self->misses));
+  return !ctools_admission_admit(&self->admission, size, &self->rng);
+}
+
+/* Insert or overwrite key. A write replaces the tags, the expiry, the
+ * priority, the cost and the size of the entry, a pinned entry stays
+ * pinned. A size of 0 is unknown: admission and max_item_size measure the
+ * value then, the entry's GDSF size is 1. A group always counts the
+ * measured bytes, whatever the size. ns is the namespace of a new entry. */
+static int LFUCache_set(LFUCache *self, PyObject *key, PyObject *value,
+                        PyObject *tags, const ctools_lfu_expiry *expiry,
+                        unsigned char priority, double cost, double size,
+                        LFUNamespace *ns) {
+  LFUWrapper *wrapper;
+  PyObject *stored;
+  double bytes = 0, admit;
+  LFUCache_SWEEP(self);
+  if (self->group ||
+      (size <= 0 && (self->max_item_size || self->admission.c))) {
+    if ((bytes = LFUCache_value_size(value)) < 0) return -1;
+  }
+  admit = size > 0 ? size : bytes;
+  if (size < 1) size = 1;
+  if ((wrapper = PyLFUCache_GetItem(self, key))) {
+    PyObject *old = wrapper->wrapped;
+    LFUCache_TRACE(self, key, SET, 1);
+    /* the old value must not outlive a write that bypasses the cache */
+    if (self->max_item_size && admit > (double)self->max_item_size) {
+      self->rejections++;
+      return LFUCache_remove(self, key, wrapper);
+    }
+    if (!(stored = LFUCache_store_value(self, key, value))) return -1;
+    wrapper->priority = priority;
+    wrapper->cost = cost;
+    wrapper->size = size;
+    LFUCache_ADD_BYTES(self, bytes - wrapper->bytes);
+    wrapper->bytes = bytes;
+    if (LFUCache_untag(self, key, wrapper)) {
+      Py_DECREF(stored);
+      return -1;
+    }
+    if (LFUWrapper_IS_STALE(wrapper, self)) {
+      /* a stale entry is replaced as if it were new */
+      ctools_lfu_counter_init(wrapper->counter, ctools_time_in_minutes());
+      wrapper->generation = self->generation;
+      self->stale--;
+      if (wrapper->ns) wrapper->ns->stale--;
+    }
+    PyObject_GC_UnTrack(wrapper);
+    LFUCache_arena_unload(self, wrapper, 0);
+    wrapper->wrapped = stored;
+    if (self->arena) LFUCache_arena_load(self, wrapper, 0);
+    LFUWrapper_MAYBE_TRACK(wrapper);
+    Py_XDECREF(old);
+    if (wrapper->gdsf.pos != CTOOLS_GDSF_NONE) {
+      LFUCache_gdsf_rate(self, wrapper);
+      ctools_gdsf_fix(self->gdsf, &wrapper->gdsf);
+    }
+    if (LFUWrapper_set_expiry(wrapper, expiry) ||
+        LFUCache_tag(self, key, wrapper, tags))
+      return -1;
+    LFUCache_WATCH_EXPIRY(self, expiry);
+    /* a bigger value may push the group over budget, maybe out of it */
+    return self->group ? LFUCacheGroup_make_room(self->group, 0) : 0;
+  }
+  LFUCache_TRACE(self, key, SET, 0);
+  if (self->spill) LFUCache_spill_discard(self, key);
+  if (LFUCache_rejects(self, admit, bytes)) {
+    self->rejections++;
+    return 0;
+  }
+  if (LFUCache_USED(self) + 1 > self->capacity) {
+    PyObject *rv = LFUCache_evict(self);
+    if (!rv) return -1;
+    Py_DECREF(rv);
+    /* pinned entries filling the capacity can't make room */
+    if (!PyDict_Size(self->dict) && LFUCache_USED(self) >= self->capacity) {
+      PyErr_SetString(PyExc_ValueError, "cache is full of pinned entries");
+      return -1;
+    }
+  }
+  if (self->group && LFUCacheGroup_make_room(self->group, bytes)) return -1;
+  if (!(stored = LFUCache_store_value(self, key, value))) return -1;
+  wrapper = LFUWrapper_create(stored, ctools_time_in_minutes());
+  Py_DECREF(stored);
+  if (!wrapper) return -1;
+  wrapper->generation = self->generation;
+  wrapper->priority = priority;
+  wrapper->cost = cost;
+  wrapper->size = size;
+  wrapper->bytes = bytes;
+  if (LFUWrapper_set_expiry(wrapper, expiry)) {
+    Py_DECREF(wrapper);
+    return -1;
+  }
+  LFUCache_WATCH_EXPIRY(self, expiry);
+  if (self->arena) LFUCache_arena_load(self, wrapper, 1);
+  if (PyDict_SetItem(self->dict, key, (PyObject *)wrapper)) {
+    Py_DECREF(wrapper);
+    return -1;
+  }
+  Py_DECREF(wrapper);
+  LFUCache_ADD_BYTES(self, bytes);
+  if (LFUCache_gdsf_add(self, key, wrapper) ||
+      (ns && LFUNamespace_add(ns, key, wrapper)) ||
+      LFUCache_tag(self, key, wrapper, tags)) {
+    LFUCache_remove(self, key, wrapper);
+    return -1;
+  }
+  return 0;
+}
+
+int PyLFUCache_SetItem(LFUCache *self, PyObject *key, PyObject *value) {
+  return LFUCache_set(self, key, value, NULL, NULL, 0, 1, 0, NULL);
+}
+
+/* Look key up in memory, then in the spill file. A record found on disk is
+ * promoted back into memory. Return a borrowed wrapper, or NULL on a miss
+ * or, with an exception set, on an error. */
+static LFUWrapper *LFUCache_lookup(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_live(self, key);
+  ctools_lfu_trace *trace = self->trace;
+  PyObject *value;
+  if (!wrapper && !PyErr_Occurred() && self->spill &&
+      (value = LFUCache_spill_take(self, key))) {
+    /* the promotion isn't an access of its own */
+    self->trace = NULL;
+    if (PyLFUCache_SetItem(self, key, value)) PyErr_Clear();
+    self->trace = trace;
+    Py_DECREF(value);
+    wrapper = PyLFUCache_GetItem(self, key);
+  }
+  LFUCache_TRACE(self, key, GET, wrapper != NULL);
+  return wrapper;
+}
+
+/* Give every frozen entry its own counter back and drop the array. */
+static void LFUCache_thaw(LFUCache *self) {
+  PyObject *key, *wrapper;
+  Py_ssize_t pos = 0;
+  if (!self->counters) return;
+  if (self->dict) {
+    while (PyDict_Next(self->dict, &pos, &key, &wrapper))
+      LFUWrapper_DETACH((LFUWrapper *)wrapper);
+  }
+  PyMem_Free(self->counters);
+  self->counters = NULL;
+}
+
+void PyLFUCache_Clear(LFUCache *self) {
+  PyObject *name, *ns;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(self->namespaces, &pos, &name, &ns)) {
+    ((LFUNamespace *)ns)->count = 0;
+    ((LFUNamespace *)ns)->stale = 0;
+  }
+  LFUCache_thaw(self);
+  LFUCache_arena_reset(self, 0);
+  if (self->spill) ctools_spill_reset(self->spill);
+  if (self->gdsf) ctools_gdsf_reset(self->gdsf);
+  LFUCache_ADD_BYTES(self, -self->bytes);
+  PyDict_Clear(self->dict);
+  PyDict_Clear(self->pinned);
+  PyDict_Clear(self->tags);
+  self->stale = 0;
+  self->reclaim_pos = 0;
+  self->next_expiry = 0;
+  self->misses = 0;
+  self->hits = 0;
+}
+
+static PyObject *LFUCache_new(PyTypeObject *type, PyObject *args,
+                              PyObject *kwds) {
+  LFUCache *self;
+  self = (LFUCache *)PyObject_GC_New(LFUCache, type);
+  if (!self) return NULL;
+  self->counters = NULL;
+  self->arena = NULL;
+  self->spill = NULL;
+  self->generation = 0;
+  self->stale = 0;
+  self->reclaim_pos = 0;
+  self->tags = NULL;
+  self->on_refresh = NULL;
+  self->next_expiry = 0;
+  self->pinned = NULL;
+  self->pinned_count = 1;
+  self->namespaces = NULL;
+  self->dead = NULL;
+  self->weak_callback = NULL;
+  self->evictions = 0;
+  memset(&self->load_latency, 0, sizeof(self->load_latency));
+  self->trace = NULL;
+  self->gdsf = NULL;
+  self->max_item_size = 0;
+  self->admission.c = 0;
+  self->rejections = 0;
+  self->bytes = 0;
+  self->group = NULL;
+  PyObject_GC_Track(self);
+  if (!(self->dict = PyDict_New()) || !(self->tags = PyDict_New()) ||
+      !(self->pinned = PyDict_New()) || !(self->namespaces = PyDict_New())) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+/* Switch eviction between sampled LFU and the GDSF heap, which takes in
+ * the evictable entries already there. */
+static int LFUCache_set_policy(LFUCache *self, const char *policy) {
+  PyObject *key, *wrapper;
+  Py_ssize_t pos = 0;
+  if (!strcmp(policy, "lfu")) {
+    if (self->gdsf) ctools_gdsf_reset(self->gdsf);
+    ctools_gdsf_free(self->gdsf);
+    self->gdsf = NULL;
+    return 0;
+  }
+  if (strcmp(policy, "gdsf")) {
+    PyErr_Format(PyExc_ValueError,
+                 "policy should be \"lfu\" or \"gdsf\", not \"%s\"", policy);
+    return -1;
+  }
+  if (self->gdsf) return 0;
+  if (!(self->gdsf = ctools_gdsf_new())) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  while (PyDict_Next(self->dict, &pos, &key, &wrapper)) {
+    if (LFUCache_gdsf_add(self, key, (LFUWrapper *)wrapper)) return -1;
+  }
+  return 0;
+}
+
+static int LFUCache_init(LFUCache *self, PyObject *args, PyObject *kwds) {
+  Py_ssize_t arena_bytes = 0, spill_bytes = 0;
+  PyObject *spill_path = NULL, *on_refresh = NULL, *seed = NULL;
+  Py_ssize_t max_item_size = 0, admission_size = 0;
+  const char *policy = "lfu";
+  int weak_values = 0;
+  static char *kwlist[] = {"capacity",      "arena_bytes",    "spill_path",
+                           "spill_bytes",   "on_refresh",     "pinned_count",
+                           "weak_values",   "seed",           "policy",
+                           "max_item_size", "admission_size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwds, "n|nO&nOppOsnn", kwlist, &self->capacity, &arena_bytes,
+          PyUnicode_FSConverter, &spill_path, &spill_bytes, &on_refresh,
+          &self->pinned_count, &weak_values, &seed, &policy, &max_item_size,
+          &admission_size)) {
+    return -1;
+  }
+  if (max_item_size < 0 || admission_size < 0) {
+    Py_XDECREF(spill_path);
+    PyErr_SetString(PyExc_ValueError,
+                    "max_item_size and admission_size should not be negative");
+    return -1;
+  }
+  if (LFUCache_set_policy(self, policy)) {
+    Py_XDECREF(spill_path);
+    return -1;
+  }
+  self->max_item_size = max_item_size;
+  if (admission_size)
+    ctools_admission_init(&self->admission, (double)admission_size,
+                          CTOOLS_ADMISSION_WINDOW);
+  else
+    self->admission.c = 0;
+  if (seed && seed != Py_None) {
+    unsigned long long v = PyLong_AsUnsignedLongLongMask(seed);
+    if (v == (unsigned long long)-1 && PyErr_Occurred()) {
+      Py_XDECREF(spill_path);
+      return -1;
+    }
+    ctools_rng_seed(&self->rng, v);
+  } else {
+    ctools_rng_seed(&self->rng, (uint64_t)(size_t)self ^
+                                    (uint64_t)(ctools_time_in_seconds() * 1e9));
+  }
+  if (weak_values && arena_bytes > 0) {
+    Py_XDECREF(spill_path);
+    PyErr_SetString(PyExc_ValueError,
+                    "weak_values can't be used with arena_bytes");
+    return -1;
+  }
+  /* weak entries left from an earlier __init__ keep queueing into dead */
+  if (!weak_values) {
+    Py_CLEAR(self->weak_callback);
+  } else if (!self->weak_callback) {
+    if ((!self->dead && !(self->dead = PyList_New(0))) ||
+        !(self->weak_callback = PyObject_GetAttrString(self->dead, "append"))) {
+      Py_XDECREF(spill_path);
+      return -1;
+    }
+  }
+  if (on_refresh == Py_None) on_refresh = NULL;
+  if (on_refresh && !PyCallable_Check(on_refresh)) {
+    Py_XDECREF(spill_path);
+    PyErr_SetString(PyExc_TypeError, "on_refresh should be callable.");
+    return -1;
+  }
+  Py_XINCREF(on_refresh);
+  Py_XSETREF(self->on_refresh, on_refresh);
+  if (self->spill) {
+    ctools_spill_close(self->spill, 1);
+    self->spill = NULL;
+  }
+  if (spill_path) {
+    if (spill_bytes <= 0) {
+      Py_DECREF(spill_path);
+      PyErr_SetString(PyExc_ValueError, "spill_bytes should be positive");
+      return -1;
+    }
+    if (LFUCache_import_pickle()) {
+      Py_DECREF(spill_path);
+      return -1;
+    }
+    self->spill =
+        ctools_spill_open(PyBytes_AS_STRING(spill_path), (size_t)spill_bytes);
+    if (!self->spill) {
+      PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, spill_path);
+      Py_DECREF(spill_path);
+      return -1;
+    }
+    Py_DECREF(spill_path);
+  }
+  if (self->capacity <= 0) {
+    PyErr_SetString(PyExc_ValueError, "Capacity should be a positive number");
+    return -1;
+  }
+  if (arena_bytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "arena_bytes should not be negative");
+    return -1;
+  }
+  if (self->arena) {
+    /* entries outlive the arena, rebuild their values */
+    LFUCache_arena_reset(self, 1);
+    ctools_arena_free(self->arena);
+    self->arena = NULL;
+  }
+  if (arena_bytes > 0) {
+    self->arena = ctools_arena_new((size_t)arena_bytes, 0);
+    if (!self->arena) {
+      PyErr_Format(PyExc_ValueError, "arena_bytes should be at least %d",
+                   CTOOLS_ARENA_MIN_CHUNK);
+      return -1;
+    }
+  }
+  self->hits = 0;
+  self->misses = 0;
+  self->evictions = 0;
+  self->rejections = 0;
+  memset(&self->load_latency, 0, sizeof(self->load_latency));
+  return 0;
+}
+
+static int LFUCache_tp_traverse(LFUCache *self, visitproc visit, void *arg) {
+  Py_VISIT(self->dict);
+  Py_VISIT(self->pinned);
+  Py_VISIT(self->namespaces);
+  Py_VISIT(self->dead);
+  Py_VISIT(self->weak_callback);
+  Py_VISIT(self->tags);
+  Py_VISIT(self->on_refresh);
+  Py_VISIT(self->group);
+  return 0;
+}
+
+static int LFUCache_tp_clear(LFUCache *self) {
+  LFUCache_thaw(self);
+  LFUCache_arena_reset(self, 0);
+  /* the heap points into the entries, let go of it while they live */
+  if (self->gdsf) ctools_gdsf_reset(self->gdsf);
+  Py_CLEAR(self->dict);
+  Py_CLEAR(self->pinned);
+  Py_CLEAR(self->namespaces);
+  Py_CLEAR(self->tags);
+  Py_CLEAR(self->weak_callback);
+  Py_CLEAR(self->dead);
+  Py_CLEAR(self->on_refresh);
+  ctools_arena_free(self->arena);
+  self->arena = NULL;
+  ctools_spill_close(self->spill, 1);
+  self->spill = NULL;
+  ctools_lfu_trace_free(self->trace);
+  self->trace = NULL;
+  ctools_gdsf_free(self->gdsf);
+  self->gdsf = NULL;
+  Py_CLEAR(self->group);
+  return 0;
+}
+
+static void LFUCache_tp_dealloc(LFUCache *self) {
+  PyObject_GC_UnTrack(self);
+  LFUCache_tp_clear(self);
+  PyObject_GC_Del(self);
+}
+
+/* Like keys(), leaves out the entries only waiting to be reclaimed. */
+static PyObject *LFUCache_repr(LFUCache *self) {
+  PyObject *key, *wrapper, *live, *rv, *dict = self->dict;
+  Py_ssize_t pos = 0;
+  if (!(live = PyDict_New())) return NULL;
+  for (;;) {
+    if (!PyDict_Next(dict, &pos, &key, &wrapper)) {
+      if (dict == self->pinned) break;
+      dict = self->pinned;
+      pos = 0;
+      continue;
+    }
+    if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, self)) continue;
+    if (PyDict_SetItem(live, key, wrapper)) {
+      Py_DECREF(live);
+      return NULL;
+    }
+  }
+  rv = PyObject_Repr(live);
+  Py_DECREF(live);
+  return rv;
+}
+
+/* Check the soft expiry of a hit. Return 1 if this read is the one that
+ * should refresh the entry, on_refresh is told about it then. */
+static int LFUCache_refresh_due(LFUCache *self, PyObject *key,
+                                LFUWrapper *wrapper) {
+  PyObject *rv;
+  if (!wrapper->expiry ||
+      ctools_lfu_expiry_check(wrapper->expiry, ctools_time_in_seconds(),
+                              &self->rng) != CTOOLS_LFU_REFRESH)
+    return 0;
+  if (self->on_refresh) {
+    /* the callback may drop the entry, hold it to re-arm the refresh */
+    Py_INCREF(wrapper);
+    /* a failing callback must not turn the hit into an error, the next
+     * read tries again */
+    if ((rv = PyObject_CallFunctionObjArgs(self->on_refresh, key, NULL))) {
+      Py_DECREF(rv);
+    } else {
+      PyErr_WriteUnraisable(self->on_refresh);
+      if (wrapper->expiry) wrapper->expiry->refreshing = 0;
+    }
+    Py_DECREF(wrapper);
+  }
+  return 1;
+}
+
+/* mp_subscript: __getitem__() */
+static PyObject *LFUCache_mp_subscript(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_lookup(self, key);
+  PyObject *value;
+  if (!wrapper) {
+    if (PyErr_Occurred()) return NULL;
+    self->misses++;
+    return PyErr_Format(PyExc_KeyError, "%S", key);
+  }
+  self->hits++;
+  if ((value = LFUWrapper_wrapped(wrapper)))
+    LFUCache_refresh_due(self, key, wrapper);
+  return value;
+}
+
+/* mp_ass_subscript: __setitem__() and __delitem__() */
+static int LFUCache_mp_ass_sub(LFUCache *self, PyObject *key, PyObject *value) {
+  if (value == NULL) {
+    return PyLFUCache_DelItem(self, key);
+  } else {
+    return PyLFUCache_SetItem(self, key, value);
+  }
+}
+
+static PyMappingMethods LFUCache_as_mapping = {
+    (lenfunc)PyLFUCache_Size,           /*mp_length*/
+    (binaryfunc)LFUCache_mp_subscript,  /*mp_subscript*/
+    (objobjargproc)LFUCache_mp_ass_sub, /*mp_ass_subscript*/
+};
+
+static PyObject *LFUCache_hints(LFUCache *self) {
+  return Py_BuildValue("iii", self->capacity, self->hits, self->misses);
+}
+
+#define LFU_KEYS 0
+#define LFU_VALUES 1
+#define LFU_ITEMS 2
+
+/* keys(), values() or items() of the live entries while some are stale,
+ * expiring or pinned. */
+static PyObject *LFUCache_live_list(LFUCache *self, int what) {
+  PyObject *key, *wrapper, *list, *item, *dict = self->dict;
+  Py_ssize_t pos = 0, i = 0;
+  if (!(list = PyList_New(PyLFUCache_Size(self)))) return NULL;
+  for (;;) {
+    if (!PyDict_Next(dict, &pos, &key, &wrapper)) {
+      if (dict == self->pinned) break;
+      dict = self->pinned;
+      pos = 0;
+      continue;
+    }
+    if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, self)) continue;
+    if (what == LFU_KEYS) {
+      Py_INCREF(key);
+      item = key;
+    } else if (what == LFU_VALUES) {
+      item = LFUWrapper_wrapped((LFUWrapper *)wrapper);
+    } else {
+      PyObject *value = LFUWrapper_wrapped((LFUWrapper *)wrapper);
+      item = value ? PyTuple_Pack(2, key, value) : NULL;
+      Py_XDECREF(value);
+    }
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i++, item);
+  }
+  /* entries may expire between counting and the walk */
+  if (PyList_SetSlice(list, i, PY_SSIZE_T_MAX, NULL)) {
+    Py_DECREF(list);
+    return NULL;
+  }
+  return list;
+}
+
+static PyObject *LFUCache_keys(LFUCache *self) {
+  LFUCache_SWEEP(self);
+  if (self->stale || self->next_expiry || PyDict_Size(self->pinned))
+    return LFUCache_live_list(self, LFU_KEYS);
+  return PyDict_Keys(self->dict);
+}
+
+static PyObject *LFUCache_values(LFUCache *self) {
+  LFUWrapper *wrapper;
+  PyObject *values;
+  LFUCache_SWEEP(self);
+  if (self->stale || self->next_expiry || PyDict_Size(self->pinned))
+    return LFUCache_live_list(self, LFU_VALUES);
+  values = PyDict_Values(self->dict);
+  if (!values) return NULL;
+  if (PyList_GET_SIZE(values) == 0) return values;
+
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(values); i++) {
     wrapper = (LFUWrapper *)PyList_GET_ITEM(values, i);
     Py_INCREF(wrapper);
     PyList_SET_ITEM(values, i, LFUWrapper_wrapped(wrapper));
@@ -403,8 +1883,11 @@ static PyObject *LFUCache_values(LFUCache *self) {
 
 static PyObject *LFUCache_items(LFUCache *self) {
   LFUWrapper *wrapper;
-  PyObject *items = PyDict_Items(self->dict);
-  PyObject *kv;
+  PyObject *items, *kv;
+  LFUCache_SWEEP(self);
+  if (self->stale || self->next_expiry || PyDict_Size(self->pinned))
+    return LFUCache_live_list(self, LFU_ITEMS);
+  items = PyDict_Items(self->dict);
   if (!items) {
     return NULL;
   }
@@ -417,25 +1900,136 @@ static PyObject *LFUCache_items(LFUCache *self) {
     PyTuple_SET_ITEM(kv, 1, LFUWrapper_wrapped(wrapper));
     Py_DECREF(wrapper);
   }
-  return items;
+  return items;
+}
+
+static PyObject *LFUCache_get(LFUCache *self, PyObject *args, PyObject *kw) {
+  PyObject *key;
+  PyObject *_default = NULL;
+  LFUWrapper *result;
+
+  static char *kwlist[] = {"key", "default", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
+    return NULL;
+  result = LFUCache_lookup(self, key);
+  if (!result) {
+    if (PyErr_Occurred()) return NULL;
+    if (!_default) Py_RETURN_NONE;
+    Py_INCREF(_default);
+    return _default;
+  }
+  PyObject *value = LFUWrapper_VALUE(result);
+  if (value) LFUCache_refresh_due(self, key, result);
+  return value;
+}
+
+/* Return the borrowed wrapper of a live entry without touching anything:
+ * no spill promotion, no reclaim, no trace. */
+static LFUWrapper *LFUCache_peek_wrapper(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_find(self, key);
+  return wrapper && !LFUWrapper_IS_DEAD(wrapper, self) ? wrapper : NULL;
+}
+
+/* Like get but leaves the entry weight, stats and expiry refresh alone. */
+static PyObject *LFUCache_peek(LFUCache *self, PyObject *args, PyObject *kw) {
+  PyObject *key, *_default = Py_None;
+  LFUWrapper *wrapper;
+
+  static char *kwlist[] = {"key", "default", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
+    return NULL;
+  if ((wrapper = LFUCache_peek_wrapper(self, key)))
+    return LFUWrapper_VALUE(wrapper);
+  if (PyErr_Occurred()) return NULL;
+  Py_INCREF(_default);
+  return _default;
+}
+
+/* The weight of key as eviction sees it, without bumping it. */
+static PyObject *LFUCache_frequency(LFUCache *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_peek_wrapper(self, key);
+  if (!wrapper) {
+    if (!PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+  return Py_BuildValue("I",
+                       LFUWrapper_WEIGHT(wrapper, ctools_time_in_minutes()));
+}
+
+/* Histogram of the weights of the live entries, or of their raw visit
+ * counts, as [(low, high, count), ...] over at most bins equal width bins.
+ * One pass copies the weights out, ctools_lfu_histogram bins them. */
+static PyObject *LFUCache_weight_histogram(LFUCache *self, PyObject *args,
+                                           PyObject *kw) {
+  PyObject *dicts[2] = {self->dict, self->pinned}, *key, *wrapper, *rv;
+  Py_ssize_t bins = 16, pos, size;
+  unsigned int *values, low, now = ctools_time_in_minutes();
+  uint64_t *counts, width;
+  size_t n = 0, used;
+  int raw = 0;
+
+  static char *kwlist[] = {"bins", "raw", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|np", kwlist, &bins, &raw))
+    return NULL;
+  if (bins <= 0) {
+    PyErr_SetString(PyExc_ValueError, "bins should be positive");
+    return NULL;
+  }
+  size = PyDict_Size(self->dict) + PyDict_Size(self->pinned);
+  values = PyMem_New(unsigned int, size ? size : 1);
+  counts = PyMem_New(uint64_t, bins);
+  if (!values || !counts) {
+    PyMem_Free(values);
+    PyMem_Free(counts);
+    return PyErr_NoMemory();
+  }
+  memset(counts, 0, bins * sizeof(uint64_t));
+  for (int d = 0; d < 2; d++) {
+    pos = 0;
+    while (PyDict_Next(dicts[d], &pos, &key, &wrapper)) {
+      LFUWrapper *w = (LFUWrapper *)wrapper;
+      if (LFUWrapper_IS_DEAD(w, self)) continue;
+      values[n++] = raw ? w->counter->visit_count : LFUWrapper_WEIGHT(w, now);
+    }
+  }
+  used = ctools_lfu_histogram(values, n, (size_t)bins, &low, &width, counts);
+  if ((rv = PyList_New((Py_ssize_t)used))) {
+    for (size_t i = 0; i < used; i++) {
+      uint64_t lo = (uint64_t)low + i * width;
+      PyObject *bin = Py_BuildValue("(KKK)", (unsigned long long)lo,
+                                    (unsigned long long)(lo + width - 1),
+                                    (unsigned long long)counts[i]);
+      if (!bin) {
+        Py_CLEAR(rv);
+        break;
+      }
+      PyList_SET_ITEM(rv, (Py_ssize_t)i, bin);
+    }
+  }
+  PyMem_Free(values);
+  PyMem_Free(counts);
+  return rv;
 }
 
-static PyObject *LFUCache_get(LFUCache *self, PyObject *args, PyObject *kw) {
-  PyObject *key;
-  PyObject *_default = NULL;
-  LFUWrapper *result;
+/* Like __getitem__ but returns (value, refresh) and default on a miss.
+ * refresh is True for the one read that should reload a soft expired
+ * entry, everybody else keeps getting the stale value meanwhile. */
+static PyObject *LFUCache_fetch(LFUCache *self, PyObject *args, PyObject *kw) {
+  PyObject *key, *value, *_default = Py_None;
+  LFUWrapper *wrapper;
 
   static char *kwlist[] = {"key", "default", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
     return NULL;
-  result = PyLFUCache_GetItem(self, key);
-  if (!result) {
-    if (!_default) Py_RETURN_NONE;
-    Py_INCREF(_default);
-    return _default;
+  if (!(wrapper = LFUCache_lookup(self, key))) {
+    if (PyErr_Occurred()) return NULL;
+    self->misses++;
+    return Py_BuildValue("(OO)", _default, Py_False);
   }
-  Py_INCREF(result->wrapped);
-  return result->wrapped;
+  self->hits++;
+  if (!(value = LFUWrapper_wrapped(wrapper))) return NULL;
+  int refresh = LFUCache_refresh_due(self, key, wrapper);
+  return Py_BuildValue("(NO)", value, refresh ? Py_True : Py_False);
 }
 
 static PyObject *LFUCache_pop(LFUCache *self, PyObject *args, PyObject *kw) {
@@ -446,18 +2040,20 @@ static PyObject *LFUCache_pop(LFUCache *self, PyObject *args, PyObject *kw) {
   static char *kwlist[] = {"key", "default", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
     return NULL;
-  result = PyLFUCache_GetItem(self, key);
+  result = LFUCache_lookup(self, key);
   if (!result) {
+    if (PyErr_Occurred()) return NULL;
     if (!_default) Py_RETURN_NONE;
     Py_INCREF(_default);
     return _default;
   }
-  Py_INCREF(result->wrapped);
-  if (!PyLFUCache_DelItem(self, key)) {
-    Py_XDECREF(result->wrapped);
+  PyObject *value = LFUWrapper_VALUE(result);
+  if (!value) return NULL;
+  if (PyLFUCache_DelItem(self, key)) {
+    Py_DECREF(value);
     return NULL;
   }
-  return result->wrapped;
+  return value;
 }
 
 static PyObject *LFUCache_setdefault(LFUCache *self, PyObject *args,
@@ -469,98 +2065,971 @@ static PyObject *LFUCache_setdefault(LFUCache *self, PyObject *args,
   static char *kwlist[] = {"key", "default", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
     return NULL;
-  result = PyLFUCache_GetItem(self, key);
+  result = LFUCache_lookup(self, key);
   if (!result) {
+    if (PyErr_Occurred()) return NULL;
     if (!_default) _default = Py_None;
     Py_INCREF(_default);
     if (PyLFUCache_SetItem(self, key, _default)) {
       Py_DECREF(_default);
       return NULL;
     }
-    return _default;
+    return _default;
+  }
+
+  return LFUWrapper_wrapped(result);
+}
+
+static PyObject *LFUCache_setnx(LFUCache *self, PyObject *args, PyObject *kw) {
+  PyObject *key;
+  PyObject *_default = NULL, *callback = NULL;
+  LFUWrapper *result;
+
+  static char *kwlist[] = {"key", "callback", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "OO", kwlist, &key, &callback))
+    return NULL;
+
+  if (callback == NULL || !PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "callback should be callable.");
+    return NULL;
+  }
+
+  result = LFUCache_lookup(self, key);
+  if (!result) {
+    if (PyErr_Occurred()) return NULL;
+    _default = PyObject_CallFunction(callback, NULL);
+    Py_INCREF(_default);
+    if (PyLFUCache_SetItem(self, key, _default)) {
+      Py_DECREF(_default);
+      return NULL;
+    }
+    return _default;
+  }
+
+  return LFUWrapper_wrapped(result);
+}
+
+/* Look every key up in one pass, hand the misses to loader(missing) in one
+ * call and insert what it returns, making room for it in one eviction
+ * batch. Return a dict of the hits merged with the loaded values. */
+static PyObject *LFUCache_get_many_or_load(LFUCache *self, PyObject *args,
+                                           PyObject *kw) {
+  PyObject *keys, *loader, *it, *key, *value, *list;
+  PyObject *result = NULL, *missing = NULL, *loaded = NULL;
+  LFUWrapper *wrapper;
+  Py_ssize_t pos = 0, n = 0;
+  double start;
+
+  static char *kwlist[] = {"keys", "loader", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "OO", kwlist, &keys, &loader))
+    return NULL;
+  if (!PyCallable_Check(loader)) {
+    PyErr_SetString(PyExc_TypeError, "loader should be callable.");
+    return NULL;
+  }
+  if (!(it = PyObject_GetIter(keys))) return NULL;
+  if (!(result = PyDict_New()) || !(missing = PyDict_New())) goto done;
+  while ((key = PyIter_Next(it))) {
+    if ((wrapper = LFUCache_lookup(self, key))) {
+      self->hits++;
+      value = LFUWrapper_wrapped(wrapper);
+      if (value) LFUCache_refresh_due(self, key, wrapper);
+      if (!value || PyDict_SetItem(result, key, value)) {
+        Py_XDECREF(value);
+        Py_DECREF(key);
+        goto done;
+      }
+      Py_DECREF(value);
+    } else if (PyErr_Occurred() || PyDict_SetItem(missing, key, Py_None)) {
+      Py_DECREF(key);
+      goto done;
+    } else {
+      self->misses++;
+    }
+    Py_DECREF(key);
+  }
+  if (PyErr_Occurred() || PyDict_Size(missing) == 0) goto done;
+
+  if (!(list = PyDict_Keys(missing))) goto done;
+  start = ctools_time_in_seconds();
+  value = PyObject_CallFunctionObjArgs(loader, list, NULL);
+  ctools_lfu_latency_add(&self->load_latency,
+                         ctools_time_in_seconds() - start);
+  Py_DECREF(list);
+  if (!value) goto done;
+  if (PyDict_Check(value)) {
+    loaded = value;
+  } else {
+    loaded = PyDict_New();
+    if (!loaded || PyDict_Update(loaded, value)) {
+      Py_DECREF(value);
+      goto done;
+    }
+    Py_DECREF(value);
+  }
+  while (PyDict_Next(loaded, &pos, &key, &value)) {
+    if (!PyLFUCache_GetItem(self, key)) n++;
+  }
+  n = LFUCache_USED(self) + n - self->capacity;
+  if (n > 0 && LFUCache_evict_n(self, n)) goto done;
+  pos = 0;
+  while (PyDict_Next(loaded, &pos, &key, &value)) {
+    if (PyLFUCache_SetItem(self, key, value) ||
+        PyDict_SetItem(result, key, value))
+      goto done;
+  }
+
+done:
+  Py_DECREF(it);
+  Py_XDECREF(missing);
+  Py_XDECREF(loaded);
+  /* every failure lands here with an exception set */
+  if (PyErr_Occurred()) Py_CLEAR(result);
+  return result;
+}
+
+/* Grow the dict once so that it holds n entries without resizing. Keys are
+ * moved to the new table, so dict positions (reclaim_pos) start over. A
+ * dict somebody else holds, see _store, is left alone. 3.13 made
+ * _PyDict_NewPresized internal and offers nothing public instead, so
+ * there this is a no-op. */
+static int LFUCache_reserve_n(LFUCache *self, Py_ssize_t n) {
+#if PY_VERSION_HEX < 0x030D0000
+  PyObject *dict, *key, *value;
+  Py_ssize_t pos = 0;
+  if (n <= PyDict_Size(self->dict) || Py_REFCNT(self->dict) > 1) return 0;
+  if (!(dict = _PyDict_NewPresized(n))) return -1;
+  /* not PyDict_Update, merging into an empty dict copies the old table */
+  while (PyDict_Next(self->dict, &pos, &key, &value)) {
+    if (PyDict_SetItem(dict, key, value)) {
+      Py_DECREF(dict);
+      return -1;
+    }
+  }
+  Py_SETREF(self->dict, dict);
+  self->reclaim_pos = 0;
+#endif
+  return 0;
+}
+
+static PyObject *LFUCache_reserve(LFUCache *self, PyObject *n) {
+  Py_ssize_t size = PyLong_AsSsize_t(n);
+  if (size == -1 && PyErr_Occurred()) return NULL;
+  if (LFUCache_reserve_n(self, Py_MIN(size, self->capacity))) return NULL;
+  Py_RETURN_NONE;
+}
+
+/* Seed the counter of a loaded entry with its weight from weights, a
+ * mapping of key -> weight as coldest() and hottest() report them. */
+static int LFUCache_seed_weight(LFUWrapper *wrapper, PyObject *weights,
+                                PyObject *key) {
+  PyObject *w;
+  unsigned long weight;
+  if (PyDict_CheckExact(weights)) {
+    if (!(w = PyDict_GetItemWithError(weights, key)))
+      return PyErr_Occurred() ? -1 : 0;
+    Py_INCREF(w);
+  } else if (!(w = PyObject_GetItem(weights, key))) {
+    if (!PyErr_ExceptionMatches(PyExc_KeyError)) return -1;
+    PyErr_Clear();
+    return 0;
+  }
+  weight = PyLong_AsUnsignedLong(w);
+  Py_DECREF(w);
+  if (weight == (unsigned long)-1 && PyErr_Occurred()) return -1;
+  wrapper->counter->visit_count = (unsigned int)Py_MIN(weight, UINT32_MAX);
+  return 0;
+}
+
+/* Insert one entry of from_items. Entries go straight into the dict until
+ * the cache is full, later ones take the normal path and evict. */
+static int LFUCache_load(LFUCache *self, PyObject *key, PyObject *value,
+                         PyObject *weights, unsigned int now) {
+  LFUWrapper *wrapper;
+  int rv;
+  if (PyDict_Size(self->dict) < self->capacity) {
+    if (!(wrapper = LFUWrapper_create(value, now))) return -1;
+    wrapper->generation = self->generation;
+    rv = PyDict_SetItem(self->dict, key, (PyObject *)wrapper);
+    Py_DECREF(wrapper);
+    if (!rv && (rv = LFUCache_gdsf_add(self, key, wrapper)))
+      LFUCache_remove(self, key, wrapper);
+  } else {
+    rv = PyLFUCache_SetItem(self, key, value);
+  }
+  if (!rv && weights != Py_None && (wrapper = PyLFUCache_GetItem(self, key)))
+    rv = LFUCache_seed_weight(wrapper, weights, key);
+  return rv;
+}
+
+/* Build a cache from a mapping or (key, value) pairs, with its dict sized
+ * once up front. */
+static PyObject *LFUCache_from_items(PyTypeObject *type, PyObject *args,
+                                     PyObject *kw) {
+  PyObject *items, *capacity, *weights = Py_None;
+  PyObject *cache, *it = NULL, *pair, *seq, *key, *value;
+  LFUCache *self;
+  unsigned int now = ctools_time_in_minutes();
+  Py_ssize_t hint, pos = 0;
+  int rv;
+
+  static char *kwlist[] = {"items", "capacity", "initial_weights", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O", kwlist, &items,
+                                   &capacity, &weights))
+    return NULL;
+  if (!(cache = PyObject_CallFunctionObjArgs((PyObject *)type, capacity,
+                                             NULL)))
+    return NULL;
+  self = (LFUCache *)cache;
+  if (PyDict_Check(items)) {
+    if (LFUCache_reserve_n(self, Py_MIN(PyDict_Size(items), self->capacity)))
+      goto fail;
+    while (PyDict_Next(items, &pos, &key, &value))
+      if (LFUCache_load(self, key, value, weights, now)) goto fail;
+    return cache;
+  }
+  if (PyObject_HasAttrString(items, "keys")) {
+    it = PyMapping_Items(items);
+  } else {
+    Py_INCREF(items);
+    it = items;
+  }
+  if (!it || (hint = PyObject_LengthHint(it, 0)) < 0 ||
+      LFUCache_reserve_n(self, Py_MIN(hint, self->capacity)))
+    goto fail;
+  Py_SETREF(it, PyObject_GetIter(it));
+  if (!it) goto fail;
+
+  while ((pair = PyIter_Next(it))) {
+    seq = PySequence_Fast(pair, "from_items expects (key, value) pairs");
+    Py_DECREF(pair);
+    if (!seq) goto fail;
+    if (PySequence_Fast_GET_SIZE(seq) != 2) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError,
+                      "from_items expects (key, value) pairs");
+      goto fail;
+    }
+    rv = LFUCache_load(self, PySequence_Fast_GET_ITEM(seq, 0),
+                       PySequence_Fast_GET_ITEM(seq, 1), weights, now);
+    Py_DECREF(seq);
+    if (rv) goto fail;
+  }
+  if (PyErr_Occurred()) goto fail;
+  Py_DECREF(it);
+  return cache;
+
+fail:
+  Py_XDECREF(it);
+  Py_DECREF(cache);
+  return NULL;
+}
+
+static PyObject *LFUCache_update(LFUCache *self, PyObject *args,
+                                 PyObject *kwargs) {
+  PyObject *key, *value;
+  PyObject *arg = NULL;
+  Py_ssize_t pos = 0;
+
+  if ((PyArg_ParseTuple(args, "|O", &arg))) {
+    if (arg && PyDict_Check(arg)) {
+      while (PyDict_Next(arg, &pos, &key, &value))
+        if (PyLFUCache_SetItem(self, key, value)) return NULL;
+    }
+  }
+
+  if (kwargs != NULL && PyArg_ValidateKeywordArguments(kwargs)) {
+    while (PyDict_Next(kwargs, &pos, &key, &value))
+      if (PyLFUCache_SetItem(self, key, value)) return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *LFUCache_set_capacity(LFUCache *self, PyObject *capacity) {
+  long long cap = PyLong_AsLongLong(capacity);
+  if (cap <= 0) {
+    PyObject *err = PyErr_Occurred();
+    if (err == NULL) {
+      PyErr_SetString(PyExc_ValueError,
+                      "Capacity should be a positive integer");
+    }
+    return NULL;
+  }
+  if (cap < self->capacity && LFUCache_USED(self) > cap) {
+    if (LFUCache_evict_n(self, LFUCache_USED(self) - cap)) return NULL;
+  }
+  self->capacity = cap;
+  Py_RETURN_NONE;
+}
+
+/* A read-only view of the entries: the GDSF heap, namespaces and tags
+ * borrow the dict's keys, so it is never written behind the cache. */
+static PyObject *LFUCache__store(LFUCache *self) {
+  return PyDictProxy_New(self->dict);
+}
+
+static PyObject *LFUCache_clear(LFUCache *self) {
+  PyLFUCache_Clear(self);
+  Py_RETURN_NONE;
+}
+
+/* Drop every entry in O(1): entries written before the bump read as
+ * misses and are reclaimed one at a time by lookups and evictions,
+ * instead of deallocating the whole dict at once like clear(). */
+static PyObject *LFUCache_invalidate_all(LFUCache *self) {
+  /* pinned entries are few and outside the reclaim scan, drop them now */
+  if (PyDict_Size(self->pinned)) {
+    PyObject *keys = PyDict_Keys(self->pinned);
+    if (!keys) return NULL;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++) {
+      PyObject *key = PyList_GET_ITEM(keys, i);
+      LFUWrapper *wrapper = (LFUWrapper *)PyDict_GetItem(self->pinned, key);
+      if (wrapper && LFUCache_remove(self, key, wrapper)) {
+        Py_DECREF(keys);
+        return NULL;
+      }
+    }
+    Py_DECREF(keys);
+  }
+  PyObject *name, *ns;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(self->namespaces, &pos, &name, &ns))
+    ((LFUNamespace *)ns)->stale = ((LFUNamespace *)ns)->count;
+  self->generation++;
+  self->stale = PyDict_Size(self->dict);
+  self->reclaim_pos = 0;
+  if (self->spill) ctools_spill_reset(self->spill);
+  Py_RETURN_NONE;
+}
+
+static PyObject *LFUCache_set_method(LFUCache *self, PyObject *args,
+                                     PyObject *kw) {
+  PyObject *key, *value, *tags = NULL;
+  ctools_lfu_expiry expiry = {0, 0, 0, 0};
+  double ttl = 0, soft_ttl = 0, now, cost = 1, size = 0;
+  unsigned char priority = 0;
+
+  static char *kwlist[] = {"key",   "value",    "tags", "ttl", "soft_ttl",
+                           "delta", "priority", "cost", "size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|OdddBdd", kwlist, &key,
+                                   &value, &tags, &ttl, &soft_ttl,
+                                   &expiry.delta, &priority, &cost, &size))
+    return NULL;
+  if (ttl < 0 || soft_ttl < 0 || expiry.delta < 0 || cost < 0 ||
+      !(size >= 0)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "ttl, soft_ttl, delta, cost and size should not be "
+                    "negative");
+    return NULL;
+  }
+  now = ctools_time_in_seconds();
+  if (ttl > 0) expiry.hard = now + ttl;
+  if (soft_ttl > 0) expiry.soft = now + soft_ttl;
+  if (LFUCache_set(self, key, value, tags,
+                   ttl > 0 || soft_ttl > 0 ? &expiry : NULL, priority, cost,
+                   size, NULL))
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+/* Move the entry of key between the evictable and the pinned dict. */
+static PyObject *LFUCache_move(LFUCache *self, PyObject *key, int pin) {
+  LFUWrapper *wrapper = LFUCache_lookup(self, key);
+  PyObject *from = pin ? self->dict : self->pinned;
+  PyObject *to = pin ? self->pinned : self->dict;
+  if (!wrapper) {
+    if (!PyErr_Occurred()) PyErr_Format(PyExc_KeyError, "%S", key);
+    return NULL;
+  }
+  if (wrapper->pinned == pin) Py_RETURN_NONE;
+  /* a frozen counter slot belongs to dict entries only */
+  LFUWrapper_DETACH(wrapper);
+  if (PyDict_SetItem(to, key, (PyObject *)wrapper)) return NULL;
+  wrapper->pinned = (unsigned char)pin;
+  /* the namespace and the heap borrow the key of the dict the entry is in */
+  if (wrapper->ns) wrapper->ns->entries[wrapper->ns_pos].key = key;
+  if (pin)
+    LFUCache_GDSF_DEL(self, wrapper);
+  else if (LFUCache_gdsf_add(self, key, wrapper))
+    return NULL;
+  if (PyDict_DelItem(from, key)) return NULL;
+  /* an unpinned entry may not fit any more */
+  if (!pin && LFUCache_USED(self) > self->capacity)
+    return LFUCache_evict(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *LFUCache_pin(LFUCache *self, PyObject *key) {
+  return LFUCache_move(self, key, 1);
+}
+
+static PyObject *LFUCache_unpin(LFUCache *self, PyObject *key) {
+  return LFUCache_move(self, key, 0);
+}
+
+/* Drop every entry set with tag. The work is proportional to the number of
+ * tagged entries, the rest of the cache isn't touched. */
+static PyObject *LFUCache_invalidate_tag(LFUCache *self, PyObject *tag) {
+  PyObject *keys = PyDict_GetItem(self->tags, tag), *key;
+  LFUWrapper *wrapper;
+  Py_ssize_t n = 0;
+  if (!keys) {
+    if (PyErr_Occurred()) return NULL;
+    return PyLong_FromSsize_t(0);
+  }
+  /* removing an entry shrinks the set, walk a snapshot of it */
+  if (!(keys = PySequence_List(keys))) return NULL;
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++) {
+    key = PyList_GET_ITEM(keys, i);
+    if (!(wrapper = PyLFUCache_GetItem(self, key))) continue;
+    if (!LFUWrapper_IS_STALE(wrapper, self)) n++;
+    if (LFUCache_remove(self, key, wrapper)) {
+      Py_DECREF(keys);
+      return NULL;
+    }
+  }
+  Py_DECREF(keys);
+  return PyLong_FromSsize_t(n);
+}
+
+static PyObject *LFUCache_spill_hints(LFUCache *self) {
+  if (!self->spill) return Py_BuildValue("nnn", 0, 0, 0);
+  return Py_BuildValue("nnn", (Py_ssize_t)self->spill->count,
+                       (Py_ssize_t)self->spill->live_bytes,
+                       (Py_ssize_t)self->spill->size);
+}
+
+static PyObject *LFUCache_arena_hints(LFUCache *self) {
+  if (!self->arena) return Py_BuildValue("nnn", 0, 0, 0);
+  return Py_BuildValue("nnn", (Py_ssize_t)self->arena->limit,
+                       (Py_ssize_t)self->arena->allocated,
+                       (Py_ssize_t)ctools_arena_used(self->arena));
+}
+
+/* Fork friendly layout: move every visit counter into one compact array so
+ * reads after fork() dirty that array instead of the pages holding keys,
+ * values and wrappers. With gc_freeze the whole heap is moved to the
+ * permanent generation so collections in the children don't touch it. */
+static PyObject *LFUCache_freeze(LFUCache *self, PyObject *args,
+                                 PyObject *kw) {
+  PyObject *key, *wrapper;
+  Py_ssize_t pos = 0, i = 0;
+  int gc_freeze = 1;
+
+  static char *kwlist[] = {"gc_freeze", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|p", kwlist, &gc_freeze))
+    return NULL;
+
+  LFUCache_thaw(self);
+  Py_ssize_t size = PyDict_Size(self->dict);
+  if (size > 0) {
+    self->counters = PyMem_New(ctools_lfu_counter, size);
+    if (!self->counters) return PyErr_NoMemory();
+    while (PyDict_Next(self->dict, &pos, &key, &wrapper)) {
+      LFUWrapper *w = (LFUWrapper *)wrapper;
+      self->counters[i] = w->_counter;
+      w->counter = &self->counters[i++];
+    }
+  }
+
+  if (gc_freeze) {
+    PyObject *gc = PyImport_ImportModule("gc");
+    if (!gc) return NULL;
+    PyObject *rv = PyObject_CallMethod(gc, "freeze", NULL);
+    Py_DECREF(gc);
+    if (!rv) {
+      /* gc.freeze() is new in python 3.7 */
+      if (!PyErr_ExceptionMatches(PyExc_AttributeError)) return NULL;
+      PyErr_Clear();
+    }
+    Py_XDECREF(rv);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *LFUCache_unfreeze(LFUCache *self) {
+  LFUCache_thaw(self);
+  Py_RETURN_NONE;
+}
+
+/* LFUNamespace Type Define */
+
+#define LFUNamespace_KEY(ns, key) PyTuple_Pack(2, (PyObject *)(ns), key)
+
+static int LFUNamespace_tp_traverse(LFUNamespace *self, visitproc visit,
+                                    void *arg) {
+  Py_VISIT(self->cache);
+  Py_VISIT(self->name);
+  return 0;
+}
+
+static int LFUNamespace_tp_clear(LFUNamespace *self) {
+  Py_CLEAR(self->cache);
+  Py_CLEAR(self->name);
+  return 0;
+}
+
+static void LFUNamespace_tp_dealloc(LFUNamespace *self) {
+  PyObject_GC_UnTrack(self);
+  LFUNamespace_tp_clear(self);
+  PyMem_Free(self->entries);
+  PyObject_GC_Del(self);
+}
+
+static PyObject *LFUNamespace_repr(LFUNamespace *self) {
+  return PyUnicode_FromFormat("LFUNamespace(%R)", self->name);
+}
+
+static Py_ssize_t LFUNamespace_len(LFUNamespace *self) {
+  LFUCache_SWEEP(self->cache);
+  return LFUNamespace_SIZE(self);
+}
+
+/* Return a new reference to the value of key and count the lookup, or
+ * NULL, with an exception set only on an error. */
+static PyObject *LFUNamespace_lookup(LFUNamespace *self, PyObject *key) {
+  PyObject *k = LFUNamespace_KEY(self, key), *value = NULL;
+  LFUWrapper *wrapper;
+  if (!k) return NULL;
+  if ((wrapper = LFUCache_lookup(self->cache, k))) {
+    self->hits++;
+    self->cache->hits++;
+    if ((value = LFUWrapper_wrapped(wrapper)))
+      LFUCache_refresh_due(self->cache, k, wrapper);
+  } else if (!PyErr_Occurred()) {
+    self->misses++;
+    self->cache->misses++;
+  }
+  Py_DECREF(k);
+  return value;
+}
+
+static PyObject *LFUNamespace_mp_subscript(LFUNamespace *self,
+                                           PyObject *key) {
+  PyObject *value = LFUNamespace_lookup(self, key);
+  if (!value && !PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+  return value;
+}
+
+static int LFUNamespace_mp_ass_sub(LFUNamespace *self, PyObject *key,
+                                   PyObject *value) {
+  PyObject *k = LFUNamespace_KEY(self, key);
+  LFUWrapper *wrapper;
+  int rv;
+  if (!k) return -1;
+  if (value) {
+    rv = LFUCache_set(self->cache, k, value, NULL, NULL, 0, 1, 0, self);
+  } else if ((wrapper = LFUCache_live(self->cache, k))) {
+    rv = LFUCache_remove(self->cache, k, wrapper);
+  } else {
+    if (!PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+    rv = -1;
+  }
+  Py_DECREF(k);
+  return rv;
+}
+
+static int LFUNamespace_contains(LFUNamespace *self, PyObject *key) {
+  PyObject *k = LFUNamespace_KEY(self, key);
+  if (!k) return -1;
+  int rv = LFUCache_live(self->cache, k) ? 1 : PyErr_Occurred() ? -1 : 0;
+  Py_DECREF(k);
+  return rv;
+}
+
+static PyObject *LFUNamespace_get(LFUNamespace *self, PyObject *args,
+                                  PyObject *kw) {
+  PyObject *key, *value, *_default = Py_None;
+
+  static char *kwlist[] = {"key", "default", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &key, &_default))
+    return NULL;
+  if ((value = LFUNamespace_lookup(self, key)) || PyErr_Occurred())
+    return value;
+  Py_INCREF(_default);
+  return _default;
+}
+
+static PyObject *LFUNamespace_hints(LFUNamespace *self) {
+  return Py_BuildValue("nnnn", self->quota, LFUNamespace_SIZE(self),
+                       self->hits, self->misses);
+}
+
+static PyMethodDef LFUNamespace_methods[] = {
+    {"get", (PyCFunction)(void (*)(void))LFUNamespace_get,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"hints", (PyCFunction)(void (*)(void))LFUNamespace_hints, METH_NOARGS,
+     NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PySequenceMethods LFUNamespace_as_sequence = {
+    0,                                 /* sq_length */
+    0,                                 /* sq_concat */
+    0,                                 /* sq_repeat */
+    0,                                 /* sq_item */
+    0,                                 /* sq_slice */
+    0,                                 /* sq_ass_item */
+    0,                                 /* sq_ass_slice */
+    (objobjproc)LFUNamespace_contains, /* sq_contains */
+    0,                                 /* sq_inplace_concat */
+    0,                                 /* sq_inplace_repeat */
+};
+
+static PyMappingMethods LFUNamespace_as_mapping = {
+    (lenfunc)LFUNamespace_len,              /*mp_length*/
+    (binaryfunc)LFUNamespace_mp_subscript,  /*mp_subscript*/
+    (objobjargproc)LFUNamespace_mp_ass_sub, /*mp_ass_subscript*/
+};
+
+static PyTypeObject LFUNamespaceType = {
+    PyVarObject_HEAD_INIT(NULL, 0) "LFUNamespace", /* tp_name */
+    sizeof(LFUNamespace),                          /* tp_basicsize */
+    0,                                             /* tp_itemsize */
+    (destructor)LFUNamespace_tp_dealloc,           /* tp_dealloc */
+    0,                                             /* tp_print */
+    0,                                             /* tp_getattr */
+    0,                                             /* tp_setattr */
+    0,                                             /* tp_compare */
+    (reprfunc)LFUNamespace_repr,                   /* tp_repr */
+    0,                                             /* tp_as_number */
+    &LFUNamespace_as_sequence,                     /* tp_as_sequence */
+    &LFUNamespace_as_mapping,                      /* tp_as_mapping */
+    0,                                             /* tp_hash */
+    0,                                             /* tp_call */
+    0,                                             /* tp_str */
+    0,                                             /* tp_getattro */
+    0,                                             /* tp_setattro */
+    0,                                             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,       /* tp_flags */
+    "A namespace of a LFUCache",                   /* tp_doc */
+    (traverseproc)LFUNamespace_tp_traverse,        /* tp_traverse */
+    (inquiry)LFUNamespace_tp_clear,                /* tp_clear */
+    0,                                             /* tp_richcompare */
+    0,                                             /* tp_weaklistoffset */
+    0,                                             /* tp_iter */
+    0,                                             /* tp_iternext */
+    LFUNamespace_methods,                          /* tp_methods */
+};
+/* LFUNamespace Type Define */
+
+/* Return the namespace called name, created on first use. A quota, the
+ * number of entries it may keep once the cache is full, replaces the
+ * current one. */
+static PyObject *LFUCache_namespace(LFUCache *self, PyObject *args,
+                                    PyObject *kw) {
+  PyObject *name, *quota = Py_None;
+  LFUNamespace *ns;
+  Py_ssize_t q = 0;
+
+  static char *kwlist[] = {"name", "quota", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "O|O", kwlist, &name, &quota))
+    return NULL;
+  if (quota != Py_None) {
+    if ((q = PyLong_AsSsize_t(quota)) == -1 && PyErr_Occurred()) return NULL;
+    if (q < 0) {
+      PyErr_SetString(PyExc_ValueError, "quota should not be negative");
+      return NULL;
+    }
+  }
+  if ((ns = (LFUNamespace *)PyDict_GetItem(self->namespaces, name))) {
+    Py_INCREF(ns);
+  } else {
+    if (PyErr_Occurred()) return NULL;
+    if (!(ns = PyObject_GC_New(LFUNamespace, &LFUNamespaceType)))
+      return NULL;
+    Py_INCREF(self);
+    Py_INCREF(name);
+    ns->cache = self;
+    ns->name = name;
+    ns->quota = ns->hits = ns->misses = 0;
+    ns->entries = NULL;
+    ns->count = ns->alloc = ns->stale = 0;
+    PyObject_GC_Track(ns);
+    if (PyDict_SetItem(self->namespaces, name, (PyObject *)ns)) {
+      Py_DECREF(ns);
+      return NULL;
+    }
   }
-
-  return LFUWrapper_wrapped(result);
+  if (quota != Py_None) ns->quota = q;
+  return (PyObject *)ns;
 }
 
-static PyObject *LFUCache_setnx(LFUCache *self, PyObject *args, PyObject *kw) {
-  PyObject *key;
-  PyObject *_default = NULL, *callback = NULL;
-  LFUWrapper *result;
+/* Record a sample of the accesses from now on, replacing a running
+ * trace. */
+static PyObject *LFUCache_start_trace(LFUCache *self, PyObject *args,
+                                      PyObject *kw) {
+  double rate = 1.0;
+  Py_ssize_t size = 65536;
+  ctools_lfu_trace *trace;
 
-  static char *kwlist[] = {"key", "callback", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kw, "OO", kwlist, &key, &callback))
+  static char *kwlist[] = {"sample_rate", "buffer_size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|dn", kwlist, &rate, &size))
     return NULL;
-
-  if (callback == NULL || !PyCallable_Check(callback)) {
-    PyErr_SetString(PyExc_TypeError, "callback should be callable.");
+  if (!(rate > 0 && rate <= 1)) {
+    PyErr_SetString(PyExc_ValueError, "sample_rate should be in (0, 1]");
     return NULL;
   }
-
-  result = PyLFUCache_GetItem(self, key);
-  if (!result) {
-    _default = PyObject_CallFunction(callback, NULL);
-    Py_INCREF(_default);
-    if (PyLFUCache_SetItem(self, key, _default)) {
-      Py_DECREF(_default);
-      return NULL;
-    }
-    return _default;
+  if (size <= 0) {
+    PyErr_SetString(PyExc_ValueError, "buffer_size should be positive");
+    return NULL;
   }
+  trace = ctools_lfu_trace_new(
+      (size_t)size, rate,
+      (uint64_t)(size_t)self ^ (uint64_t)(ctools_time_in_seconds() * 1e9));
+  if (!trace)
+    return PyErr_NoMemory();
+  ctools_lfu_trace_free(self->trace);
+  self->trace = trace;
+  Py_RETURN_NONE;
+}
 
-  return LFUWrapper_wrapped(result);
+/* Return the buffered records, oldest first, as bytes of TRACE_RECORD
+ * structs, and empty the buffer. */
+static PyObject *LFUCache_drain_trace(LFUCache *self) {
+  PyObject *rv;
+  size_t n;
+  if (!self->trace) return PyBytes_FromStringAndSize(NULL, 0);
+  n = self->trace->count;
+  rv = PyBytes_FromStringAndSize(NULL, n * sizeof(ctools_lfu_trace_record));
+  if (!rv) return NULL;
+  ctools_lfu_trace_drain(self->trace,
+                         (ctools_lfu_trace_record *)PyBytes_AS_STRING(rv), n);
+  return rv;
 }
 
-static PyObject *LFUCache_update(LFUCache *self, PyObject *args,
-                                 PyObject *kwargs) {
-  PyObject *key, *value;
-  PyObject *arg = NULL;
-  Py_ssize_t pos = 0;
+static PyObject *LFUCache_stop_trace(LFUCache *self) {
+  PyObject *rv = LFUCache_drain_trace(self);
+  if (!rv) return NULL;
+  ctools_lfu_trace_free(self->trace);
+  self->trace = NULL;
+  return rv;
+}
 
-  if ((PyArg_ParseTuple(args, "|O", &arg))) {
-    if (arg && PyDict_Check(arg)) {
-      while (PyDict_Next(arg, &pos, &key, &value))
-        if (PyLFUCache_SetItem(self, key, value)) return NULL;
-    }
-  }
+/* (buffered, dropped) records, dropped ones were overwritten before they
+ * were drained. */
+static PyObject *LFUCache_trace_hints(LFUCache *self) {
+  if (!self->trace) return Py_BuildValue("nK", (Py_ssize_t)0, 0ULL);
+  return Py_BuildValue("nK", (Py_ssize_t)self->trace->count,
+                       (unsigned long long)self->trace->dropped);
+}
 
-  if (kwargs != NULL && PyArg_ValidateKeywordArguments(kwargs)) {
-    while (PyDict_Next(kwargs, &pos, &key, &value))
-      if (PyLFUCache_SetItem(self, key, value)) return NULL;
+/* (c, rejections): the current admission parameter, 0 without
+ * admission_size, and the writes kept out so far. */
+static PyObject *LFUCache_admission_hints(LFUCache *self) {
+  return Py_BuildValue("dn", self->admission.c, self->rejections);
+}
+
+/* LFUWeightScan Type Define */
+
+/* An incremental pass over the evictable entries keeping the k coldest, or
+ * hottest, in a bounded heap. Ranks are taken the way eviction takes them,
+ * priority class first, and inverted for hottest. */
+// clang-format off
+typedef struct {
+  PyObject_HEAD
+  LFUCache *cache;
+  ctools_lfu_rank *heap; /* items are new references to keys */
+  size_t count;
+  size_t k;
+  Py_ssize_t pos; /* dict position the next step resumes at */
+  unsigned int now;
+  int hottest;
+  int done;
+} LFUWeightScan;
+// clang-format on
+
+#define LFUWeightScan_STEP 1024
+
+static int LFUWeightScan_tp_traverse(LFUWeightScan *self, visitproc visit,
+                                     void *arg) {
+  Py_VISIT(self->cache);
+  for (size_t i = 0; i < self->count; i++)
+    Py_VISIT((PyObject *)self->heap[i].item);
+  return 0;
+}
+
+static int LFUWeightScan_tp_clear(LFUWeightScan *self) {
+  Py_CLEAR(self->cache);
+  while (self->count) {
+    PyObject *key = (PyObject *)self->heap[--self->count].item;
+    Py_DECREF(key);
   }
+  return 0;
+}
 
-  Py_RETURN_NONE;
+static void LFUWeightScan_tp_dealloc(LFUWeightScan *self) {
+  PyObject_GC_UnTrack(self);
+  LFUWeightScan_tp_clear(self);
+  PyMem_Free(self->heap);
+  PyObject_GC_Del(self);
 }
 
-static PyObject *LFUCache_set_capacity(LFUCache *self, PyObject *capacity) {
-  long long cap = PyLong_AsLongLong(capacity);
-  if (cap <= 0) {
-    PyObject *err = PyErr_Occurred();
-    if (err == NULL) {
-      PyErr_SetString(PyExc_ValueError,
-                      "Capacity should be a positive integer");
+/* Visit up to n more entries. Return 1 once the pass is over. */
+static int LFUWeightScan_advance(LFUWeightScan *self, Py_ssize_t n) {
+  LFUCache *cache = self->cache;
+  PyObject *key, *wrapper, *out;
+  uint64_t rank;
+
+  if (self->done) return 1;
+  while (n-- > 0) {
+    if (!PyDict_Next(cache->dict, &self->pos, &key, &wrapper)) {
+      self->done = 1;
+      return 1;
     }
+    if (LFUWrapper_IS_DEAD((LFUWrapper *)wrapper, cache)) continue;
+    rank = LFUWrapper_RANK((LFUWrapper *)wrapper, self->now);
+    if (self->hottest) rank = ~rank;
+    Py_INCREF(key);
+    out = ctools_lfu_heap_push(self->heap, &self->count, self->k, rank, key);
+    Py_XDECREF(out);
+  }
+  return 0;
+}
+
+static PyObject *LFUWeightScan_step(LFUWeightScan *self, PyObject *args) {
+  Py_ssize_t n = LFUWeightScan_STEP;
+  if (!PyArg_ParseTuple(args, "|n", &n)) return NULL;
+  return PyBool_FromLong(LFUWeightScan_advance(self, n));
+}
+
+/* Return [(key, weight), ...] coldest (hottest) first. Entries gone from the
+ * cache since they were seen are left out. If the cache changed between
+ * steps, keys met twice are listed once. */
+static PyObject *LFUWeightScan_result(LFUWeightScan *self) {
+  PyObject *rv, *seen, *key, *item;
+  ctools_lfu_rank *ranks;
+  unsigned int weight;
+  int fail = 0;
+
+  if (!(ranks = PyMem_New(ctools_lfu_rank, self->count ? self->count : 1)))
+    return PyErr_NoMemory();
+  memcpy(ranks, self->heap, self->count * sizeof(ctools_lfu_rank));
+  ctools_lfu_rank_sort(ranks, self->count);
+  if (!(rv = PyList_New(0)) || !(seen = PySet_New(NULL))) {
+    Py_XDECREF(rv);
+    PyMem_Free(ranks);
     return NULL;
   }
-  if (cap < self->capacity && PyLFUCache_Size(self) > cap) {
-    int r = PyLFUCache_Size(self) - cap;
-    for (int i = 0; i < r; ++i) {
-      if (LFUCache_evict(self) == NULL) return NULL;
+  for (size_t i = 0; i < self->count && !fail; i++) {
+    key = (PyObject *)ranks[i].item;
+    if (!PyDict_GetItem(self->cache->dict, key)) continue;
+    if ((fail = PySet_Contains(seen, key))) {
+      fail = fail < 0;
+      continue;
     }
+    weight = (unsigned int)(self->hottest ? ~ranks[i].rank : ranks[i].rank);
+    if ((fail = PySet_Add(seen, key))) break;
+    if (!(item = Py_BuildValue("(OI)", key, weight))) {
+      fail = 1;
+      break;
+    }
+    fail = PyList_Append(rv, item);
+    Py_DECREF(item);
   }
-  self->capacity = cap;
-  Py_RETURN_NONE;
+  PyMem_Free(ranks);
+  Py_DECREF(seen);
+  if (fail) Py_CLEAR(rv);
+  return rv;
 }
 
-static PyObject *LFUCache__store(LFUCache *self) {
-  PyObject *dict = self->dict;
-  Py_INCREF(dict);
-  return dict;
+static PyMethodDef LFUWeightScan_methods[] = {
+    {"step", (PyCFunction)LFUWeightScan_step, METH_VARARGS, NULL},
+    {"result", (PyCFunction)(void (*)(void))LFUWeightScan_result, METH_NOARGS,
+     NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyTypeObject LFUWeightScanType = {
+    PyVarObject_HEAD_INIT(NULL, 0) "LFUWeightScan", /* tp_name */
+    sizeof(LFUWeightScan),                          /* tp_basicsize */
+    0,                                              /* tp_itemsize */
+    (destructor)LFUWeightScan_tp_dealloc,           /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_compare */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,        /* tp_flags */
+    "A coldest/hottest scan of a LFUCache",         /* tp_doc */
+    (traverseproc)LFUWeightScan_tp_traverse,        /* tp_traverse */
+    (inquiry)LFUWeightScan_tp_clear,                /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    LFUWeightScan_methods,                          /* tp_methods */
+};
+/* LFUWeightScan Type Define */
+
+static PyObject *LFUWeightScan_new(LFUCache *cache, Py_ssize_t k,
+                                   int hottest) {
+  LFUWeightScan *self;
+  if (k < 0) {
+    PyErr_SetString(PyExc_ValueError, "k should not be negative");
+    return NULL;
+  }
+  if (!(self = PyObject_GC_New(LFUWeightScan, &LFUWeightScanType)))
+    return NULL;
+  Py_INCREF(cache);
+  self->cache = cache;
+  self->count = 0;
+  self->pos = 0;
+  self->now = ctools_time_in_minutes();
+  self->hottest = hottest;
+  self->done = 0;
+  /* the heap can't hold more than the cache does */
+  self->k = (size_t)Py_MIN(k, PyDict_Size(cache->dict));
+  if (!(self->heap = PyMem_New(ctools_lfu_rank, self->k ? self->k : 1))) {
+    Py_DECREF(cache);
+    PyObject_GC_Del(self);
+    return PyErr_NoMemory();
+  }
+  PyObject_GC_Track(self);
+  return (PyObject *)self;
 }
 
-static PyObject *LFUCache_clear(LFUCache *self) {
-  PyLFUCache_Clear(self);
-  Py_RETURN_NONE;
+static PyObject *LFUCache_weight_scan(LFUCache *self, PyObject *args,
+                                      PyObject *kw) {
+  Py_ssize_t k;
+  int hottest = 0;
+
+  static char *kwlist[] = {"k", "hottest", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "n|p", kwlist, &k, &hottest))
+    return NULL;
+  LFUCache_SWEEP(self);
+  return LFUWeightScan_new(self, k, hottest);
+}
+
+/* A whole scan in one go. */
+static PyObject *LFUCache_rank_k(LFUCache *self, PyObject *k, int hottest) {
+  PyObject *scan, *rv;
+  Py_ssize_t n = PyLong_AsSsize_t(k);
+  if (n == -1 && PyErr_Occurred()) return NULL;
+  LFUCache_SWEEP(self);
+  if (!(scan = LFUWeightScan_new(self, n, hottest))) return NULL;
+  LFUWeightScan_advance((LFUWeightScan *)scan, PY_SSIZE_T_MAX);
+  rv = LFUWeightScan_result((LFUWeightScan *)scan);
+  Py_DECREF(scan);
+  return rv;
+}
+
+static PyObject *LFUCache_coldest(LFUCache *self, PyObject *k) {
+  return LFUCache_rank_k(self, k, 0);
+}
+
+static PyObject *LFUCache_hottest(LFUCache *self, PyObject *k) {
+  return LFUCache_rank_k(self, k, 1);
 }
 
 /* tp_methods */
@@ -569,7 +3038,20 @@ static PyMethodDef LFUCache_methods[] = {
     {"set_capacity", (PyCFunction)LFUCache_set_capacity, METH_O, NULL},
     {"hints", (PyCFunction)(void (*)(void))LFUCache_hints, METH_NOARGS, NULL},
     {"lfu", (PyCFunction)(void (*)(void))LFUCache_lfu, METH_NOARGS, NULL},
+    {"coldest", (PyCFunction)LFUCache_coldest, METH_O, NULL},
+    {"hottest", (PyCFunction)LFUCache_hottest, METH_O, NULL},
+    {"weight_scan", (PyCFunction)(void (*)(void))LFUCache_weight_scan,
+     METH_VARARGS | METH_KEYWORDS, NULL},
     {"get", (PyCFunction)LFUCache_get, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"peek", (PyCFunction)(void (*)(void))LFUCache_peek,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"frequency", (PyCFunction)LFUCache_frequency, METH_O, NULL},
+    {"weight_histogram", (PyCFunction)(void (*)(void))LFUCache_weight_histogram,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"fetch", (PyCFunction)(void (*)(void))LFUCache_fetch,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"get_many_or_load", (PyCFunction)(void (*)(void))LFUCache_get_many_or_load,
+     METH_VARARGS | METH_KEYWORDS, NULL},
     {"setdefault", (PyCFunction)(void (*)(void))LFUCache_setdefault,
      METH_VARARGS | METH_KEYWORDS, NULL},
     {"pop", (PyCFunction)(void (*)(void))LFUCache_pop,
@@ -579,10 +3061,40 @@ static PyMethodDef LFUCache_methods[] = {
     {"items", (PyCFunction)(void (*)(void))LFUCache_items, METH_NOARGS, NULL},
     {"update", (PyCFunction)(void (*)(void))LFUCache_update,
      METH_VARARGS | METH_KEYWORDS, NULL},
+    {"reserve", (PyCFunction)LFUCache_reserve, METH_O, NULL},
+    {"from_items", (PyCFunction)(void (*)(void))LFUCache_from_items,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS, NULL},
     {"clear", (PyCFunction)(void (*)(void))LFUCache_clear, METH_NOARGS, NULL},
+    {"invalidate_all", (PyCFunction)(void (*)(void))LFUCache_invalidate_all,
+     METH_NOARGS, NULL},
+    {"set", (PyCFunction)(void (*)(void))LFUCache_set_method,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"invalidate_tag", (PyCFunction)LFUCache_invalidate_tag, METH_O, NULL},
+    {"pin", (PyCFunction)LFUCache_pin, METH_O, NULL},
+    {"namespace", (PyCFunction)(void (*)(void))LFUCache_namespace,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"unpin", (PyCFunction)LFUCache_unpin, METH_O, NULL},
     {"setnx", (PyCFunction)(void (*)(void))LFUCache_setnx,
      METH_VARARGS | METH_KEYWORDS, NULL},
     {"_store", (PyCFunction)(void (*)(void))LFUCache__store, METH_NOARGS, NULL},
+    {"freeze", (PyCFunction)(void (*)(void))LFUCache_freeze,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"unfreeze", (PyCFunction)(void (*)(void))LFUCache_unfreeze, METH_NOARGS,
+     NULL},
+    {"arena_hints", (PyCFunction)(void (*)(void))LFUCache_arena_hints,
+     METH_NOARGS, NULL},
+    {"spill_hints", (PyCFunction)(void (*)(void))LFUCache_spill_hints,
+     METH_NOARGS, NULL},
+    {"start_trace", (PyCFunction)(void (*)(void))LFUCache_start_trace,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"drain_trace", (PyCFunction)(void (*)(void))LFUCache_drain_trace,
+     METH_NOARGS, NULL},
+    {"stop_trace", (PyCFunction)(void (*)(void))LFUCache_stop_trace,
+     METH_NOARGS, NULL},
+    {"trace_hints", (PyCFunction)(void (*)(void))LFUCache_trace_hints,
+     METH_NOARGS, NULL},
+    {"admission_hints", (PyCFunction)(void (*)(void))LFUCache_admission_hints,
+     METH_NOARGS, NULL},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
@@ -637,16 +3149,448 @@ static PyTypeObject LFUCacheType = {
     (newfunc)LFUCache_new,                     /* tp_new */
 };
 
+/* Measure the bytes of every entry of a cache joining a group. */
+static int LFUCache_measure(LFUCache *self) {
+  PyObject *dicts[2] = {self->dict, self->pinned}, *key, *wrapper, *value;
+  double bytes = 0;
+  Py_ssize_t pos;
+  for (int d = 0; d < 2; d++) {
+    pos = 0;
+    while (PyDict_Next(dicts[d], &pos, &key, &wrapper)) {
+      LFUWrapper *w = (LFUWrapper *)wrapper;
+      if (!(value = LFUWrapper_VALUE(w))) return -1;
+      w->bytes = LFUCache_value_size(value);
+      Py_DECREF(value);
+      if (w->bytes < 0) {
+        w->bytes = 0;
+        return -1;
+      }
+      bytes += w->bytes;
+    }
+  }
+  self->bytes = bytes;
+  return 0;
+}
+
+/* LFUCacheGroup Type Define */
+static PyObject *LFUCacheGroup_new(PyTypeObject *type, PyObject *args,
+                                   PyObject *kw) {
+  LFUCacheGroup *self;
+  Py_ssize_t max_bytes;
+  static char *kwlist[] = {"max_bytes", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "n", kwlist, &max_bytes))
+    return NULL;
+  if (max_bytes <= 0) {
+    PyErr_SetString(PyExc_ValueError, "max_bytes should be positive");
+    return NULL;
+  }
+  if (!(self = PyObject_GC_New(LFUCacheGroup, type))) return NULL;
+  self->max_bytes = (double)max_bytes;
+  self->bytes = 0;
+  ctools_rng_seed(&self->rng, (uint64_t)(size_t)self ^
+                                  (uint64_t)(ctools_time_in_seconds() * 1e9));
+  if (!(self->members = PyList_New(0))) {
+    PyObject_GC_Del(self);
+    return NULL;
+  }
+  PyObject_GC_Track(self);
+  return (PyObject *)self;
+}
+
+static int LFUCacheGroup_tp_traverse(LFUCacheGroup *self, visitproc visit,
+                                     void *arg) {
+  Py_VISIT(self->members);
+  return 0;
+}
+
+static int LFUCacheGroup_tp_clear(LFUCacheGroup *self) {
+  Py_CLEAR(self->members);
+  return 0;
+}
+
+static void LFUCacheGroup_tp_dealloc(LFUCacheGroup *self) {
+  PyObject_GC_UnTrack(self);
+  LFUCacheGroup_tp_clear(self);
+  PyObject_GC_Del(self);
+}
+
+static Py_ssize_t LFUCacheGroup_len(LFUCacheGroup *self) {
+  return self->members ? PyList_GET_SIZE(self->members) : 0;
+}
+
+/* Add cache to the group. Its entries are measured in bytes and count
+ * against the budget from now on, the group evicts right away if they
+ * don't fit. */
+static PyObject *LFUCacheGroup_join(LFUCacheGroup *self, PyObject *cache) {
+  LFUCache *c = (LFUCache *)cache;
+  if (!PyObject_TypeCheck(cache, &LFUCacheType)) {
+    PyErr_SetString(PyExc_TypeError, "only a LFUCache can join a group");
+    return NULL;
+  }
+  if (c->group == self) Py_RETURN_NONE;
+  if (c->group) {
+    PyErr_SetString(PyExc_ValueError, "cache is in another group already");
+    return NULL;
+  }
+  if (!self->members) {
+    PyErr_SetString(PyExc_ValueError, "group is cleared");
+    return NULL;
+  }
+  if (LFUCache_measure(c) || PyList_Append(self->members, cache)) return NULL;
+  Py_INCREF(self);
+  c->group = self;
+  self->bytes += c->bytes;
+  if (LFUCacheGroup_make_room(self, 0)) return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *LFUCacheGroup_leave(LFUCacheGroup *self, PyObject *cache) {
+  LFUCache *c = (LFUCache *)cache;
+  Py_ssize_t n = LFUCacheGroup_len(self);
+  for (Py_ssize_t i = 0; i < n; i++) {
+    if (PyList_GET_ITEM(self->members, i) != cache) continue;
+    self->bytes -= c->bytes;
+    c->group = NULL;
+    Py_DECREF(self);
+    if (PyList_SetSlice(self->members, i, i + 1, NULL)) return NULL;
+    Py_RETURN_NONE;
+  }
+  PyErr_SetString(PyExc_ValueError, "cache is not in the group");
+  return NULL;
+}
+
+static PyObject *LFUCacheGroup_set_max_bytes(LFUCacheGroup *self,
+                                             PyObject *max_bytes) {
+  Py_ssize_t n = PyLong_AsSsize_t(max_bytes);
+  if (n == -1 && PyErr_Occurred()) return NULL;
+  if (n <= 0) {
+    PyErr_SetString(PyExc_ValueError, "max_bytes should be positive");
+    return NULL;
+  }
+  self->max_bytes = (double)n;
+  if (LFUCacheGroup_make_room(self, 0)) return NULL;
+  Py_RETURN_NONE;
+}
+
+/* [(cache, bytes, entries), ...] in join order. */
+static PyObject *LFUCacheGroup_occupancy(LFUCacheGroup *self) {
+  Py_ssize_t n = LFUCacheGroup_len(self);
+  PyObject *rv = PyList_New(n), *item;
+  if (!rv) return NULL;
+  for (Py_ssize_t i = 0; i < n; i++) {
+    LFUCache *member = (LFUCache *)PyList_GET_ITEM(self->members, i);
+    if (!(item = Py_BuildValue("(Onn)", member, (Py_ssize_t)member->bytes,
+                               PyLFUCache_Size(member)))) {
+      Py_DECREF(rv);
+      return NULL;
+    }
+    PyList_SET_ITEM(rv, i, item);
+  }
+  return rv;
+}
+
+static PyObject *LFUCacheGroup_hints(LFUCacheGroup *self) {
+  return Py_BuildValue("nn", (Py_ssize_t)self->bytes,
+                       (Py_ssize_t)self->max_bytes);
+}
+
+static PyMethodDef LFUCacheGroup_methods[] = {
+    {"join", (PyCFunction)LFUCacheGroup_join, METH_O, NULL},
+    {"leave", (PyCFunction)LFUCacheGroup_leave, METH_O, NULL},
+    {"set_max_bytes", (PyCFunction)LFUCacheGroup_set_max_bytes, METH_O, NULL},
+    {"occupancy", (PyCFunction)(void (*)(void))LFUCacheGroup_occupancy,
+     METH_NOARGS, NULL},
+    {"hints", (PyCFunction)(void (*)(void))LFUCacheGroup_hints, METH_NOARGS,
+     NULL},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PySequenceMethods LFUCacheGroup_as_sequence = {
+    (lenfunc)LFUCacheGroup_len, /* sq_length */
+};
+
+static PyTypeObject LFUCacheGroupType = {
+    PyVarObject_HEAD_INIT(NULL, 0) "CacheGroup", /* tp_name */
+    sizeof(LFUCacheGroup),                       /* tp_basicsize */
+    0,                                           /* tp_itemsize */
+    (destructor)LFUCacheGroup_tp_dealloc,        /* tp_dealloc */
+    0,                                           /* tp_print */
+    0,                                           /* tp_getattr */
+    0,                                           /* tp_setattr */
+    0,                                           /* tp_compare */
+    0,                                           /* tp_repr */
+    0,                                           /* tp_as_number */
+    &LFUCacheGroup_as_sequence,                  /* tp_as_sequence */
+    0,                                           /* tp_as_mapping */
+    0,                                           /* tp_hash */
+    0,                                           /* tp_call */
+    0,                                           /* tp_str */
+    0,                                           /* tp_getattro */
+    0,                                           /* tp_setattro */
+    0,                                           /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,     /* tp_flags */
+    "LFUCaches sharing one byte budget",         /* tp_doc */
+    (traverseproc)LFUCacheGroup_tp_traverse,     /* tp_traverse */
+    (inquiry)LFUCacheGroup_tp_clear,             /* tp_clear */
+    0,                                           /* tp_richcompare */
+    0,                                           /* tp_weaklistoffset */
+    0,                                           /* tp_iter */
+    0,                                           /* tp_iternext */
+    LFUCacheGroup_methods,                       /* tp_methods */
+    0,                                           /* tp_members */
+    0,                                           /* tp_getset */
+    0,                                           /* tp_base */
+    0,                                           /* tp_dict */
+    0,                                           /* tp_descr_get */
+    0,                                           /* tp_descr_set */
+    0,                                           /* tp_dictoffset */
+    0,                                           /* tp_init */
+    0,                                           /* tp_alloc */
+    (newfunc)LFUCacheGroup_new,                  /* tp_new */
+};
+/* LFUCacheGroup Type Define */
+
+/* OpenMetrics exposition */
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  int fail;
+} LFUText;
+
+static void LFUText_printf(LFUText *t, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  if (t->fail) return;
+  va_start(ap, fmt);
+  n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    t->fail = 1;
+    return;
+  }
+  if ((size_t)n >= t->cap - t->len) {
+    size_t cap = t->cap;
+    char *buf;
+    while (cap - t->len <= (size_t)n) cap *= 2;
+    if (!(buf = PyMem_Realloc(t->buf, cap))) {
+      t->fail = 1;
+      return;
+    }
+    t->buf = buf;
+    t->cap = cap;
+    va_start(ap, fmt);
+    vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+    va_end(ap);
+  }
+  t->len += (size_t)n;
+}
+
+#define LFU_METRIC_HITS 0
+#define LFU_METRIC_MISSES 1
+#define LFU_METRIC_EVICTIONS 2
+#define LFU_METRIC_REJECTIONS 3
+#define LFU_METRIC_SIZE 4
+#define LFU_METRIC_CAPACITY 5
+
+static const struct {
+  const char *name;
+  const char *type;
+  const char *help;
+} LFU_METRICS[] = {
+    {"ctools_lfu_hits", "counter", "Lookups served from the cache."},
+    {"ctools_lfu_misses", "counter", "Lookups that missed the cache."},
+    {"ctools_lfu_evictions", "counter", "Entries evicted to make room."},
+    {"ctools_lfu_rejections", "counter", "Writes kept out by admission."},
+    {"ctools_lfu_size", "gauge", "Live entries in the cache."},
+    {"ctools_lfu_capacity", "gauge", "Maximum number of entries."},
+};
+
+static Py_ssize_t LFUCache_metric(LFUCache *self, int metric) {
+  switch (metric) {
+    case LFU_METRIC_HITS:
+      return self->hits;
+    case LFU_METRIC_MISSES:
+      return self->misses;
+    case LFU_METRIC_EVICTIONS:
+      return self->evictions;
+    case LFU_METRIC_REJECTIONS:
+      return self->rejections;
+    case LFU_METRIC_SIZE:
+      return PyLFUCache_Size(self);
+    default:
+      return self->capacity;
+  }
+}
+
+/* Return the label value of name escaped for the exposition format, a new
+ * PyMem string. */
+static char *LFUText_label(PyObject *name) {
+  Py_ssize_t size;
+  const char *s;
+  char *label, *p;
+  if (!PyUnicode_Check(name)) {
+    PyErr_Format(PyExc_TypeError, "cache names should be str, not %.200s",
+                 Py_TYPE(name)->tp_name);
+    return NULL;
+  }
+  if (!(s = PyUnicode_AsUTF8AndSize(name, &size))) return NULL;
+  if (!(p = label = PyMem_Malloc(size * 2 + 1))) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (Py_ssize_t i = 0; i < size; i++) {
+    if (s[i] == '\\' || s[i] == '"' || s[i] == '\n') {
+      *p++ = '\\';
+      *p++ = s[i] == '\n' ? 'n' : s[i];
+    } else {
+      *p++ = s[i];
+    }
+  }
+  *p = '\0';
+  return label;
+}
+
+static void LFUText_histogram(LFUText *t, const char *name,
+                              const ctools_lfu_latency *h,
+                              const char *label) {
+  uint64_t cumulative = 0;
+  char le[32];
+  for (int i = 0; i < CTOOLS_LFU_LATENCY_BUCKETS; i++) {
+    cumulative += h->counts[i];
+    /* le is a float, "1.0" rather than "1" */
+    snprintf(le, sizeof(le), "%g", ctools_lfu_latency_bounds[i]);
+    if (!strpbrk(le, ".e")) strcat(le, ".0");
+    LFUText_printf(t, "%s_bucket{cache=\"%s\",le=\"%s\"} %llu\n", name,
+                   label, le, (unsigned long long)cumulative);
+  }
+  LFUText_printf(t, "%s_bucket{cache=\"%s\",le=\"+Inf\"} %llu\n", name, label,
+                 (unsigned long long)h->count);
+  LFUText_printf(t, "%s_sum{cache=\"%s\"} %.9g\n", name, label, h->sum);
+  LFUText_printf(t, "%s_count{cache=\"%s\"} %llu\n", name, label,
+                 (unsigned long long)h->count);
+}
+
+PyDoc_STRVAR(metrics_text__doc__,
+             "metrics_text(caches_by_name) -> str\n\n\
+    Render hits, misses, evictions, size, capacity and loader latency of\n\
+    every cache in OpenMetrics text format, labeled cache=\"name\".");
+
+static PyObject *LFU_metrics_text(PyObject *m, PyObject *caches_by_name) {
+  PyObject *items = NULL, *rv = NULL, *name, *cache;
+  LFUCache **caches = NULL;
+  char **labels = NULL;
+  Py_ssize_t n = 0, i;
+  LFUText t = {NULL, 0, 4096, 0};
+
+  if (!(items = PyMapping_Items(caches_by_name))) return NULL;
+  n = PyList_GET_SIZE(items);
+  caches = PyMem_New(LFUCache *, n ? n : 1);
+  labels = PyMem_New(char *, n ? n : 1);
+  t.buf = PyMem_Malloc(t.cap);
+  if (!caches || !labels || !t.buf) {
+    PyErr_NoMemory();
+    n = 0;
+    goto done;
+  }
+  for (i = 0; i < n; i++) labels[i] = NULL;
+  for (i = 0; i < n; i++) {
+    PyObject *item = PyList_GET_ITEM(items, i);
+    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+      PyErr_SetString(PyExc_TypeError, "items() should return pairs");
+      goto done;
+    }
+    name = PyTuple_GET_ITEM(item, 0);
+    cache = PyTuple_GET_ITEM(item, 1);
+    if (!PyObject_TypeCheck(cache, &LFUCacheType)) {
+      PyErr_Format(PyExc_TypeError, "%R is not a LFUCache", name);
+      goto done;
+    }
+    if (!(labels[i] = LFUText_label(name))) goto done;
+    caches[i] = (LFUCache *)cache;
+  }
+
+  for (int metric = 0; metric <= LFU_METRIC_CAPACITY; metric++) {
+    const char *family = LFU_METRICS[metric].name;
+    int counter = LFU_METRICS[metric].type[0] == 'c';
+    LFUText_printf(&t, "# TYPE %s %s\n# HELP %s %s\n", family,
+                   LFU_METRICS[metric].type, family, LFU_METRICS[metric].help);
+    for (i = 0; i < n; i++) {
+      LFUText_printf(&t, "%s%s{cache=\"%s\"} %zd\n", family,
+                     counter ? "_total" : "", labels[i],
+                     LFUCache_metric(caches[i], metric));
+    }
+  }
+  LFUText_printf(&t,
+                 "# TYPE ctools_lfu_load_seconds histogram\n"
+                 "# HELP ctools_lfu_load_seconds Time spent in "
+                 "get_many_or_load loaders.\n");
+  for (i = 0; i < n; i++) {
+    LFUText_histogram(&t, "ctools_lfu_load_seconds",
+                      &caches[i]->load_latency, labels[i]);
+  }
+  LFUText_printf(&t, "# EOF\n");
+  if (t.fail)
+    PyErr_NoMemory();
+  else
+    rv = PyUnicode_DecodeUTF8(t.buf, t.len, NULL);
+
+done:
+  if (labels) {
+    for (i = 0; i < n; i++) PyMem_Free(labels[i]);
+  }
+  PyMem_Free(labels);
+  PyMem_Free(caches);
+  PyMem_Free(t.buf);
+  Py_DECREF(items);
+  return rv;
+}
+
+static PyMethodDef ctools_lfu_methods[] = {
+    {"metrics_text", (PyCFunction)LFU_metrics_text, METH_O,
+     metrics_text__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+/* C-API entries, see ctools_capi.h */
+
+static PyObject *LFUCache_CAPI_New(Py_ssize_t capacity) {
+  return PyObject_CallFunction((PyObject *)&LFUCacheType, "n", capacity);
+}
+
+static PyObject *LFUCache_CAPI_GetItem(PyObject *self, PyObject *key) {
+  LFUWrapper *wrapper = LFUCache_lookup((LFUCache *)self, key);
+  PyObject *value;
+  if (!wrapper) {
+    /* a failing __hash__ or __eq__ is no miss */
+    if (!PyErr_Occurred()) ((LFUCache *)self)->misses++;
+    return NULL;
+  }
+  if ((value = LFUWrapper_wrapped(wrapper))) ((LFUCache *)self)->hits++;
+  return value;
+}
+
+static CToolsLFU_CAPI ctools_lfu_capi = {
+    CTOOLS_CAPI_VERSION,
+    &LFUCacheType,
+    LFUCache_CAPI_New,
+    LFUCache_CAPI_GetItem,
+    (int (*)(PyObject *, PyObject *, PyObject *))PyLFUCache_SetItem,
+    (int (*)(PyObject *, PyObject *))PyLFUCache_DelItem,
+    (Py_ssize_t(*)(PyObject *))PyLFUCache_Size,
+};
+
 static struct PyModuleDef _ctools_lfu_module = {
     PyModuleDef_HEAD_INIT,
-    "_ctools_lfu", /* m_name */
-    NULL,          /* m_doc */
-    -1,            /* m_size */
-    NULL,          /* m_methods */
-    NULL,          /* m_reload */
-    NULL,          /* m_traverse */
-    NULL,          /* m_clear */
-    NULL,          /* m_free */
+    "_ctools_lfu",      /* m_name */
+    NULL,               /* m_doc */
+    -1,                 /* m_size */
+    ctools_lfu_methods, /* m_methods */
+    NULL,               /* m_reload */
+    NULL,               /* m_traverse */
+    NULL,               /* m_clear */
+    NULL,               /* m_free */
 };
 
 PyMODINIT_FUNC PyInit__ctools_lfu(void) {
@@ -654,14 +3598,49 @@ PyMODINIT_FUNC PyInit__ctools_lfu(void) {
 
   if (PyType_Ready(&LFUWrapperType) < 0) return NULL;
 
+  if (PyType_Ready(&LFUNamespaceType) < 0) return NULL;
+
+  if (PyType_Ready(&LFUWeightScanType) < 0) return NULL;
+
+  if (PyType_Ready(&LFUCacheGroupType) < 0) return NULL;
+
+  PyObject *weakref = PyImport_ImportModule("weakref");
+  if (!weakref) return NULL;
+  LFUWeakRef_base = (PyTypeObject *)PyObject_GetAttrString(weakref, "ref");
+  Py_DECREF(weakref);
+  if (!LFUWeakRef_base) return NULL;
+  if (!PyType_Check(LFUWeakRef_base)) {
+    PyErr_SetString(PyExc_TypeError, "weakref.ref is not a type");
+    return NULL;
+  }
+  LFUWeakRefType.tp_base = LFUWeakRef_base;
+  if (PyType_Ready(&LFUWeakRefType) < 0) return NULL;
+
   PyObject *m = PyModule_Create(&_ctools_lfu_module);
   if (m == NULL) return NULL;
 
   Py_INCREF(&LFUWrapperType);
   Py_INCREF(&LFUCacheType);
+  Py_INCREF(&LFUNamespaceType);
+  Py_INCREF(&LFUWeightScanType);
 
   PyModule_AddObject(m, "LFUCache", (PyObject *)&LFUCacheType);
   PyModule_AddObject(m, "LFUWrapper", (PyObject *)&LFUWrapperType);
+  PyModule_AddObject(m, "LFUNamespace", (PyObject *)&LFUNamespaceType);
+  PyModule_AddObject(m, "LFUWeightScan", (PyObject *)&LFUWeightScanType);
+  PyModule_AddObject(m, "CacheGroup", (PyObject *)&LFUCacheGroupType);
+  PyModule_AddStringConstant(m, "TRACE_RECORD", "=QQBB6x");
+  PyModule_AddIntConstant(m, "TRACE_GET", CTOOLS_LFU_TRACE_GET);
+  PyModule_AddIntConstant(m, "TRACE_SET", CTOOLS_LFU_TRACE_SET);
+  PyModule_AddIntConstant(m, "TRACE_DEL", CTOOLS_LFU_TRACE_DEL);
+
+  PyObject *capi =
+      PyCapsule_New(&ctools_lfu_capi, CTOOLS_LFU_CAPSULE_NAME, NULL);
+  if (capi == NULL || PyModule_AddObject(m, "_C_API", capi)) {
+    Py_XDECREF(capi);
+    Py_DECREF(m);
+    return NULL;
+  }
 
   return m;
 }
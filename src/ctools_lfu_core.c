@@ -0,0 +1,289 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "ctools_lfu_core.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+unsigned int ctools_time_in_minutes(void) {
+  return (unsigned int)(((uint64_t)time(NULL) / 60) & UINT32_MAX);
+}
+
+double ctools_time_in_seconds(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+  return (double)time(NULL);
+#endif
+}
+
+int ctools_lfu_expiry_check(ctools_lfu_expiry *e, double now,
+                            ctools_rng *rng) {
+  if (ctools_lfu_expired(e, now)) return CTOOLS_LFU_EXPIRED;
+  if (e->refreshing || e->soft <= 0) return CTOOLS_LFU_FRESH;
+  if (now < e->soft) {
+    /* XFetch: refresh early when now - delta * beta * ln(u) passes soft,
+     * so concurrent readers of a hot key spread their refreshes out. */
+    double u = ctools_rng_unit(rng);
+    if (e->delta <= 0 ||
+        now - e->delta * CTOOLS_LFU_XFETCH_BETA * log(u) < e->soft)
+      return CTOOLS_LFU_FRESH;
+  }
+  e->refreshing = 1;
+  return CTOOLS_LFU_REFRESH;
+}
+
+void *ctools_lfu_heap_push(ctools_lfu_rank *heap, size_t *n, size_t k,
+                           uint64_t rank, void *item) {
+  size_t i, child;
+  void *out;
+  if (*n < k) {
+    /* sift up */
+    for (i = (*n)++; i > 0 && heap[(i - 1) / 2].rank < rank; i = (i - 1) / 2)
+      heap[i] = heap[(i - 1) / 2];
+    heap[i].rank = rank;
+    heap[i].item = item;
+    return NULL;
+  }
+  if (k == 0 || rank >= heap[0].rank) return item;
+  /* replace the root and sift down */
+  out = heap[0].item;
+  for (i = 0; (child = 2 * i + 1) < k; i = child) {
+    if (child + 1 < k && heap[child + 1].rank > heap[child].rank) child++;
+    if (heap[child].rank <= rank) break;
+    heap[i] = heap[child];
+  }
+  heap[i].rank = rank;
+  heap[i].item = item;
+  return out;
+}
+
+static int ctools_lfu_rank_cmp(const void *a, const void *b) {
+  uint64_t x = ((const ctools_lfu_rank *)a)->rank;
+  uint64_t y = ((const ctools_lfu_rank *)b)->rank;
+  return x < y ? -1 : x > y;
+}
+
+void ctools_lfu_rank_sort(ctools_lfu_rank *ranks, size_t n) {
+  qsort(ranks, n, sizeof(ctools_lfu_rank), ctools_lfu_rank_cmp);
+}
+
+/* Prometheus' default buckets, plus 1ms for in-process loaders. */
+const double ctools_lfu_latency_bounds[CTOOLS_LFU_LATENCY_BUCKETS] = {
+    0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+void ctools_lfu_latency_add(ctools_lfu_latency *h, double seconds) {
+  int i = 0;
+  while (i < CTOOLS_LFU_LATENCY_BUCKETS &&
+         seconds > ctools_lfu_latency_bounds[i])
+    i++;
+  h->counts[i]++;
+  h->count++;
+  h->sum += seconds;
+}
+
+ctools_lfu_trace *ctools_lfu_trace_new(size_t size, double rate,
+                                       uint64_t seed) {
+  ctools_lfu_trace *t = malloc(sizeof(ctools_lfu_trace));
+  if (!t) return NULL;
+  if (!(t->records = malloc(size * sizeof(ctools_lfu_trace_record)))) {
+    free(t);
+    return NULL;
+  }
+  t->size = size;
+  t->head = t->count = 0;
+  t->dropped = 0;
+  t->threshold = (uint64_t)(rate * 4294967296.0);
+  ctools_rng_seed(&t->rng, seed);
+  return t;
+}
+
+void ctools_lfu_trace_free(ctools_lfu_trace *t) {
+  if (!t) return;
+  free(t->records);
+  free(t);
+}
+
+void ctools_lfu_trace_add(ctools_lfu_trace *t, uint64_t key_hash, int op,
+                          int hit) {
+  ctools_lfu_trace_record *r = &t->records[t->head];
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+  r->time_ns = (uint64_t)time(NULL) * 1000000000ULL;
+#endif
+  r->key_hash = key_hash;
+  r->op = (uint8_t)op;
+  r->hit = (uint8_t)hit;
+  memset(r->reserved, 0, sizeof(r->reserved));
+  t->head = (t->head + 1) % t->size;
+  if (t->count < t->size)
+    t->count++;
+  else
+    t->dropped++;
+}
+
+size_t ctools_lfu_trace_drain(ctools_lfu_trace *t,
+                              ctools_lfu_trace_record *out, size_t n) {
+  size_t tail = (t->head + t->size - t->count) % t->size, first;
+  if (n > t->count) n = t->count;
+  first = t->size - tail < n ? t->size - tail : n;
+  memcpy(out, t->records + tail, first * sizeof(ctools_lfu_trace_record));
+  memcpy(out + first, t->records,
+         (n - first) * sizeof(ctools_lfu_trace_record));
+  t->count -= n;
+  return n;
+}
+
+size_t ctools_lfu_histogram(const unsigned int *values, size_t n, size_t bins,
+                            unsigned int *low, uint64_t *width,
+                            uint64_t *counts) {
+  unsigned int min = UINT32_MAX, max = 0;
+  uint64_t span;
+  size_t i;
+  *low = 0;
+  *width = 1;
+  if (!n || !bins) return 0;
+  for (i = 0; i < n; i++) {
+    if (values[i] < min) min = values[i];
+    if (values[i] > max) max = values[i];
+  }
+  span = (uint64_t)max - min + 1;
+  *low = min;
+  *width = (span + bins - 1) / bins;
+  for (i = 0; i < n; i++) counts[(values[i] - min) / *width]++;
+  return (size_t)((span + *width - 1) / *width);
+}
+
+void ctools_admission_init(ctools_admission *a, double c, uint64_t window) {
+  a->c = c;
+  a->step = CTOOLS_ADMISSION_STEP;
+  a->ratio = 0;
+  a->window = window;
+  a->hits = a->requests = 0;
+}
+
+int ctools_admission_admit(const ctools_admission *a, double size,
+                           ctools_rng *rng) {
+  return ctools_rng_unit(rng) <= exp(-size / a->c);
+}
+
+void ctools_admission_tune(ctools_admission *a, uint64_t hits,
+                           uint64_t requests) {
+  double ratio;
+  if (requests < a->requests || hits < a->hits) {
+    a->hits = hits;
+    a->requests = requests;
+    return;
+  }
+  if (requests - a->requests < a->window) return;
+  ratio = (double)(hits - a->hits) / (double)(requests - a->requests);
+  if (ratio < a->ratio) a->step = 1 / a->step;
+  a->c *= a->step;
+  if (a->c < CTOOLS_ADMISSION_MIN_C || a->c > CTOOLS_ADMISSION_MAX_C) {
+    a->c = a->c < CTOOLS_ADMISSION_MIN_C ? CTOOLS_ADMISSION_MIN_C
+                                         : CTOOLS_ADMISSION_MAX_C;
+    a->step = 1 / a->step;
+  }
+  a->ratio = ratio;
+  a->hits = hits;
+  a->requests = requests;
+}
+
+#define GDSF_SET(g, i, node) \
+  do {                       \
+    (g)->heap[i] = (node);   \
+    (node)->pos = (i);       \
+  } while (0)
+
+static void gdsf_sift_up(ctools_gdsf *g, size_t i) {
+  ctools_gdsf_node *node = g->heap[i];
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (g->heap[parent]->priority <= node->priority) break;
+    GDSF_SET(g, i, g->heap[parent]);
+    i = parent;
+  }
+  GDSF_SET(g, i, node);
+}
+
+static void gdsf_sift_down(ctools_gdsf *g, size_t i) {
+  ctools_gdsf_node *node = g->heap[i];
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= g->count) break;
+    if (child + 1 < g->count &&
+        g->heap[child + 1]->priority < g->heap[child]->priority)
+      child++;
+    if (node->priority <= g->heap[child]->priority) break;
+    GDSF_SET(g, i, g->heap[child]);
+    i = child;
+  }
+  GDSF_SET(g, i, node);
+}
+
+ctools_gdsf *ctools_gdsf_new(void) {
+  return calloc(1, sizeof(ctools_gdsf));
+}
+
+int ctools_gdsf_push(ctools_gdsf *g, ctools_gdsf_node *node) {
+  if (g->count == g->alloc) {
+    size_t alloc = g->alloc ? g->alloc * 2 : 64;
+    ctools_gdsf_node **heap = realloc(g->heap, alloc * sizeof(*heap));
+    if (!heap) return -1;
+    g->heap = heap;
+    g->alloc = alloc;
+  }
+  g->heap[g->count] = node;
+  gdsf_sift_up(g, g->count++);
+  return 0;
+}
+
+void ctools_gdsf_remove(ctools_gdsf *g, ctools_gdsf_node *node) {
+  size_t i = node->pos;
+  ctools_gdsf_node *last = g->heap[--g->count];
+  node->pos = CTOOLS_GDSF_NONE;
+  if (i == g->count) return;
+  GDSF_SET(g, i, last);
+  ctools_gdsf_fix(g, last);
+}
+
+void ctools_gdsf_fix(ctools_gdsf *g, ctools_gdsf_node *node) {
+  size_t i = node->pos;
+  if (i > 0 && g->heap[(i - 1) / 2]->priority > node->priority)
+    gdsf_sift_up(g, i);
+  else
+    gdsf_sift_down(g, i);
+}
+
+void ctools_gdsf_reset(ctools_gdsf *g) {
+  for (size_t i = 0; i < g->count; i++) g->heap[i]->pos = CTOOLS_GDSF_NONE;
+  g->count = 0;
+  g->inflation = 0;
+}
+
+void ctools_gdsf_free(ctools_gdsf *g) {
+  if (!g) return;
+  free(g->heap);
+  free(g);
+}
@@ -0,0 +1,279 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_LFU_CORE_H
+#define _CTOOLS_LFU_CORE_H
+#include <stddef.h>
+#include "ctools_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* LFU counter scheme used by LFUCache: every hit bumps visit_count and the
+ * weight decays by one per idle minute. */
+
+#define CTOOLS_LFU_INIT_VAL 255U
+
+/* Caches smaller than CTOOLS_LFU_BUCKET_SIZE are scanned; bigger ones are
+ * split into CTOOLS_LFU_BUCKET buckets and one entry per bucket is sampled. */
+#define CTOOLS_LFU_BUCKET 8
+#define CTOOLS_LFU_BUCKET_SIZE 256
+
+typedef struct {
+  unsigned int last_visit;
+  unsigned int visit_count;
+} ctools_lfu_counter;
+
+unsigned int ctools_time_in_minutes(void);
+
+/* xorshift64* generator. Every cache owns one, so eviction sampling shares
+ * no state with rand() and a seeded cache evicts reproducibly. */
+typedef struct {
+  uint64_t state;
+} ctools_rng;
+
+static inline void ctools_rng_seed(ctools_rng *r, uint64_t seed) {
+  /* splitmix64 of the seed, any seed (0 too) gives a non-zero state */
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  seed ^= seed >> 31;
+  r->state = seed ? seed : 1;
+}
+
+static inline uint64_t ctools_rng_next(ctools_rng *r) {
+  r->state ^= r->state >> 12;
+  r->state ^= r->state << 25;
+  r->state ^= r->state >> 27;
+  return r->state * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, limit], by a multiply-shift instead of a rejection loop. */
+static inline uint32_t ctools_rng_limit(ctools_rng *r, uint32_t limit) {
+  return (uint32_t)(((ctools_rng_next(r) >> 32) * ((uint64_t)limit + 1)) >>
+                    32);
+}
+
+/* Uniform in (0, 1]. */
+static inline double ctools_rng_unit(ctools_rng *r) {
+  return ((ctools_rng_next(r) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+static inline void ctools_lfu_counter_init(ctools_lfu_counter *c,
+                                           unsigned int now) {
+  c->last_visit = now;
+  c->visit_count = CTOOLS_LFU_INIT_VAL;
+}
+
+static inline void ctools_lfu_counter_incr(ctools_lfu_counter *c,
+                                           unsigned int now) {
+  /* saturate, a seeded counter may start at the top */
+  if (c->visit_count != UINT32_MAX) c->visit_count++;
+  c->last_visit = now;
+}
+
+static inline unsigned int ctools_lfu_weight(const ctools_lfu_counter *c,
+                                             unsigned int now) {
+  unsigned int num, counter;
+  counter = c->visit_count;
+  num = now - c->last_visit;
+  return num > counter ? 0 : counter - num;
+}
+
+/* Soft and hard expiry of an entry in ctools_time_in_seconds() time, 0 is
+ * never. Past soft the value is still served but due for one refresh, which
+ * XFetch may start before soft, the earlier the longer the value took to
+ * compute (delta seconds). Past hard the entry is gone. */
+typedef struct {
+  double soft;
+  double hard;
+  double delta;
+  int refreshing;
+} ctools_lfu_expiry;
+
+#define CTOOLS_LFU_FRESH 0
+#define CTOOLS_LFU_REFRESH 1
+#define CTOOLS_LFU_EXPIRED 2
+
+#define CTOOLS_LFU_XFETCH_BETA 1.0
+
+/* Monotonic clock for expiry. */
+double ctools_time_in_seconds(void);
+
+static inline int ctools_lfu_expired(const ctools_lfu_expiry *e, double now) {
+  return e->hard > 0 && now >= e->hard;
+}
+
+/* Return CTOOLS_LFU_EXPIRED, CTOOLS_LFU_REFRESH for the one read that should
+ * refresh the entry, or CTOOLS_LFU_FRESH. rng draws the XFetch coin. */
+int ctools_lfu_expiry_check(ctools_lfu_expiry *e, double now, ctools_rng *rng);
+
+/* Latency histogram over fixed bounds in seconds. counts[i] holds the
+ * samples in (bounds[i - 1], bounds[i]], the last slot those above every
+ * bound; exporters make them cumulative. */
+#define CTOOLS_LFU_LATENCY_BUCKETS 12
+
+extern const double ctools_lfu_latency_bounds[CTOOLS_LFU_LATENCY_BUCKETS];
+
+typedef struct {
+  uint64_t counts[CTOOLS_LFU_LATENCY_BUCKETS + 1];
+  uint64_t count;
+  double sum;
+} ctools_lfu_latency;
+
+void ctools_lfu_latency_add(ctools_lfu_latency *h, double seconds);
+
+/* Sampled access trace: a ring of fixed size records that keeps the newest
+ * ones until they are drained. */
+#define CTOOLS_LFU_TRACE_GET 0
+#define CTOOLS_LFU_TRACE_SET 1
+#define CTOOLS_LFU_TRACE_DEL 2
+
+/* 24 bytes, struct format "=QQBB6x". */
+typedef struct {
+  uint64_t key_hash;
+  uint64_t time_ns; /* monotonic clock */
+  uint8_t op;
+  uint8_t hit;
+  uint8_t reserved[6];
+} ctools_lfu_trace_record;
+
+typedef struct {
+  ctools_lfu_trace_record *records;
+  size_t size;
+  size_t head; /* next slot written */
+  size_t count;
+  uint64_t dropped; /* overwritten before they were drained */
+  uint64_t threshold; /* an access is sampled if a 32 bit draw is below */
+  /* Draws of its own, so that tracing leaves the draws of the cache, and
+   * with them a seeded eviction order, alone. */
+  ctools_rng rng;
+} ctools_lfu_trace;
+
+/* Return a trace of size records sampling rate (0, 1] of the accesses with
+ * draws seeded by seed, or NULL when out of memory. */
+ctools_lfu_trace *ctools_lfu_trace_new(size_t size, double rate,
+                                       uint64_t seed);
+void ctools_lfu_trace_free(ctools_lfu_trace *t);
+
+static inline int ctools_lfu_trace_sampled(ctools_lfu_trace *t) {
+  return (ctools_rng_next(&t->rng) >> 32) < t->threshold;
+}
+
+void ctools_lfu_trace_add(ctools_lfu_trace *t, uint64_t key_hash, int op,
+                          int hit);
+
+/* Move up to n of the oldest records to out. Return how many. */
+size_t ctools_lfu_trace_drain(ctools_lfu_trace *t,
+                              ctools_lfu_trace_record *out, size_t n);
+
+/* Spread n values over at most bins equal width bins running from the
+ * smallest value to the largest. Set *low and *width of the bins, add to
+ * counts (bins long, zeroed) and return the number of bins used. width is
+ * 64 bit: one bin over the full 32 bit range is 2^32 wide. */
+size_t ctools_lfu_histogram(const unsigned int *values, size_t n, size_t bins,
+                            unsigned int *low, uint64_t *width,
+                            uint64_t *counts);
+
+/* Bounded max-heap keeping the k lowest ranks pushed into it, used to find
+ * the coldest (or, with inverted ranks, the hottest) entries in one pass. */
+typedef struct {
+  uint64_t rank;
+  void *item;
+} ctools_lfu_rank;
+
+/* Push into heap of *n entries, k at most. Return the item that doesn't fit
+ * any more, the pushed one or the one it replaced, or NULL if none. */
+void *ctools_lfu_heap_push(ctools_lfu_rank *heap, size_t *n, size_t k,
+                           uint64_t rank, void *item);
+
+/* Sort the entries by rank, lowest first. */
+void ctools_lfu_rank_sort(ctools_lfu_rank *ranks, size_t n);
+
+/* Size-aware admission after AdaptSize: a new object of size bytes gets in
+ * with probability exp(-size / c), so one huge value rarely pushes out
+ * many small hot ones. AdaptSize picks c from a model of the request
+ * stream; here c hill-climbs on the hit ratio instead, once per window of
+ * requests it moves by step and turns around when the ratio dropped. */
+#define CTOOLS_ADMISSION_WINDOW 4096
+#define CTOOLS_ADMISSION_STEP 2.0
+#define CTOOLS_ADMISSION_MIN_C 64.0
+#define CTOOLS_ADMISSION_MAX_C 1099511627776.0 /* 1 TiB */
+
+typedef struct {
+  double c;
+  double step; /* factor the next window multiplies c by */
+  double ratio; /* hit ratio of the last window */
+  uint64_t window;
+  uint64_t hits; /* totals at the start of the window */
+  uint64_t requests;
+} ctools_admission;
+
+void ctools_admission_init(ctools_admission *a, double c, uint64_t window);
+
+/* Return 1 if an object of size bytes gets in, rng draws the coin. */
+int ctools_admission_admit(const ctools_admission *a, double size,
+                           ctools_rng *rng);
+
+/* Feed the running totals of hits and requests, c moves once a window of
+ * requests is complete. Totals going back (a reset) start a new window. */
+void ctools_admission_tune(ctools_admission *a, uint64_t hits,
+                           uint64_t requests);
+
+/* GreedyDual-Size-Frequency: an entry's priority is the inflation at its
+ * last (re)computation plus frequency * cost / size, the lowest priority is
+ * evicted and its priority becomes the inflation, which ages everything
+ * not touched since. Nodes live inside the caller's entries and know their
+ * heap slot, so any of them can be removed or re-sifted in O(log n). */
+#define CTOOLS_GDSF_NONE ((size_t)-1)
+
+typedef struct {
+  double priority;
+  size_t pos; /* heap slot, CTOOLS_GDSF_NONE when not in a heap */
+  void *item;
+} ctools_gdsf_node;
+
+typedef struct {
+  ctools_gdsf_node **heap;
+  size_t count;
+  size_t alloc;
+  double inflation;
+} ctools_gdsf;
+
+static inline double ctools_gdsf_priority(const ctools_gdsf *g, double freq,
+                                          double cost, double size) {
+  return g->inflation + freq * cost / size;
+}
+
+static inline ctools_gdsf_node *ctools_gdsf_min(const ctools_gdsf *g) {
+  return g->count ? g->heap[0] : NULL;
+}
+
+/* Return an empty heap, or NULL when out of memory. */
+ctools_gdsf *ctools_gdsf_new(void);
+/* Return 0, or -1 when out of memory. */
+int ctools_gdsf_push(ctools_gdsf *g, ctools_gdsf_node *node);
+void ctools_gdsf_remove(ctools_gdsf *g, ctools_gdsf_node *node);
+/* Restore the heap after the priority of node changed. */
+void ctools_gdsf_fix(ctools_gdsf *g, ctools_gdsf_node *node);
+/* Forget every node and the inflation, keep the heap allocated. */
+void ctools_gdsf_reset(ctools_gdsf *g);
+void ctools_gdsf_free(ctools_gdsf *g);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_LFU_CORE_H */
@@ -0,0 +1,346 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "ctools_spill.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef O_NOFOLLOW
+#define SPILL_NOFOLLOW O_NOFOLLOW
+#else
+#define SPILL_NOFOLLOW 0
+#endif
+
+#define SPILL_MAGIC 0x4C495053U /* "SPIL" */
+#define SPILL_EMPTY 0
+#define SPILL_REMOVED UINT64_MAX
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t key_len;
+  uint32_t value_len;
+  uint32_t reserved;
+  uint64_t hash;
+  uint64_t check;
+} spill_header;
+
+#define RECORD_SIZE(key_len, value_len) \
+  ALIGN8(sizeof(spill_header) + (size_t)(key_len) + (size_t)(value_len))
+
+/* FNV-1a over the record keyed with the secret, then a splitmix64
+ * finalizer so that the secret can't be read back from a checksum. */
+static uint64_t spill_checksum(const ctools_spill *spill,
+                               const spill_header *h) {
+  const unsigned char *p = (const unsigned char *)(h + 1);
+  size_t n = (size_t)h->key_len + h->value_len;
+  uint64_t x = spill->secret ^ h->hash;
+  x = (x ^ h->key_len) * 0x100000001b3ULL;
+  x = (x ^ h->value_len) * 0x100000001b3ULL;
+  for (size_t i = 0; i < n; i++) x = (x ^ p[i]) * 0x100000001b3ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Return the header at off if it holds an intact record that fits in its
+ * segment, NULL otherwise. */
+static spill_header *spill_record(const ctools_spill *spill, size_t off) {
+  size_t end = (off / spill->segment_size + 1) * spill->segment_size;
+  spill_header *h = (spill_header *)(spill->base + off);
+  if (off + sizeof(spill_header) > end || h->magic != SPILL_MAGIC ||
+      off + RECORD_SIZE(h->key_len, h->value_len) > end ||
+      h->check != spill_checksum(spill, h))
+    return NULL;
+  return h;
+}
+
+static int spill_index_resize(ctools_spill *spill, size_t cap) {
+  ctools_spill_slot *old = spill->slots;
+  size_t old_cap = old ? spill->mask + 1 : 0;
+  ctools_spill_slot *slots =
+      (ctools_spill_slot *)calloc(cap, sizeof(ctools_spill_slot));
+  if (!slots) return -1;
+  spill->slots = slots;
+  spill->mask = cap - 1;
+  spill->tombs = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].offset == SPILL_EMPTY || old[i].offset == SPILL_REMOVED)
+      continue;
+    size_t j = old[i].hash & spill->mask;
+    while (slots[j].offset != SPILL_EMPTY) j = (j + 1) & spill->mask;
+    slots[j] = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+static int spill_index_insert(ctools_spill *spill, uint64_t hash,
+                              size_t offset, size_t size) {
+  size_t i;
+  if ((spill->count + spill->tombs + 1) * 2 > spill->mask + 1) {
+    size_t cap = spill->mask + 1;
+    while (cap < (spill->count + 1) * 4) cap *= 2;
+    if (spill_index_resize(spill, cap)) return -1;
+  }
+  i = hash & spill->mask;
+  while (spill->slots[i].offset != SPILL_EMPTY &&
+         spill->slots[i].offset != SPILL_REMOVED)
+    i = (i + 1) & spill->mask;
+  if (spill->slots[i].offset == SPILL_REMOVED) spill->tombs--;
+  spill->slots[i].hash = hash;
+  spill->slots[i].offset = (uint64_t)offset + 1;
+  spill->slots[i].size = size;
+  spill->slots[i].hit = 0;
+  spill->count++;
+  return 0;
+}
+
+void ctools_spill_delete(ctools_spill *spill, size_t slot) {
+  spill->live_bytes -= spill->slots[slot].size;
+  spill->slots[slot].offset = SPILL_REMOVED;
+  spill->count--;
+  spill->tombs++;
+}
+
+static void spill_fill(spill_header *h, size_t off, ctools_spill_record *rec) {
+  rec->key = (const char *)(h + 1);
+  rec->key_len = h->key_len;
+  rec->value = rec->key + h->key_len;
+  rec->value_len = h->value_len;
+  rec->offset = off;
+}
+
+int ctools_spill_find(ctools_spill *spill, uint64_t hash, size_t *slot,
+                      ctools_spill_record *rec) {
+  size_t i = *slot == CTOOLS_SPILL_START ? hash & spill->mask
+                                         : (*slot + 1) & spill->mask;
+  for (; spill->slots[i].offset != SPILL_EMPTY; i = (i + 1) & spill->mask) {
+    if (spill->slots[i].offset == SPILL_REMOVED ||
+        spill->slots[i].hash != hash)
+      continue;
+    size_t off = (size_t)spill->slots[i].offset - 1;
+    spill_header *h = spill_record(spill, off);
+    if (!h || h->hash != hash) {
+      /* overwritten behind our back */
+      ctools_spill_delete(spill, i);
+      continue;
+    }
+    spill_fill(h, off, rec);
+    spill->slots[i].hit = 1;
+    *slot = i;
+    return 1;
+  }
+  return 0;
+}
+
+int ctools_spill_recheck(ctools_spill *spill, size_t slot,
+                         ctools_spill_record *rec) {
+  spill_header *h;
+  if (slot > spill->mask || spill->slots[slot].offset != rec->offset + 1)
+    return 0;
+  if (!(h = spill_record(spill, rec->offset)) ||
+      h->hash != spill->slots[slot].hash)
+    return 0;
+  spill_fill(h, rec->offset, rec);
+  return 1;
+}
+
+/* Drop the index entries pointing into [off, end), for when a segment can't
+ * be walked record by record. */
+static void spill_purge(ctools_spill *spill, size_t off, size_t end) {
+  for (size_t i = 0; i <= spill->mask; i++) {
+    uint64_t o = spill->slots[i].offset;
+    if (o != SPILL_EMPTY && o != SPILL_REMOVED && o - 1 >= off && o - 1 < end)
+      ctools_spill_delete(spill, i);
+  }
+}
+
+/* Return the index slot of the record at off, or (size_t)-1 if it isn't
+ * indexed any more. */
+static size_t spill_slot_of(const ctools_spill *spill, uint64_t hash,
+                            size_t off) {
+  size_t i = hash & spill->mask;
+  for (; spill->slots[i].offset != SPILL_EMPTY; i = (i + 1) & spill->mask) {
+    if (spill->slots[i].offset == (uint64_t)off + 1) return i;
+  }
+  return (size_t)-1;
+}
+
+/* Reclaim segment: records hit since the last lap move to its front while
+ * they take at most keep bytes, and lose their hit; the index entries of
+ * the others are dropped. Return the offset writing resumes at. */
+static size_t spill_reclaim(ctools_spill *spill, size_t segment,
+                            size_t keep) {
+  size_t off = segment * spill->segment_size, to = off;
+  size_t end = off + spill->segment_size, limit = off + keep;
+  while (off + sizeof(spill_header) <= end) {
+    spill_header *h = (spill_header *)(spill->base + off);
+    if (h->magic != SPILL_MAGIC) break;
+    if (!spill_record(spill, off)) {
+      spill_purge(spill, off, end);
+      break;
+    }
+    size_t size = RECORD_SIZE(h->key_len, h->value_len);
+    size_t i = spill_slot_of(spill, h->hash, off);
+    if (i != (size_t)-1) {
+      if (spill->slots[i].hit && to + size <= limit) {
+        /* the checksum doesn't cover the offset, the record moves as is */
+        if (to != off) memmove(spill->base + to, h, size);
+        spill->slots[i].offset = (uint64_t)to + 1;
+        spill->slots[i].hit = 0;
+        to += size;
+      } else {
+        ctools_spill_delete(spill, i);
+      }
+    }
+    off += size;
+  }
+  if (to + sizeof(uint32_t) <= end)
+    memset(spill->base + to, 0, sizeof(uint32_t));
+  return to;
+}
+
+/* Move on to the next segment with room for need bytes. */
+static void spill_rotate(ctools_spill *spill, size_t need) {
+  size_t end = (spill->segment + 1) * spill->segment_size;
+  size_t keep = spill->segment_size - need;
+  if (keep > spill->segment_size / 2) keep = spill->segment_size / 2;
+  if (spill->head + sizeof(uint32_t) <= end)
+    memset(spill->base + spill->head, 0, sizeof(uint32_t));
+  spill->segment = (spill->segment + 1) % spill->n_segments;
+  spill->head = spill_reclaim(spill, spill->segment, keep);
+}
+
+int ctools_spill_put(ctools_spill *spill, uint64_t hash, const char *key,
+                     uint32_t key_len, const char *value, uint32_t value_len) {
+  size_t need = RECORD_SIZE(key_len, value_len);
+  spill_header *h;
+  if (need > spill->segment_size) return -1;
+  if (spill->head + need > (spill->segment + 1) * spill->segment_size)
+    spill_rotate(spill, need);
+  if (spill_index_insert(spill, hash, spill->head, need)) return -1;
+
+  h = (spill_header *)(spill->base + spill->head);
+  h->magic = SPILL_MAGIC;
+  h->key_len = key_len;
+  h->value_len = value_len;
+  h->reserved = 0;
+  h->hash = hash;
+  memcpy((char *)(h + 1), key, key_len);
+  memcpy((char *)(h + 1) + key_len, value, value_len);
+  h->check = spill_checksum(spill, h);
+  spill->head += need;
+  spill->live_bytes += need;
+  return 0;
+}
+
+void ctools_spill_reset(ctools_spill *spill) {
+  memset(spill->slots, 0, (spill->mask + 1) * sizeof(ctools_spill_slot));
+  spill->count = spill->tombs = spill->live_bytes = 0;
+  for (size_t i = 0; i < spill->n_segments; i++)
+    memset(spill->base + i * spill->segment_size, 0, sizeof(uint32_t));
+  spill->segment = 0;
+  spill->head = 0;
+}
+
+#ifndef _WIN32
+
+static uint64_t spill_secret(const ctools_spill *spill) {
+  uint64_t secret = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    if (read(fd, &secret, sizeof(secret)) != (ssize_t)sizeof(secret))
+      secret = 0;
+    close(fd);
+  }
+  if (!secret)
+    secret = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^
+             (uint64_t)(uintptr_t)spill;
+  return secret;
+}
+
+ctools_spill *ctools_spill_open(const char *path, size_t size) {
+  ctools_spill *spill;
+  int err;
+  size_t segment_size = ALIGN8(size / CTOOLS_SPILL_SEGMENTS);
+  if (segment_size < CTOOLS_SPILL_MIN_SEGMENT)
+    segment_size = CTOOLS_SPILL_MIN_SEGMENT;
+  if (size / segment_size < 2) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  spill = (ctools_spill *)calloc(1, sizeof(ctools_spill));
+  if (!spill) return NULL;
+  spill->fd = -1;
+  spill->n_segments = size / segment_size;
+  spill->segment_size = segment_size;
+  spill->size = spill->n_segments * segment_size;
+  spill->secret = spill_secret(spill);
+  if (!(spill->path = strdup(path)) || spill_index_resize(spill, 1024))
+    goto fail;
+
+  /* never reuse a file someone else may have prepared, nor follow a link */
+  spill->fd = open(path, O_RDWR | O_CREAT | O_EXCL | SPILL_NOFOLLOW, 0600);
+  if (spill->fd < 0 || ftruncate(spill->fd, (off_t)spill->size)) goto fail;
+  spill->base = (char *)mmap(NULL, spill->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, spill->fd, 0);
+  if (spill->base == MAP_FAILED) {
+    spill->base = NULL;
+    goto fail;
+  }
+  return spill;
+
+fail:
+  err = errno;
+  ctools_spill_close(spill, 1);
+  errno = err;
+  return NULL;
+}
+
+void ctools_spill_close(ctools_spill *spill, int unlink_file) {
+  if (!spill) return;
+  if (spill->base) munmap(spill->base, spill->size);
+  if (spill->fd >= 0) {
+    close(spill->fd);
+    if (unlink_file) unlink(spill->path);
+  }
+  free(spill->path);
+  free(spill->slots);
+  free(spill);
+}
+
+#else
+
+ctools_spill *ctools_spill_open(const char *path, size_t size) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+void ctools_spill_close(ctools_spill *spill, int unlink_file) {}
+
+#endif
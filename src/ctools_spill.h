@@ -0,0 +1,106 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_SPILL_H
+#define _CTOOLS_SPILL_H
+#include <stddef.h>
+#include "ctools_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A memory-mapped, log structured overflow store.
+ *
+ * The file is a ring of fixed size segments. Records are appended to the
+ * current segment; when it is full the ring moves on and the oldest segment
+ * is reclaimed. Records found by a lookup since the last lap get a second
+ * chance: they are compacted to the front of the segment, up to half of
+ * it. The index entries of the others are dropped and their space is
+ * reused. Reclamation thus runs one segment at a time, never as a full
+ * pass over the file.
+ *
+ * The index is an open addressing table in ordinary memory mapping a 64 bit
+ * key hash to a record offset. Hashes may collide; callers compare keys.
+ *
+ * The file is created exclusively and never trusted: every record carries a
+ * checksum keyed with a per-process secret, and records failing it are
+ * ignored, so whatever else writes to the mapping can't forge a record. */
+
+#define CTOOLS_SPILL_MIN_SEGMENT (64 * 1024)
+#define CTOOLS_SPILL_SEGMENTS 16
+
+typedef struct {
+  uint64_t hash;
+  uint64_t offset; /* record offset + 1, 0 for empty, UINT64_MAX for removed */
+  size_t size;     /* record size, kept here rather than read from the file */
+  int hit;         /* found since the segment was last reclaimed */
+} ctools_spill_slot;
+
+typedef struct {
+  int fd;
+  char *path;
+  char *base;
+  size_t size;
+  size_t segment_size;
+  size_t n_segments;
+  size_t segment; /* segment being written */
+  size_t head;    /* next write offset */
+  ctools_spill_slot *slots;
+  size_t mask;
+  size_t count; /* indexed records */
+  size_t tombs;
+  size_t live_bytes;
+  uint64_t secret; /* checksum key */
+} ctools_spill;
+
+typedef struct {
+  const char *key;
+  uint32_t key_len;
+  const char *value;
+  uint32_t value_len;
+  size_t offset;
+} ctools_spill_record;
+
+/* Create path, which must not exist yet, and map size bytes of it. Return
+ * NULL and set errno on failure. */
+ctools_spill *ctools_spill_open(const char *path, size_t size);
+/* Unmap and close; remove the file too when unlink_file is set. */
+void ctools_spill_close(ctools_spill *spill, int unlink_file);
+/* Forget every record. */
+void ctools_spill_reset(ctools_spill *spill);
+
+/* Append a record. Return -1 if it doesn't fit in a segment or the index
+ * can't grow. Pointers from earlier lookups are invalid afterwards. */
+int ctools_spill_put(ctools_spill *spill, uint64_t hash, const char *key,
+                     uint32_t key_len, const char *value, uint32_t value_len);
+
+/* Iterate records indexed under hash. Start with *slot == CTOOLS_SPILL_START;
+ * return 1 and fill rec while candidates remain, 0 afterwards. Candidates
+ * count as hits and survive the next reclamation of their segment. */
+#define CTOOLS_SPILL_START ((size_t)-1)
+int ctools_spill_find(ctools_spill *spill, uint64_t hash, size_t *slot,
+                      ctools_spill_record *rec);
+/* Check that slot still indexes the record rec was filled with, and refill
+ * rec from the current mapping. Return 0 if the record is gone. */
+int ctools_spill_recheck(ctools_spill *spill, size_t slot,
+                         ctools_spill_record *rec);
+/* Drop the record found at slot. */
+void ctools_spill_delete(ctools_spill *spill, size_t slot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_SPILL_H */
@@ -0,0 +1,770 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+/* flock() */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+#include "ctools_store.h"
+#include "ctools_hash.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_RECORD_MAGIC 0x4B534944U /* "DISK" */
+#define STORE_INDEX_MAGIC 0x58444E49U  /* "INDX" */
+#define STORE_INDEX_VERSION 1
+#define STORE_TOMBSTONE 0x80000000U
+#define STORE_EMPTY 0
+#define STORE_REMOVED UINT32_MAX
+#define STORE_INDEX_MIN 1024
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t crc; /* over everything after this field */
+  uint32_t key_len;
+  uint32_t value_len;
+  uint64_t hash;
+  uint32_t flags;
+  uint32_t reserved;
+} store_header;
+
+/* The index file: this header followed by the slot table. The fields are
+ * only meaningful while clean is set. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t clean;
+  uint32_t first_segment;
+  uint64_t n_segments;
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t tombs;
+  uint64_t tail_used;
+  uint64_t live_bytes;
+} store_index_header;
+
+#define RECORD_SIZE(key_len, value_len) \
+  ALIGN8(sizeof(store_header) + (size_t)(key_len) + (size_t)(value_len))
+#define HEADER_SIZE(h) RECORD_SIZE((h)->key_len, (h)->value_len)
+#define INDEX_HEADER(store) ((store_index_header *)(store)->index_base)
+#define INDEX_SIZE(cap) \
+  (sizeof(store_index_header) + (cap) * sizeof(ctools_store_slot))
+#define TAIL(store) (&(store)->segments[(store)->n_segments - 1])
+#define SLOT_USED(s) \
+  ((s)->segment != STORE_EMPTY && (s)->segment != STORE_REMOVED)
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+  if (crc_table[1]) return;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const char *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  crc = ~crc;
+  while (len--) crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t record_crc(const store_header *h) {
+  return crc_update(0, (const char *)&h->key_len,
+                    sizeof(store_header) - offsetof(store_header, key_len) +
+                        h->key_len + h->value_len);
+}
+
+static ctools_store_segment *store_segment(ctools_store *store, uint32_t id) {
+  return &store->segments[id - store->segments[0].id];
+}
+
+static store_header *slot_record(ctools_store *store,
+                                 const ctools_store_slot *slot) {
+  return (store_header *)(store_segment(store, slot->segment - 1)->base +
+                          slot->offset);
+}
+
+static void fill_record(const store_header *h, ctools_store_record *rec) {
+  rec->key = (const char *)(h + 1);
+  rec->key_len = h->key_len;
+  rec->value = rec->key + h->key_len;
+  rec->value_len = h->value_len;
+  rec->flags = h->flags & CTOOLS_STORE_USER_FLAGS;
+}
+
+/* ---- index ---- */
+
+static size_t index_lookup(ctools_store *store, uint64_t hash, const char *key,
+                           uint32_t key_len) {
+  size_t i = hash & store->mask;
+  for (; store->slots[i].segment != STORE_EMPTY; i = (i + 1) & store->mask) {
+    ctools_store_slot *s = &store->slots[i];
+    if (s->segment == STORE_REMOVED || s->hash != hash) continue;
+    store_header *h = slot_record(store, s);
+    if (h->key_len == key_len && !memcmp(h + 1, key, key_len)) return i;
+  }
+  return (size_t)-1;
+}
+
+static void index_place(ctools_store *store, const ctools_store_slot *slot) {
+  size_t i = slot->hash & store->mask;
+  while (SLOT_USED(&store->slots[i])) i = (i + 1) & store->mask;
+  if (store->slots[i].segment == STORE_REMOVED) store->tombs--;
+  store->slots[i] = *slot;
+  store->count++;
+}
+
+/* Map the index file with room for cap slots and rehash into it. */
+static int index_resize(ctools_store *store, size_t cap) {
+  size_t old_cap = store->slots ? store->mask + 1 : 0;
+  size_t size = INDEX_SIZE(cap);
+  ctools_store_slot *old = NULL;
+  char *base;
+
+  if (old_cap) {
+    old = (ctools_store_slot *)malloc(old_cap * sizeof(ctools_store_slot));
+    if (!old) return -1;
+    memcpy(old, store->slots, old_cap * sizeof(ctools_store_slot));
+  }
+  if (ftruncate(store->index_fd, (off_t)size)) goto fail;
+  base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      store->index_fd, 0);
+  if (base == MAP_FAILED) goto fail;
+  if (store->index_base) munmap(store->index_base, store->index_size);
+  store->index_base = base;
+  store->index_size = size;
+  store->slots = (ctools_store_slot *)(base + sizeof(store_index_header));
+  memset(store->slots, 0, cap * sizeof(ctools_store_slot));
+  store->mask = cap - 1;
+  store->count = store->tombs = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (SLOT_USED(&old[i])) index_place(store, &old[i]);
+  }
+  free(old);
+  return 0;
+
+fail:
+  free(old);
+  return -1;
+}
+
+static int index_reserve(ctools_store *store) {
+  size_t cap = store->mask + 1;
+  if ((store->count + store->tombs + 1) * 2 <= cap) return 0;
+  while (cap < (store->count + 1) * 4) cap *= 2;
+  return index_resize(store, cap);
+}
+
+static void index_remove(ctools_store *store, size_t i) {
+  store->live_bytes -= HEADER_SIZE(slot_record(store, &store->slots[i]));
+  store->slots[i].segment = STORE_REMOVED;
+  store->count--;
+  store->tombs++;
+}
+
+/* ---- segments ---- */
+
+static char *segment_path(ctools_store *store, uint32_t id) {
+  size_t len = strlen(store->path) + 16;
+  char *path = (char *)malloc(len);
+  if (path) snprintf(path, len, "%s/%08x.seg", store->path, (unsigned)id);
+  return path;
+}
+
+static int segment_map(ctools_store_segment *seg, const char *path,
+                       size_t size, int create) {
+  int err;
+  seg->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+  if (seg->fd < 0) return -1;
+  if (create) {
+    /* reserve the blocks now, so a full disk fails here and not with
+     * SIGBUS on a later store into the mapping */
+    err = posix_fallocate(seg->fd, 0, (off_t)size);
+    if (err && err != EINVAL && err != EOPNOTSUPP) {
+      errno = err;
+      goto fail;
+    }
+    if (err && ftruncate(seg->fd, (off_t)size)) goto fail;
+  } else {
+    struct stat st;
+    if (fstat(seg->fd, &st)) goto fail;
+    size = (size_t)st.st_size;
+    if (size < sizeof(store_header)) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+  seg->base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           seg->fd, 0);
+  if (seg->base == MAP_FAILED) goto fail;
+  seg->size = size;
+  seg->used = create ? 0 : size;
+  seg->live = 0;
+  return 0;
+
+fail:
+  err = errno;
+  close(seg->fd);
+  if (create) unlink(path);
+  errno = err;
+  return -1;
+}
+
+static void segment_unmap(ctools_store_segment *seg) {
+  munmap(seg->base, seg->size);
+  close(seg->fd);
+}
+
+/* Start a new segment after the newest one. */
+static int segment_add(ctools_store *store) {
+  uint32_t id = store->n_segments ? TAIL(store)->id + 1 : 0;
+  ctools_store_segment *segments = (ctools_store_segment *)realloc(
+      store->segments, (store->n_segments + 1) * sizeof(ctools_store_segment));
+  char *path;
+  if (!segments) return -1;
+  store->segments = segments;
+  if (!(path = segment_path(store, id))) return -1;
+  segments[store->n_segments].id = id;
+  if (segment_map(&segments[store->n_segments], path, store->segment_size,
+                  1)) {
+    free(path);
+    return -1;
+  }
+  free(path);
+  store->n_segments++;
+  return 0;
+}
+
+/* Unmap and delete the oldest segment. */
+static void segment_drop(ctools_store *store) {
+  char *path = segment_path(store, store->segments[0].id);
+  segment_unmap(&store->segments[0]);
+  if (path) unlink(path);
+  free(path);
+  store->n_segments--;
+  memmove(store->segments, store->segments + 1,
+          store->n_segments * sizeof(ctools_store_segment));
+}
+
+/* Append a record and return it, or NULL with errno set. key and value may
+ * point into a segment. */
+static store_header *store_append(ctools_store *store, uint64_t hash,
+                                  const char *key, uint32_t key_len,
+                                  const char *value, uint32_t value_len,
+                                  uint32_t flags, ctools_store_slot *slot) {
+  size_t need = RECORD_SIZE(key_len, value_len);
+  ctools_store_segment *tail = TAIL(store);
+  store_header *h;
+
+  if (need > store->segment_size) {
+    errno = EFBIG;
+    return NULL;
+  }
+  if (tail->used + need > tail->size) {
+    /* a record may live in the tail itself, keep it mapped */
+    if (segment_add(store)) return NULL;
+    tail = TAIL(store);
+  }
+  h = (store_header *)(tail->base + tail->used);
+  memmove((char *)(h + 1), key, key_len);
+  if (value_len) memmove((char *)(h + 1) + key_len, value, value_len);
+  h->key_len = key_len;
+  h->value_len = value_len;
+  h->hash = hash;
+  h->flags = flags;
+  h->reserved = 0;
+  h->crc = record_crc(h);
+  h->magic = STORE_RECORD_MAGIC;
+  slot->hash = hash;
+  slot->segment = tail->id + 1;
+  slot->offset = (uint32_t)tail->used;
+  tail->used += need;
+  return h;
+}
+
+/* Iterate the records of seg, stopping at the first torn one. */
+static store_header *segment_next(ctools_store_segment *seg, size_t *off,
+                                  int verify) {
+  store_header *h;
+  if (*off + sizeof(store_header) > seg->size) return NULL;
+  h = (store_header *)(seg->base + *off);
+  if (h->magic != STORE_RECORD_MAGIC) return NULL;
+  if (*off + HEADER_SIZE(h) > seg->size) return NULL;
+  if (verify && record_crc(h) != h->crc) return NULL;
+  *off += HEADER_SIZE(h);
+  return h;
+}
+
+/* ---- store ---- */
+
+static int store_delete_slot(ctools_store *store, size_t i) {
+  ctools_store_slot tomb;
+  store_header *h = slot_record(store, &store->slots[i]);
+  /* the key is copied out of the record before appending may move on */
+  if (!store_append(store, h->hash, (const char *)(h + 1), h->key_len, NULL,
+                    0, STORE_TOMBSTONE, &tomb))
+    return -1;
+  index_remove(store, i);
+  return 0;
+}
+
+/* Delete the entry with the lowest weight among a few sampled ones. */
+static int store_evict(ctools_store *store) {
+  unsigned int now = ctools_time_in_minutes();
+  unsigned int weight = 0;
+  size_t victim = (size_t)-1;
+
+  for (int n = 0; n < CTOOLS_LFU_BUCKET; n++) {
+    size_t i = (size_t)ctools_rng_next(&store->rng) & store->mask;
+    while (!SLOT_USED(&store->slots[i])) i = (i + 1) & store->mask;
+    unsigned int w = ctools_lfu_weight(&store->slots[i].counter, now);
+    if (victim == (size_t)-1 || w < weight) {
+      victim = i;
+      weight = w;
+    }
+  }
+  return store_delete_slot(store, victim);
+}
+
+static size_t store_garbage(ctools_store *store) {
+  return ctools_store_disk_bytes(store) - store->live_bytes;
+}
+
+int ctools_store_compact(ctools_store *store) {
+  size_t off = 0;
+  store_header *h;
+  if (store->n_segments < 2) return 0;
+  while ((h = segment_next(&store->segments[0], &off, 0))) {
+    if (h->flags & STORE_TOMBSTONE) continue;
+    size_t at = (char *)h - store->segments[0].base;
+    size_t i = h->hash & store->mask;
+    for (; store->slots[i].segment != STORE_EMPTY; i = (i + 1) & store->mask) {
+      ctools_store_slot *s = &store->slots[i];
+      if (s->segment == store->segments[0].id + 1 && s->offset == at) {
+        ctools_store_slot moved;
+        if (!store_append(store, h->hash, (const char *)(h + 1), h->key_len,
+                          (const char *)(h + 1) + h->key_len, h->value_len,
+                          h->flags, &moved))
+          return -1;
+        /* segment_add() may have moved the segment table */
+        h = (store_header *)(store->segments[0].base + at);
+        s->segment = moved.segment;
+        s->offset = moved.offset;
+        break;
+      }
+    }
+  }
+  /* the copies must be on disk before their originals go away */
+  if (msync(TAIL(store)->base, TAIL(store)->size, MS_SYNC)) return -1;
+  segment_drop(store);
+  return 1;
+}
+
+int ctools_store_get(ctools_store *store, const char *key, uint32_t key_len,
+                     ctools_store_record *rec) {
+  uint64_t hash = ctools_fnv1a_64(key, key_len);
+  size_t i = index_lookup(store, hash, key, key_len);
+  if (i == (size_t)-1) return 0;
+  ctools_lfu_counter_incr(&store->slots[i].counter, ctools_time_in_minutes());
+  fill_record(slot_record(store, &store->slots[i]), rec);
+  return 1;
+}
+
+int ctools_store_put(ctools_store *store, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len, uint32_t flags) {
+  uint64_t hash = ctools_fnv1a_64(key, key_len);
+  size_t need = RECORD_SIZE(key_len, value_len);
+  size_t i = index_lookup(store, hash, key, key_len);
+  size_t old = 0;
+  ctools_store_slot slot;
+
+  if (need > store->segment_size) {
+    errno = EFBIG;
+    return -1;
+  }
+  if (i != (size_t)-1) {
+    /* replacing keeps the counter */
+    slot.counter = store->slots[i].counter;
+    old = HEADER_SIZE(slot_record(store, &store->slots[i]));
+  } else {
+    ctools_lfu_counter_init(&slot.counter, ctools_time_in_minutes());
+  }
+  while (store->count && store->live_bytes - old + need > store->max_bytes) {
+    if (store_evict(store)) return -1;
+    /* the old record may have been the victim */
+    if (old && !SLOT_USED(&store->slots[i])) {
+      i = (size_t)-1;
+      old = 0;
+    }
+  }
+  if (i == (size_t)-1 && index_reserve(store)) return -1;
+  if (!store_append(store, hash, key, key_len, value, value_len,
+                    flags & CTOOLS_STORE_USER_FLAGS, &slot))
+    return -1;
+  /* the old record stays indexed until the new one is written, a failed
+   * append leaves the store as it was */
+  if (i != (size_t)-1) {
+    store->slots[i].segment = slot.segment;
+    store->slots[i].offset = slot.offset;
+    store->live_bytes -= old;
+  } else {
+    index_place(store, &slot);
+  }
+  store->live_bytes += need;
+
+  /* one segment per write keeps compaction incremental */
+  if (store_garbage(store) > store->live_bytes + store->segment_size)
+    return ctools_store_compact(store) < 0 ? -1 : 0;
+  return 0;
+}
+
+int ctools_store_delete(ctools_store *store, const char *key,
+                        uint32_t key_len) {
+  uint64_t hash = ctools_fnv1a_64(key, key_len);
+  size_t i = index_lookup(store, hash, key, key_len);
+  if (i == (size_t)-1) return 0;
+  return store_delete_slot(store, i) ? -1 : 1;
+}
+
+int ctools_store_next(ctools_store *store, size_t *pos,
+                      ctools_store_record *rec) {
+  for (size_t i = *pos; i <= store->mask; i++) {
+    if (SLOT_USED(&store->slots[i])) {
+      fill_record(slot_record(store, &store->slots[i]), rec);
+      *pos = i + 1;
+      return 1;
+    }
+  }
+  *pos = store->mask + 1;
+  return 0;
+}
+
+size_t ctools_store_disk_bytes(ctools_store *store) {
+  size_t n = TAIL(store)->used;
+  for (size_t i = 0; i + 1 < store->n_segments; i++)
+    n += store->segments[i].size;
+  return n;
+}
+
+int ctools_store_clear(ctools_store *store) {
+  if (segment_add(store)) return -1;
+  while (store->n_segments > 1) segment_drop(store);
+  memset(store->slots, 0, (store->mask + 1) * sizeof(ctools_store_slot));
+  store->count = store->tombs = store->live_bytes = 0;
+  return 0;
+}
+
+/* Rebuild the index by replaying every segment, oldest first. */
+static int store_recover(ctools_store *store) {
+  store->live_bytes = 0;
+  if (index_resize(store, STORE_INDEX_MIN)) return -1;
+  for (size_t n = 0; n < store->n_segments; n++) {
+    ctools_store_segment *seg = &store->segments[n];
+    store_header *h;
+    size_t off = 0, at = 0;
+    while ((h = segment_next(seg, &off, 1))) {
+      ctools_store_slot slot;
+      size_t i = index_lookup(store, h->hash, (const char *)(h + 1),
+                              h->key_len);
+      if (i != (size_t)-1) {
+        slot.counter = store->slots[i].counter;
+        index_remove(store, i);
+      } else {
+        ctools_lfu_counter_init(&slot.counter, ctools_time_in_minutes());
+      }
+      if (!(h->flags & STORE_TOMBSTONE)) {
+        if (index_reserve(store)) return -1;
+        slot.hash = h->hash;
+        slot.segment = seg->id + 1;
+        slot.offset = (uint32_t)at;
+        index_place(store, &slot);
+        store->live_bytes += HEADER_SIZE(h);
+      }
+      at = off;
+    }
+    seg->used = off;
+  }
+  /* wipe whatever a torn write left behind the tail */
+  memset(TAIL(store)->base + TAIL(store)->used, 0,
+         TAIL(store)->size - TAIL(store)->used);
+  return 0;
+}
+
+/* Trust the index if the store was closed cleanly with these segments. */
+static int store_load_index(ctools_store *store) {
+  store_index_header *ih;
+  struct stat st;
+  size_t cap;
+  char *base;
+
+  if (fstat(store->index_fd, &st) ||
+      (size_t)st.st_size < INDEX_SIZE(STORE_INDEX_MIN))
+    return 0;
+  ih = (store_index_header *)mmap(NULL, sizeof(store_index_header), PROT_READ,
+                                  MAP_SHARED, store->index_fd, 0);
+  if ((char *)ih == MAP_FAILED) return 0;
+  cap = (size_t)ih->capacity;
+  int ok = ih->magic == STORE_INDEX_MAGIC &&
+           ih->version == STORE_INDEX_VERSION && ih->clean &&
+           ih->first_segment == store->segments[0].id &&
+           ih->n_segments == store->n_segments && cap &&
+           !(cap & (cap - 1)) && INDEX_SIZE(cap) == (size_t)st.st_size &&
+           ih->tail_used <= TAIL(store)->size;
+  if (ok) {
+    store->count = (size_t)ih->count;
+    store->tombs = (size_t)ih->tombs;
+    store->live_bytes = (size_t)ih->live_bytes;
+    TAIL(store)->used = (size_t)ih->tail_used;
+  }
+  munmap((char *)ih, sizeof(store_index_header));
+  if (!ok) return 0;
+
+  base = (char *)mmap(NULL, INDEX_SIZE(cap), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, store->index_fd, 0);
+  if (base == MAP_FAILED) return -1;
+  store->index_base = base;
+  store->index_size = INDEX_SIZE(cap);
+  store->slots = (ctools_store_slot *)(base + sizeof(store_index_header));
+  store->mask = cap - 1;
+  return 1;
+}
+
+static void store_save_index(ctools_store *store, int clean) {
+  store_index_header *ih = INDEX_HEADER(store);
+  ih->magic = STORE_INDEX_MAGIC;
+  ih->version = STORE_INDEX_VERSION;
+  ih->first_segment = store->segments[0].id;
+  ih->n_segments = store->n_segments;
+  ih->capacity = store->mask + 1;
+  ih->count = store->count;
+  ih->tombs = store->tombs;
+  ih->tail_used = TAIL(store)->used;
+  ih->live_bytes = store->live_bytes;
+  ih->clean = (uint32_t)clean;
+}
+
+static int cmp_id(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Map the newest run of consecutive segment ids found in the directory. A
+ * newest segment too short for a record is a torn segment_add, it holds no
+ * data and is deleted. */
+static int store_load_segments(ctools_store *store) {
+  uint32_t *ids = NULL, id;
+  size_t n = 0, cap = 0, first;
+  struct dirent *ent;
+  char tail[8];
+  DIR *dir = opendir(store->path);
+  if (!dir) return -1;
+  while ((ent = readdir(dir))) {
+    if (strlen(ent->d_name) != 12 ||
+        sscanf(ent->d_name, "%8x%7s", &id, tail) != 2 || strcmp(tail, ".seg"))
+      continue;
+    if (n == cap) {
+      cap = cap * 2 + 16;
+      uint32_t *more = (uint32_t *)realloc(ids, cap * sizeof(uint32_t));
+      if (!more) {
+        free(ids);
+        closedir(dir);
+        return -1;
+      }
+      ids = more;
+    }
+    ids[n++] = id;
+  }
+  closedir(dir);
+
+  if (n) {
+    qsort(ids, n, sizeof(uint32_t), cmp_id);
+    for (first = n - 1; first > 0 && ids[first - 1] + 1 == ids[first];)
+      first--;
+    store->segments = (ctools_store_segment *)calloc(
+        n - first, sizeof(ctools_store_segment));
+    for (size_t i = first; store->segments && i < n; i++) {
+      char *path = segment_path(store, ids[i]);
+      ctools_store_segment *seg = &store->segments[store->n_segments];
+      struct stat st;
+      seg->id = ids[i];
+      if (path && i == n - 1 && !stat(path, &st) &&
+          (size_t)st.st_size < sizeof(store_header)) {
+        if (unlink(path)) {
+          free(path);
+          free(ids);
+          return -1;
+        }
+        free(path);
+        break;
+      }
+      if (!path || segment_map(seg, path, 0, 0)) {
+        free(path);
+        free(ids);
+        return -1;
+      }
+      free(path);
+      store->n_segments++;
+    }
+  }
+  free(ids);
+  if (n && !store->segments) return -1;
+  return store->n_segments ? 0 : segment_add(store);
+}
+
+ctools_store *ctools_store_open(const char *path, size_t max_bytes,
+                                size_t segment_size) {
+  ctools_store *store;
+  char *index_path = NULL;
+  struct stat st;
+  int err, loaded;
+
+  if (!max_bytes) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!segment_size) segment_size = max_bytes / 8;
+  if (segment_size < CTOOLS_STORE_MIN_SEGMENT)
+    segment_size = CTOOLS_STORE_MIN_SEGMENT;
+  if (segment_size > CTOOLS_STORE_MAX_SEGMENT)
+    segment_size = CTOOLS_STORE_MAX_SEGMENT;
+  if (mkdir(path, 0755) && errno != EEXIST) return NULL;
+
+  crc_init();
+  store = (ctools_store *)calloc(1, sizeof(ctools_store));
+  if (!store) return NULL;
+  store->index_fd = -1;
+  store->max_bytes = max_bytes;
+  ctools_rng_seed(&store->rng,
+                  (uint64_t)(size_t)store ^
+                      (uint64_t)(ctools_time_in_seconds() * 1e9));
+  store->segment_size = ALIGN8(segment_size);
+  if (!(store->path = strdup(path))) goto fail;
+  if (!(index_path = (char *)malloc(strlen(path) + 8))) goto fail;
+  sprintf(index_path, "%s/index", path);
+  store->index_fd = open(index_path, O_RDWR | O_CREAT, 0644);
+  free(index_path);
+  if (store->index_fd < 0) goto fail;
+
+  /* flock() locks belong to the open file, not the process, so a second
+   * open from this process is refused too */
+  if (flock(store->index_fd, LOCK_EX | LOCK_NB)) goto fail;
+
+  if (fstat(store->index_fd, &st) || store_load_segments(store)) goto fail;
+  if ((loaded = store_load_index(store)) < 0) goto fail;
+  if (!loaded && store_recover(store)) goto fail;
+  store->recovered = !loaded && st.st_size > 0;
+
+  /* from now on a crash leaves the index dirty */
+  store_save_index(store, 0);
+  if (msync(store->index_base, sizeof(store_index_header), MS_SYNC))
+    goto fail;
+  return store;
+
+fail:
+  err = errno;
+  for (size_t i = 0; i < store->n_segments; i++)
+    segment_unmap(&store->segments[i]);
+  if (store->index_base) munmap(store->index_base, store->index_size);
+  if (store->index_fd >= 0) close(store->index_fd);
+  free(store->segments);
+  free(store->path);
+  free(store);
+  errno = err;
+  return NULL;
+}
+
+int ctools_store_sync(ctools_store *store) {
+  for (size_t i = 0; i < store->n_segments; i++) {
+    if (msync(store->segments[i].base, store->segments[i].size, MS_SYNC))
+      return -1;
+  }
+  store_save_index(store, 0);
+  return msync(store->index_base, store->index_size, MS_SYNC);
+}
+
+int ctools_store_close(ctools_store *store) {
+  int rv = 0;
+  if (!store) return 0;
+  if (ctools_store_sync(store)) {
+    rv = -1;
+  } else {
+    store_save_index(store, 1);
+    rv = msync(store->index_base, sizeof(store_index_header), MS_SYNC);
+  }
+  for (size_t i = 0; i < store->n_segments; i++)
+    segment_unmap(&store->segments[i]);
+  munmap(store->index_base, store->index_size);
+  close(store->index_fd);
+  free(store->segments);
+  free(store->path);
+  free(store);
+  return rv;
+}
+
+#else
+
+ctools_store *ctools_store_open(const char *path, size_t max_bytes,
+                                size_t segment_size) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+int ctools_store_close(ctools_store *store) { return 0; }
+
+int ctools_store_sync(ctools_store *store) { return 0; }
+
+int ctools_store_get(ctools_store *store, const char *key, uint32_t key_len,
+                     ctools_store_record *rec) {
+  return 0;
+}
+
+int ctools_store_put(ctools_store *store, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len, uint32_t flags) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int ctools_store_delete(ctools_store *store, const char *key,
+                        uint32_t key_len) {
+  return 0;
+}
+
+int ctools_store_clear(ctools_store *store) { return 0; }
+
+int ctools_store_compact(ctools_store *store) { return 0; }
+
+int ctools_store_next(ctools_store *store, size_t *pos,
+                      ctools_store_record *rec) {
+  return 0;
+}
+
+size_t ctools_store_disk_bytes(ctools_store *store) { return 0; }
+
+#endif
@@ -0,0 +1,130 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _CTOOLS_STORE_H
+#define _CTOOLS_STORE_H
+#include <stddef.h>
+#include "ctools_config.h"
+#include "ctools_lfu_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A persistent, LFU evicting key-value store living in one directory.
+ *
+ * Values are appended to fixed size segment files (00000000.seg, ...) and
+ * never rewritten in place; deletions append a tombstone. Every record
+ * carries a CRC32, so a torn tail is detected and cut off.
+ *
+ * The index file maps a 64 bit key hash to the segment and offset of the
+ * latest record and keeps an LFU counter next to it, the same counter
+ * scheme as LFUCache. The index is trusted only if the store was closed
+ * cleanly; otherwise it is rebuilt by replaying the segments in order.
+ *
+ * Once more than max_bytes of records are live, entries with the lowest
+ * sampled weight are deleted. Dead bytes are reclaimed by compacting the
+ * oldest segment: its live records are copied forward and the file is
+ * removed. Compaction runs incrementally from put() and by request.
+ *
+ * A store is opened once at a time, guarded by a flock() on the index
+ * file: opening it again, from this process or another, fails with
+ * EWOULDBLOCK. */
+
+#define CTOOLS_STORE_MIN_SEGMENT (64 * 1024)
+#define CTOOLS_STORE_MAX_SEGMENT (256 * 1024 * 1024)
+/* Record flags at or above this bit belong to the store. */
+#define CTOOLS_STORE_USER_FLAGS 0x00ffffffU
+
+typedef struct {
+  uint64_t hash;
+  uint32_t segment; /* segment id + 1, 0 for empty, UINT32_MAX for removed */
+  uint32_t offset;
+  ctools_lfu_counter counter;
+} ctools_store_slot;
+
+typedef struct {
+  uint32_t id;
+  int fd;
+  char *base;
+  size_t size;
+  size_t used;
+  size_t live;
+} ctools_store_segment;
+
+typedef struct {
+  char *path;
+  int index_fd;
+  char *index_base;
+  size_t index_size;
+  ctools_store_slot *slots;
+  size_t mask;
+  size_t count;
+  size_t tombs;
+  ctools_store_segment *segments; /* oldest first, ids are contiguous */
+  size_t n_segments;
+  size_t segment_size;
+  size_t max_bytes;
+  size_t live_bytes;
+  int recovered; /* a dirty index was rebuilt when opening */
+  ctools_rng rng; /* eviction sampling */
+} ctools_store;
+
+typedef struct {
+  const char *key;
+  uint32_t key_len;
+  const char *value;
+  uint32_t value_len;
+  uint32_t flags;
+} ctools_store_record;
+
+/* Open or create the store in directory path. segment_size 0 picks one
+ * from max_bytes. Return NULL and set errno on failure. */
+ctools_store *ctools_store_open(const char *path, size_t max_bytes,
+                                size_t segment_size);
+/* Flush everything, mark the index clean and release the store. */
+int ctools_store_close(ctools_store *store);
+/* Flush segments and index to disk. The index stays dirty. */
+int ctools_store_sync(ctools_store *store);
+
+/* Look key up and bump its counter. Return 1 and fill rec on a hit, 0 on a
+ * miss. rec points into the mapping and is valid until the next write. */
+int ctools_store_get(ctools_store *store, const char *key, uint32_t key_len,
+                     ctools_store_record *rec);
+/* Insert or replace key. flags must fit CTOOLS_STORE_USER_FLAGS. Return 0,
+ * or -1 with errno set (EFBIG when the record exceeds a segment). */
+int ctools_store_put(ctools_store *store, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len, uint32_t flags);
+/* Return 1 if key was deleted, 0 if missing, -1 with errno set. */
+int ctools_store_delete(ctools_store *store, const char *key,
+                        uint32_t key_len);
+/* Delete every record and remove all segments but a fresh one. */
+int ctools_store_clear(ctools_store *store);
+/* Compact the oldest segment. Return 1 if a segment was removed, 0 when
+ * there is nothing to compact, -1 with errno set. */
+int ctools_store_compact(ctools_store *store);
+
+/* Iterate live records. Start with *pos == 0; return 1 and fill rec while
+ * records remain. The store must not be modified while iterating. */
+int ctools_store_next(ctools_store *store, size_t *pos,
+                      ctools_store_record *rec);
+
+/* Bytes held by segment files. */
+size_t ctools_store_disk_bytes(ctools_store *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CTOOLS_STORE_H */
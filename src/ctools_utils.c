@@ -14,9 +14,13 @@ limitations under the License.
 */
 #ifndef _CTOOLS_FUNCS_H
 #define _CTOOLS_FUNCS_H
+#define PY_SSIZE_T_CLEAN
+#define _CTOOLS_MODULE
 #include <Python.h>
 #include <datetime.h>
+#include "ctools_capi.h"
 #include "ctools_config.h"
+#include "ctools_hash.h"
 
 PyDoc_STRVAR(jump_consistent_hash__doc__,
              "jump_consistent_hash(key: int, num_buckets: int) -> int:\n\n\
@@ -34,14 +38,7 @@ static PyObject *Ctools__jump_hash(PyObject *m, PyObject *args) {
   int32_t num_buckets;
 
   if (!PyArg_ParseTuple(args, "Ki", &key, &num_buckets)) return NULL;
-
-  int64_t b = -1, j = 0;
-  while (j < num_buckets) {
-    b = j;
-    key = key * 2862933555777941757ULL + 1;
-    j = (b + 1) * ((double)(1LL << 31) / ((double)((key >> 33) + 1)));
-  }
-  return Py_BuildValue("i", b);
+  return Py_BuildValue("i", ctools_jump_consistent_hash(key, num_buckets));
 }
 
 #define PyDateTime_FromDate(year, month, day) \
@@ -65,78 +62,6 @@ static PyObject *Ctools__int8_to_datetime(PyObject *m, PyObject *date_integer) {
   }
   return PyDateTime_FromDate(date / 10000, date % 10000 / 100, date % 100);
 }
-static unsigned int fnv1a(const char *s, unsigned long len) {
-  unsigned int hash = 2166136261U;
-  for (unsigned long i = 0; i < len; i++) {
-    hash = hash ^ s[i];
-    /* hash * (1 << 24 + 1 << 8 + 0x93) */
-    hash +=
-        (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24);
-  }
-  return hash;
-}
-
-static unsigned int fnv1(const char *s, unsigned long len) {
-  unsigned int hash = 2166136261U;
-  for (unsigned long i = 0; i < len; i++) {
-    /* hash * (1 << 24 + 1 << 8 + 0x93) */
-    hash +=
-        (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24);
-    hash = hash ^ s[i];
-  }
-  return hash;
-}
-
-static unsigned int murmur_hash2(const char *str, unsigned long len) {
-  unsigned int hash, key;
-
-  hash = 0 ^ len;
-  while (len >= 4) {
-    key = str[0];
-    key |= str[1] << 8;
-    key |= str[2] << 16;
-    key |= str[3] << 24;
-
-    key *= 0x5bd1e995;
-    key ^= key >> 24;
-    key *= 0x5bd1e995;
-
-    hash *= 0x5bd1e995;
-    hash ^= key;
-
-    str += 4;
-    len -= 4;
-  }
-
-  switch (len) {
-    case 3:
-      hash ^= str[2] << 16;
-      /* fall through */
-    case 2:
-      hash ^= str[1] << 8;
-      /* fall through */
-    case 1:
-      hash ^= str[0];
-      hash *= 0x5bd1e995;
-    default:;
-  }
-
-  hash ^= hash >> 13;
-  hash *= 0x5bd1e995;
-  hash ^= hash >> 15;
-
-  return hash;
-}
-
-static unsigned int djb2(const char *str, unsigned long len) {
-  unsigned int hash = 5381;
-  for (unsigned long i = 0; i < len; i++) {
-    hash = ((hash << 5) + hash) + str[i];
-  }
-
-  return hash;
-}
-
 PyDoc_STRVAR(strhash__doc__,
              "strhash(s, method='fnv1a') -> int:\n\n\
     hash str with consistent value.\n\n\
@@ -147,27 +72,65 @@ PyDoc_STRVAR(strhash__doc__,
     :return: hash number\n\
     :rtype: int\n");
 
+typedef struct {
+  unsigned int (*bytes)(const char *s, unsigned long len);
+  unsigned int (*ucs)(const void *data, int kind, unsigned long len);
+} CtoolsStrHash;
+
+static const CtoolsStrHash ctools_strhash_fnv1a = {ctools_fnv1a,
+                                                   ctools_fnv1a_ucs};
+static const CtoolsStrHash ctools_strhash_fnv1 = {ctools_fnv1,
+                                                  ctools_fnv1_ucs};
+static const CtoolsStrHash ctools_strhash_djb2 = {ctools_djb2,
+                                                  ctools_djb2_ucs};
+static const CtoolsStrHash ctools_strhash_murmur = {ctools_murmur_hash2,
+                                                    ctools_murmur_hash2_ucs};
+
 static PyObject *Ctools__strhash(PyObject *m, PyObject *args) {
+  PyObject *obj;
+  const CtoolsStrHash *h = &ctools_strhash_fnv1a;
   const char *s, *method = NULL;
   Py_ssize_t len = 0, m_len = 0;
-  if (!PyArg_ParseTuple(args, "s#|s#", &s, &len, &method, &m_len)) return NULL;
-  if (method == NULL) return Py_BuildValue("I", fnv1a(s, len));
-  switch (method[0]) {
-    case 'f': {
-      if (m_len == 5)
-        return Py_BuildValue("I", fnv1a(s, len));
-      else
-        return Py_BuildValue("I", fnv1(s, len));
+  if (!PyArg_ParseTuple(args, "O|s#", &obj, &method, &m_len)) return NULL;
+  if (method != NULL) {
+    switch (method[0]) {
+      case 'f':
+        h = m_len == 5 ? &ctools_strhash_fnv1a : &ctools_strhash_fnv1;
+        break;
+      case 'd':
+        h = &ctools_strhash_djb2;
+        break;
+      case 'm':
+        h = &ctools_strhash_murmur;
+        break;
+      default: {
+        PyErr_SetString(PyExc_ValueError, "invalid method");
+        return NULL;
+      }
     }
-    case 'd':
-      return Py_BuildValue("I", djb2(s, len));
-    case 'm':
-      return Py_BuildValue("I", murmur_hash2(s, len));
-    default: {
-      PyErr_SetString(PyExc_ValueError, "invalid method");
-      return NULL;
+  }
+  /* "s#" would attach a UTF-8 copy to a non-ASCII str for the rest of its
+   * life, hash its PEP 393 storage directly instead. */
+  if (PyUnicode_Check(obj)) {
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(obj) < 0) return NULL;
+#endif
+    if (!PyUnicode_IS_ASCII(obj)) {
+      const void *data = PyUnicode_DATA(obj);
+      int kind = PyUnicode_KIND(obj);
+      len = PyUnicode_GET_LENGTH(obj);
+      if (kind != PyUnicode_1BYTE_KIND &&
+          ctools_utf8_length(data, kind, len) < 0) {
+        /* A lone surrogate, let the codec raise UnicodeEncodeError. */
+        PyObject *utf8 = PyUnicode_AsUTF8String(obj);
+        Py_XDECREF(utf8);
+        return NULL;
+      }
+      return Py_BuildValue("I", h->ucs(data, kind, len));
     }
   }
+  if (!PyArg_Parse(obj, "s#", &s, &len)) return NULL;
+  return Py_BuildValue("I", h->bytes(s, len));
 }
 
 static PyMethodDef ctools_utils_methods[] = {
@@ -191,10 +154,25 @@ static struct PyModuleDef _ctools_utils_module = {
     NULL,                 /* m_free */
 };
 
+static CToolsUtils_CAPI ctools_utils_capi = {
+    CTOOLS_CAPI_VERSION, ctools_fnv1a,        ctools_fnv1,
+    ctools_djb2,         ctools_murmur_hash2, ctools_jump_consistent_hash,
+};
+
 PyMODINIT_FUNC PyInit__ctools_utils(void) {
   PyDateTime_IMPORT;
 
-  return PyModule_Create(&_ctools_utils_module);
+  PyObject *m = PyModule_Create(&_ctools_utils_module);
+  if (m == NULL) return NULL;
+
+  PyObject *capi =
+      PyCapsule_New(&ctools_utils_capi, CTOOLS_UTILS_CAPSULE_NAME, NULL);
+  if (capi == NULL || PyModule_AddObject(m, "_C_API", capi)) {
+    Py_XDECREF(capi);
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
 }
 
 #endif  // _CTOOLS_FUNCS_H
@@ -0,0 +1,983 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* ctoolsd: a local cache daemon speaking the memcached text protocol.
+ *
+ * Every worker thread runs its own epoll loop; the listening socket is in
+ * all of them with EPOLLEXCLUSIVE so each connection wakes one worker.
+ * Items live in ctools_kv tables sharded by key hash, each behind a mutex,
+ * so workers only contend when they touch the same shard.
+ *
+ *   ctoolsd [-s unix_path | -p port] [-l addr] [-m megabytes] [-t threads]
+ *           [-S shards]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "ctools_hash.h"
+#include "ctools_kv.h"
+
+#define CTOOLSD_VERSION "0.0.5"
+#define MAX_KEY 250
+#define MAX_LINE 8192
+#define MAX_TOKENS (MAX_LINE / 2 + 1)
+#define READ_CHUNK 16384
+#define MAX_EVENTS 64
+#define ACCEPT_BACKOFF_MS 100
+#define REL_TIME_MAX (60 * 60 * 24 * 30)
+
+#define STAT_INCR(v) __atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+#define STAT_DECR(v) __atomic_sub_fetch(&(v), 1, __ATOMIC_RELAXED)
+#define STAT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+typedef struct {
+  pthread_mutex_t lock;
+  ctools_kv *kv;
+  uint64_t get_hits;
+  uint64_t get_misses;
+  uint64_t cmd_set;
+  uint64_t cmd_touch;
+  uint64_t delete_hits;
+  uint64_t delete_misses;
+  uint64_t incr_hits;
+  uint64_t incr_misses;
+  uint64_t decr_hits;
+  uint64_t decr_misses;
+  uint64_t cas_hits;
+  uint64_t cas_misses;
+  uint64_t cas_badval;
+  uint64_t touch_hits;
+  uint64_t touch_misses;
+} shard;
+
+enum { CMD_SET, CMD_ADD, CMD_REPLACE, CMD_APPEND, CMD_PREPEND, CMD_CAS };
+
+typedef struct conn {
+  int fd;
+  char *rbuf;
+  size_t rlen, rcap;
+  char *wbuf;
+  size_t wlen, wpos, wcap;
+  size_t swallow; /* payload bytes of a rejected command left to skip */
+  int skip_line;  /* skip up to the next newline after a bad data chunk */
+  int writing;    /* EPOLLOUT is registered */
+  int closing;    /* close once wbuf is drained */
+  /* a storage command waiting for its data block */
+  int pending;
+  int cmd;
+  int noreply;
+  char key[MAX_KEY];
+  uint32_t key_len;
+  uint32_t flags;
+  uint32_t exptime;
+  uint32_t bytes;
+  uint64_t cas;
+  struct conn *prev, *next;
+} conn;
+
+typedef struct {
+  pthread_t thread;
+  int epfd;
+  int stop_fd;
+  conn *conns;
+  int64_t accept_resume; /* ms the paused listener comes back at, 0 if on */
+} worker;
+
+static struct {
+  shard *shards;
+  int n_shards;
+  worker *workers;
+  int n_threads;
+  int listen_fd;
+  size_t max_bytes;
+  time_t started;
+  uint64_t curr_conns;
+  uint64_t total_conns;
+  uint64_t cmd_get;
+  uint64_t cmd_flush;
+} server;
+
+static uint32_t now_seconds(void) { return (uint32_t)time(NULL); }
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* memcached exptime: 0 never, up to 30 days relative, else absolute. */
+static uint32_t real_exptime(int64_t exptime, uint32_t now) {
+  if (exptime == 0) return 0;
+  if (exptime < 0) return 1;
+  if (exptime <= REL_TIME_MAX) return now + (uint32_t)exptime;
+  return (uint32_t)exptime;
+}
+
+static shard *shard_of(const char *key, uint32_t key_len) {
+  uint64_t h = ctools_fnv1a_64(key, key_len);
+  return &server.shards[(h >> 32) % (uint64_t)server.n_shards];
+}
+
+static int parse_u64(const char *s, uint64_t *out) {
+  char *end;
+  if (!*s || *s == '-') return 0;
+  errno = 0;
+  *out = strtoull(s, &end, 10);
+  return !errno && !*end;
+}
+
+static int parse_i64(const char *s, int64_t *out) {
+  char *end;
+  if (!*s) return 0;
+  errno = 0;
+  *out = strtoll(s, &end, 10);
+  return !errno && !*end;
+}
+
+/* ---- output ---- */
+
+static int out_reserve(conn *c, size_t n) {
+  if (c->wlen + n <= c->wcap) return 0;
+  size_t cap = c->wcap ? c->wcap : 4096;
+  while (cap < c->wlen + n) cap *= 2;
+  char *buf = (char *)realloc(c->wbuf, cap);
+  if (!buf) return -1;
+  c->wbuf = buf;
+  c->wcap = cap;
+  return 0;
+}
+
+static void out_bytes(conn *c, const char *s, size_t n) {
+  if (out_reserve(c, n)) {
+    c->closing = 1;
+    return;
+  }
+  memcpy(c->wbuf + c->wlen, s, n);
+  c->wlen += n;
+}
+
+static void out_str(conn *c, const char *s) { out_bytes(c, s, strlen(s)); }
+
+static void out_fmt(conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void out_fmt(conn *c, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0 || out_reserve(c, (size_t)n + 1)) {
+    c->closing = 1;
+    return;
+  }
+  va_start(ap, fmt);
+  vsnprintf(c->wbuf + c->wlen, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  c->wlen += (size_t)n;
+}
+
+/* ---- commands ---- */
+
+static void cmd_get(conn *c, char **tokens, int ntokens, int with_cas) {
+  uint32_t now = now_seconds();
+  if (ntokens < 2) {
+    out_str(c, "ERROR\r\n");
+    return;
+  }
+  for (int i = 1; i < ntokens; i++) {
+    size_t len = strlen(tokens[i]);
+    if (len > MAX_KEY) {
+      out_str(c, "CLIENT_ERROR bad command line format\r\n");
+      return;
+    }
+    shard *s = shard_of(tokens[i], (uint32_t)len);
+    STAT_INCR(server.cmd_get);
+    pthread_mutex_lock(&s->lock);
+    ctools_kv_item *item = ctools_kv_get(s->kv, tokens[i], (uint32_t)len, now);
+    if (item) {
+      s->get_hits++;
+      if (with_cas) {
+        out_fmt(c, "VALUE %s %u %u %" PRIu64 "\r\n", tokens[i], item->flags,
+                item->value_len, item->cas);
+      } else {
+        out_fmt(c, "VALUE %s %u %u\r\n", tokens[i], item->flags,
+                item->value_len);
+      }
+      out_bytes(c, CTOOLS_KV_VALUE(item), item->value_len);
+      out_str(c, "\r\n");
+    } else {
+      s->get_misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  out_str(c, "END\r\n");
+}
+
+/* Parse "<cmd> <key> <flags> <exptime> <bytes> [cas] [noreply]" and wait
+ * for the data block. */
+static void cmd_store_begin(conn *c, int cmd, char **tokens, int ntokens) {
+  int nargs = cmd == CMD_CAS ? 6 : 5;
+  uint64_t flags, bytes, cas = 0;
+  int64_t exptime;
+  size_t len;
+
+  if (ntokens != nargs && !(ntokens == nargs + 1 &&
+                            !strcmp(tokens[nargs], "noreply"))) {
+    out_str(c, "ERROR\r\n");
+    return;
+  }
+  len = strlen(tokens[1]);
+  if (len > MAX_KEY || !parse_u64(tokens[2], &flags) || flags > UINT32_MAX ||
+      !parse_i64(tokens[3], &exptime) || !parse_u64(tokens[4], &bytes) ||
+      bytes > INT32_MAX || (cmd == CMD_CAS && !parse_u64(tokens[5], &cas))) {
+    out_str(c, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+  c->noreply = ntokens == nargs + 1;
+  if (CTOOLS_KV_ITEM_SIZE(len, bytes) >
+      server.max_bytes / (size_t)server.n_shards) {
+    out_str(c, "SERVER_ERROR object too large for cache\r\n");
+    c->swallow = bytes + 2;
+    return;
+  }
+  c->pending = 1;
+  c->cmd = cmd;
+  memcpy(c->key, tokens[1], len);
+  c->key_len = (uint32_t)len;
+  c->flags = (uint32_t)flags;
+  c->exptime = real_exptime(exptime, now_seconds());
+  c->bytes = (uint32_t)bytes;
+  c->cas = cas;
+}
+
+static const char *store_item(conn *c, const char *data) {
+  shard *s = shard_of(c->key, c->key_len);
+  uint32_t now = now_seconds();
+  ctools_kv_item *old, *item;
+  const char *reply = "STORED\r\n";
+  uint32_t len = c->bytes;
+
+  pthread_mutex_lock(&s->lock);
+  s->cmd_set++;
+  old = c->cmd == CMD_SET ? NULL
+                          : ctools_kv_get(s->kv, c->key, c->key_len, now);
+  switch (c->cmd) {
+    case CMD_ADD:
+      if (old) reply = "NOT_STORED\r\n";
+      break;
+    case CMD_REPLACE:
+      if (!old) reply = "NOT_STORED\r\n";
+      break;
+    case CMD_APPEND:
+    case CMD_PREPEND:
+      if (!old) reply = "NOT_STORED\r\n";
+      else len += old->value_len;
+      break;
+    case CMD_CAS:
+      if (!old) {
+        s->cas_misses++;
+        reply = "NOT_FOUND\r\n";
+      } else if (old->cas != c->cas) {
+        s->cas_badval++;
+        reply = "EXISTS\r\n";
+      } else {
+        s->cas_hits++;
+      }
+      break;
+  }
+  if (strcmp(reply, "STORED\r\n")) goto done;
+
+  if (!(item = ctools_kv_alloc(c->key, c->key_len, len, c->flags,
+                               c->exptime))) {
+    reply = "SERVER_ERROR out of memory storing object\r\n";
+    goto done;
+  }
+  if (c->cmd == CMD_APPEND) {
+    item->flags = old->flags;
+    item->exptime = old->exptime;
+    memcpy(CTOOLS_KV_VALUE(item), CTOOLS_KV_VALUE(old), old->value_len);
+    memcpy(CTOOLS_KV_VALUE(item) + old->value_len, data, c->bytes);
+  } else if (c->cmd == CMD_PREPEND) {
+    item->flags = old->flags;
+    item->exptime = old->exptime;
+    memcpy(CTOOLS_KV_VALUE(item), data, c->bytes);
+    memcpy(CTOOLS_KV_VALUE(item) + c->bytes, CTOOLS_KV_VALUE(old),
+           old->value_len);
+  } else {
+    memcpy(CTOOLS_KV_VALUE(item), data, c->bytes);
+  }
+  if (ctools_kv_link(s->kv, item, now)) {
+    reply = errno == E2BIG ? "SERVER_ERROR object too large for cache\r\n"
+                           : "SERVER_ERROR out of memory storing object\r\n";
+    free(item);
+  }
+
+done:
+  pthread_mutex_unlock(&s->lock);
+  return reply;
+}
+
+static void cmd_delete(conn *c, char **tokens, int ntokens) {
+  int noreply = ntokens == 3 && !strcmp(tokens[2], "noreply");
+  size_t len;
+  if (ntokens != 2 && !noreply) {
+    out_str(c, "CLIENT_ERROR bad command line format.  "
+               "Usage: delete <key> [noreply]\r\n");
+    return;
+  }
+  if ((len = strlen(tokens[1])) > MAX_KEY) {
+    out_str(c, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+  shard *s = shard_of(tokens[1], (uint32_t)len);
+  pthread_mutex_lock(&s->lock);
+  int deleted =
+      ctools_kv_delete(s->kv, tokens[1], (uint32_t)len, now_seconds());
+  if (deleted) s->delete_hits++;
+  else s->delete_misses++;
+  pthread_mutex_unlock(&s->lock);
+  if (!noreply) out_str(c, deleted ? "DELETED\r\n" : "NOT_FOUND\r\n");
+}
+
+static void cmd_arithmetic(conn *c, char **tokens, int ntokens, int incr) {
+  int noreply = ntokens == 4 && !strcmp(tokens[3], "noreply");
+  uint32_t now = now_seconds();
+  uint64_t delta, value;
+  char digits[24];
+  size_t len;
+
+  if (ntokens != 3 && !noreply) {
+    out_str(c, "ERROR\r\n");
+    return;
+  }
+  if ((len = strlen(tokens[1])) > MAX_KEY) {
+    out_str(c, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+  if (!parse_u64(tokens[2], &delta)) {
+    out_str(c, "CLIENT_ERROR invalid numeric delta argument\r\n");
+    return;
+  }
+  shard *s = shard_of(tokens[1], (uint32_t)len);
+  pthread_mutex_lock(&s->lock);
+  ctools_kv_item *old = ctools_kv_get(s->kv, tokens[1], (uint32_t)len, now);
+  if (!old) {
+    if (incr) s->incr_misses++;
+    else s->decr_misses++;
+    pthread_mutex_unlock(&s->lock);
+    if (!noreply) out_str(c, "NOT_FOUND\r\n");
+    return;
+  }
+  if (old->value_len >= sizeof(digits)) goto non_numeric;
+  memcpy(digits, CTOOLS_KV_VALUE(old), old->value_len);
+  digits[old->value_len] = '\0';
+  /* memcached pads decremented values with spaces; accept them */
+  for (size_t i = old->value_len; i > 0 && digits[i - 1] == ' '; i--)
+    digits[i - 1] = '\0';
+  if (!parse_u64(digits, &value)) goto non_numeric;
+
+  if (incr) {
+    s->incr_hits++;
+    value += delta; /* wraps like memcached */
+  } else {
+    s->decr_hits++;
+    value = delta > value ? 0 : value - delta;
+  }
+  len = (size_t)snprintf(digits, sizeof(digits), "%" PRIu64, value);
+  ctools_kv_item *item = ctools_kv_alloc(tokens[1], old->key_len,
+                                         (uint32_t)len, old->flags,
+                                         old->exptime);
+  if (!item) {
+    pthread_mutex_unlock(&s->lock);
+    out_str(c, "SERVER_ERROR out of memory\r\n");
+    return;
+  }
+  memcpy(CTOOLS_KV_VALUE(item), digits, len);
+  if (ctools_kv_link(s->kv, item, now)) {
+    free(item);
+    pthread_mutex_unlock(&s->lock);
+    out_str(c, "SERVER_ERROR out of memory\r\n");
+    return;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (!noreply) {
+    out_bytes(c, digits, len);
+    out_str(c, "\r\n");
+  }
+  return;
+
+non_numeric:
+  pthread_mutex_unlock(&s->lock);
+  out_str(c, "CLIENT_ERROR cannot increment or decrement non-numeric "
+             "value\r\n");
+}
+
+static void cmd_touch(conn *c, char **tokens, int ntokens) {
+  int noreply = ntokens == 4 && !strcmp(tokens[3], "noreply");
+  uint32_t now = now_seconds();
+  int64_t exptime;
+  size_t len;
+  if ((ntokens != 3 && !noreply) || (len = strlen(tokens[1])) > MAX_KEY ||
+      !parse_i64(tokens[2], &exptime)) {
+    out_str(c, "CLIENT_ERROR bad command line format\r\n");
+    return;
+  }
+  shard *s = shard_of(tokens[1], (uint32_t)len);
+  pthread_mutex_lock(&s->lock);
+  s->cmd_touch++;
+  ctools_kv_item *item = ctools_kv_get(s->kv, tokens[1], (uint32_t)len, now);
+  if (item) {
+    s->touch_hits++;
+    item->exptime = real_exptime(exptime, now);
+  } else {
+    s->touch_misses++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (!noreply) out_str(c, item ? "TOUCHED\r\n" : "NOT_FOUND\r\n");
+}
+
+static void cmd_flush_all(conn *c, char **tokens, int ntokens) {
+  int noreply = !strcmp(tokens[ntokens - 1], "noreply");
+  /* a delay argument is accepted, but the flush is immediate */
+  STAT_INCR(server.cmd_flush);
+  for (int i = 0; i < server.n_shards; i++) {
+    pthread_mutex_lock(&server.shards[i].lock);
+    ctools_kv_flush(server.shards[i].kv);
+    pthread_mutex_unlock(&server.shards[i].lock);
+  }
+  if (!noreply) out_str(c, "OK\r\n");
+}
+
+#define STAT_FIELD(name) total.name += s->name;
+
+static void cmd_stats(conn *c) {
+  shard total;
+  uint64_t items = 0, bytes = 0, evictions = 0, expired = 0;
+  uint32_t now = now_seconds();
+
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < server.n_shards; i++) {
+    shard *s = &server.shards[i];
+    pthread_mutex_lock(&s->lock);
+    STAT_FIELD(get_hits)
+    STAT_FIELD(get_misses)
+    STAT_FIELD(cmd_set)
+    STAT_FIELD(cmd_touch)
+    STAT_FIELD(delete_hits)
+    STAT_FIELD(delete_misses)
+    STAT_FIELD(incr_hits)
+    STAT_FIELD(incr_misses)
+    STAT_FIELD(decr_hits)
+    STAT_FIELD(decr_misses)
+    STAT_FIELD(cas_hits)
+    STAT_FIELD(cas_misses)
+    STAT_FIELD(cas_badval)
+    STAT_FIELD(touch_hits)
+    STAT_FIELD(touch_misses)
+    items += s->kv->count;
+    bytes += s->kv->bytes;
+    evictions += s->kv->evictions;
+    expired += s->kv->expired;
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  out_fmt(c, "STAT pid %d\r\n", (int)getpid());
+  out_fmt(c, "STAT uptime %u\r\n", now - (uint32_t)server.started);
+  out_fmt(c, "STAT time %u\r\n", now);
+  out_fmt(c, "STAT version %s\r\n", CTOOLSD_VERSION);
+  out_fmt(c, "STAT pointer_size %d\r\n", (int)(8 * sizeof(void *)));
+  out_fmt(c, "STAT curr_connections %" PRIu64 "\r\n",
+          STAT_LOAD(server.curr_conns));
+  out_fmt(c, "STAT total_connections %" PRIu64 "\r\n",
+          STAT_LOAD(server.total_conns));
+  out_fmt(c, "STAT cmd_get %" PRIu64 "\r\n", STAT_LOAD(server.cmd_get));
+  out_fmt(c, "STAT cmd_set %" PRIu64 "\r\n", total.cmd_set);
+  out_fmt(c, "STAT cmd_flush %" PRIu64 "\r\n", STAT_LOAD(server.cmd_flush));
+  out_fmt(c, "STAT cmd_touch %" PRIu64 "\r\n", total.cmd_touch);
+  out_fmt(c, "STAT get_hits %" PRIu64 "\r\n", total.get_hits);
+  out_fmt(c, "STAT get_misses %" PRIu64 "\r\n", total.get_misses);
+  out_fmt(c, "STAT get_expired %" PRIu64 "\r\n", expired);
+  out_fmt(c, "STAT delete_hits %" PRIu64 "\r\n", total.delete_hits);
+  out_fmt(c, "STAT delete_misses %" PRIu64 "\r\n", total.delete_misses);
+  out_fmt(c, "STAT incr_hits %" PRIu64 "\r\n", total.incr_hits);
+  out_fmt(c, "STAT incr_misses %" PRIu64 "\r\n", total.incr_misses);
+  out_fmt(c, "STAT decr_hits %" PRIu64 "\r\n", total.decr_hits);
+  out_fmt(c, "STAT decr_misses %" PRIu64 "\r\n", total.decr_misses);
+  out_fmt(c, "STAT cas_hits %" PRIu64 "\r\n", total.cas_hits);
+  out_fmt(c, "STAT cas_misses %" PRIu64 "\r\n", total.cas_misses);
+  out_fmt(c, "STAT cas_badval %" PRIu64 "\r\n", total.cas_badval);
+  out_fmt(c, "STAT touch_hits %" PRIu64 "\r\n", total.touch_hits);
+  out_fmt(c, "STAT touch_misses %" PRIu64 "\r\n", total.touch_misses);
+  out_fmt(c, "STAT threads %d\r\n", server.n_threads);
+  out_fmt(c, "STAT shards %d\r\n", server.n_shards);
+  out_fmt(c, "STAT limit_maxbytes %zu\r\n", server.max_bytes);
+  out_fmt(c, "STAT bytes %" PRIu64 "\r\n", bytes);
+  out_fmt(c, "STAT curr_items %" PRIu64 "\r\n", items);
+  out_fmt(c, "STAT evictions %" PRIu64 "\r\n", evictions);
+  out_str(c, "END\r\n");
+}
+
+static int tokenize(char *line, char **tokens) {
+  int n = 0;
+  char *p = line;
+  while (*p) {
+    while (*p == ' ') *p++ = '\0';
+    if (!*p) break;
+    if (n == MAX_TOKENS) return -1;
+    tokens[n++] = p;
+    while (*p && *p != ' ') p++;
+  }
+  return n;
+}
+
+/* Run one command line, NUL terminated without its line ending. */
+static void conn_command(conn *c, char *line) {
+  char *tokens[MAX_TOKENS];
+  int n = tokenize(line, tokens);
+  const char *cmd;
+
+  if (n <= 0) {
+    out_str(c, "ERROR\r\n");
+    return;
+  }
+  cmd = tokens[0];
+  if (!strcmp(cmd, "get")) {
+    cmd_get(c, tokens, n, 0);
+  } else if (!strcmp(cmd, "gets")) {
+    cmd_get(c, tokens, n, 1);
+  } else if (!strcmp(cmd, "set")) {
+    cmd_store_begin(c, CMD_SET, tokens, n);
+  } else if (!strcmp(cmd, "add")) {
+    cmd_store_begin(c, CMD_ADD, tokens, n);
+  } else if (!strcmp(cmd, "replace")) {
+    cmd_store_begin(c, CMD_REPLACE, tokens, n);
+  } else if (!strcmp(cmd, "append")) {
+    cmd_store_begin(c, CMD_APPEND, tokens, n);
+  } else if (!strcmp(cmd, "prepend")) {
+    cmd_store_begin(c, CMD_PREPEND, tokens, n);
+  } else if (!strcmp(cmd, "cas")) {
+    cmd_store_begin(c, CMD_CAS, tokens, n);
+  } else if (!strcmp(cmd, "delete") && n >= 2) {
+    cmd_delete(c, tokens, n);
+  } else if (!strcmp(cmd, "incr") && n >= 3) {
+    cmd_arithmetic(c, tokens, n, 1);
+  } else if (!strcmp(cmd, "decr") && n >= 3) {
+    cmd_arithmetic(c, tokens, n, 0);
+  } else if (!strcmp(cmd, "touch") && n >= 3) {
+    cmd_touch(c, tokens, n);
+  } else if (!strcmp(cmd, "stats") && n == 1) {
+    cmd_stats(c);
+  } else if (!strcmp(cmd, "flush_all")) {
+    cmd_flush_all(c, tokens, n);
+  } else if (!strcmp(cmd, "version")) {
+    out_str(c, "VERSION " CTOOLSD_VERSION "\r\n");
+  } else if (!strcmp(cmd, "verbosity")) {
+    if (strcmp(tokens[n - 1], "noreply")) out_str(c, "OK\r\n");
+  } else if (!strcmp(cmd, "quit")) {
+    c->closing = 1;
+  } else {
+    out_str(c, "ERROR\r\n");
+  }
+}
+
+/* Consume as many complete commands from rbuf as possible. */
+static void conn_process(conn *c) {
+  size_t pos = 0;
+  while (!c->closing && pos < c->rlen) {
+    char *buf = c->rbuf + pos;
+    size_t avail = c->rlen - pos;
+
+    if (c->swallow) {
+      size_t n = c->swallow < avail ? c->swallow : avail;
+      c->swallow -= n;
+      pos += n;
+      continue;
+    }
+    if (c->skip_line) {
+      char *nl = (char *)memchr(buf, '\n', avail);
+      pos += nl ? (size_t)(nl - buf) + 1 : avail;
+      c->skip_line = !nl;
+      continue;
+    }
+    if (c->pending) {
+      if (avail < (size_t)c->bytes + 2) break;
+      c->pending = 0;
+      if (memcmp(buf + c->bytes, "\r\n", 2)) {
+        out_str(c, "CLIENT_ERROR bad data chunk\r\n");
+        pos += c->bytes;
+        c->skip_line = 1;
+        continue;
+      }
+      const char *reply = store_item(c, buf);
+      if (!c->noreply) out_str(c, reply);
+      pos += c->bytes + 2;
+      continue;
+    }
+
+    char *nl = (char *)memchr(buf, '\n', avail);
+    if (!nl) {
+      if (avail > MAX_LINE) {
+        out_str(c, "CLIENT_ERROR line too long\r\n");
+        c->closing = 1;
+      }
+      break;
+    }
+    pos += (size_t)(nl - buf) + 1;
+    if (nl > buf && nl[-1] == '\r') nl--;
+    *nl = '\0';
+    conn_command(c, buf);
+  }
+  memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+  c->rlen -= pos;
+}
+
+/* ---- event loop ---- */
+
+static void conn_close(worker *w, conn *c) {
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  if (c->prev) c->prev->next = c->next;
+  else w->conns = c->next;
+  if (c->next) c->next->prev = c->prev;
+  free(c->rbuf);
+  free(c->wbuf);
+  free(c);
+  STAT_DECR(server.curr_conns);
+}
+
+/* Send what we can; return -1 if the connection went away. */
+static int conn_flush(worker *w, conn *c) {
+  while (c->wpos < c->wlen) {
+    ssize_t n = send(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    c->wpos += (size_t)n;
+  }
+  if (c->wpos == c->wlen) {
+    c->wpos = c->wlen = 0;
+    if (c->closing) return -1;
+  }
+  int writing = c->wlen > 0;
+  if (writing != c->writing) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->writing = writing;
+  }
+  return 0;
+}
+
+static void conn_read(worker *w, conn *c) {
+  if (c->rcap - c->rlen < READ_CHUNK) {
+    size_t cap = c->rcap ? c->rcap * 2 : READ_CHUNK * 2;
+    if (c->pending && cap < c->rlen + c->bytes + 2 + READ_CHUNK)
+      cap = c->rlen + c->bytes + 2 + READ_CHUNK;
+    char *buf = (char *)realloc(c->rbuf, cap);
+    if (!buf) {
+      conn_close(w, c);
+      return;
+    }
+    c->rbuf = buf;
+    c->rcap = cap;
+  }
+  ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    conn_close(w, c);
+    return;
+  }
+  if (n < 0) return;
+  c->rlen += (size_t)n;
+  conn_process(c);
+  if (conn_flush(w, c)) conn_close(w, c);
+}
+
+/* Out of descriptors the pending connection stays queued and the level
+ * triggered listener would wake the worker again at once, so the worker
+ * leaves it alone for a while. */
+static void worker_pause_accept(worker *w) {
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, server.listen_fd, NULL);
+  w->accept_resume = now_ms() + ACCEPT_BACKOFF_MS;
+}
+
+static void worker_resume_accept(worker *w) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = &server.listen_fd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, server.listen_fd, &ev))
+    w->accept_resume = now_ms() + ACCEPT_BACKOFF_MS;
+  else
+    w->accept_resume = 0;
+}
+
+static void worker_accept(worker *w) {
+  for (;;) {
+    int fd = accept4(server.listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM)
+        worker_pause_accept(w);
+      return;
+    }
+    conn *c = (conn *)calloc(1, sizeof(conn));
+    struct epoll_event ev;
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->next = w->conns;
+    if (w->conns) w->conns->prev = c;
+    w->conns = c;
+    STAT_INCR(server.curr_conns);
+    STAT_INCR(server.total_conns);
+  }
+}
+
+static void *worker_run(void *arg) {
+  worker *w = (worker *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    int timeout = -1;
+    if (w->accept_resume) {
+      int64_t left = w->accept_resume - now_ms();
+      timeout = left > 0 ? (int)left : 0;
+    }
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+    if (w->accept_resume && now_ms() >= w->accept_resume)
+      worker_resume_accept(w);
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &server.listen_fd) {
+        worker_accept(w);
+      } else if (ptr == &w->stop_fd) {
+        while (w->conns) conn_close(w, w->conns);
+        return NULL;
+      } else {
+        conn *c = (conn *)ptr;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          conn_close(w, c);
+        } else if (events[i].events & EPOLLIN) {
+          conn_read(w, c);
+        } else if (conn_flush(w, c)) {
+          conn_close(w, c);
+        }
+      }
+    }
+  }
+}
+
+/* Set up the descriptors of w. All workers are set up before any starts,
+ * so connections accepted early can't take the descriptors they need. */
+static int worker_init(worker *w) {
+  struct epoll_event ev;
+  w->conns = NULL;
+  w->accept_resume = 0;
+  if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+  if ((w->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) return -1;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->stop_fd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->stop_fd, &ev)) return -1;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = &server.listen_fd;
+  return epoll_ctl(w->epfd, EPOLL_CTL_ADD, server.listen_fd, &ev);
+}
+
+static int listen_on(const char *unix_path, const char *addr, int port) {
+  int fd, one = 1;
+  if (unix_path) {
+    struct sockaddr_un sa;
+    if (strlen(unix_path) >= sizeof(sa.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, unix_path);
+    unlink(unix_path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) goto fail;
+  } else {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) goto fail;
+  }
+  if (listen(fd, 1024)) goto fail;
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: ctoolsd [-s unix_path | -p port] [-l addr] [-m megabytes]\n"
+          "               [-t threads] [-S shards]\n"
+          "  -s  listen on a unix socket\n"
+          "  -p  TCP port, default 11211\n"
+          "  -l  TCP address, default 127.0.0.1\n"
+          "  -m  memory for items in megabytes, default 64\n"
+          "  -t  worker threads, default 4\n"
+          "  -S  cache shards, default 16\n");
+}
+
+int main(int argc, char **argv) {
+  const char *unix_path = NULL, *addr = "127.0.0.1";
+  long port = 11211, megabytes = 64, threads = 4, shards = 16;
+  sigset_t signals;
+  int opt, sig;
+
+  while ((opt = getopt(argc, argv, "s:p:l:m:t:S:h")) != -1) {
+    switch (opt) {
+      case 's':
+        unix_path = optarg;
+        break;
+      case 'p':
+        port = strtol(optarg, NULL, 10);
+        break;
+      case 'l':
+        addr = optarg;
+        break;
+      case 'm':
+        megabytes = strtol(optarg, NULL, 10);
+        break;
+      case 't':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      case 'S':
+        shards = strtol(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (port <= 0 || port > 65535 || megabytes <= 0 || threads <= 0 ||
+      threads > 1024 || shards <= 0 || shards > 65536) {
+    usage();
+    return 2;
+  }
+
+  /* workers inherit the mask, only main handles shutdown signals */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  server.started = time(NULL);
+  server.max_bytes = (size_t)megabytes * 1024 * 1024;
+  server.n_shards = (int)shards;
+  server.shards = (shard *)calloc((size_t)shards, sizeof(shard));
+  server.n_threads = (int)threads;
+  server.workers = (worker *)calloc((size_t)threads, sizeof(worker));
+  if (!server.shards || !server.workers) {
+    perror("ctoolsd");
+    return 1;
+  }
+  for (int i = 0; i < server.n_shards; i++) {
+    pthread_mutex_init(&server.shards[i].lock, NULL);
+    server.shards[i].kv = ctools_kv_new(server.max_bytes / (size_t)shards);
+    if (!server.shards[i].kv) {
+      perror("ctoolsd");
+      return 1;
+    }
+  }
+
+  if ((server.listen_fd = listen_on(unix_path, addr, (int)port)) < 0) {
+    perror("ctoolsd: listen");
+    return 1;
+  }
+  for (int i = 0; i < server.n_threads; i++) {
+    if (worker_init(&server.workers[i])) {
+      perror("ctoolsd: worker");
+      return 1;
+    }
+  }
+  for (int i = 0; i < server.n_threads; i++) {
+    if (pthread_create(&server.workers[i].thread, NULL, worker_run,
+                       &server.workers[i])) {
+      perror("ctoolsd: worker");
+      return 1;
+    }
+  }
+  if (unix_path) {
+    fprintf(stderr, "ctoolsd %s listening on %s\n", CTOOLSD_VERSION,
+            unix_path);
+  } else {
+    fprintf(stderr, "ctoolsd %s listening on %s:%ld\n", CTOOLSD_VERSION, addr,
+            port);
+  }
+
+  sigwait(&signals, &sig);
+
+  for (int i = 0; i < server.n_threads; i++) {
+    uint64_t one = 1;
+    if (write(server.workers[i].stop_fd, &one, sizeof(one)) < 0) continue;
+  }
+  for (int i = 0; i < server.n_threads; i++) {
+    pthread_join(server.workers[i].thread, NULL);
+    close(server.workers[i].epfd);
+    close(server.workers[i].stop_fd);
+  }
+  close(server.listen_fd);
+  if (unix_path) unlink(unix_path);
+  for (int i = 0; i < server.n_shards; i++) {
+    ctools_kv_free(server.shards[i].kv);
+    pthread_mutex_destroy(&server.shards[i].lock);
+  }
+  free(server.shards);
+  free(server.workers);
+  return 0;
+}
@@ -0,0 +1,585 @@
+/* Copyright 2019 ko-han. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctools_arena.h"
+#include "ctools_hash.h"
+#include "ctools_kv.h"
+#include "ctools_lfu_core.h"
+#include "ctools_spill.h"
+#include "ctools_store.h"
+
+static int failures = 0;
+
+#define CHECK_EQ(expr, expected)                                      \
+  do {                                                                \
+    unsigned long long _v = (unsigned long long)(expr);               \
+    if (_v != (unsigned long long)(expected)) {                       \
+      fprintf(stderr, "%s:%d: %s == %llu, expected %llu\n", __FILE__, \
+              __LINE__, #expr, _v, (unsigned long long)(expected));   \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+/* Values must stay identical to ctools.strhash / jump_consistent_hash. */
+static void test_hash(void) {
+  CHECK_EQ(ctools_fnv1a("abc", 3), 440920331U);
+  CHECK_EQ(ctools_fnv1("abc", 3), 1134309195U);
+  CHECK_EQ(ctools_djb2("abc", 3), 193485963U);
+  CHECK_EQ(ctools_murmur_hash2("abc", 3), 324500635U);
+  CHECK_EQ(ctools_fnv1a("hello ctools", 12), 3169651241U);
+  CHECK_EQ(ctools_murmur_hash2("hello ctools", 12), 2115523439U);
+  CHECK_EQ(ctools_fnv1a("", 0), 2166136261U);
+  CHECK_EQ(ctools_djb2("", 0), 5381U);
+}
+
+/* The PEP 393 kernels must agree with the byte kernels on the UTF-8 form. */
+static void test_hash_ucs(void) {
+  static const uint8_t ucs1[] = {'c', 0xe9, 'f', 0xff, 'a', 'b', 'c'};
+  static const uint16_t ucs2[] = {0x6587, 0x5b57, 'x', 0x30c6, 0xd14d, 0xe9};
+  static const uint32_t ucs4[] = {0x1f600, 'a', 0x4e2d, 0x10ffff, 0x7ff};
+  static const char utf8_1[] = "c\xc3\xa9" "f\xc3\xbf" "abc";
+  static const char utf8_2[] =
+      "\xe6\x96\x87\xe5\xad\x97x\xe3\x83\x86\xed\x85\x8d\xc3\xa9";
+  static const char utf8_4[] =
+      "\xf0\x9f\x98\x80" "a\xe4\xb8\xad\xf4\x8f\xbf\xbf\xdf\xbf";
+  static const uint16_t surrogate[] = {'a', 0xd800, 'b'};
+
+#define CHECK_UCS(data, kind, utf8)                                          \
+  do {                                                                       \
+    unsigned long n = sizeof(data) / (kind), len = sizeof(utf8) - 1;         \
+    CHECK_EQ(ctools_utf8_length(data, kind, n), len);                        \
+    CHECK_EQ(ctools_fnv1a_ucs(data, kind, n), ctools_fnv1a(utf8, len));      \
+    CHECK_EQ(ctools_fnv1_ucs(data, kind, n), ctools_fnv1(utf8, len));        \
+    CHECK_EQ(ctools_djb2_ucs(data, kind, n), ctools_djb2(utf8, len));        \
+    for (unsigned long i = 0; i <= n; i++) {                                 \
+      CHECK_EQ(ctools_murmur_hash2_ucs(data, kind, i),                       \
+               ctools_murmur_hash2(                                          \
+                   utf8, (unsigned long)ctools_utf8_length(data, kind, i))); \
+    }                                                                        \
+  } while (0)
+  CHECK_UCS(ucs1, 1, utf8_1);
+  CHECK_UCS(ucs2, 2, utf8_2);
+  CHECK_UCS(ucs4, 4, utf8_4);
+#undef CHECK_UCS
+  CHECK_EQ(ctools_utf8_length(surrogate, 2, 3), -1);
+}
+
+static void test_jump_consistent_hash(void) {
+  CHECK_EQ(ctools_jump_consistent_hash(65535, 1024), 874);
+  CHECK_EQ(ctools_jump_consistent_hash(1, 10), 6);
+  CHECK_EQ(ctools_jump_consistent_hash(123456789, 100), 34);
+  for (uint64_t key = 0; key < 1000; key++) {
+    int32_t b = ctools_jump_consistent_hash(key, 17);
+    CHECK_EQ(b >= 0 && b < 17, 1);
+  }
+}
+
+static void test_lfu_counter(void) {
+  ctools_lfu_counter c;
+  ctools_lfu_counter_init(&c, 100);
+  CHECK_EQ(ctools_lfu_weight(&c, 100), CTOOLS_LFU_INIT_VAL);
+  CHECK_EQ(ctools_lfu_weight(&c, 110), CTOOLS_LFU_INIT_VAL - 10);
+  CHECK_EQ(ctools_lfu_weight(&c, 100 + CTOOLS_LFU_INIT_VAL + 1), 0);
+  ctools_lfu_counter_incr(&c, 120);
+  CHECK_EQ(c.visit_count, CTOOLS_LFU_INIT_VAL + 1);
+  CHECK_EQ(ctools_lfu_weight(&c, 120), CTOOLS_LFU_INIT_VAL + 1);
+}
+
+static void test_rng(void) {
+  ctools_rng a, b;
+  int seen[8] = {0};
+  ctools_rng_seed(&a, 42);
+  ctools_rng_seed(&b, 42);
+  for (int i = 0; i < 1000; i++) {
+    CHECK_EQ(ctools_rng_next(&a), ctools_rng_next(&b));
+  }
+  ctools_rng_seed(&b, 43);
+  CHECK_EQ(ctools_rng_next(&a) != ctools_rng_next(&b), 1);
+  ctools_rng_seed(&a, 0);
+  CHECK_EQ(a.state != 0, 1);
+  for (int i = 0; i < 10000; i++) {
+    uint32_t r = ctools_rng_limit(&a, 7);
+    double u = ctools_rng_unit(&a);
+    CHECK_EQ(r <= 7, 1);
+    CHECK_EQ(u > 0 && u <= 1, 1);
+    seen[r]++;
+  }
+  for (int i = 0; i < 8; i++) CHECK_EQ(seen[i] > 1000 && seen[i] < 1500, 1);
+  CHECK_EQ(ctools_rng_limit(&a, 0), 0);
+}
+
+static void test_lfu_expiry(void) {
+  ctools_lfu_expiry e = {100.0, 200.0, 0.0, 0};
+  ctools_rng rng;
+  int early = 0;
+  ctools_rng_seed(&rng, 1);
+  CHECK_EQ(ctools_lfu_expiry_check(&e, 50.0, &rng), CTOOLS_LFU_FRESH);
+  CHECK_EQ(ctools_lfu_expiry_check(&e, 150.0, &rng), CTOOLS_LFU_REFRESH);
+  /* the refresh is handed out once */
+  CHECK_EQ(ctools_lfu_expiry_check(&e, 150.0, &rng), CTOOLS_LFU_FRESH);
+  CHECK_EQ(ctools_lfu_expiry_check(&e, 200.0, &rng), CTOOLS_LFU_EXPIRED);
+
+  /* XFetch: a slow value is refreshed before soft now and then */
+  for (int i = 0; i < 1000; i++) {
+    ctools_lfu_expiry x = {100.0, 0.0, 10.0, 0};
+    if (ctools_lfu_expiry_check(&x, 95.0, &rng) == CTOOLS_LFU_REFRESH) early++;
+    CHECK_EQ(ctools_lfu_expiry_check(&x, 1e9, &rng) != CTOOLS_LFU_EXPIRED, 1);
+  }
+  /* P = exp(-5 / 10) */
+  CHECK_EQ(early > 500 && early < 700, 1);
+  ctools_lfu_expiry never = {0.0, 0.0, 10.0, 0};
+  CHECK_EQ(ctools_lfu_expiry_check(&never, 1e9, &rng), CTOOLS_LFU_FRESH);
+}
+
+static void test_lfu_heap(void) {
+  ctools_lfu_rank heap[4];
+  size_t n = 0;
+  int items[16];
+  for (int i = 0; i < 16; i++) {
+    uint64_t rank = (uint64_t)((i * 7) % 16); /* 0..15 shuffled */
+    items[i] = (int)rank;
+    void *out = ctools_lfu_heap_push(heap, &n, 4, rank, &items[i]);
+    CHECK_EQ(n, i < 4 ? i + 1 : 4);
+    if (out) CHECK_EQ(*(int *)out >= 4, 1);
+  }
+  ctools_lfu_rank_sort(heap, n);
+  for (size_t i = 0; i < n; i++) {
+    CHECK_EQ(heap[i].rank, i);
+    CHECK_EQ(*(int *)heap[i].item, i);
+  }
+  CHECK_EQ(ctools_lfu_heap_push(heap, &n, 0, 1, &items[0]) == &items[0], 1);
+}
+
+static void test_lfu_latency(void) {
+  ctools_lfu_latency h;
+  memset(&h, 0, sizeof(h));
+  ctools_lfu_latency_add(&h, 0.0002);
+  ctools_lfu_latency_add(&h, 0.001);
+  ctools_lfu_latency_add(&h, 0.3);
+  ctools_lfu_latency_add(&h, 60);
+  CHECK_EQ(h.counts[0], 2);
+  CHECK_EQ(h.counts[7], 1);
+  CHECK_EQ(h.counts[CTOOLS_LFU_LATENCY_BUCKETS], 1);
+  CHECK_EQ(h.count, 4);
+  CHECK_EQ(h.sum > 60.3 && h.sum < 60.302, 1);
+}
+
+static void test_lfu_trace(void) {
+  ctools_lfu_trace *t = ctools_lfu_trace_new(4, 1.0, 0);
+  ctools_lfu_trace_record out[4];
+  int sampled = 0;
+  for (uint64_t i = 0; i < 6; i++) {
+    ctools_lfu_trace_add(t, i, CTOOLS_LFU_TRACE_GET, (int)(i & 1));
+  }
+  CHECK_EQ(sizeof(ctools_lfu_trace_record), 24);
+  CHECK_EQ(t->count, 4);
+  CHECK_EQ(t->dropped, 2);
+  /* oldest first, across the wrap */
+  CHECK_EQ(ctools_lfu_trace_drain(t, out, 3), 3);
+  CHECK_EQ(out[0].key_hash, 2);
+  CHECK_EQ(out[2].key_hash, 4);
+  CHECK_EQ(out[1].hit, 1);
+  CHECK_EQ(out[0].time_ns <= out[2].time_ns, 1);
+  ctools_lfu_trace_add(t, 6, CTOOLS_LFU_TRACE_DEL, 0);
+  CHECK_EQ(ctools_lfu_trace_drain(t, out, 4), 2);
+  CHECK_EQ(out[0].key_hash, 5);
+  CHECK_EQ(out[1].op, CTOOLS_LFU_TRACE_DEL);
+  CHECK_EQ(t->count, 0);
+  ctools_lfu_trace_free(t);
+
+  t = ctools_lfu_trace_new(1, 0.25, 7);
+  for (int i = 0; i < 10000; i++) sampled += ctools_lfu_trace_sampled(t);
+  CHECK_EQ(sampled > 2200 && sampled < 2800, 1);
+  ctools_lfu_trace_free(t);
+}
+
+static void test_lfu_histogram(void) {
+  unsigned int values[] = {255, 256, 256, 260, 300, 355};
+  unsigned int low, one = 7, full[] = {0, UINT32_MAX};
+  uint64_t width, counts[4] = {0};
+  CHECK_EQ(ctools_lfu_histogram(values, 6, 4, &low, &width, counts), 4);
+  CHECK_EQ(low, 255);
+  CHECK_EQ(width, 26); /* 101 values over 4 bins */
+  CHECK_EQ(counts[0], 4);
+  CHECK_EQ(counts[1], 1);
+  CHECK_EQ(counts[2], 0);
+  CHECK_EQ(counts[3], 1);
+  memset(counts, 0, sizeof(counts));
+  CHECK_EQ(ctools_lfu_histogram(&one, 1, 4, &low, &width, counts), 1);
+  CHECK_EQ(low, 7);
+  CHECK_EQ(width, 1);
+  CHECK_EQ(counts[0], 1);
+  CHECK_EQ(ctools_lfu_histogram(values, 0, 4, &low, &width, counts), 0);
+  /* one bin over the whole range doesn't wrap to a zero width */
+  memset(counts, 0, sizeof(counts));
+  CHECK_EQ(ctools_lfu_histogram(full, 2, 1, &low, &width, counts), 1);
+  CHECK_EQ(width, (uint64_t)1 << 32);
+  CHECK_EQ(counts[0], 2);
+}
+
+static void test_gdsf(void) {
+  ctools_gdsf *g = ctools_gdsf_new();
+  ctools_gdsf_node nodes[8];
+  double priorities[8] = {5, 3, 8, 1, 9, 2, 7, 4};
+  CHECK_EQ(ctools_gdsf_min(g) == NULL, 1);
+  for (int i = 0; i < 8; i++) {
+    nodes[i].priority = priorities[i];
+    CHECK_EQ(ctools_gdsf_push(g, &nodes[i]), 0);
+  }
+  CHECK_EQ(ctools_gdsf_min(g) == &nodes[3], 1);
+  /* removing from the middle keeps the heap sorted */
+  ctools_gdsf_remove(g, &nodes[5]);
+  CHECK_EQ(nodes[5].pos == CTOOLS_GDSF_NONE, 1);
+  nodes[3].priority = 6;
+  ctools_gdsf_fix(g, &nodes[3]);
+  nodes[4].priority = 0.5;
+  ctools_gdsf_fix(g, &nodes[4]);
+  {
+    double expect[] = {0.5, 3, 4, 5, 6, 7, 8}, last = 0;
+    for (int i = 0; i < 7; i++) {
+      ctools_gdsf_node *min = ctools_gdsf_min(g);
+      CHECK_EQ(min->priority == expect[i], 1);
+      CHECK_EQ(min->priority >= last, 1);
+      last = min->priority;
+      ctools_gdsf_remove(g, min);
+    }
+  }
+  CHECK_EQ(g->count, 0);
+  g->inflation = 2;
+  CHECK_EQ(ctools_gdsf_priority(g, 3, 10, 5) == 8, 1);
+  ctools_gdsf_push(g, &nodes[0]);
+  ctools_gdsf_reset(g);
+  CHECK_EQ(nodes[0].pos == CTOOLS_GDSF_NONE, 1);
+  CHECK_EQ(g->count, 0);
+  CHECK_EQ(g->inflation == 0, 1);
+  ctools_gdsf_free(g);
+}
+
+static void test_admission(void) {
+  ctools_admission a;
+  ctools_rng rng;
+  int small = 0, big = 0;
+  ctools_rng_seed(&rng, 1);
+  ctools_admission_init(&a, 1000, 100);
+  for (int i = 0; i < 1000; i++) {
+    small += ctools_admission_admit(&a, 10, &rng);
+    big += ctools_admission_admit(&a, 5000, &rng);
+  }
+  CHECK_EQ(small > 980, 1);
+  CHECK_EQ(big < 30, 1);
+
+  /* c keeps its direction while the ratio improves, turns when it drops */
+  ctools_admission_tune(&a, 0, 50);
+  CHECK_EQ(a.c == 1000, 1);
+  ctools_admission_tune(&a, 10, 100);
+  CHECK_EQ(a.c == 2000, 1);
+  ctools_admission_tune(&a, 30, 200);
+  CHECK_EQ(a.c == 4000, 1);
+  ctools_admission_tune(&a, 35, 300);
+  CHECK_EQ(a.c == 2000, 1);
+  /* a reset starts a new window */
+  ctools_admission_tune(&a, 0, 0);
+  ctools_admission_tune(&a, 0, 99);
+  CHECK_EQ(a.c == 2000, 1);
+
+  ctools_admission_init(&a, CTOOLS_ADMISSION_MIN_C, 1);
+  a.step = 0.5;
+  ctools_admission_tune(&a, 0, 1);
+  CHECK_EQ(a.c == CTOOLS_ADMISSION_MIN_C, 1);
+  CHECK_EQ(a.step == 2, 1);
+}
+
+static void test_arena(void) {
+  ctools_arena *arena = ctools_arena_new(4096, 1024);
+  void *chunks[64];
+  int n = 0;
+
+  CHECK_EQ(arena != NULL, 1);
+  CHECK_EQ(arena->page_size, 1024);
+  CHECK_EQ(arena->classes[0].chunk_size, CTOOLS_ARENA_MIN_CHUNK);
+  CHECK_EQ(arena->classes[arena->n_classes - 1].chunk_size, 1024);
+  CHECK_EQ(ctools_arena_class(arena, 1), 0);
+  CHECK_EQ(ctools_arena_class(arena, 1025), -1);
+  CHECK_EQ(ctools_arena_alloc(arena, 1025) == NULL, 1);
+
+  /* 4 pages of 16 chunks each, then the limit is hit */
+  while (n < 64 && (chunks[n] = ctools_arena_alloc(arena, 60))) n++;
+  CHECK_EQ(n, 64);
+  CHECK_EQ(ctools_arena_alloc(arena, 60) == NULL, 1);
+  CHECK_EQ(arena->allocated, 4096);
+  CHECK_EQ(ctools_arena_used(arena), 64 * 64);
+
+  /* freed chunks are recycled within their class */
+  ctools_arena_release(arena, chunks[10], 60);
+  CHECK_EQ(ctools_arena_alloc(arena, 200) == NULL, 1);
+  CHECK_EQ(ctools_arena_alloc(arena, 33) == chunks[10], 1);
+
+  ctools_arena_reset(arena);
+  CHECK_EQ(arena->allocated, 0);
+  CHECK_EQ(ctools_arena_used(arena), 0);
+  CHECK_EQ(ctools_arena_alloc(arena, 1024) != NULL, 1);
+  ctools_arena_free(arena);
+
+  CHECK_EQ(ctools_arena_new(8, 0) == NULL, 1);
+}
+
+static void test_kv(void) {
+  ctools_kv *kv = ctools_kv_new(64 * 1024);
+  ctools_kv_item *item;
+  char key[16];
+  uint32_t now = 1000000;
+
+  item = ctools_kv_alloc("a", 1, 3, 7, 0);
+  memcpy(CTOOLS_KV_VALUE(item), "abc", 3);
+  CHECK_EQ(ctools_kv_link(kv, item, now), 0);
+  item = ctools_kv_get(kv, "a", 1, now);
+  CHECK_EQ(item != NULL, 1);
+  CHECK_EQ(item->flags, 7);
+  CHECK_EQ(memcmp(CTOOLS_KV_VALUE(item), "abc", 3), 0);
+  uint64_t cas = item->cas;
+
+  /* replacing keeps the counter and bumps cas */
+  item = ctools_kv_alloc("a", 1, 1, 0, now + 10);
+  CHECK_EQ(ctools_kv_link(kv, item, now), 0);
+  item = ctools_kv_get(kv, "a", 1, now);
+  CHECK_EQ(item->counter.visit_count, CTOOLS_LFU_INIT_VAL + 2);
+  CHECK_EQ(item->cas > cas, 1);
+  CHECK_EQ(kv->count, 1);
+  CHECK_EQ(ctools_kv_get(kv, "a", 1, now + 10) == NULL, 1);
+  CHECK_EQ(kv->count, 0);
+  CHECK_EQ(kv->bytes, 0);
+
+  /* the byte limit holds and hot keys survive */
+  for (int i = 0; i < 10; i++) {
+    int len = snprintf(key, sizeof(key), "hot%d", i);
+    CHECK_EQ(ctools_kv_link(kv, ctools_kv_alloc(key, len, 100, 0, 0), now), 0);
+    for (int j = 0; j < 100; j++) ctools_kv_get(kv, key, len, now);
+  }
+  for (int i = 0; i < 10000; i++) {
+    int len = snprintf(key, sizeof(key), "%d", i);
+    CHECK_EQ(ctools_kv_link(kv, ctools_kv_alloc(key, len, 100, 0, 0), now), 0);
+    CHECK_EQ(kv->bytes <= kv->max_bytes, 1);
+  }
+  int hot = 0;
+  for (int i = 0; i < 10; i++) {
+    int len = snprintf(key, sizeof(key), "hot%d", i);
+    hot += ctools_kv_get(kv, key, len, now) != NULL;
+  }
+  CHECK_EQ(hot >= 9, 1);
+  CHECK_EQ(kv->evictions > 0, 1);
+  CHECK_EQ(ctools_kv_delete(kv, "hot0", 4, now), 1);
+  CHECK_EQ(ctools_kv_delete(kv, "hot0", 4, now), 0);
+
+  item = ctools_kv_alloc("big", 3, 64 * 1024, 0, 0);
+  CHECK_EQ(ctools_kv_link(kv, item, now), -1);
+  free(item);
+  ctools_kv_flush(kv);
+  CHECK_EQ(kv->count, 0);
+  ctools_kv_free(kv);
+}
+
+#ifndef _WIN32
+static void test_spill(void) {
+  char path[] = "/tmp/ctools_test_spill_XXXXXX";
+  char key[16], value[1000];
+  ctools_spill_record rec;
+  size_t slot;
+  int found = 0;
+
+  close(mkstemp(path));
+  /* existing files and links are refused */
+  CHECK_EQ(ctools_spill_open(path, 4 * CTOOLS_SPILL_MIN_SEGMENT) == NULL, 1);
+  CHECK_EQ(errno, EEXIST);
+  unlink(path);
+  CHECK_EQ(symlink("/tmp/ctools_test_spill_target", path), 0);
+  CHECK_EQ(ctools_spill_open(path, 4 * CTOOLS_SPILL_MIN_SEGMENT) == NULL, 1);
+  unlink(path);
+  /* 4 segments of 64 KiB */
+  ctools_spill *spill = ctools_spill_open(path, 4 * CTOOLS_SPILL_MIN_SEGMENT);
+  CHECK_EQ(spill != NULL, 1);
+  CHECK_EQ(spill->n_segments, 4);
+  CHECK_EQ(ctools_spill_put(spill, 1, "k", 1, value, 1 << 17), -1);
+
+  memset(value, 'v', sizeof(value));
+  for (uint64_t i = 0; i < 1000; i++) {
+    int n = snprintf(key, sizeof(key), "%d", (int)i);
+    CHECK_EQ(ctools_spill_put(spill, i % 100, key, n, value, sizeof(value)), 0);
+  }
+  /* the ring holds ~256 records of 1 KiB, older ones were reclaimed */
+  CHECK_EQ(spill->count < 256 && spill->count > 128, 1);
+  CHECK_EQ(spill->live_bytes <= spill->size, 1);
+
+  slot = CTOOLS_SPILL_START;
+  while (ctools_spill_find(spill, 999 % 100, &slot, &rec)) {
+    if (rec.key_len == 3 && !memcmp(rec.key, "999", 3)) {
+      found = 1;
+      CHECK_EQ(rec.value_len, sizeof(value));
+      CHECK_EQ(rec.value[999], 'v');
+      ctools_spill_delete(spill, slot);
+    }
+  }
+  CHECK_EQ(found, 1);
+  slot = CTOOLS_SPILL_START;
+  found = 0;
+  while (ctools_spill_find(spill, 0, &slot, &rec))
+    found |= rec.key_len == 1 && rec.key[0] == '0';
+  CHECK_EQ(found, 0);
+
+  /* a record found once a lap outlives many laps, an idle one doesn't */
+  CHECK_EQ(ctools_spill_put(spill, 8000, "hot", 3, value, 100), 0);
+  CHECK_EQ(ctools_spill_put(spill, 8001, "cold", 4, value, 100), 0);
+  for (uint64_t i = 0; i < 2000; i++) {
+    if (i % 50 == 0) {
+      slot = CTOOLS_SPILL_START;
+      CHECK_EQ(ctools_spill_find(spill, 8000, &slot, &rec), 1);
+    }
+    CHECK_EQ(ctools_spill_put(spill, 9000 + i, "k", 1, value, sizeof(value)),
+             0);
+  }
+  slot = CTOOLS_SPILL_START;
+  CHECK_EQ(ctools_spill_find(spill, 8000, &slot, &rec), 1);
+  CHECK_EQ(rec.key_len == 3 && !memcmp(rec.key, "hot", 3), 1);
+  CHECK_EQ(rec.value_len == 100 && rec.value[99] == 'v', 1);
+  slot = CTOOLS_SPILL_START;
+  CHECK_EQ(ctools_spill_find(spill, 8001, &slot, &rec), 0);
+  CHECK_EQ(spill->live_bytes <= spill->size, 1);
+
+  /* a record changed behind the index is dropped, not returned */
+  CHECK_EQ(ctools_spill_put(spill, 7000, "x", 1, value, sizeof(value)), 0);
+  slot = CTOOLS_SPILL_START;
+  CHECK_EQ(ctools_spill_find(spill, 7000, &slot, &rec), 1);
+  CHECK_EQ(ctools_spill_recheck(spill, slot, &rec), 1);
+  ((char *)rec.value)[0] = 'w';
+  CHECK_EQ(ctools_spill_recheck(spill, slot, &rec), 0);
+  slot = CTOOLS_SPILL_START;
+  CHECK_EQ(ctools_spill_find(spill, 7000, &slot, &rec), 0);
+  CHECK_EQ(spill->live_bytes <= spill->size, 1);
+
+  ctools_spill_reset(spill);
+  CHECK_EQ(spill->count, 0);
+  slot = CTOOLS_SPILL_START;
+  CHECK_EQ(ctools_spill_find(spill, 1, &slot, &rec), 0);
+  ctools_spill_close(spill, 1);
+  CHECK_EQ(access(path, F_OK), -1);
+
+  CHECK_EQ(ctools_spill_open(path, 1024) == NULL, 1);
+}
+
+static void test_store(void) {
+  char path[] = "/tmp/ctools_test_store_XXXXXX";
+  char key[16], value[200];
+  ctools_store_record rec;
+  size_t pos = 0, n = 0;
+
+  CHECK_EQ(mkdtemp(path) != NULL, 1);
+  ctools_store *store = ctools_store_open(path, 256 * 1024, 0);
+  CHECK_EQ(store != NULL, 1);
+  CHECK_EQ(store->recovered, 0);
+  CHECK_EQ(ctools_store_put(store, "a", 1, "1", 1, 7), 0);
+  CHECK_EQ(ctools_store_put(store, "a", 1, "22", 2, 7), 0);
+  CHECK_EQ(ctools_store_get(store, "a", 1, &rec), 1);
+  CHECK_EQ(rec.value_len, 2);
+  CHECK_EQ(rec.flags, 7);
+  CHECK_EQ(ctools_store_delete(store, "a", 1), 1);
+  CHECK_EQ(ctools_store_delete(store, "a", 1), 0);
+  CHECK_EQ(ctools_store_get(store, "a", 1, &rec), 0);
+
+  /* writing 4x max_bytes evicts and compacts */
+  memset(value, 'v', sizeof(value));
+  for (int i = 0; i < 5000; i++) {
+    int len = snprintf(key, sizeof(key), "%d", i);
+    CHECK_EQ(ctools_store_put(store, key, len, value, sizeof(value), 0), 0);
+  }
+  CHECK_EQ(store->live_bytes <= store->max_bytes, 1);
+  CHECK_EQ(ctools_store_disk_bytes(store) < 4 * store->max_bytes, 1);
+  CHECK_EQ(ctools_store_get(store, "4999", 4, &rec), 1);
+  while (ctools_store_next(store, &pos, &rec)) n++;
+  CHECK_EQ(n, store->count);
+  size_t count = store->count;
+  CHECK_EQ(ctools_store_close(store), 0);
+
+  /* a clean close keeps the index */
+  store = ctools_store_open(path, 256 * 1024, 0);
+  CHECK_EQ(store != NULL, 1);
+  CHECK_EQ(store->recovered, 0);
+  CHECK_EQ(store->count, count);
+  CHECK_EQ(ctools_store_get(store, "4999", 4, &rec), 1);
+  CHECK_EQ(rec.value[199], 'v');
+  /* the store is locked, against this process too */
+  CHECK_EQ(ctools_store_open(path, 256 * 1024, 0) == NULL, 1);
+  CHECK_EQ(ctools_store_close(store), 0);
+
+  /* a process killed before close leaves the index dirty, the next open
+   * replays the segments */
+  pid_t pid = fork();
+  if (!pid) {
+    store = ctools_store_open(path, 256 * 1024, 0);
+    _exit(!store || ctools_store_delete(store, "4999", 4) != 1 ||
+          ctools_store_put(store, "new", 3, "x", 1, 0));
+  }
+  int status = -1;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK_EQ(status, 0);
+  store = ctools_store_open(path, 256 * 1024, 0);
+  CHECK_EQ(store != NULL, 1);
+  CHECK_EQ(store->recovered, 1);
+  CHECK_EQ(store->count, count);
+  CHECK_EQ(ctools_store_get(store, "4999", 4, &rec), 0);
+  CHECK_EQ(ctools_store_get(store, "new", 3, &rec), 1);
+  CHECK_EQ(ctools_store_put(store, "big", 3, value, 256 * 1024, 0), -1);
+  CHECK_EQ(ctools_store_put(store, "new", 3, "yy", 2, 0), 0);
+  CHECK_EQ(store->count, count);
+  CHECK_EQ(ctools_store_get(store, "new", 3, &rec), 1);
+  CHECK_EQ(rec.value_len, 2);
+  CHECK_EQ(ctools_store_clear(store), 0);
+  CHECK_EQ(store->count, 0);
+  CHECK_EQ(ctools_store_close(store), 0);
+}
+#endif
+
+int main(void) {
+  test_hash();
+  test_hash_ucs();
+  test_jump_consistent_hash();
+  test_lfu_counter();
+  test_rng();
+  test_lfu_expiry();
+  test_lfu_heap();
+  test_lfu_latency();
+  test_lfu_trace();
+  test_lfu_histogram();
+  test_gdsf();
+  test_admission();
+  test_arena();
+  test_kv();
+#ifndef _WIN32
+  test_spill();
+  test_store();
+#endif
+  if (failures) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
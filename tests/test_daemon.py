@@ -0,0 +1,231 @@
+"""ctoolsd protocol tests: python tests/test_daemon.py path/to/ctoolsd"""
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+DAEMON = None
+
+
+class Client(object):
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.buf = b''
+
+    def close(self):
+        self.sock.close()
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def line(self):
+        while b'\r\n' not in self.buf:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise EOFError
+            self.buf += chunk
+        line, self.buf = self.buf.split(b'\r\n', 1)
+        return line
+
+    def exact(self, n):
+        while len(self.buf) < n:
+            self.buf += self.sock.recv(65536)
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def cmd(self, line, data=None):
+        payload = line.encode() + b'\r\n'
+        if data is not None:
+            payload += data + b'\r\n'
+        self.send(payload)
+        return self.line()
+
+    def get(self, *keys, cas=False):
+        self.send(('gets ' if cas else 'get ').encode() +
+                  ' '.join(keys).encode() + b'\r\n')
+        rv = {}
+        while True:
+            line = self.line().split()
+            if line == [b'END']:
+                return rv
+            value = self.exact(int(line[3]) + 2)[:-2]
+            rv[line[1].decode()] = (value, int(line[2])) + (
+                (int(line[4]),) if cas else ())
+
+    def stats(self):
+        self.send(b'stats\r\n')
+        rv = {}
+        while True:
+            line = self.line().split()
+            if line == [b'END']:
+                return rv
+            rv[line[1].decode()] = line[2].decode()
+
+
+class DaemonTest(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, 'ctoolsd.sock')
+        self.proc = subprocess.Popen(
+            [DAEMON, '-s', self.path, '-m', '4', '-t', '4', '-S', '4'],
+            stderr=subprocess.DEVNULL)
+        for _ in range(500):
+            if os.path.exists(self.path):
+                break
+            time.sleep(0.01)
+        self.client = Client(self.path)
+
+    def tearDown(self):
+        self.client.close()
+        self.proc.send_signal(signal.SIGTERM)
+        self.assertEqual(self.proc.wait(10), 0)
+        self.assertFalse(os.path.exists(self.path))
+        shutil.rmtree(self.dir)
+
+    def test_storage(self):
+        c = self.client
+        self.assertEqual(c.cmd('set a 5 0 3', b'abc'), b'STORED')
+        self.assertEqual(c.get('a'), {'a': (b'abc', 5)})
+        self.assertEqual(c.cmd('add a 0 0 1', b'x'), b'NOT_STORED')
+        self.assertEqual(c.cmd('add b 0 0 1', b'x'), b'STORED')
+        self.assertEqual(c.cmd('replace c 0 0 1', b'x'), b'NOT_STORED')
+        self.assertEqual(c.cmd('replace b 0 0 1', b'y'), b'STORED')
+        self.assertEqual(c.cmd('append a 0 0 2', b'de'), b'STORED')
+        self.assertEqual(c.cmd('prepend a 0 0 2', b'__'), b'STORED')
+        self.assertEqual(c.get('a', 'b', 'c'),
+                         {'a': (b'__abcde', 5), 'b': (b'y', 0)})
+        self.assertEqual(c.cmd('set bin 0 0 4', b'\r\n\0\n'), b'STORED')
+        self.assertEqual(c.get('bin'), {'bin': (b'\r\n\0\n', 0)})
+
+    def test_cas(self):
+        c = self.client
+        c.cmd('set k 0 0 1', b'1')
+        unique = c.get('k', cas=True)['k'][2]
+        self.assertEqual(c.cmd('cas k 0 0 1 %d' % unique, b'2'), b'STORED')
+        self.assertEqual(c.cmd('cas k 0 0 1 %d' % unique, b'3'), b'EXISTS')
+        self.assertEqual(c.cmd('cas missing 0 0 1 1', b'3'), b'NOT_FOUND')
+        self.assertEqual(c.get('k'), {'k': (b'2', 0)})
+
+    def test_delete_incr_touch(self):
+        c = self.client
+        c.cmd('set n 0 0 2', b'10')
+        self.assertEqual(c.cmd('incr n 5'), b'15')
+        self.assertEqual(c.cmd('decr n 100'), b'0')
+        self.assertEqual(c.cmd('incr missing 1'), b'NOT_FOUND')
+        c.cmd('set s 0 0 1', b'x')
+        self.assertTrue(c.cmd('incr s 1').startswith(b'CLIENT_ERROR'))
+        self.assertEqual(c.cmd('touch n 100'), b'TOUCHED')
+        self.assertEqual(c.cmd('touch missing 100'), b'NOT_FOUND')
+        self.assertEqual(c.cmd('delete n'), b'DELETED')
+        self.assertEqual(c.cmd('delete n'), b'NOT_FOUND')
+        self.assertEqual(c.cmd('set e 0 -1 1', b'x'), b'STORED')
+        self.assertEqual(c.get('e'), {})
+        self.assertEqual(c.cmd('flush_all'), b'OK')
+        self.assertEqual(c.get('s'), {})
+
+    def test_protocol_errors(self):
+        c = self.client
+        self.assertEqual(c.cmd('bogus'), b'ERROR')
+        self.assertTrue(c.cmd('set k x 0 1').startswith(b'CLIENT_ERROR'))
+        self.assertTrue(c.cmd('set k 0 0 1', b'xx').startswith(
+            b'CLIENT_ERROR'))
+        self.assertTrue(c.cmd('set big 0 0 %d' % (2 << 20),
+                              b'x' * (2 << 20)).startswith(b'SERVER_ERROR'))
+        self.assertEqual(c.cmd('version'), b'VERSION 0.0.5')
+        # noreply and pipelining
+        c.send(b'set q 0 0 1 noreply\r\n1\r\nset r 0 0 1\r\n2\r\nget q r\r\n')
+        self.assertEqual(c.line(), b'STORED')
+        self.assertEqual(c.line(), b'VALUE q 0 1')
+
+    def test_eviction_and_stats(self):
+        c = self.client
+        value = b'v' * 1000
+        for i in range(100):
+            c.cmd('set hot%d 0 0 %d' % (i, len(value)), value)
+        for _ in range(5):
+            c.get(*['hot%d' % i for i in range(100)])
+        c.send(b''.join(b'set cold%d 0 0 %d noreply\r\n%s\r\n' %
+                        (i, len(value), value) for i in range(20000)))
+        stats = c.stats()
+        self.assertLessEqual(int(stats['bytes']), 4 << 20)
+        self.assertGreater(int(stats['evictions']), 0)
+        self.assertEqual(int(stats['limit_maxbytes']), 4 << 20)
+        self.assertEqual(int(stats['get_hits']), 500)
+        self.assertGreater(len(c.get(*['hot%d' % i for i in range(100)])), 90)
+
+    def test_concurrent_clients(self):
+        errors = []
+
+        def run(n):
+            try:
+                client = Client(self.path)
+                for i in range(500):
+                    key = 'c%d_%d' % (n, i)
+                    assert client.cmd('set %s 0 0 3' % key, b'abc') == \
+                        b'STORED'
+                    assert client.get(key) == {key: (b'abc', 0)}
+                client.cmd('incr counter 1')
+                client.close()
+            except Exception as e:
+                errors.append(e)
+
+        self.client.cmd('set counter 0 0 1', b'0')
+        threads = [threading.Thread(target=run, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(self.client.get('counter'), {'counter': (b'8', 0)})
+        self.assertGreaterEqual(int(self.client.stats()['total_connections']),
+                                9)
+
+    def test_out_of_descriptors(self):
+        import resource
+        path = os.path.join(self.dir, 'small.sock')
+        proc = subprocess.Popen(
+            [DAEMON, '-s', path, '-t', '2'], stderr=subprocess.DEVNULL,
+            preexec_fn=lambda: resource.setrlimit(
+                resource.RLIMIT_NOFILE, (16, 16)))
+        try:
+            for _ in range(500):
+                if os.path.exists(path):
+                    break
+                time.sleep(0.01)
+
+            def cpu():
+                with open('/proc/%d/stat' % proc.pid) as f:
+                    fields = f.read().rsplit(')', 1)[1].split()
+                return (int(fields[11]) + int(fields[12])) / \
+                    os.sysconf('SC_CLK_TCK')
+
+            # more clients than descriptors: the rest wait in the backlog
+            clients = [Client(path) for _ in range(20)]
+            before = cpu()
+            time.sleep(1)
+            # without a backoff the workers would spin on accept
+            self.assertLess(cpu() - before, 0.5)
+            for client in clients[1:]:
+                client.close()
+            self.assertEqual(clients[0].cmd('version'), b'VERSION 0.0.5')
+            late = Client(path)
+            self.assertEqual(late.cmd('version'), b'VERSION 0.0.5')
+            late.close()
+            clients[0].close()
+        finally:
+            proc.send_signal(signal.SIGTERM)
+            proc.wait(10)
+
+
+if __name__ == '__main__':
+    DAEMON = os.path.abspath(sys.argv.pop(1))
+    unittest.main()
@@ -1,8 +1,12 @@
 import unittest
+import time
 import random
 import string
+import struct
 import uuid
 import sys
+import ctypes
+from collections import UserDict
 from datetime import datetime, timedelta
 
 from ctools import *
@@ -64,6 +68,111 @@ class T(unittest.TestCase):
         with self.assertRaises(TypeError):
             strhash(s, method='fnv1a')
 
+    def test_strhash_unicode(self):
+        for us in ("café", "文字テキスト텍스트", "emoji 😀 中文", "\x00\xff\u07ff"):
+            size = sys.getsizeof(us)
+            for meth in ("fnv1a", "fnv1", "djb2", "murmur"):
+                self.assertEqual(strhash(us, meth), strhash(us.encode(), meth))
+            # no UTF-8 copy is left behind on the str
+            self.assertEqual(sys.getsizeof(us), size)
+
+        with self.assertRaises(UnicodeEncodeError):
+            strhash("a\ud800b")
+
+
+class CAPITest(unittest.TestCase):
+
+    @staticmethod
+    def capsule_pointer(capsule, name):
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        return get_pointer(capsule, name)
+
+    def test_utils_capi(self):
+        import _ctools_utils
+
+        hash_func = ctypes.CFUNCTYPE(ctypes.c_uint, ctypes.c_char_p, ctypes.c_ulong)
+
+        class UtilsCAPI(ctypes.Structure):
+            _fields_ = [
+                ("version", ctypes.c_int),
+                ("fnv1a", hash_func),
+                ("fnv1", hash_func),
+                ("djb2", hash_func),
+                ("murmur_hash2", hash_func),
+                ("jump_consistent_hash",
+                 ctypes.CFUNCTYPE(ctypes.c_int32, ctypes.c_uint64, ctypes.c_int32)),
+            ]
+
+        ptr = self.capsule_pointer(_ctools_utils._C_API, b"_ctools_utils._C_API")
+        api = UtilsCAPI.from_address(ptr)
+        self.assertEqual(api.version, 1)
+        s = "hello ctools"
+        b = s.encode()
+        self.assertEqual(api.fnv1a(b, len(b)), strhash(s, "fnv1a"))
+        self.assertEqual(api.fnv1(b, len(b)), strhash(s, "fnv1"))
+        self.assertEqual(api.djb2(b, len(b)), strhash(s, "djb2"))
+        self.assertEqual(api.murmur_hash2(b, len(b)), strhash(s, "murmur"))
+        self.assertEqual(api.jump_consistent_hash(65535, 1024),
+                         jump_consistent_hash(65535, 1024))
+
+    def test_lfu_capi(self):
+        import _ctools_lfu
+
+        class LFUCAPI(ctypes.Structure):
+            _fields_ = [
+                ("version", ctypes.c_int),
+                ("LFUCacheType", ctypes.c_void_p),
+                ("LFUCache_New", ctypes.PYFUNCTYPE(ctypes.py_object, ctypes.c_ssize_t)),
+                ("LFUCache_GetItem", ctypes.PYFUNCTYPE(
+                    ctypes.c_void_p, ctypes.py_object, ctypes.py_object)),
+                ("LFUCache_SetItem", ctypes.PYFUNCTYPE(
+                    ctypes.c_int, ctypes.py_object, ctypes.py_object, ctypes.py_object)),
+                ("LFUCache_DelItem", ctypes.PYFUNCTYPE(
+                    ctypes.c_int, ctypes.py_object, ctypes.py_object)),
+                ("LFUCache_Size", ctypes.PYFUNCTYPE(ctypes.c_ssize_t, ctypes.py_object)),
+            ]
+
+        ptr = self.capsule_pointer(_ctools_lfu._C_API, b"_ctools_lfu._C_API")
+        api = LFUCAPI.from_address(ptr)
+        self.assertEqual(api.LFUCacheType, id(LFUCache))
+
+        cache = api.LFUCache_New(2)
+        self.assertIsInstance(cache, LFUCache)
+        self.assertEqual(api.LFUCache_SetItem(cache, "a", "1"), 0)
+        self.assertEqual(api.LFUCache_Size(cache), 1)
+        self.assertEqual(cache["a"], "1")
+        self.assertIsNone(api.LFUCache_GetItem(cache, "b"))
+        value = "1"
+        refcnt = sys.getrefcount(value)
+        ref = api.LFUCache_GetItem(cache, "a")
+        self.assertEqual(ctypes.cast(ref, ctypes.py_object).value, value)
+        # a hit is a new reference, the caller releases it
+        ctypes.pythonapi.Py_DecRef(ctypes.c_void_p(ref))
+        self.assertEqual(sys.getrefcount(value), refcnt)
+        self.assertEqual(api.LFUCache_DelItem(cache, "a"), 0)
+        self.assertEqual(len(cache), 0)
+
+        class BadKey(object):
+            def __hash__(self):
+                return hash("k")
+
+            def __eq__(self, other):
+                raise RuntimeError("eq")
+
+        # an error is reported as such, not counted as a miss
+        self.assertEqual(api.LFUCache_SetItem(cache, "k", "v"), 0)
+        hints = cache.hints()
+        with self.assertRaises(RuntimeError):
+            api.LFUCache_GetItem(cache, BadKey())
+        self.assertEqual(cache.hints(), hints)
+
+    def test_get_include(self):
+        import os
+        self.assertTrue(os.path.exists(os.path.join(get_include(), "ctools_capi.h")))
+        self.assertTrue(os.path.exists(os.path.join(get_include(), "capi.pxd")))
+
 
 def set_random(mp):
     key = str(uuid.uuid1())
@@ -281,6 +390,930 @@ class LFUTest(unittest.TestCase):
         v = cache.setnx(key, lambda: 1)
         self.assertEqual(v, val)
 
+    def test_gc_untracked_atomic(self):
+        import gc
+        cache = LFUCache(10)
+        store = cache._store()
+        cache['str'] = 'value'
+        cache['bytes'] = b'value'
+        cache['int'] = 1
+        cache['float'] = 1.0
+        cache['list'] = []
+        for k in ('str', 'bytes', 'int', 'float'):
+            self.assertFalse(gc.is_tracked(store[k]), k)
+        self.assertTrue(gc.is_tracked(store['list']))
+
+        cache['str'] = {}
+        cache['list'] = 1
+        self.assertTrue(gc.is_tracked(store['str']))
+        self.assertFalse(gc.is_tracked(store['list']))
+
+        # cycles through container values are still collected
+        import weakref
+
+        class Node:
+            pass
+
+        node = Node()
+        node.cache = cache
+        cache['node'] = node
+        ref = weakref.ref(node)
+        del node, cache, store
+        gc.collect()
+        self.assertIsNone(ref())
+
+    def test_freeze(self):
+        cache = LFUCache(10)
+        store = cache._store()
+        for i in range(5):
+            cache[str(i)] = str(i)
+        cache.freeze(gc_freeze=False)
+
+        wrapper = store['0']
+        weight = wrapper.weight()
+        for _ in range(3):
+            self.assertEqual(cache['0'], '0')
+        self.assertEqual(wrapper.weight(), weight + 3)
+
+        # entries leaving a frozen cache keep their counters
+        del cache['0']
+        self.assertEqual(wrapper.weight(), weight + 3)
+        cache['new'] = 'new'
+        for i in range(20):
+            cache[str(i + 100)] = i
+        self.assertEqual(len(cache), 10)
+
+        cache.freeze(gc_freeze=False)
+        w = next(iter(store.values()))
+        cache.unfreeze()
+        cache.clear()
+        self.assertEqual(len(cache), 0)
+        self.assertGreaterEqual(w.weight(), 0)
+
+    @unittest.skipUnless(hasattr(__import__('os'), 'fork'), 'requires fork')
+    def test_freeze_fork(self):
+        import os
+        cache = LFUCache(100)
+        for i in range(100):
+            cache[str(i)] = str(i)
+        cache.freeze()
+        try:
+            pid = os.fork()
+            if pid == 0:
+                ok = all(cache[str(i)] == str(i) for i in range(100))
+                os._exit(0 if ok else 1)
+            _, status = os.waitpid(pid, 0)
+            self.assertEqual(status, 0)
+        finally:
+            import gc
+            if hasattr(gc, 'unfreeze'):
+                gc.unfreeze()
+
+    def test_arena(self):
+        cache = LFUCache(1000, arena_bytes=64 * 1024)
+        store = cache._store()
+        values = {
+            'b': b'bytes' * 10,
+            'empty': b'',
+            'ascii': 'ascii' * 10,
+            'latin1': 'caf\xe9',
+            'ucs2': '文字テキスト텍스트',
+            'ucs4': '\U0001f600 emoji',
+            'int': 1,
+            'bytearray': bytearray(b'x'),
+        }
+        cache.update(values)
+        for k, v in values.items():
+            self.assertEqual(cache[k], v)
+            self.assertIs(type(cache[k]), type(v))
+            self.assertEqual(cache.get(k), v)
+            self.assertEqual(repr(store[k]), repr(v))
+        self.assertGreater(cache.arena_hints()[2], 0)
+
+        # replace and delete recycle chunks
+        cache['b'] = 'replaced'
+        self.assertEqual(cache['b'], 'replaced')
+        wrapper = store['ucs2']
+        self.assertEqual(cache.pop('ucs2'), values['ucs2'])
+        self.assertEqual(wrapper.wrapped(), values['ucs2'])
+        del cache['ascii']
+        self.assertNotIn('ascii', cache)
+
+        # memory stays bounded: full arena evicts entries
+        for i in range(2000):
+            cache[str(i)] = b'x' * 1000
+        limit, allocated, used = cache.arena_hints()
+        self.assertLessEqual(allocated, limit)
+        self.assertLessEqual(used, allocated)
+
+        values = cache.values()
+        cache.clear()
+        self.assertEqual(len(cache), 0)
+        self.assertEqual(cache.arena_hints()[1], 0)
+        for v in values:
+            self.assertIn(type(v), (bytes, str, int, bytearray))
+
+        big = b'x' * (2 * 1024 * 1024)
+        cache['big'] = big
+        self.assertEqual(cache['big'], big)
+
+        with self.assertRaises(ValueError):
+            LFUCache(10, arena_bytes=1)
+
+    def test_arena_shared_store(self):
+        cache = LFUCache(10, arena_bytes=4096)
+        cache['a'] = b'value'
+        store = cache._store()
+        with self.assertRaises(TypeError):
+            store['b'] = store['a']
+        del cache
+        self.assertEqual(store['a'].wrapped(), b'value')
+
+    def test_arena_reinit(self):
+        cache = LFUCache(10, arena_bytes=4096)
+        cache['a'] = b'x' * 10
+        cache['b'] = 'y' * 10
+        cache.pin('b')
+        cache.__init__(10, arena_bytes=8192)
+        self.assertEqual(cache['a'], b'x' * 10)
+        self.assertEqual(cache['b'], 'y' * 10)
+        cache.__init__(10)
+        self.assertEqual(cache['a'], b'x' * 10)
+        self.assertEqual(cache['b'], 'y' * 10)
+        self.assertEqual(cache.arena_hints(), (0, 0, 0))
+
+    @unittest.skipIf(sys.platform == 'win32', 'requires mmap')
+    def test_spill(self):
+        import os
+        import tempfile
+        path = os.path.join(tempfile.mkdtemp(), 'spill')
+        cache = LFUCache(10, spill_path=path, spill_bytes=1024 * 1024)
+        self.assertTrue(os.path.exists(path))
+        for i in range(100):
+            cache[i] = {'value': i}
+        self.assertEqual(len(cache), 10)
+        count, live_bytes, size = cache.spill_hints()
+        self.assertEqual(count, 90)
+        self.assertGreater(live_bytes, 0)
+
+        # a miss in memory is served from disk and promoted
+        self.assertIn(0, cache)
+        self.assertEqual(cache[0], {'value': 0})
+        self.assertEqual(cache.get(1), {'value': 1})
+        self.assertEqual(cache.spill_hints()[0], 90)
+        self.assertEqual(len(cache), 10)
+
+        # overwrite and delete reach the disk tier
+        cache[2] = 'new'
+        self.assertEqual(cache[2], 'new')
+        del cache[3]
+        self.assertNotIn(3, cache)
+        self.assertEqual(cache.pop(4), {'value': 4})
+        self.assertNotIn(4, cache)
+
+        # unpicklable values are simply dropped on eviction
+        cache['lambda'] = lambda: 1
+        for i in range(1000, 1020):
+            cache[i] = i
+        self.assertNotIn('lambda', cache)
+
+        cache.clear()
+        self.assertEqual(cache.spill_hints()[0], 0)
+        self.assertNotIn(5, cache)
+        del cache
+        self.assertFalse(os.path.exists(path))
+
+    @unittest.skipIf(sys.platform == 'win32', 'requires mmap')
+    def test_spill_compaction(self):
+        import os
+        import tempfile
+        path = os.path.join(tempfile.mkdtemp(), 'spill')
+        cache = LFUCache(1, spill_path=path, spill_bytes=256 * 1024)
+        for i in range(10000):
+            cache[i] = b'x' * 100
+        count, live_bytes, size = cache.spill_hints()
+        self.assertLess(count, 10000)
+        self.assertLessEqual(live_bytes, size)
+        self.assertIn(9998, cache)
+        self.assertNotIn(0, cache)
+
+        # entries found in the spill get a second chance when it wraps
+        other = LFUCache(1, spill_path=path + '2', spill_bytes=256 * 1024)
+        other['hot'] = b'h' * 100
+        other['cold'] = b'c' * 100
+        for i in range(10000):
+            if i % 100 == 0:
+                self.assertIn('hot', other)
+            other[i] = b'x' * 100
+        self.assertNotIn('cold', other)
+        self.assertEqual(other['hot'], b'h' * 100)
+
+        with self.assertRaises(ValueError):
+            LFUCache(1, spill_path=path)
+        with self.assertRaises(FileExistsError):
+            LFUCache(1, spill_path=path, spill_bytes=1024 * 1024)
+        self.assertIn(9998, cache)
+
+    def test_pop(self):
+        cache = LFUCache(10)
+        cache['a'] = 'value'
+        self.assertEqual(cache.pop('a'), 'value')
+        self.assertNotIn('a', cache)
+        self.assertEqual(cache.pop('a', 1), 1)
+
+    def test_invalidate_all(self):
+        cache = LFUCache(300)
+        for i in range(300):
+            cache[i] = [i]
+        cache.invalidate_all()
+        self.assertEqual(len(cache), 0)
+        self.assertEqual(len(cache._store()), 300)
+        self.assertEqual(cache.keys(), [])
+        self.assertEqual(list(cache), [])
+        self.assertNotIn(0, cache)
+        self.assertIsNone(cache.get(1))
+        with self.assertRaises(KeyError):
+            cache[2]
+        self.assertEqual(len(cache._store()), 297)
+
+        cache[3] = 'new'
+        self.assertEqual(len(cache), 1)
+        self.assertEqual(cache.items(), [(3, 'new')])
+        self.assertEqual(cache.values(), ['new'])
+        self.assertEqual(repr(cache), "{3: 'new'}")
+        # stale entries are evicted first, live ones survive
+        for i in range(1000, 1299):
+            cache[i] = i
+        self.assertEqual(len(cache), 300)
+        self.assertEqual(cache[3], 'new')
+        self.assertEqual(len(cache._store()), 300)
+        cache.invalidate_all()
+        cache.clear()
+        self.assertEqual(len(cache), 0)
+
+    def test_invalidate_tag(self):
+        cache = LFUCache(100)
+        for i in range(10):
+            cache.set(i, i, tags=['tenant:%d' % (i % 2), 'all'])
+        cache[10] = 10
+        self.assertEqual(cache.invalidate_tag('tenant:0'), 5)
+        self.assertEqual(sorted(cache.keys()), [1, 3, 5, 7, 9, 10])
+        self.assertEqual(cache.invalidate_tag('tenant:0'), 0)
+        self.assertEqual(cache.invalidate_tag('missing'), 0)
+
+        # a write replaces the tags of the entry
+        cache.set(1, 'x', tags=('other',))
+        cache[3] = 'y'
+        self.assertEqual(cache.invalidate_tag('all'), 3)
+        self.assertEqual(sorted(cache.keys()), [1, 3, 10])
+        self.assertEqual(cache.invalidate_tag('other'), 1)
+        self.assertEqual(sorted(cache.keys()), [3, 10])
+
+        # evicted and deleted entries leave the index
+        cache = LFUCache(2)
+        cache.set('a', 1, tags=['t'])
+        del cache['a']
+        cache.set('b', 2, tags=['t'])
+        cache['c'] = 3
+        cache['d'] = 4
+        self.assertEqual(cache.invalidate_tag('t'), 0)
+        with self.assertRaises(TypeError):
+            cache.set('e', 5, tags=[[]])
+        self.assertNotIn('e', cache)
+
+    def test_soft_and_hard_ttl(self):
+        refreshed = []
+        cache = LFUCache(10, on_refresh=refreshed.append)
+        cache.set('a', 1, soft_ttl=0.2, ttl=2)
+        cache.set('b', 2, ttl=0.2)
+        cache.set('c', 3, soft_ttl=0.2)
+        self.assertEqual(cache.fetch('a'), (1, False))
+        time.sleep(0.4)
+        # past soft the stale value is served and refreshed exactly once
+        self.assertEqual(cache.fetch('a'), (1, True))
+        self.assertEqual(cache.fetch('a'), (1, False))
+        self.assertEqual(cache['c'], 3)
+        self.assertEqual(cache.get('c'), 3)
+        self.assertEqual(refreshed, ['a', 'c'])
+        # past hard the entry is gone, from len and the views too
+        self.assertEqual(len(cache), 2)
+        self.assertEqual(sorted(cache.keys()), ['a', 'c'])
+        self.assertEqual(sorted(cache.values()), [1, 3])
+        self.assertEqual(sorted(cache), ['a', 'c'])
+        self.assertNotIn('b', cache)
+        self.assertEqual(cache.fetch('b', 0), (0, False))
+        cache['a'] = 'new'
+        time.sleep(1.7)
+        self.assertEqual(cache.fetch('a'), ('new', False))
+        with self.assertRaises(ValueError):
+            cache.set('d', 4, ttl=-1)
+
+    def test_failed_refresh(self):
+        calls = []
+
+        def on_refresh(key):
+            calls.append(key)
+            if len(calls) == 1:
+                raise RuntimeError(key)
+
+        hook, sys.unraisablehook = sys.unraisablehook, lambda args: None
+        try:
+            cache = LFUCache(10, on_refresh=on_refresh)
+            cache.set('a', 1, soft_ttl=0.01)
+            time.sleep(0.05)
+            # the failed refresh is retried by the next read, once
+            self.assertEqual(cache.fetch('a'), (1, True))
+            self.assertEqual(cache.fetch('a'), (1, True))
+            self.assertEqual(cache.fetch('a'), (1, False))
+            self.assertEqual(calls, ['a', 'a'])
+        finally:
+            sys.unraisablehook = hook
+
+    def test_xfetch(self):
+        cache = LFUCache(1000)
+        for i in range(1000):
+            cache.set(i, i, soft_ttl=5, delta=10)
+        # a slow value is refreshed early by some readers, not all of them
+        early = sum(cache.fetch(i)[1] for i in range(1000))
+        self.assertGreater(early, 0)
+        self.assertLess(early, 1000)
+
+    def test_get_many_or_load(self):
+        cache = LFUCache(5)
+        for i in range(5):
+            cache[i] = i
+        calls = []
+
+        def loader(keys):
+            calls.append(keys)
+            return {k: k * 10 for k in keys if k != 9}
+
+        rv = cache.get_many_or_load([0, 1, 7, 8, 9, 7], loader)
+        self.assertEqual(rv, {0: 0, 1: 1, 7: 70, 8: 80})
+        # misses are loaded once, in order, without duplicates
+        self.assertEqual(calls, [[7, 8, 9]])
+        self.assertEqual(len(cache), 5)
+        # the lightest entries made room, the ones just read survive
+        self.assertEqual(sorted(cache.keys()), [0, 1, 4, 7, 8])
+        self.assertEqual(cache.get_many_or_load(iter([0, 7]), loader),
+                         {0: 0, 7: 70})
+        self.assertEqual(len(calls), 1)
+
+        # any mapping will do
+        rv = cache.get_many_or_load(['x'], lambda keys: UserDict(x=1))
+        self.assertEqual(rv, {'x': 1})
+        self.assertEqual(cache['x'], 1)
+        with self.assertRaises(ZeroDivisionError):
+            cache.get_many_or_load(['y'], lambda keys: 1 / 0)
+        with self.assertRaises(TypeError):
+            cache.get_many_or_load(['y'], None)
+
+    def test_pin(self):
+        cache = LFUCache(10)
+        cache['flag'] = True
+        cache.pin('flag')
+        cache.pin('flag')
+        for i in range(100):
+            cache[i] = i
+        # pinned entries are never evicted and count against capacity
+        self.assertEqual(len(cache), 10)
+        self.assertTrue(cache['flag'])
+        self.assertIn('flag', cache.keys())
+        self.assertIn(('flag', True), cache.items())
+        self.assertEqual(len(cache.values()), 10)
+        cache['flag'] = False
+        self.assertFalse(cache['flag'])
+        with self.assertRaises(KeyError):
+            cache.pin('missing')
+
+        cache.unpin('flag')
+        self.assertEqual(len(cache), 10)
+        cache.pin('flag')
+        del cache['flag']
+        self.assertNotIn('flag', cache)
+        self.assertEqual(len(cache), 9)
+
+        cache = LFUCache(2, pinned_count=False)
+        for i in range(3):
+            cache[i] = i
+            cache.pin(i)
+        cache['a'] = 1
+        cache['b'] = 2
+        self.assertEqual(len(cache), 5)
+        cache.set_capacity(1)
+        self.assertEqual(len(cache), 4)
+        # unpinning over capacity makes room at once
+        cache.unpin(0)
+        self.assertEqual(len(cache), 3)
+        cache.invalidate_all()
+        self.assertEqual(len(cache), 0)
+
+        # with pinned_count, a cache full of pinned entries refuses more
+        cache = LFUCache(2)
+        for i in range(2):
+            cache[i] = i
+            cache.pin(i)
+        with self.assertRaises(ValueError):
+            cache['a'] = 1
+        self.assertNotIn('a', cache)
+        self.assertEqual(len(cache), 2)
+
+    def test_evict_rank_zero(self):
+        # an entry of rank 0 is the victim, not whichever comes after it
+        weights = {i: 100 for i in range(10)}
+        weights[0] = 0
+        cache = LFUCache.from_items({i: i for i in range(10)}, 10,
+                                    initial_weights=weights)
+        cache['new'] = 1
+        self.assertNotIn(0, cache)
+        self.assertEqual(len(cache), 10)
+
+    def test_priority(self):
+        cache = LFUCache(300)
+        for i in range(300):
+            cache.set(i, i, priority=1 if i % 3 else 0)
+        for i in range(0, 300, 3):
+            cache[i]
+        # the low class goes first, whatever the weights
+        cache.set_capacity(200)
+        self.assertEqual([k for k in cache.keys() if k % 3 == 0], [])
+        for i in range(300, 400):
+            cache.set(i, i, priority=2)
+        cache.set_capacity(100)
+        self.assertEqual(sorted(cache.keys()), list(range(300, 400)))
+        # a plain write drops the entry back to class 0
+        cache[300] = 'x'
+        cache.set_capacity(99)
+        self.assertNotIn(300, cache)
+
+    def test_namespace(self):
+        cache = LFUCache(100)
+        noisy = cache.namespace('noisy', quota=10)
+        quiet = cache.namespace('quiet', 50)
+        self.assertIs(cache.namespace('noisy'), noisy)
+        # under no pressure a namespace may outgrow its quota
+        for i in range(200):
+            noisy[i] = i
+        self.assertEqual(len(noisy), 100)
+        # once the cache is full, namespaces over quota pay first
+        for i in range(50):
+            quiet[i] = i
+        self.assertEqual((len(noisy), len(quiet), len(cache)), (50, 50, 100))
+        cache[None] = 1
+        self.assertEqual((len(noisy), len(quiet)), (49, 50))
+
+        # keys of different namespaces don't collide
+        noisy[0] = 'noisy'
+        self.assertEqual(quiet[0], 0)
+        self.assertEqual(quiet.get(999, 'x'), 'x')
+        self.assertIn(1, quiet)
+        self.assertNotIn(999, quiet)
+        with self.assertRaises(KeyError):
+            quiet[999]
+        self.assertEqual(quiet.hints(), (50, 50, 1, 2))
+        del quiet[1]
+        with self.assertRaises(KeyError):
+            del quiet[1]
+        self.assertEqual(len(quiet), 49)
+
+        cache.invalidate_all()
+        self.assertEqual((len(noisy), len(quiet)), (0, 0))
+        quiet[0] = 0
+        self.assertEqual(len(quiet), 1)
+        cache.clear()
+        self.assertEqual(len(quiet), 0)
+        with self.assertRaises(ValueError):
+            cache.namespace('x', -1)
+
+    def test_weak_values(self):
+        class Value(object):
+            pass
+
+        cache = LFUCache(100, weak_values=True)
+        values = [Value() for _ in range(10)]
+        for i, v in enumerate(values):
+            cache[i] = v
+        del v
+        self.assertIs(cache[3], values[3])
+        self.assertEqual(len(cache), 10)
+        # entries go away with their values, in one sweep
+        del values[5:]
+        self.assertNotIn(7, cache)
+        self.assertIsNone(cache.get(8))
+        self.assertEqual(len(cache), 5)
+        self.assertEqual(sorted(cache.keys()), [0, 1, 2, 3, 4])
+        self.assertEqual(len(cache.values()), 5)
+
+        # a replaced value dying doesn't take the new one along
+        old = Value()
+        cache[0] = old
+        cache[0] = values[0]
+        del old
+        self.assertIs(cache[0], values[0])
+        with self.assertRaises(TypeError):
+            cache['int'] = 1
+        with self.assertRaises(ValueError):
+            LFUCache(10, weak_values=True, arena_bytes=1 << 20)
+
+        # the callbacks don't reference the cache, no cycle keeps it alive
+        self.assertEqual(sys.getrefcount(cache), 2)
+
+        # re-init without weak_values stores strongly again
+        cache.__init__(100)
+        cache['int'] = 1
+        cache['obj'] = Value()
+        self.assertIsInstance(cache['obj'], Value)
+        self.assertEqual(cache['int'], 1)
+        # older weak entries still go away with their values
+        del values[1:]
+        self.assertNotIn(3, cache)
+        self.assertIs(cache[0], values[0])
+
+    def test_seed(self):
+        def run(seed, trace=False):
+            cache = LFUCache(300, seed=seed)
+            if trace:
+                cache.start_trace(0.5)
+            for i in range(2000):
+                cache[i] = i
+                cache.get(i // 2)
+            return sorted(cache.keys())
+
+        # the same seed replays the same eviction sequence, traced or not
+        self.assertEqual(run(42), run(42))
+        self.assertEqual(run(42), run(42, trace=True))
+        self.assertNotEqual(run(42), run(43))
+        self.assertEqual(len(run(None)), 300)
+        with self.assertRaises(TypeError):
+            LFUCache(10, seed="1")
+
+    def test_coldest_hottest(self):
+        cache = LFUCache(1000)
+        for i in range(500):
+            cache[i] = i
+            for _ in range(i % 50):
+                cache[i]
+        cache.pin(499)
+
+        coldest = cache.coldest(10)
+        self.assertEqual(len(coldest), 10)
+        self.assertEqual({k % 50 for k, _ in coldest}, {0})
+        self.assertEqual([w for _, w in coldest], sorted(w for _, w in coldest))
+        hottest = cache.hottest(9)
+        self.assertEqual({k % 50 for k, _ in hottest}, {49})
+        self.assertNotIn(499, [k for k, _ in hottest])
+        self.assertGreater(hottest[0][1], coldest[-1][1])
+        self.assertEqual(len(cache.coldest(10000)), 499)
+        self.assertEqual(cache.coldest(0), [])
+        with self.assertRaises(ValueError):
+            cache.coldest(-1)
+
+        # spread over several calls
+        scan = cache.weight_scan(10)
+        steps = 1
+        while not scan.step(64):
+            steps += 1
+        self.assertEqual(steps, 8)
+        self.assertEqual(scan.result(), coldest)
+        scan = cache.weight_scan(9, hottest=True)
+        scan.step(100)
+        del cache[49]
+        while not scan.step():
+            pass
+        self.assertEqual(scan.result(), [e for e in hottest if e[0] != 49])
+
+    def test_from_items(self):
+        data = {i: str(i) for i in range(100)}
+        for items in (data, list(data.items()), UserDict(data),
+                      iter(data.items())):
+            cache = LFUCache.from_items(items, 200)
+            self.assertIsInstance(cache, LFUCache)
+            self.assertEqual(dict(cache.items()), data)
+
+        # past capacity it evicts like __setitem__
+        cache = LFUCache.from_items(data, 10, initial_weights={5: 1000})
+        self.assertEqual(len(cache), 10)
+        self.assertIn(5, cache)
+        cache = LFUCache.from_items(data, 100, initial_weights={3: 1, 4: 999})
+        self.assertEqual(cache.coldest(1), [(3, 1)])
+        self.assertEqual(cache.hottest(1), [(4, 999)])
+
+        with self.assertRaises(ValueError):
+            LFUCache.from_items([(1, 2, 3)], 10)
+        with self.assertRaises(TypeError):
+            LFUCache.from_items([1], 10)
+        with self.assertRaises(ValueError):
+            LFUCache.from_items(data, 0)
+
+    def test_reserve(self):
+        cache = LFUCache(1000)
+        cache.update({i: i for i in range(10)})
+        cache.invalidate_all()
+        cache[10] = 10
+        cache.reserve(500)
+        cache.update({i: i for i in range(20, 520)})
+        self.assertEqual(len(cache), 501)
+        self.assertNotIn(1, cache)
+        self.assertEqual(cache[10], 10)
+        cache.reserve(0)
+        with self.assertRaises(TypeError):
+            cache.reserve("1")
+
+        # a visit past a weight seeded at the top doesn't wrap
+        cache = LFUCache.from_items({1: 1}, 10, initial_weights={1: 2 ** 32})
+        cache[1]
+        self.assertEqual(cache.frequency(1), 2 ** 32 - 1)
+
+    @unittest.skipIf(sys.version_info >= (3, 13),
+                     "no public API presizes a dict")
+    def test_reserve_presizes(self):
+        import gc
+
+        def table_size(cache):
+            # the dict is the first object the cache reports to the gc
+            return sys.getsizeof(gc.get_referents(cache)[0])
+
+        # the table is presized, not a copy of the old one
+        cache = LFUCache(100000)
+        cache.update({i: i for i in range(100)})
+        before = table_size(cache)
+        cache.reserve(50000)
+        self.assertGreater(table_size(cache), 10 * before)
+        self.assertEqual(cache[99], 99)
+        # not behind the back of a _store() view
+        cache = LFUCache(100000)
+        cache.update({i: i for i in range(100)})
+        store = cache._store()
+        cache.reserve(50000)
+        self.assertEqual(table_size(cache), before)
+        self.assertEqual(len(store), 100)
+
+    def test_metrics_text(self):
+        cache = LFUCache(2)
+        cache.update({1: 1, 2: 2, 3: 3})
+        cache[3]
+        cache.get_many_or_load([4], lambda keys: {k: k for k in keys})
+        text = metrics_text({"users": cache, 'a"b': LFUCache(5)})
+        lines = text.splitlines()
+        self.assertEqual(lines[-1], "# EOF")
+        self.assertIn("# TYPE ctools_lfu_hits counter", lines)
+        self.assertIn('ctools_lfu_hits_total{cache="users"} 1', lines)
+        self.assertIn('ctools_lfu_misses_total{cache="users"} 1', lines)
+        self.assertIn('ctools_lfu_evictions_total{cache="users"} 2', lines)
+        self.assertIn('ctools_lfu_size{cache="users"} 2', lines)
+        self.assertIn('ctools_lfu_capacity{cache="a\\"b"} 5', lines)
+        self.assertIn('ctools_lfu_load_seconds_bucket{cache="users",le="1.0"} 1',
+                      lines)
+        self.assertIn('ctools_lfu_load_seconds_count{cache="a\\"b"} 0', lines)
+        self.assertTrue(all(l.startswith("#")
+                            for l in metrics_text({}).splitlines()))
+        with self.assertRaises(TypeError):
+            metrics_text({"x": {}})
+        with self.assertRaises(TypeError):
+            metrics_text({1: cache})
+
+    def test_trace(self):
+        cache = LFUCache(10)
+        self.assertEqual(cache.drain_trace(), b"")
+        cache.start_trace(1.0, 4)
+        cache["a"] = 1
+        cache["a"]
+        cache.get("b")
+        del cache["a"]
+        records = list(struct.iter_unpack(TRACE_RECORD, cache.drain_trace()))
+        self.assertEqual([(r[2], r[3]) for r in records],
+                         [(TRACE_SET, 0), (TRACE_GET, 1), (TRACE_GET, 0),
+                          (TRACE_DEL, 1)])
+        self.assertEqual({r[0] for r in records},
+                         {hash("a") & (2 ** 64 - 1), hash("b") & (2 ** 64 - 1)})
+        self.assertEqual([r[1] for r in records], sorted(r[1] for r in records))
+        self.assertEqual(cache.trace_hints(), (0, 0))
+
+        # the ring keeps the newest records
+        for i in range(6):
+            cache[i] = i
+        self.assertEqual(cache.trace_hints(), (4, 2))
+        records = list(struct.iter_unpack(TRACE_RECORD, cache.stop_trace()))
+        self.assertEqual([r[0] for r in records], [2, 3, 4, 5])
+        cache[0]
+        self.assertEqual(cache.trace_hints(), (0, 0))
+
+        cache.start_trace(0.1, 100000)
+        for i in range(10000):
+            cache.get(i)
+        self.assertTrue(500 < cache.trace_hints()[0] < 1500)
+        with self.assertRaises(ValueError):
+            cache.start_trace(0)
+        with self.assertRaises(ValueError):
+            cache.start_trace(0.5, 0)
+
+        # unhashable keys fail as they would untraced
+        cache.start_trace(1.0, 4)
+        with self.assertRaises(TypeError):
+            cache[[1]]
+        with self.assertRaises(TypeError):
+            cache[[1]] = 1
+        self.assertEqual(cache.trace_hints(), (0, 0))
+
+    def test_weight_histogram_peek(self):
+        cache = LFUCache(100)
+        for i in range(10):
+            cache[i] = i
+            for _ in range(i):
+                cache[i]
+        hints = cache.hints()
+        self.assertEqual(cache.peek(3), 3)
+        self.assertEqual(cache.peek("x", "d"), "d")
+        self.assertIsNone(cache.peek("x"))
+        self.assertEqual(cache.frequency(9), dict(cache.hottest(1))[9])
+        self.assertGreater(cache.frequency(9), cache.frequency(0))
+        self.assertEqual(cache.frequency(0), cache.frequency(0))
+        self.assertEqual(cache.hints(), hints)
+        with self.assertRaises(KeyError):
+            cache.frequency("x")
+
+        bins = cache.weight_histogram(4)
+        self.assertLessEqual(len(bins), 4)
+        self.assertEqual(sum(b[2] for b in bins), 10)
+        self.assertEqual(bins[0][0], cache.coldest(1)[0][1])
+        self.assertLessEqual(cache.hottest(1)[0][1], bins[-1][1])
+        for (_, high, _), (low, _, _) in zip(bins, bins[1:]):
+            self.assertEqual(high + 1, low)
+        raw = cache.weight_histogram(10, raw=True)
+        self.assertEqual(sum(b[2] for b in raw), 10)
+        self.assertEqual(cache.hints(), hints)
+        self.assertEqual(LFUCache(1).weight_histogram(), [])
+        with self.assertRaises(ValueError):
+            cache.weight_histogram(0)
+        wide = LFUCache.from_items({1: 1, 2: 2}, 10,
+                                   initial_weights={1: 0, 2: 2 ** 32 - 1})
+        (low, high, count), = wide.weight_histogram(1, raw=True)
+        self.assertEqual((low, count), (0, 2))
+        self.assertGreaterEqual(high, 2 ** 32 - 2)
+
+    def test_gdsf(self):
+        cache = LFUCache(3, policy="gdsf")
+        cache.set("cheap", 1, cost=1)
+        cache.set("dear", 2, cost=100)
+        cache.set("mid", 3, cost=10)
+        cache.set("new", 4, cost=5)
+        self.assertNotIn("cheap", cache)
+        # evictions raise the inflation of the entries set after them, a
+        # cheap entry still goes before the dear ones set before it
+        cache.set("x", 5, cost=1)
+        cache.set("y", 6, cost=1)
+        self.assertNotIn("new", cache)
+        self.assertNotIn("x", cache)
+        self.assertEqual(set(cache.keys()), {"dear", "mid", "y"})
+
+        # hits raise the priority, size lowers it
+        cache = LFUCache(2, policy="gdsf")
+        cache.set("a", 1, cost=1)
+        cache.set("b", 2, cost=3)
+        for _ in range(5):
+            cache["a"]
+        cache.set("c", 3, cost=4, size=2)
+        self.assertEqual(set(cache.keys()), {"a", "c"})
+        cache.set("d", 4, cost=4, size=1)
+        self.assertEqual(set(cache.keys()), {"a", "d"})
+
+        # pinned entries leave the heap, deleted ones too
+        cache = LFUCache(3, policy="gdsf")
+        for i in range(3):
+            cache.set(i, i, cost=i + 1)
+        cache.pin(0)
+        del cache[1]
+        cache.set(3, 3, cost=10)
+        cache.set(4, 4, cost=10)
+        self.assertEqual(set(cache.keys()), {0, 3, 4})
+        cache.unpin(0)
+        cache.set(5, 5, cost=10)
+        self.assertEqual(set(cache.keys()), {3, 4, 5})
+        cache.set_capacity(1)
+        self.assertEqual(len(cache), 1)
+        cache.clear()
+        cache.set("a", 1)
+        self.assertEqual(cache["a"], 1)
+
+        # an expired entry goes before live ones, whatever its priority
+        cache = LFUCache(2, policy="gdsf")
+        cache.set("dear", 1, cost=100, ttl=0.01)
+        cache.set("cheap", 2, cost=1)
+        time.sleep(0.05)
+        cache.set("new", 3, cost=1)
+        self.assertEqual(set(cache.keys()), {"cheap", "new"})
+
+        with self.assertRaises(ValueError):
+            LFUCache(1, policy="lru")
+        with self.assertRaises(ValueError):
+            cache.set("a", 1, size=-1)
+        with self.assertRaises(ValueError):
+            cache.set("a", 1, cost=-1)
+
+    def test_admission(self):
+        cache = LFUCache(10, max_item_size=100)
+        cache["small"] = b"x" * 10
+        cache["big"] = b"x" * 1000
+        self.assertNotIn("big", cache)
+        # an oversized write drops the old value too
+        cache["small"] = "x" * 1000
+        self.assertNotIn("small", cache)
+        cache.set("k", 1, size=1000)
+        self.assertNotIn("k", cache)
+        cache.set("k", b"x" * 1000, size=10)
+        self.assertIn("k", cache)
+        self.assertEqual(cache.admission_hints(), (0, 3))
+        self.assertIn('ctools_lfu_rejections_total{cache="c"} 3',
+                      metrics_text({"c": cache}).splitlines())
+
+        cache = LFUCache(1000, admission_size=1000, seed=1)
+        for i in range(200):
+            cache[i] = b"x" * 10
+            cache[-i - 1] = b"x" * 10000
+        self.assertGreater(len([k for k in cache.keys() if k >= 0]), 190)
+        self.assertLess(len([k for k in cache.keys() if k < 0]), 5)
+        c, rejections = cache.admission_hints()
+        self.assertEqual(c, 1000)
+        self.assertEqual(rejections, 400 - len(cache))
+        # a window of hits moves c
+        for _ in range(5000):
+            cache[0]
+        cache["new"] = b""
+        self.assertEqual(cache.admission_hints()[0], 2000)
+
+        # measuring for admission leaves the gdsf size alone
+        cache = LFUCache(2, policy="gdsf", max_item_size=10 ** 6)
+        cache.set("a", b"x" * 1000, cost=2)
+        cache.set("b", b"x", cost=1)
+        cache.set("c", b"x", cost=5)
+        self.assertEqual(set(cache.keys()), {"a", "c"})
+
+        with self.assertRaises(ValueError):
+            LFUCache(1, max_item_size=-1)
+
+    def test_cache_group(self):
+        group = CacheGroup(1000)
+        hot, cold = LFUCache(100), LFUCache(100)
+        hot["a"] = b"x" * 100
+        group.join(hot)
+        group.join(cold)
+        group.join(cold)
+        self.assertEqual(len(group), 2)
+        self.assertEqual(group.hints(), (100, 1000))
+        for i in range(4):
+            hot[i] = b"x" * 100
+        for k in hot.keys():
+            for _ in range(5):
+                hot[k]
+        for i in range(10):
+            cold[i] = b"x" * 100
+        self.assertEqual(group.occupancy(), [(hot, 500, 5), (cold, 500, 5)])
+
+        # the coldest entries of the group make room, whichever cache
+        # holds them
+        hot["big"] = b"x" * 300
+        self.assertEqual(group.occupancy(), [(hot, 800, 6), (cold, 200, 2)])
+        cold["huge"] = b"x" * 2000
+        self.assertNotIn("huge", cold)
+        cold[cold.keys()[0]] = b"x" * 50
+        self.assertEqual(group.hints(), (950, 1000))
+
+        group.leave(cold)
+        self.assertEqual(group.hints(), (800, 1000))
+        with self.assertRaises(ValueError):
+            group.leave(cold)
+        with self.assertRaises(ValueError):
+            CacheGroup(10).join(hot)
+        with self.assertRaises(TypeError):
+            group.join({})
+        group.set_max_bytes(400)
+        self.assertLessEqual(group.hints()[0], 400)
+        hot.clear()
+        self.assertEqual(group.hints(), (0, 400))
+        with self.assertRaises(ValueError):
+            CacheGroup(0)
+
+        # bytes are measured whatever the gdsf size says
+        hot.set("s", b"x" * 300, size=1)
+        self.assertEqual(group.hints(), (300, 400))
+        gdsf = LFUCache(2, policy="gdsf")
+        gdsf.set("small", b"x" * 100, size=1)
+        gdsf.set("large", b"x", size=100)
+        CacheGroup(1000).join(gdsf)
+        gdsf["new"] = b"x"
+        self.assertEqual(sorted(gdsf.keys()), ["new", "small"])
+
+    def test_cache_group_even_load(self):
+        group = CacheGroup(1000)
+        a, b = LFUCache(100), LFUCache(100)
+        group.join(a)
+        group.join(b)
+        for i in range(50):
+            a[i] = b"x" * 100
+            b[i] = b"x" * 100
+        for cache, n, _ in group.occupancy():
+            self.assertGreaterEqual(n, 400)
+
     def test_iter(self):
         cache = LFUCache(257)
         keys = []
@@ -292,5 +1325,105 @@ class LFUTest(unittest.TestCase):
             self.assertIn(k, keys)
 
 
+@unittest.skipIf(sys.platform == 'win32', 'requires mmap')
+class DiskLFUStoreTest(unittest.TestCase):
+
+    def setUp(self):
+        import tempfile
+        self.path = tempfile.mkdtemp()
+
+    def tearDown(self):
+        import shutil
+        shutil.rmtree(self.path)
+
+    def test_mapping(self):
+        with DiskLFUStore(self.path, 1024 * 1024) as store:
+            store['a'] = b'bytes'
+            store[b'a'] = 'str'
+            store['obj'] = {'list': [1, 2]}
+            self.assertEqual(store['a'], b'bytes')
+            self.assertEqual(store[b'a'], 'str')
+            self.assertEqual(store['obj'], {'list': [1, 2]})
+            self.assertEqual(len(store), 3)
+            self.assertIn('a', store)
+            self.assertNotIn('b', store)
+            self.assertEqual(store.get('b', 1), 1)
+            self.assertEqual(sorted(map(repr, store)),
+                             ["'a'", "'obj'", "b'a'"])
+            del store['a']
+            self.assertNotIn('a', store)
+            with self.assertRaises(KeyError):
+                del store['a']
+            with self.assertRaises(KeyError):
+                store['a']
+            with self.assertRaises(TypeError):
+                store[1] = 1
+            self.assertEqual(store.hints(), (1024 * 1024, 3, 2))
+            store.clear()
+            self.assertEqual(len(store), 0)
+        with self.assertRaises(ValueError):
+            len(store)
+
+    def test_persist(self):
+        with DiskLFUStore(self.path, 1024 * 1024) as store:
+            for i in range(1000):
+                store[str(i)] = i
+        store = DiskLFUStore(self.path, 1024 * 1024)
+        self.assertFalse(store.disk_hints()[3])
+        self.assertEqual(len(store), 1000)
+        self.assertEqual(store['999'], 999)
+        with self.assertRaises(BlockingIOError):
+            DiskLFUStore(self.path, 1024 * 1024)
+        store.close()
+
+    def test_recover(self):
+        import os
+        pid = os.fork()
+        if pid == 0:
+            store = DiskLFUStore(self.path, 1024 * 1024)
+            for i in range(1000):
+                store[str(i)] = i
+            del store['0']
+            os._exit(0)
+        os.waitpid(pid, 0)
+        store = DiskLFUStore(self.path, 1024 * 1024)
+        count, live_bytes, disk_bytes, recovered = store.disk_hints()
+        self.assertTrue(recovered)
+        self.assertEqual(count, 999)
+        self.assertNotIn('0', store)
+        self.assertEqual(store['999'], 999)
+        store.close()
+
+        # a crash right after creating a segment leaves it empty
+        segs = sorted(f for f in os.listdir(self.path) if f.endswith('.seg'))
+        torn = '%08x.seg' % (int(segs[-1][:8], 16) + 1)
+        open(os.path.join(self.path, torn), 'wb').close()
+        store = DiskLFUStore(self.path, 1024 * 1024)
+        self.assertEqual(store.disk_hints()[0], 999)
+        self.assertEqual(store['999'], 999)
+        store['new'] = 1
+        self.assertEqual(store['new'], 1)
+        store.close()
+
+    def test_evict_and_compact(self):
+        store = DiskLFUStore(self.path, 256 * 1024)
+        for i in range(100):
+            store['hot%d' % i] = b'h' * 100
+        for _ in range(10):
+            for i in range(100):
+                store['hot%d' % i]
+        for i in range(10000):
+            store['cold%d' % i] = b'c' * 100
+        count, live_bytes, disk_bytes, _ = store.disk_hints()
+        self.assertLessEqual(live_bytes, 256 * 1024)
+        self.assertLess(disk_bytes, 1024 * 1024)
+        self.assertGreater(sum('hot%d' % i in store for i in range(100)), 90)
+        store.compact()
+        self.assertLessEqual(store.disk_hints()[2], disk_bytes)
+        with self.assertRaises(ValueError):
+            store['big'] = b'x' * 1024 * 1024
+        store.close()
+
+
 if __name__ == '__main__':
     unittest.main()